@@ -0,0 +1,187 @@
+#include "server_util.h"
+
+extern int debug;
+
+/*=================================== RING ===================================*/
+
+/**
+* Prepare an empty ring.
+* @ring    ring to prepare
+* @store   job store the frames are built from
+* Return 0 on success, -1 on error.
+*/
+int broadcast_init(struct Broadcast *ring, struct JobStore *store) {
+  memset(ring, 0, sizeof(*ring));
+  ring->store = store;
+  if (pthread_mutex_init(&ring->lock, NULL)) {
+    fprintf(stderr, RED ">>> %d <<< [Server Error] Failed to set up broadcast ring.\n" RESET, getpid());
+    return -1;
+  }
+  if (debug)
+    printf(">>> %d <<< Broadcasting through a ring of %d x %d KB.\n", getpid(), BROADCAST_CHUNKS,
+           BROADCAST_CHUNK_SIZE / 1024);
+  return 0;
+}
+
+/**
+* Drop the ring's chunks. Called once no out queue refers to one.
+* @ring   ring to free
+*/
+void broadcast_free(struct Broadcast *ring) {
+  for (size_t i = 0; i < ring->count; i++)
+    broadcast_release(ring->chunks[(ring->oldest + i) % BROADCAST_CHUNKS]);
+  ring->count = 0;
+  pthread_mutex_destroy(&ring->lock);
+}
+
+/**
+* Drop a reference to a chunk, freeing it with the last one. Matches the
+* release callback of out_push_shared().
+* @chunk   chunk to release
+*/
+void broadcast_release(void *chunk) {
+  struct BroadcastChunk *released = (struct BroadcastChunk *) chunk;
+  if (!__atomic_sub_fetch(&released->refs, 1, __ATOMIC_ACQ_REL))
+    free(released);
+}
+
+/**
+* Bytes of frames in a chunk (utility method).
+* @chunk   chunk to measure
+*/
+static size_t chunk_used(struct BroadcastChunk *chunk) {
+  return chunk->jobs ? chunk->ends[chunk->jobs - 1] : 0;
+}
+
+/**
+* Start a chunk at the ring's next job, dropping the oldest chunk if the
+* ring is full (utility method). Call with the ring locked.
+* @ring       ring to add to
+* @capacity   bytes the first frame needs
+* Return the chunk, NULL on allocation failure.
+*/
+static struct BroadcastChunk *add_chunk(struct Broadcast *ring, size_t capacity) {
+  if (capacity < BROADCAST_CHUNK_SIZE)
+    capacity = BROADCAST_CHUNK_SIZE;
+  struct BroadcastChunk *chunk = (struct BroadcastChunk *) malloc(sizeof(struct BroadcastChunk) + capacity);
+  if (!chunk)
+    return NULL;
+  chunk->refs = 1;
+  chunk->first_job = ring->next_job;
+  chunk->jobs = 0;
+  chunk->capacity = capacity;
+  if (ring->count == BROADCAST_CHUNKS) {
+    broadcast_release(ring->chunks[ring->oldest % BROADCAST_CHUNKS]);
+    ring->oldest++;
+    ring->count--;
+    ring->dropped_chunks++;
+  }
+  ring->chunks[(ring->oldest + ring->count) % BROADCAST_CHUNKS] = chunk;
+  ring->count++;
+  return chunk;
+}
+
+/**
+* Build the frames of indexed jobs into the ring, from its next job on
+* (utility method). Call with the ring locked.
+* @ring   ring to fill
+* @job    job a connection is waiting for; if the ring is behind it, the
+*         ring skips ahead
+*/
+static void fill(struct Broadcast *ring, size_t job) {
+  struct BroadcastChunk *chunk = NULL;
+  if (ring->count)
+    chunk = ring->chunks[(ring->oldest + ring->count - 1) % BROADCAST_CHUNKS];
+  if (job > ring->next_job) { // a chunk holds consecutive jobs only
+    ring->next_job = job;
+    chunk = NULL;
+  }
+  size_t header_size = sizeof(char) + sizeof(int);
+  size_t built = 0;
+  struct JobEntry entry;
+  while (built < BROADCAST_FILL_BYTES && !job_store_get(ring->store, ring->next_job, &entry)) {
+    size_t length = header_size + (entry.length ? entry.length + 1 : 0);
+    if (!chunk || chunk->jobs == BROADCAST_CHUNK_JOBS || chunk_used(chunk) + length > chunk->capacity) {
+      chunk = add_chunk(ring, length);
+      if (!chunk)
+        break;
+    }
+    char *frame = chunk->data + chunk_used(chunk);
+    struct JobMessage header;
+    header.job_info = (unsigned char) ((entry.type << 5) + entry.checksum);
+    header.text_length = htonl(entry.length);
+    memcpy(frame, &header, header_size);
+    if (entry.length) {
+      memcpy(frame + header_size, job_store_text(ring->store, &entry), entry.length);
+      frame[length - 1] = '\0';
+    }
+    chunk->ends[chunk->jobs] = (uint32_t) (chunk_used(chunk) + length);
+    chunk->jobs++;
+    ring->next_job++;
+    ring->built_jobs++;
+    ring->built_bytes += length;
+    built += length;
+  }
+}
+
+/**
+* Take a run of consecutive frames from the ring, building them if the
+* ring has not reached them yet.
+* @ring        ring to take from
+* @job         first job of the run
+* @max_jobs    most jobs in the run
+* @max_bytes   no job starts this many bytes or more into the run
+* @span        filled in with the run, holding a reference to its chunk
+*              (see broadcast_release())
+* Return number of jobs in the run, 0 if the ring does not hold the job.
+*/
+long broadcast_span(struct Broadcast *ring, size_t job, long max_jobs, long max_bytes, struct BroadcastSpan *span) {
+  pthread_mutex_lock(&ring->lock);
+  if (job >= ring->next_job)
+    fill(ring, job);
+  struct BroadcastChunk *chunk = NULL;
+  for (size_t i = ring->count; i-- > 0;) {
+    struct BroadcastChunk *kept = ring->chunks[(ring->oldest + i) % BROADCAST_CHUNKS];
+    if (job >= kept->first_job) {
+      if (job < kept->first_job + kept->jobs)
+        chunk = kept;
+      break;
+    }
+  }
+  if (!chunk) {
+    pthread_mutex_unlock(&ring->lock);
+    return 0;
+  }
+
+  unsigned int first = (unsigned int) (job - chunk->first_job);
+  size_t start = first ? chunk->ends[first - 1] : 0;
+  size_t end = start;
+  long jobs = 0;
+  while (first + jobs < chunk->jobs && jobs < max_jobs && (long) (end - start) < max_bytes) {
+    end = chunk->ends[first + jobs];
+    jobs++;
+  }
+  __atomic_add_fetch(&chunk->refs, 1, __ATOMIC_RELAXED);
+  pthread_mutex_unlock(&ring->lock);
+  span->chunk = chunk;
+  span->data = chunk->data + start;
+  span->length = end - start;
+  span->jobs = jobs;
+  return jobs;
+}
+
+/**
+* Read the statistics of the ring.
+* @ring    ring to report on
+* @stats   filled in with the statistics
+*/
+void broadcast_stats(struct Broadcast *ring, struct BroadcastStats *stats) {
+  pthread_mutex_lock(&ring->lock);
+  stats->built_jobs = ring->built_jobs;
+  stats->built_bytes = ring->built_bytes;
+  stats->dropped_chunks = ring->dropped_chunks;
+  stats->bytes = 0;
+  for (size_t i = 0; i < ring->count; i++)
+    stats->bytes += chunk_used(ring->chunks[(ring->oldest + i) % BROADCAST_CHUNKS]);
+  pthread_mutex_unlock(&ring->lock);
+}
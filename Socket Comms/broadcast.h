@@ -0,0 +1,73 @@
+#ifndef BROADCAST_H
+#define BROADCAST_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <pthread.h>
+
+/* Shared send ring of the broadcast mode (--broadcast). Job frames are
+   built once, back to back, into chunks of the ring by whichever
+   connection first needs them; every connection keeps its own cursor
+   (its next job) and queues whole runs of consecutive frames as a single
+   segment that refers to the chunk. Sending a job to one more client
+   then costs a share of a writev() or send, not an index lookup and
+   three queue segments.
+   The ring keeps the newest BROADCAST_CHUNKS chunks and never waits for
+   anyone: a client that falls further behind is served its jobs one by
+   one from the job file, like without the ring, until it is back within
+   reach. Chunks are reference counted, so a dropped chunk lives on until
+   the last queued segment referring to it is sent.
+   The ring holds plain job frames, so clients that asked for CRC32C
+   trailers or compressed jobs are always served from the job file. */
+
+#define BROADCAST_CHUNKS 64
+#define BROADCAST_CHUNK_SIZE (1024 * 1024)   // bytes of frames per chunk, more for a larger job
+#define BROADCAST_CHUNK_JOBS 8192            // frames per chunk at most
+#define BROADCAST_FILL_BYTES (256 * 1024)    // frames built per fill, bounds the time the ring is locked
+
+struct JobStore;
+
+struct BroadcastChunk {
+  int refs;                // the ring's, while kept, and queued segments'
+  size_t first_job;        // number of the chunk's first job
+  unsigned int jobs;       // frames built so far
+  size_t capacity;         // bytes of data
+  uint32_t ends[BROADCAST_CHUNK_JOBS]; // end of each frame in data
+  char data[];
+};
+
+/* Run of consecutive frames taken from the ring. */
+struct BroadcastSpan {
+  struct BroadcastChunk *chunk; // holds a reference for the queued segment
+  const char *data;
+  size_t length;
+  long jobs;
+};
+
+struct Broadcast {
+  struct JobStore *store;
+  pthread_mutex_t lock;
+  struct BroadcastChunk *chunks[BROADCAST_CHUNKS]; // kept chunks, by sequence number
+  size_t oldest;           // sequence number of the oldest chunk kept
+  size_t count;            // chunks kept
+  size_t next_job;         // first job not in the ring
+  uint64_t built_jobs;     // statistics, read with the lock held
+  uint64_t built_bytes;
+  uint64_t dropped_chunks;
+};
+
+/* Statistics of the ring. */
+struct BroadcastStats {
+  uint64_t built_jobs;
+  uint64_t built_bytes;
+  uint64_t dropped_chunks;
+  uint64_t bytes;          // bytes of frames in the kept chunks
+};
+
+int broadcast_init(struct Broadcast *ring, struct JobStore *store);
+void broadcast_free(struct Broadcast *ring);
+long broadcast_span(struct Broadcast *ring, size_t job, long max_jobs, long max_bytes, struct BroadcastSpan *span);
+void broadcast_release(void *chunk);
+void broadcast_stats(struct Broadcast *ring, struct BroadcastStats *stats);
+
+#endif
@@ -0,0 +1,174 @@
+#include <string.h>
+#include <immintrin.h>
+
+#include "checksum.h"
+
+#define CRC32C_POLYNOMIAL 0x82F63B78 // reflected Castagnoli polynomial
+
+
+/*============================== BYTE SUMS ===================================*/
+
+/**
+* Sum bytes one at a time (fallback and tail handling).
+* @data     bytes to sum
+* @length   number of bytes
+* Return sum of all bytes.
+*/
+static uint64_t sum_scalar(const unsigned char *data, size_t length) {
+  uint64_t sum = 0;
+  for (size_t i = 0; i < length; i++)
+    sum += data[i];
+  return sum;
+}
+
+/**
+* Sum bytes 16 at a time; psadbw against zero adds eight bytes per lane.
+* @data     bytes to sum
+* @length   number of bytes
+* Return sum of all bytes.
+*/
+__attribute__((target("sse2")))
+static uint64_t sum_sse2(const unsigned char *data, size_t length) {
+  __m128i zero = _mm_setzero_si128();
+  __m128i total = _mm_setzero_si128();
+  size_t i = 0;
+  for (; i + 16 <= length; i += 16) {
+    __m128i block = _mm_loadu_si128((const __m128i *) (data + i));
+    total = _mm_add_epi64(total, _mm_sad_epu8(block, zero));
+  }
+  uint64_t lanes[2];
+  _mm_storeu_si128((__m128i *) lanes, total);
+  return lanes[0] + lanes[1] + sum_scalar(data + i, length - i);
+}
+
+/**
+* Sum bytes 32 at a time.
+* @data     bytes to sum
+* @length   number of bytes
+* Return sum of all bytes.
+*/
+__attribute__((target("avx2")))
+static uint64_t sum_avx2(const unsigned char *data, size_t length) {
+  __m256i zero = _mm256_setzero_si256();
+  __m256i total = _mm256_setzero_si256();
+  size_t i = 0;
+  for (; i + 32 <= length; i += 32) {
+    __m256i block = _mm256_loadu_si256((const __m256i *) (data + i));
+    total = _mm256_add_epi64(total, _mm256_sad_epu8(block, zero));
+  }
+  uint64_t lanes[4];
+  _mm256_storeu_si256((__m256i *) lanes, total);
+  return lanes[0] + lanes[1] + lanes[2] + lanes[3] + sum_scalar(data + i, length - i);
+}
+
+
+/*================================ CRC32C ====================================*/
+
+/**
+* CRC32C one bit at a time (fallback for CPUs without SSE4.2).
+* @crc      running CRC, inverted
+* @data     bytes to add
+* @length   number of bytes
+* Return updated CRC, inverted.
+*/
+static uint32_t crc32c_scalar(uint32_t crc, const unsigned char *data, size_t length) {
+  for (size_t i = 0; i < length; i++) {
+    crc ^= data[i];
+    for (int bit = 0; bit < 8; bit++)
+      crc = (crc >> 1) ^ (CRC32C_POLYNOMIAL & (0 - (crc & 1)));
+  }
+  return crc;
+}
+
+/**
+* CRC32C eight bytes at a time with the SSE4.2 crc32 instruction.
+* @crc      running CRC, inverted
+* @data     bytes to add
+* @length   number of bytes
+* Return updated CRC, inverted.
+*/
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_sse42(uint32_t crc, const unsigned char *data, size_t length) {
+  size_t i = 0;
+#if defined(__x86_64__)
+  uint64_t crc64 = crc;
+  for (; i + 8 <= length; i += 8) {
+    uint64_t word;
+    memcpy(&word, data + i, sizeof(word));
+    crc64 = _mm_crc32_u64(crc64, word);
+  }
+  crc = (uint32_t) crc64;
+#endif
+  for (; i < length; i++)
+    crc = _mm_crc32_u8(crc, data[i]);
+  return crc;
+}
+
+
+/*============================ RUNTIME DISPATCH ==============================*/
+
+struct ChecksumEngine {
+  uint64_t (*sum)(const unsigned char *data, size_t length);
+  uint32_t (*crc32c)(uint32_t crc, const unsigned char *data, size_t length);
+  const char *name;
+};
+
+static const struct ChecksumEngine *engine; // chosen on first use
+
+/**
+* Pick the fastest implementations this CPU supports (utility method).
+* Racing callers pick the same engine, so no lock is needed.
+* Return the chosen engine.
+*/
+static const struct ChecksumEngine *select_engine(void) {
+  static const struct ChecksumEngine engines[] = {
+    { sum_avx2, crc32c_sse42, "avx2+sse4.2" },
+    { sum_avx2, crc32c_scalar, "avx2" },
+    { sum_sse2, crc32c_sse42, "sse2+sse4.2" },
+    { sum_sse2, crc32c_scalar, "sse2" },
+    { sum_scalar, crc32c_scalar, "scalar" },
+  };
+  const struct ChecksumEngine *chosen = __atomic_load_n(&engine, __ATOMIC_ACQUIRE);
+  if (chosen)
+    return chosen;
+
+  __builtin_cpu_init();
+  int crc = __builtin_cpu_supports("sse4.2");
+  if (__builtin_cpu_supports("avx2"))
+    chosen = &engines[crc ? 0 : 1];
+  else if (__builtin_cpu_supports("sse2"))
+    chosen = &engines[crc ? 2 : 3];
+  else
+    chosen = &engines[4];
+  __atomic_store_n(&engine, chosen, __ATOMIC_RELEASE);
+  return chosen;
+}
+
+/**
+* Compute checksum (Rule: sum of all characters in text % 32).
+* Bytes are summed unsigned, which gives the same result modulo 32 as
+* summing them as signed chars.
+* @text      compute checksum of this text
+* @length    text length
+* Return checksum as unsigned char.
+*/
+unsigned char checksum_text(const void *text, size_t length) {
+  return (unsigned char) (select_engine()->sum((const unsigned char *) text, length) % 32);
+}
+
+/**
+* Compute the CRC32C (Castagnoli) of a buffer.
+* @data     bytes to check
+* @length   number of bytes
+* Return the CRC.
+*/
+uint32_t checksum_crc32c(const void *data, size_t length) {
+  return ~select_engine()->crc32c(~0u, (const unsigned char *) data, length);
+}
+
+/**
+* Name the implementations in use, for debug output.
+*/
+const char *checksum_engine(void) {
+  return select_engine()->name;
+}
@@ -0,0 +1,16 @@
+#ifndef CHECKSUM_H
+#define CHECKSUM_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Job text checksums shared by client and server.
+   The protocol checksum (sum of text bytes % 32) is computed in one pass
+   with AVX2 or SSE2 when the CPU has them, the optional CRC32C with the
+   SSE4.2 crc32 instruction. The implementation is chosen on first use. */
+
+unsigned char checksum_text(const void *text, size_t length);
+uint32_t checksum_crc32c(const void *data, size_t length);
+const char *checksum_engine(void);
+
+#endif
@@ -1,7 +1,14 @@
 #include "client_util.h"
 
 int debug = 0; // 0 for normal use, 1 for debug mode
-int interrupted = 0; // switch to 1 when interrupt is caught
+volatile sig_atomic_t interrupted = 0; // switch to 1 when interrupt is caught
+struct CreditWindow credits; // jobs and bytes consumed since the last grant
+struct ClientOptions options;
+struct Session session = { 1, 0, 0, { NULL, 0, 0, NULL }, NULL, 0, 0, 0, 0, 0, { -1, -1 } };
+struct Prefetch prefetch;
+struct Sink sinks[2]; // batch mode outputs, indexed by job type ('O' or 'E')
+struct PoolStats pool_stats;
+struct Pool pool; // job texts in the printers, metrics and dictionaries as they arrive
 
 /**
 * Print instructions.
@@ -13,6 +20,24 @@ int usage(int argc, char* argv[]) {
     if(argc < 3) {
         printf("Usage: %s [server address] [port]\n", argv[0]);
         printf("Debug: %s [server address] [port] -debug\n", argv[0]);
+        printf("Options:\n");
+        printf("  --relay   splice job texts from the socket to the printers without copying\n");
+        printf("  --crc32c  have the server append a CRC32C to every job and check it\n");
+        printf("  --v1      speak protocol version 1 (for servers without version 2)\n");
+        printf("  --no-compress  do not accept compressed jobs\n");
+        printf("  --stats   print the server's metrics and exit\n");
+        printf("  --fetch N|all  batch mode: fetch N or all jobs without the menu, then exit\n");
+        printf("  --out FILE     batch mode: write 'O' job texts to FILE (default stdout)\n");
+        printf("  --err FILE     batch mode: write 'E' job texts to FILE (default stderr)\n");
+        printf("  --memory-cap MB  bound the memory each process holds for received texts\n");
+        printf("  --types O|E|OE   only receive jobs of these types (the server filters them)\n");
+        printf("  --match TEXT     only receive jobs whose text contains TEXT\n");
+        printf("  --resume FILE    batch mode: continue where the session saved in FILE stopped,\n");
+        printf("                   appending to the output files, and keep FILE up to date\n");
+        printf("  --trace FILE     record events and write them to FILE on SIGUSR1 and on exit,\n");
+        printf("                   those of the printers to FILE.<pid>, for jobtrace\n");
+        printf("Batch mode exits with 0 once the jobs are written, %d if the server is busy,\n", EXIT_BUSY);
+        printf("1 on errors, and prints a throughput summary to stderr.\n");
         printf("Server address is its domain name or IPv4 address (IPv6 is NOT supported).\n");
         printf("Note: The first IP address in the table is used on DNS lookup.\n");
         return 1;
@@ -20,20 +45,110 @@ int usage(int argc, char* argv[]) {
     return 0;
 }
 
+/**
+* Parse options following the server address and port.
+* @argc  number of arguments to main
+* @argv  array of arguments to main
+* Return 0 on success, -1 on an unknown option.
+*/
+int parse_options(int argc, char *argv[]) {
+  for (int i = 3; i < argc; i++) {
+    if (!strcmp(argv[i], "-debug") || !strcmp(argv[i], "--debug")) {
+      debug = 1;
+    } else if (!strcmp(argv[i], "--relay")) {
+      options.relay = 1;
+    } else if (!strcmp(argv[i], "--crc32c")) {
+      options.crc32c = 1;
+    } else if (!strcmp(argv[i], "--v1")) {
+      options.legacy = 1;
+    } else if (!strcmp(argv[i], "--no-compress")) {
+      options.no_compress = 1;
+    } else if (!strcmp(argv[i], "--stats")) {
+      options.stats = 1;
+    } else if (!strcmp(argv[i], "--fetch") && i + 1 < argc) {
+      char *end;
+      i++;
+      options.fetch = strcmp(argv[i], "all") ? strtoll(argv[i], &end, 10) : -1;
+      if (!options.fetch || (options.fetch != -1 && (*end || options.fetch < 0))) {
+        fprintf(stderr, RED ">>> %d <<< [Client Error] Invalid number of jobs to fetch.\n" RESET, getpid());
+        return -1;
+      }
+    } else if (!strcmp(argv[i], "--out") && i + 1 < argc) {
+      options.out_path = argv[++i];
+    } else if (!strcmp(argv[i], "--err") && i + 1 < argc) {
+      options.err_path = argv[++i];
+    } else if (!strcmp(argv[i], "--memory-cap") && i + 1 < argc) {
+      int megabytes = parse_number(argv[++i]);
+      if (megabytes <= 0) {
+        fprintf(stderr, RED ">>> %d <<< [Client Error] Invalid memory cap.\n" RESET, getpid());
+        return -1;
+      }
+      options.memory_cap = (size_t) megabytes * 1024 * 1024;
+    } else if (!strcmp(argv[i], "--types") && i + 1 < argc) {
+      const char *types = argv[++i];
+      options.types = 0;
+      for (; *types; types++) {
+        if (*types != 'O' && *types != 'E') {
+          fprintf(stderr, RED ">>> %d <<< [Client Error] Job types are 'O' and 'E'.\n" RESET, getpid());
+          return -1;
+        }
+        options.types |= (unsigned char) (1u << ((*types == 'O') ? TYPE_O : TYPE_E));
+      }
+    } else if (!strcmp(argv[i], "--resume") && i + 1 < argc) {
+      options.resume_path = argv[++i];
+    } else if (!strcmp(argv[i], "--trace") && i + 1 < argc) {
+      options.trace_path = argv[++i];
+    } else if (!strcmp(argv[i], "--match") && i + 1 < argc) {
+      options.match = argv[++i];
+      if (!*options.match || strlen(options.match) > FILTER_MAX_PATTERN) {
+        fprintf(stderr, RED ">>> %d <<< [Client Error] Match text must be 1 - %d bytes long.\n" RESET, getpid(),
+                FILTER_MAX_PATTERN);
+        return -1;
+      }
+    } else {
+      fprintf(stderr, RED ">>> %d <<< [Client Error] Unknown option \"%s\".\n" RESET, getpid(), argv[i]);
+      return -1;
+    }
+  }
+  if ((options.out_path || options.err_path || options.resume_path) && !options.fetch) {
+    fprintf(stderr, RED ">>> %d <<< [Client Error] --out, --err and --resume need --fetch.\n" RESET, getpid());
+    return -1;
+  }
+  if (options.fetch && options.relay) {
+    fprintf(stderr, ">>> %d <<< [Client Warning] Batch mode writes job texts itself, --relay is ignored.\n",
+            getpid());
+    options.relay = 0;
+  }
+  return 0;
+}
+
 int main(int argc, char *argv[]) {
   if(usage(argc, argv)) {
       return EXIT_SUCCESS;
   }
 
-  if (argc == 4) {
-    if (!strcmp(argv[3], "-debug"))
-      debug = 1;
-  }
+  if (parse_options(argc, argv))
+    return EXIT_FAILURE;
+  pool_init(&pool, options.memory_cap, &pool_stats);
 
   // signal handling
   struct sigaction sa;
   memset(&sa, 0, sizeof(sa));
 
+  if (options.trace_path) {
+    if (trace_init(options.trace_path))
+      return EXIT_FAILURE;
+    trace_attach();
+    atexit(trace_close); // also run by the printers, which write their own rings
+    sa.sa_handler = handler;
+    sa.sa_flags = SA_RESTART;
+    if (sigaction(SIGUSR1, &sa, NULL)) {
+      perror(RED "[Client Error] Failed to catch trace signal" RESET);
+      return EXIT_FAILURE;
+    }
+    sa.sa_flags = 0;
+  }
+
   if (debug)
     printf(">>> %d <<< Client process start.\n", getpid());
 
@@ -41,13 +156,31 @@ int main(int argc, char *argv[]) {
   if (sock < 0) {
     close(sock);
     if (sock == -2)
-      return EXIT_SUCCESS;
+      return options.fetch ? EXIT_BUSY : EXIT_SUCCESS;
     return EXIT_FAILURE;
   }
 
   if (debug)
     printf(">>> %d <<< Connected to address %s, port %s.\n", getpid(), argv[1], argv[2]);
 
+  if (options.stats) {
+    int stats_status = print_stats(sock);
+    send_request(sock, stats_status ? ERROR_REQUEST : STOP_REQUEST);
+    close(sock);
+    codec_dict_free(&session.dict);
+    return stats_status ? EXIT_FAILURE : EXIT_SUCCESS;
+  }
+
+  if (options.fetch) {
+    sa.sa_handler = handler; // no SA_RESTART, so a blocked read() returns on interrupt and the batch stops
+    sigaction(SIGINT, &sa, NULL);
+    int batch_status = run_batch(sock);
+    close(sock);
+    codec_dict_free(&session.dict);
+    free(session.inflated);
+    return batch_status ? EXIT_FAILURE : EXIT_SUCCESS;
+  }
+
   // pipe creation
   int pipe_out[2], pipe_err[2];
   if (pipe(pipe_out) == -1 || pipe(pipe_err) == -1) {
@@ -56,6 +189,10 @@ int main(int argc, char *argv[]) {
     close(sock);
     return EXIT_FAILURE;
   }
+  if (options.relay) { // fewer wakeups when whole jobs fit in the pipe
+    fcntl(pipe_out[1], F_SETPIPE_SZ, RELAY_PIPE_SIZE);
+    fcntl(pipe_err[1], F_SETPIPE_SZ, RELAY_PIPE_SIZE);
+  }
 
   int client_pid = getpid();
   int out_pid;
@@ -79,7 +216,18 @@ int main(int argc, char *argv[]) {
       close(pipe_out[0]);
       close(pipe_err[0]);
 
-      int menu_status = command_menu(sock, pipe_out, pipe_err);
+      struct RecvBuffer in;
+      if (recv_init(&in, sock, RECV_BUFFER_SIZE)) {
+        fprintf(stderr, RED ">>> %d <<< [Client Error] Failed to allocate receive buffer.\n" RESET, getpid());
+        exit(EXIT_FAILURE);
+      }
+      in.exact = options.relay; // leave job texts in the socket for splice()
+      int menu_status = command_menu(&in, pipe_out, pipe_err);
+      if (debug)
+        printf(">>> %d <<< Made %lu read() calls on the server connection.\n", getpid(), in.reads);
+      recv_free(&in);
+      codec_dict_free(&session.dict);
+      free(session.inflated);
       close(pipe_out[1]);
       close(pipe_err[1]);
 
@@ -101,6 +249,7 @@ int main(int argc, char *argv[]) {
 
       if (debug)
         printf(">>> %d <<< Stderr printing process start (fork from %d).\n", getpid(), client_pid);
+      trace_attach();
 
       close(pipe_out[0]);
       close(pipe_out[1]);
@@ -112,8 +261,10 @@ int main(int argc, char *argv[]) {
           close(pipe_err[0]);
           if (status == 1) {
             close(sock);
-            if (debug)
+            if (debug) {
               printf(">>> %d <<< Stderr printing process terminated.\n", getpid());
+              print_pool_stats();
+            }
             return EXIT_SUCCESS;
           }
           send_request(sock, ERROR_REQUEST);
@@ -130,6 +281,7 @@ int main(int argc, char *argv[]) {
 
     if (debug)
       printf(">>> %d <<< Stdout printing process start (fork from %d).\n", getpid(), client_pid);
+    trace_attach();
 
     close(pipe_err[0]);
     close(pipe_err[1]);
@@ -140,8 +292,10 @@ int main(int argc, char *argv[]) {
         close(pipe_out[0]);
         if (status == 1) {
           close(sock);
-          if (debug)
+          if (debug) {
             printf(">>> %d <<< Stdout printing process terminated.\n", getpid());
+            print_pool_stats();
+          }
           return EXIT_SUCCESS;
         }
         send_request(sock, ERROR_REQUEST);
@@ -180,6 +334,9 @@ int establish_connection(char *host_addr, char *port_string) {
     return -1;
   }
 
+  int nodelay = 1; // acknowledgements and credit grants are small and must not wait
+  setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+
   int ip_status = prepare_address(&serveraddr, host_addr, port);
   if (ip_status != 1) {
     fprintf(stderr, RED ">>> %d <<< [Client Error] Failed to resolve server address.\n" RESET, getpid());
@@ -203,9 +360,40 @@ int establish_connection(char *host_addr, char *port_string) {
   }
 
   if (available == 0) {
-    printf(">>> %d <<< <Client Notification> Server is ready to accept connections.\n", getpid());
+    if (!options.fetch) // stdout may carry job texts in batch mode
+      printf(">>> %d <<< <Client Notification> Server is ready to accept connections.\n", getpid());
+    if (options.legacy) {
+      session.capabilities = 0; // only one-byte requests, which every server understands
+    } else if (send_hello(sock) || receive_hello(sock)) {
+      return -1;
+    } else if ((session.capabilities & CAP_DICTIONARY) && receive_dictionary(sock)) {
+      return -1;
+    } else if ((session.capabilities & CAP_RESUME) && receive_session(sock)) {
+      return -1;
+    }
+    if (options.crc32c && !(session.capabilities & CAP_CRC32C)) {
+      fprintf(options.fetch ? stderr : stdout, ">>> %d <<< <Client Notification> Server does not send CRC32C trailers.\n",
+              getpid());
+      options.crc32c = 0;
+    }
+    if ((options.types || options.match) && !(session.capabilities & CAP_FILTER)) {
+      fprintf(options.fetch ? stderr : stdout, ">>> %d <<< <Client Notification> Server does not filter jobs.\n",
+              getpid());
+    } else if ((options.types || options.match) && send_filter(sock)) {
+      return -1;
+    }
+    if (options.resume_path && resume_session(sock)) // after FILTER, which decides the jobs passed over
+      return -1;
+
+    if ((session.capabilities & CAP_CREDIT) && send_credit(sock, CREDIT_WINDOW_JOBS, CREDIT_WINDOW_BYTES))
+      return -1;
+    // relayed texts bypass the client, so batches (decoded in user space) are not used
+    if ((session.capabilities & CAP_BATCH) && !options.relay && send_batch_limit(sock, BATCH_MAX_JOBS))
+      return -1;
+    if (options.crc32c && send_crc_request(sock))
+      return -1;
   } else {
-    printf(">>> %d <<< <Client Notification> Server is busy.\n", getpid());
+    fprintf(options.fetch ? stderr : stdout, ">>> %d <<< <Client Notification> Server is busy.\n", getpid());
     return -2;
   }
   return sock;
@@ -235,12 +423,13 @@ int prepare_address(struct sockaddr_in *serveraddr, char *host_addr, int port) {
 
 /**
 * Print command menu, process user input.
-* @socket     send queries via this socket
+* @in         receive buffer of the server connection
 * @pipe_out   send information to stdout printer via this pipe
 * @pipe_err   send information to stderr printer via this pipe
 * Return -1 on errors propagated from lower level methods, 0 on success.
 */
-int command_menu(int socket, int pipe_out[2], int pipe_err[2]) {
+int command_menu(struct RecvBuffer *in, int pipe_out[2], int pipe_err[2]) {
+  int socket = in->fd;
   while (1) {
     micro_sleep(100000); // preserve printing order
 
@@ -274,13 +463,17 @@ int command_menu(int socket, int pipe_out[2], int pipe_err[2]) {
       int request_status = send_request(socket, (char) ONE_JOB_REQUEST);
       if (request_status)
         return -1;
-      int process_status = process_reply(socket, pipe_out, pipe_err);
+      int process_status = process_reply(in, pipe_out, pipe_err);
       if (process_status <= 0)
         return process_status;
 
     } else if (option == 2) {
-      printf("Enter the number of jobs to fetch (0 - 126): ");
-      int jobs;
+      long long max_jobs = (session.version >= 2) ? LLONG_MAX : 126;
+      if (session.version >= 2)
+        printf("Enter the number of jobs to fetch: ");
+      else
+        printf("Enter the number of jobs to fetch (0 - 126): ");
+      long long jobs;
 
       char jobs_buf[128];
       fgets(jobs_buf, sizeof(jobs_buf), stdin);
@@ -290,24 +483,18 @@ int command_menu(int socket, int pipe_out[2], int pipe_err[2]) {
         return 0;
       } else {
         jobs_buf[strcspn(jobs_buf, "\n")] = 0;
-        jobs = atoi(jobs_buf);
-        if (jobs < 0 || option > 126) {
+        jobs = strtoll(jobs_buf, NULL, 10);
+        if (jobs < 0 || jobs > max_jobs) {
           printf("Invalid input.\n");
           continue;
         }
       }
+      if (!jobs) // a 0 byte would start an extended request
+        continue;
 
-      unsigned char request = ((char) jobs) & 127;
-      if (debug)
-        printf(">>> %d <<< Sending request (%d) to server.\n", getpid(), (int) request);
-      int request_status = send_request(socket, request);
-      if (request_status)
-        return -1;
-      for (int i = 0; i < jobs; i++) {
-        int process_status = process_reply(socket, pipe_out, pipe_err);
-        if (process_status <= 0)
-          return process_status;
-      }
+      int fetch_status = fetch_jobs(in, pipe_out, pipe_err, jobs);
+      if (fetch_status <= 0)
+        return fetch_status;
 
     } else if (option == 3) {
       if (debug)
@@ -317,7 +504,7 @@ int command_menu(int socket, int pipe_out[2], int pipe_err[2]) {
         return -1;
 
       while(1) {
-        int process_status = process_reply(socket, pipe_out, pipe_err);
+        int process_status = process_reply(in, pipe_out, pipe_err);
         if (process_status <= 0)
           return process_status;
       }
@@ -343,6 +530,157 @@ int command_menu(int socket, int pipe_out[2], int pipe_err[2]) {
 }
 
 
+/*================================ BATCH MODE ================================*/
+
+/**
+* Fetch the jobs asked for on the command line without the menu, writing
+* their texts straight to the output files, and print a summary. An
+* interrupt stops the fetch, but what arrived is still written out.
+* @socket   connected socket
+* Return 0 on success, -1 on error or interrupt.
+*/
+int run_batch(int socket) {
+  struct RecvBuffer in;
+  if (recv_init(&in, socket, RECV_BUFFER_SIZE)) {
+    fprintf(stderr, RED ">>> %d <<< [Client Error] Failed to allocate receive buffer.\n" RESET, getpid());
+    send_request(socket, ERROR_REQUEST);
+    return -1;
+  }
+  in.stop = &interrupted;
+  if (open_sink(&sinks[TYPE_O], options.out_path, STDOUT_FILENO, session.kept[TYPE_O]) ||
+      open_sink(&sinks[TYPE_E], options.err_path, STDERR_FILENO, session.kept[TYPE_E])) {
+    close_sink(&sinks[TYPE_O]);
+    recv_free(&in);
+    send_request(socket, ERROR_REQUEST);
+    return -1;
+  }
+
+  struct timespec start, end;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  int status;
+  if (options.fetch == -1) {
+    status = send_request(socket, (unsigned char) ALL_JOBS_REQUEST) ? -1 : 1;
+    while ((status > 0 || status == REPLY_DONE) && !interrupted)
+      status = process_reply(&in, NULL, NULL); // 0 after the 'Q' job
+    if (interrupted)
+      status = -1;
+  } else {
+    status = fetch_jobs(&in, NULL, NULL, options.fetch);
+    if (status == 1) // every job arrived, the 'Q' job was not needed
+      status = (flush_acks(socket) || send_request(socket, (unsigned char) STOP_REQUEST)) ? -1 : 0;
+  }
+  if (sink_flush(&sinks[TYPE_O]) || sink_flush(&sinks[TYPE_E]))
+    status = -1;
+  else if ((session.capabilities & CAP_RESUME) && save_checkpoint()) // exact, even if the connection broke
+    status = -1;
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  if (status)
+    send_request(socket, ERROR_REQUEST);
+
+  double seconds = (double) (end.tv_sec - start.tv_sec) + (double) (end.tv_nsec - start.tv_nsec) / 1e9;
+  unsigned long long jobs = sinks[TYPE_O].jobs + sinks[TYPE_E].jobs;
+  double megabytes = (double) (sinks[TYPE_O].bytes + sinks[TYPE_E].bytes) / 1e6;
+  if (seconds <= 0)
+    seconds = 1e-9;
+  fprintf(stderr, ">>> %d <<< <Client Notification> %s %llu job(s) (%llu 'O', %llu 'E', %.1f MB) in %.3f s: "
+          "%.0f jobs/s, %.1f MB/s.\n", getpid(),
+          status ? (interrupted ? "Interrupted after" : "Stopped after") : "Fetched", jobs, sinks[TYPE_O].jobs,
+          sinks[TYPE_E].jobs, megabytes, seconds, (double) jobs / seconds, megabytes / seconds);
+  if (debug)
+    printf(">>> %d <<< Made %lu read() calls on the server connection.\n", getpid(), in.reads);
+  close_sink(&sinks[TYPE_O]);
+  close_sink(&sinks[TYPE_E]);
+  recv_free(&in);
+  return status ? -1 : 0;
+}
+
+/**
+* Open an output of batch mode.
+* @sink     sink to prepare
+* @path     file to create or truncate, NULL or "-" for std_fd
+* @std_fd   standard output or standard error
+* @keep     -1 to create or truncate the file; otherwise a resumed session
+*           appends to it, after cutting a longer file back to keep bytes
+* Return 0 on success, -1 on error.
+*/
+int open_sink(struct Sink *sink, const char *path, int std_fd, long long keep) {
+  memset(sink, 0, sizeof(*sink));
+  sink->fd = std_fd;
+  if (path && strcmp(path, "-"))
+    sink->fd = open(path, O_WRONLY | O_CREAT | (keep < 0 ? O_TRUNC : O_APPEND) | O_CLOEXEC, 0644);
+  if (sink->fd == -1) {
+    perror(RED "[Client Error] Failed to open output file" RESET);
+    return -1;
+  }
+  struct stat st;
+  if (sink->fd != std_fd && keep >= 0 && !fstat(sink->fd, &st) && st.st_size > keep && ftruncate(sink->fd, keep)) {
+    perror(RED "[Client Error] Failed to cut output file back" RESET);
+    close_sink(sink);
+    return -1;
+  }
+  // an O_APPEND file stays at offset 0 until written, but checkpoints record the offset
+  if (sink->fd != std_fd && keep >= 0 && lseek(sink->fd, 0, SEEK_END) == -1) {
+    perror(RED "[Client Error] Failed to seek to end of output file" RESET);
+    close_sink(sink);
+    return -1;
+  }
+  sink->buffer = (char *) malloc(SINK_BUFFER_SIZE);
+  if (!sink->buffer) {
+    fprintf(stderr, RED ">>> %d <<< [Client Error] Failed to allocate output buffer.\n" RESET, getpid());
+    close_sink(sink);
+    return -1;
+  }
+  return 0;
+}
+
+/**
+* Add a job text and its newline to an output of batch mode. Texts that
+* do not fit in the buffer are written directly.
+* @sink     output to add to
+* @text     job text
+* @length   length of the text
+* Return 0 on success, -1 on error.
+*/
+int sink_write(struct Sink *sink, const char *text, size_t length) {
+  sink->jobs++;
+  sink->bytes += length;
+  if (sink->length + length + 1 > SINK_BUFFER_SIZE && sink_flush(sink))
+    return -1;
+  if (length + 1 > SINK_BUFFER_SIZE)
+    return (write_all(sink->fd, text, length) || write_all(sink->fd, "\n", 1)) ? -1 : 0;
+  memcpy(sink->buffer + sink->length, text, length);
+  sink->buffer[sink->length + length] = '\n';
+  sink->length += length + 1;
+  return 0;
+}
+
+/**
+* Write everything gathered in an output of batch mode.
+* @sink   output to flush
+* Return 0 on success, -1 on error.
+*/
+int sink_flush(struct Sink *sink) {
+  if (!sink->length)
+    return 0;
+  int status = write_all(sink->fd, sink->buffer, sink->length);
+  sink->length = 0;
+  return status;
+}
+
+/**
+* Release an output of batch mode, closing it unless it is standard
+* output or standard error.
+* @sink   output to close
+*/
+void close_sink(struct Sink *sink) {
+  if (sink->fd > STDERR_FILENO)
+    close(sink->fd);
+  free(sink->buffer);
+  memset(sink, 0, sizeof(*sink));
+  sink->fd = -1;
+}
+
+
 /*==================== COMMUNICATION WITH SERVER AND PIPES ===================*/
 
 /**
@@ -361,92 +699,786 @@ int send_request(int socket, unsigned char request) {
 }
 
 /**
-* Process server's reply.
-* @socket     read reply from this socket
-* @pipe_out   send information to stdout printer via this pipe
-* @pipe_err   send information to stderr printer via this pipe
-* Return -1 on error, 0 on success and quit, 1 if received 'O' or 'E' type job.
+* Grant the server credit for more jobs (see FLOW CONTROL in protocol.txt).
+* @socket   send grant via this socket
+* @jobs     number of further jobs the server may send
+* @bytes    number of further bytes the server may send
+* Return 0 on success, -1 on failure.
+*/
+int send_credit(int socket, unsigned int jobs, unsigned int bytes) {
+  unsigned char grant[2 + 2 * sizeof(uint32_t)];
+  uint32_t jobs_n = htonl(jobs);
+  uint32_t bytes_n = htonl(bytes);
+  grant[0] = (unsigned char) EXTENDED_REQUEST;
+  grant[1] = (unsigned char) EXT_CREDIT;
+  memcpy(grant + 2, &jobs_n, sizeof(uint32_t));
+  memcpy(grant + 2 + sizeof(uint32_t), &bytes_n, sizeof(uint32_t));
+  if (debug)
+    printf(">>> %d <<< Granting server %u job(s) and %u byte(s).\n", getpid(), jobs, bytes);
+  if (write(socket, grant, sizeof(grant)) != sizeof(grant)) {
+    fprintf(stderr, RED ">>> %d <<< [Client Error] Failed to send credit.\n" RESET, getpid());
+    return -1;
+  }
+  return 0;
+}
+
+/**
+* Tell the server that several jobs may be sent in one batch frame.
+* @socket       send request via this socket
+* @batch_jobs   most jobs per batch
+* Return 0 on success, -1 on failure.
 */
-int process_reply(int socket, int pipe_out[2], int pipe_err[2]) {
-  unsigned char job_info;
-  if (read(socket, &job_info, sizeof(char)) != sizeof(char)) {
-    fprintf(stderr, RED ">>> %d <<< [Client Error] Failed to receive job information.\n" RESET, getpid());
+int send_batch_limit(int socket, unsigned int batch_jobs) {
+  unsigned char request[2 + sizeof(uint32_t)];
+  uint32_t batch_jobs_n = htonl(batch_jobs);
+  request[0] = (unsigned char) EXTENDED_REQUEST;
+  request[1] = (unsigned char) EXT_BATCH;
+  memcpy(request + 2, &batch_jobs_n, sizeof(uint32_t));
+  if (write(socket, request, sizeof(request)) != sizeof(request)) {
+    fprintf(stderr, RED ">>> %d <<< [Client Error] Failed to send batch request.\n" RESET, getpid());
     return -1;
   }
+  return 0;
+}
 
-  // read text length
-  int text_length;
-  if (read(socket, &text_length, sizeof(int)) != sizeof(int)) {
-    fprintf(stderr, RED ">>> %d <<< [Client Error] Failed to receive job text length.\n" RESET, getpid());
+/**
+* Ask the server to append a CRC32C to every job text.
+* @socket   send request to this socket
+* Return 0 on success, -1 on failure.
+*/
+int send_crc_request(int socket) {
+  unsigned char request[2];
+  request[0] = (unsigned char) EXTENDED_REQUEST;
+  request[1] = (unsigned char) EXT_CRC32C;
+  if (write(socket, request, sizeof(request)) != sizeof(request)) {
+    fprintf(stderr, RED ">>> %d <<< [Client Error] Failed to send CRC32C request.\n" RESET, getpid());
     return -1;
   }
-  text_length = ntohl(text_length);
-  ssize_t text_size = (text_length == 0) ? 0 : sizeof(char) * (text_length+1);
-  ssize_t msg_size = sizeof(char) + sizeof(int) + text_size;
-  struct JobMessage *msg = (struct JobMessage *) malloc(msg_size);
+  return 0;
+}
 
-  msg->job_info = job_info;
-  msg->text_length = text_length;
+/**
+* Offer protocol version 2 and every capability the client supports.
+* @socket   send request to this socket
+* Return 0 on success, -1 on failure.
+*/
+int send_hello(int socket) {
+  unsigned char request[3 + VARINT_MAX_SIZE];
+  request[0] = (unsigned char) EXTENDED_REQUEST;
+  request[1] = (unsigned char) EXT_HELLO;
+  request[2] = (unsigned char) PROTOCOL_VERSION;
+  uint32_t capabilities = CLIENT_CAPABILITIES;
+  if (options.no_compress)
+    capabilities &= ~(CAP_COMPRESS | CAP_DICTIONARY);
+  if (!options.resume_path) // no checkpoint file to keep
+    capabilities &= ~CAP_RESUME;
+  size_t size = 3 + varint_encode(capabilities, request + 3);
+  if (debug)
+    printf(">>> %d <<< Offering protocol version %d.\n", getpid(), PROTOCOL_VERSION);
+  if (write(socket, request, size) != (ssize_t) size) {
+    fprintf(stderr, RED ">>> %d <<< [Client Error] Failed to send HELLO request.\n" RESET, getpid());
+    return -1;
+  }
+  return 0;
+}
 
-  // read job text
-  ssize_t received_bytes = 0;
-  ssize_t received_currently = 0;
-  while (received_bytes < text_size) {
-    received_currently = read(socket, msg->job_text + received_bytes, text_size - received_bytes);
-    if (received_currently == -1) {
-      perror(RED "[Client Error] Failed to receive text" RESET);
-      return -1;
-    } else {
-      received_bytes += received_currently;
-    }
+/**
+* Tell the server which jobs to send (see FILTERS in protocol.txt).
+* Jobs of other types, or whose text lacks the match text, are not sent.
+* @socket   send request to this socket
+* Return 0 on success, -1 on failure.
+*/
+int send_filter(int socket) {
+  unsigned char request[3 + VARINT_MAX_SIZE + FILTER_MAX_PATTERN];
+  size_t length = options.match ? strlen(options.match) : 0;
+  request[0] = (unsigned char) EXTENDED_REQUEST;
+  request[1] = (unsigned char) EXT_FILTER;
+  request[2] = options.types;
+  size_t size = 3 + varint_encode(length, request + 3);
+  if (length)
+    memcpy(request + size, options.match, length);
+  size += length;
+  if (debug)
+    printf(">>> %d <<< Asking server for job types 0x%02x only, matching \"%s\".\n", getpid(),
+           (unsigned int) options.types, options.match ? options.match : "");
+  if (write_all(socket, request, size)) {
+    fprintf(stderr, RED ">>> %d <<< [Client Error] Failed to send FILTER request.\n" RESET, getpid());
+    return -1;
+  }
+  return 0;
+}
+
+/**
+* Wait for the server's answer to HELLO and record what was agreed.
+* @socket   receive from this socket
+* Return 0 on success, -1 on failure.
+*/
+int receive_hello(int socket) {
+  size_t header_size = sizeof(char) + sizeof(int);
+  unsigned char frame[sizeof(char) + sizeof(int) + 2 + VARINT_MAX_SIZE];
+  if (read_all(socket, frame, header_size)) {
+    fprintf(stderr, RED ">>> %d <<< [Client Error] Server does not speak protocol version 2 (try --v1).\n" RESET, getpid());
+    return -1;
+  }
+  uint32_t length;
+  memcpy(&length, frame + 1, sizeof(uint32_t));
+  length = ntohl(length);
+  if ((frame[0] >> 5) != TYPE_C || length < 3 || length > sizeof(frame) - header_size ||
+      read_all(socket, frame + header_size, length) || frame[header_size] != CTRL_HELLO) {
+    fprintf(stderr, RED ">>> %d <<< [Client Error] Malformed HELLO reply.\n" RESET, getpid());
+    return -1;
   }
 
+  uint64_t capabilities;
+  if (varint_decode(frame + header_size + 2, length - 2, &capabilities) <= 0) {
+    fprintf(stderr, RED ">>> %d <<< [Client Error] Malformed HELLO reply.\n" RESET, getpid());
+    return -1;
+  }
+  session.version = frame[header_size + 1];
+  session.capabilities = (uint32_t) capabilities;
   if (debug)
-    printf("\n>>> %d <<< Received message (%li bytes) from server.\n", getpid(), msg_size);
+    printf(">>> %d <<< Server speaks version %d (capabilities 0x%x).\n", getpid(), session.version,
+           (unsigned int) session.capabilities);
+  return 0;
+}
+
+/**
+* Receive the compression dictionary the server sends right after its
+* HELLO reply when DICTIONARY was agreed.
+* @socket   receive from this socket
+* Return 0 on success, -1 on failure.
+*/
+int receive_dictionary(int socket) {
+  size_t header_size = sizeof(char) + sizeof(int);
+  unsigned char header[sizeof(char) + sizeof(int)];
+  if (read_all(socket, header, header_size)) {
+    fprintf(stderr, RED ">>> %d <<< [Client Error] Failed to receive compression dictionary.\n" RESET, getpid());
+    return -1;
+  }
+  uint32_t length;
+  memcpy(&length, header + 1, sizeof(uint32_t));
+  length = ntohl(length);
+  if ((header[0] >> 5) != TYPE_C || length < 2 || length > 1 + VARINT_MAX_SIZE + CODEC_MAX_OFFSET) {
+    fprintf(stderr, RED ">>> %d <<< [Client Error] Malformed compression dictionary.\n" RESET, getpid());
+    return -1;
+  }
 
-  int validation = validate_checksum(msg);
-  if (validation) {
+  unsigned char *payload = (unsigned char *) pool_alloc(&pool, length);
+  if (!payload) {
+    fprintf(stderr, RED ">>> %d <<< [Client Error] Failed to allocate compression dictionary.\n" RESET, getpid());
+    return -1;
+  }
+  uint64_t id;
+  int used = 0;
+  if (read_all(socket, payload, length) || payload[0] != CTRL_DICTIONARY ||
+      (used = varint_decode(payload + 1, length - 1, &id)) <= 0 ||
+      codec_dict_load(&session.dict, payload + 1 + used, length - 1 - used) || session.dict.id != id) {
+    fprintf(stderr, RED ">>> %d <<< [Client Error] Malformed compression dictionary.\n" RESET, getpid());
+    pool_free(&pool, payload);
+    return -1;
+  }
+  pool_free(&pool, payload);
+  if (debug)
+    printf(">>> %d <<< Received %zu byte compression dictionary.\n", getpid(), session.dict.length);
+  return 0;
+}
+
+/**
+* Receive the session token the server sends after its HELLO reply (and
+* dictionary) when RESUME was agreed.
+* @socket   receive from this socket
+* Return 0 on success, -1 on failure.
+*/
+int receive_session(int socket) {
+  size_t header_size = sizeof(char) + sizeof(int);
+  unsigned char frame[sizeof(char) + sizeof(int) + 1 + VARINT_MAX_SIZE];
+  if (read_all(socket, frame, header_size)) {
+    fprintf(stderr, RED ">>> %d <<< [Client Error] Failed to receive session token.\n" RESET, getpid());
+    return -1;
+  }
+  uint32_t length;
+  memcpy(&length, frame + 1, sizeof(uint32_t));
+  length = ntohl(length);
+  if ((frame[0] >> 5) != TYPE_C || length < 2 || length > sizeof(frame) - header_size ||
+      read_all(socket, frame + header_size, length) || frame[header_size] != CTRL_SESSION ||
+      varint_decode(frame + header_size + 1, length - 1, &session.token) <= 0) {
+    fprintf(stderr, RED ">>> %d <<< [Client Error] Malformed session token.\n" RESET, getpid());
+    return -1;
+  }
+  if (debug)
+    printf(">>> %d <<< Session token %016llx.\n", getpid(), (unsigned long long) session.token);
+  return 0;
+}
+
+/**
+* Continue where the session saved in the checkpoint file stopped, if it
+* was served from the same job file (see RESUMING in protocol.txt).
+* Without a checkpoint file, or with one of another job file, the
+* session starts from the first job.
+* @socket   send request to this socket
+* Return 0 on success, -1 on failure.
+*/
+int resume_session(int socket) {
+  if (!(session.capabilities & CAP_RESUME)) {
+    fprintf(stderr, ">>> %d <<< <Client Notification> Server cannot resume sessions, starting from the first job.\n",
+            getpid());
+    return 0;
+  }
+  FILE *file = fopen(options.resume_path, "r");
+  if (!file && errno == ENOENT)
+    return 0;
+  unsigned long long token, checkpoint, processed;
+  long long kept[2];
+  int parsed = 0;
+  if (file) {
+    parsed = fscanf(file, "%llx %llu %llu %lld %lld", &token, &checkpoint, &processed, &kept[TYPE_O], &kept[TYPE_E]);
+    fclose(file);
+  }
+  if (parsed != 5) {
+    fprintf(stderr, RED ">>> %d <<< [Client Error] Failed to read checkpoint file \"%s\".\n" RESET, getpid(),
+            options.resume_path);
+    return -1;
+  }
+  if (token != session.token) {
+    fprintf(stderr, ">>> %d <<< <Client Notification> Checkpoint is from another job file, "
+            "starting from the first job.\n", getpid());
+    return 0;
+  }
+
+  unsigned char request[2 + 2 * VARINT_MAX_SIZE];
+  request[0] = (unsigned char) EXTENDED_REQUEST;
+  request[1] = (unsigned char) EXT_RESUME;
+  size_t size = 2 + varint_encode(checkpoint, request + 2);
+  size += varint_encode(processed, request + size);
+  if (write_all(socket, request, size)) {
+    fprintf(stderr, RED ">>> %d <<< [Client Error] Failed to send RESUME request.\n" RESET, getpid());
+    return -1;
+  }
+  session.checkpoint = checkpoint;
+  session.processed = processed;
+  session.resumed = 1;
+  for (int type = 0; type < 2; type++) // a size that was not known keeps the whole output
+    session.kept[type] = (kept[type] < 0) ? LLONG_MAX : kept[type];
+  fprintf(stderr, ">>> %d <<< <Client Notification> Resuming after checkpoint %llu and %llu more job(s).\n",
+          getpid(), checkpoint, processed);
+  return 0;
+}
+
+/**
+* Record a CHECKPOINT frame. In batch mode with --resume, the outputs
+* are flushed and the checkpoint file is updated, so a client that
+* crashes receives at most the jobs since the last checkpoint again.
+* @checkpoint   position in the frame
+* Return 0 on success, -1 on failure.
+*/
+int reach_checkpoint(uint64_t checkpoint) {
+  session.checkpoint = checkpoint;
+  session.processed = 0;
+  if (!options.resume_path)
+    return 0;
+  if (sink_flush(&sinks[TYPE_O]) || sink_flush(&sinks[TYPE_E]))
+    return -1;
+  return save_checkpoint();
+}
+
+/**
+* Save the position of the session to the checkpoint file: the session
+* token, the last checkpoint, the jobs processed since and the size of
+* each output, which a resumed session cuts back to. Call with the
+* outputs flushed. The file is replaced with rename(), so it always holds
+* a whole position.
+* Return 0 on success, -1 on failure.
+*/
+int save_checkpoint(void) {
+  char path[PATH_MAX];
+  if (snprintf(path, sizeof(path), "%s.tmp", options.resume_path) >= (int) sizeof(path)) {
+    fprintf(stderr, RED ">>> %d <<< [Client Error] Checkpoint file name is too long.\n" RESET, getpid());
+    return -1;
+  }
+  FILE *file = fopen(path, "w");
+  int status = file ? 0 : -1;
+  if (file && fprintf(file, "%llx %llu %llu %lld %lld\n", (unsigned long long) session.token,
+                      (unsigned long long) session.checkpoint, (unsigned long long) session.processed,
+                      (long long) lseek(sinks[TYPE_O].fd, 0, SEEK_CUR),
+                      (long long) lseek(sinks[TYPE_E].fd, 0, SEEK_CUR)) < 0)
+    status = -1;
+  if (file && fclose(file))
+    status = -1;
+  if (!status && rename(path, options.resume_path))
+    status = -1;
+  if (status)
+    perror(RED "[Client Error] Failed to save checkpoint" RESET);
+  return status;
+}
+
+/**
+* Ask the server for its metrics and print them (protocol version 2).
+* @socket   connection to the server, no jobs requested yet
+* Return 0 on success, -1 on failure.
+*/
+int print_stats(int socket) {
+  if (session.version < 2) {
+    fprintf(stderr, RED ">>> %d <<< [Client Error] Metrics need protocol version 2.\n" RESET, getpid());
+    return -1;
+  }
+  unsigned char request[2] = { EXTENDED_REQUEST, EXT_STATS };
+  if (write_all(socket, request, sizeof(request))) {
+    fprintf(stderr, RED ">>> %d <<< [Client Error] Failed to send STATS request.\n" RESET, getpid());
+    return -1;
+  }
+
+  unsigned char header[sizeof(char) + sizeof(int) + 1];
+  uint32_t length;
+  if (read_all(socket, header, sizeof(header))) {
+    fprintf(stderr, RED ">>> %d <<< [Client Error] Failed to receive metrics.\n" RESET, getpid());
+    return -1;
+  }
+  memcpy(&length, header + 1, sizeof(uint32_t));
+  length = ntohl(length);
+  if ((header[0] >> 5) != TYPE_C || header[sizeof(header) - 1] != CTRL_STATS || !length || length > 1024 * 1024) {
+    fprintf(stderr, RED ">>> %d <<< [Client Error] Malformed metrics reply.\n" RESET, getpid());
+    return -1;
+  }
+  char *text = (char *) pool_alloc(&pool, length);
+  if (!text || read_all(socket, text, length - 1)) {
+    fprintf(stderr, RED ">>> %d <<< [Client Error] Failed to receive metrics.\n" RESET, getpid());
+    pool_free(&pool, text);
+    return -1;
+  }
+  fwrite(text, 1, length - 1, stdout);
+  pool_free(&pool, text);
+  return 0;
+}
+
+/**
+* Request any number of jobs (protocol version 2).
+* @socket   send request to this socket
+* @jobs     number of jobs, 0 for all jobs
+* Return 0 on success, -1 on failure.
+*/
+int send_fetch(int socket, uint64_t jobs) {
+  unsigned char request[2 + VARINT_MAX_SIZE];
+  request[0] = (unsigned char) EXTENDED_REQUEST;
+  request[1] = (unsigned char) EXT_FETCH;
+  size_t size = 2 + varint_encode(jobs, request + 2);
+  if (debug)
+    printf(">>> %d <<< Requesting %llu job(s) from server.\n", getpid(), (unsigned long long) jobs);
+  if (write(socket, request, size) != (ssize_t) size) {
+    fprintf(stderr, RED ">>> %d <<< [Client Error] Failed to send request.\n" RESET, getpid());
+    return -1;
+  }
+  return 0;
+}
+
+/**
+* Request jobs under an ID; the server reports when they have all been
+* sent (protocol version 2).
+* @socket   send request to this socket
+* @id       request ID
+* @jobs     number of jobs
+* Return 0 on success, -1 on failure.
+*/
+int send_fetch_id(int socket, uint64_t id, uint64_t jobs) {
+  unsigned char request[2 + 2 * VARINT_MAX_SIZE];
+  request[0] = (unsigned char) EXTENDED_REQUEST;
+  request[1] = (unsigned char) EXT_FETCH_ID;
+  size_t size = 2 + varint_encode(id, request + 2);
+  size += varint_encode(jobs, request + size);
+  if (debug)
+    printf(">>> %d <<< Requesting %llu job(s) from server (request %llu).\n", getpid(),
+           (unsigned long long) jobs, (unsigned long long) id);
+  if (write(socket, request, size) != (ssize_t) size) {
+    fprintf(stderr, RED ">>> %d <<< [Client Error] Failed to send request.\n" RESET, getpid());
+    return -1;
+  }
+  return 0;
+}
+
+/**
+* Count a leased job as done; acknowledgements are sent in groups.
+* @socket   send acknowledgements to this socket
+* Return 0 on success, -1 on failure.
+*/
+int acknowledge_job(int socket) {
+  if (!(session.capabilities & CAP_LEASES))
+    return 0;
+  if (++session.unacked < ACK_BATCH_JOBS)
+    return 0;
+  return flush_acks(socket);
+}
+
+/**
+* Acknowledge every leased job that is done.
+* @socket   send acknowledgements to this socket
+* Return 0 on success, -1 on failure.
+*/
+int flush_acks(int socket) {
+  if (!session.unacked)
+    return 0;
+  unsigned char request[2 + VARINT_MAX_SIZE];
+  request[0] = (unsigned char) EXTENDED_REQUEST;
+  request[1] = (unsigned char) EXT_ACK;
+  size_t size = 2 + varint_encode(session.unacked, request + 2);
+  if (debug)
+    printf(">>> %d <<< Acknowledging %lu job(s).\n", getpid(), session.unacked);
+  session.unacked = 0;
+  if (write(socket, request, size) != (ssize_t) size) {
+    fprintf(stderr, RED ">>> %d <<< [Client Error] Failed to acknowledge jobs.\n" RESET, getpid());
+    return -1;
+  }
+  return 0;
+}
+
+/**
+* Account for a consumed job and refill the server's credit when half of
+* the window is used up.
+* @socket     send grant via this socket
+* @msg_size   size of the consumed message
+* Return 0 on success, -1 on failure.
+*/
+int consume_credit(int socket, size_t msg_size) {
+  if (!(session.capabilities & CAP_CREDIT))
+    return 0;
+  credits.used_jobs++;
+  credits.used_bytes += msg_size;
+  if (credits.used_jobs < CREDIT_WINDOW_JOBS / 2 && credits.used_bytes < CREDIT_WINDOW_BYTES / 2)
+    return 0;
+  int status = send_credit(socket, credits.used_jobs, credits.used_bytes);
+  credits.used_jobs = 0;
+  credits.used_bytes = 0;
+  return status;
+}
+
+/**
+* Make bytes of the next frame available in the receive buffer.
+* @in       receive buffer of the server connection
+* @needed   number of bytes required
+* Return 0 on success, -1 on error or if the server closed the connection.
+*/
+int receive_bytes(struct RecvBuffer *in, size_t needed) {
+  int fill_status = recv_fill(in, needed);
+  if (fill_status == 1) {
+    fprintf(stderr, RED ">>> %d <<< [Client Error] Server closed the connection.\n" RESET, getpid());
+    return -1;
+  } else if (fill_status == -1) {
+    if (errno == EINTR) // stopped by an interrupt, the caller reports it
+      return -1;
+    perror(RED "[Client Error] Failed to receive from server" RESET);
+    return -1;
+  }
+  return 0;
+}
+
+/**
+* Route a validated 'O' or 'E' job to its printer (utility method).
+* @in         receive buffer the job was parsed from
+* @pipe_out   send information to stdout printer via this pipe
+* @pipe_err   send information to stderr printer via this pipe
+* @msg        job, with text length in host byte order
+* @msg_size   size of the job on the wire
+* Return 0 on success, -1 on error.
+*/
+int dispatch_job(struct RecvBuffer *in, int pipe_out[2], int pipe_err[2], struct JobMessage *msg, size_t msg_size) {
+  unsigned char job_type = (msg->job_info) >> 5;
+  if (validate_checksum(msg)) {
     fprintf(stderr, RED ">>> %d <<< [Client Error] Checksum validation failed.\n" RESET, getpid());
     return -1;
   }
+  if (msg->text_length && options.fetch) { // an empty text has nothing to print
+    if (sink_write(&sinks[job_type], msg->job_text, msg->text_length))
+      return -1;
+  } else if (msg->text_length) {
+    int *pipefd = (job_type == (unsigned char) TYPE_O) ? pipe_out : pipe_err;
+    if (send_to_pipe(pipefd, (unsigned char) ONE_JOB_REQUEST, msg) == -1)
+      return -1;
+  }
+  session.processed++;
+  if (acknowledge_job(in->fd))
+    return -1;
+  return consume_credit(in->fd, msg_size);
+}
+
+/**
+* Send one request of a multi-request fetch and remember it.
+* Requests carry IDs if the server reports their completion; otherwise
+* their jobs are counted as they arrive.
+* @socket   send request to this socket
+* @jobs     number of jobs (at most 126 with protocol version 1)
+* Return 0 on success, -1 on failure.
+*/
+int prefetch_request(int socket, long long jobs) {
+  int status;
+  uint64_t id = prefetch.next_id++;
+  if (session.capabilities & CAP_REQUEST_IDS) {
+    status = send_fetch_id(socket, id, (uint64_t) jobs);
+  } else if (session.version >= 2) {
+    status = send_fetch(socket, (uint64_t) jobs);
+  } else {
+    unsigned char request = ((char) jobs) & 127;
+    if (debug)
+      printf(">>> %d <<< Sending request (%d) to server.\n", getpid(), (int) request);
+    status = send_request(socket, request);
+  }
+  if (status)
+    return -1;
+  int slot = (prefetch.head + prefetch.count) % PREFETCH_DEPTH;
+  prefetch.jobs[slot] = jobs;
+  prefetch.ids[slot] = id;
+  prefetch.count++;
+  return 0;
+}
+
+/**
+* Count received jobs against the oldest requests. Requests without an
+* ID are complete once all their jobs arrived; those with an ID wait for
+* the server's DONE frame.
+* @jobs   number of jobs received
+*/
+void prefetch_received(long long jobs) {
+  for (int i = 0; i < prefetch.count && jobs > 0; i++) {
+    int slot = (prefetch.head + i) % PREFETCH_DEPTH;
+    long long counted = (jobs < prefetch.jobs[slot]) ? jobs : prefetch.jobs[slot];
+    prefetch.jobs[slot] -= counted;
+    jobs -= counted;
+  }
+  while (!(session.capabilities & CAP_REQUEST_IDS) && prefetch.count && !prefetch.jobs[prefetch.head]) {
+    prefetch.head = (prefetch.head + 1) % PREFETCH_DEPTH;
+    prefetch.count--;
+  }
+}
+
+/**
+* Fetch several jobs, keeping PREFETCH_DEPTH requests in flight so the
+* next request reaches the server before the current one is finished.
+* @in         receive buffer of the server connection
+* @pipe_out   send information to stdout printer via this pipe
+* @pipe_err   send information to stderr printer via this pipe
+* @jobs       number of jobs to fetch
+* Return -1 on error, 0 on quit, 1 once all jobs were received.
+*/
+int fetch_jobs(struct RecvBuffer *in, int pipe_out[2], int pipe_err[2], long long jobs) {
+  long long chunk = (session.version >= 2) ? FETCH_CHUNK_JOBS : 126;
+  long long requested = 0;
+  long long received = 0;
+  while (received < jobs || prefetch.count) {
+    if (in->stop && *in->stop) { // interrupted, jobs already buffered are left behind
+      prefetch.count = 0;
+      return -1;
+    }
+    while (prefetch.count < PREFETCH_DEPTH && requested < jobs) {
+      long long size = (jobs - requested < chunk) ? jobs - requested : chunk;
+      if (prefetch_request(in->fd, size))
+        return -1;
+      requested += size;
+    }
+    int process_status = process_reply(in, pipe_out, pipe_err);
+    if (process_status == REPLY_DONE)
+      continue;
+    if (process_status <= 0) {
+      prefetch.count = 0;
+      return process_status;
+    }
+    received += process_status;
+    prefetch_received(process_status);
+  }
+  return 1;
+}
 
+/**
+* Process server's reply. The frame is parsed in place in the receive
+* buffer, which reads as much as is available on each read().
+* @in         receive buffer of the server connection
+* @pipe_out   send information to stdout printer via this pipe
+* @pipe_err   send information to stderr printer via this pipe
+* Return -1 on error, 0 on success and quit, REPLY_DONE after a DONE control
+* frame, number of 'O' and 'E' type jobs received otherwise.
+*/
+int process_reply(struct RecvBuffer *in, int pipe_out[2], int pipe_err[2]) {
+  size_t header_size = sizeof(char) + sizeof(int);
+  if (recv_available(in) < header_size && flush_acks(in->fd)) // about to wait for the server
+    return -1;
+  if (receive_bytes(in, header_size))
+    return -1;
+  struct JobMessage *msg = (struct JobMessage *) recv_peek(in);
   unsigned char job_type = (msg->job_info) >> 5;
-  if (job_type == (unsigned char) TYPE_O) {
-    if (send_to_pipe(pipe_out, (unsigned char) ONE_JOB_REQUEST, msg) == -1)
+  unsigned int text_length = ntohl(msg->text_length);
+  if (job_type == (unsigned char) TYPE_B)
+    return process_batch(in, pipe_out, pipe_err, text_length);
+  if (job_type == (unsigned char) TYPE_C) {
+    if (receive_bytes(in, header_size + text_length))
       return -1;
-    free(msg);
-    return 1;
+    unsigned char *payload = (unsigned char *) recv_peek(in) + header_size;
+    unsigned char opcode = text_length ? payload[0] : 0;
+    uint64_t id;
+    int decoded = (text_length > 1 && varint_decode(payload + 1, text_length - 1, &id) > 0);
+    recv_consume(in, header_size + text_length);
+    if (decoded && opcode == CTRL_CHECKPOINT) {
+      if (reach_checkpoint(id))
+        return -1;
+      return process_reply(in, pipe_out, pipe_err);
+    }
+    if (!decoded || opcode != CTRL_DONE) // unknown control frames are skipped
+      return process_reply(in, pipe_out, pipe_err);
+    if (debug)
+      printf(">>> %d <<< Server finished request %llu.\n", getpid(), (unsigned long long) id);
+    if (prefetch.count && prefetch.ids[prefetch.head] == id) {
+      prefetch.head = (prefetch.head + 1) % PREFETCH_DEPTH;
+      prefetch.count--;
+    }
+    return REPLY_DONE;
+  }
+  if (options.relay && text_length && (job_type == (unsigned char) TYPE_O || job_type == (unsigned char) TYPE_E)) {
+    int *pipefd = (job_type == (unsigned char) TYPE_O) ? pipe_out : pipe_err;
+    if (relay_to_pipe(in, pipefd, text_length))
+      return -1;
+    size_t trailer = trailer_size(text_length); // relayed texts are not checked
+    if (trailer) {
+      if (receive_bytes(in, trailer))
+        return -1;
+      recv_consume(in, trailer);
+    }
+    if (acknowledge_job(in->fd))
+      return -1;
+    return consume_credit(in->fd, header_size + text_length + 1 + trailer) ? -1 : 1;
+  }
 
-  } else if (job_type == (unsigned char) TYPE_E) {
-    if (send_to_pipe(pipe_err, (unsigned char) ONE_JOB_REQUEST, msg) == -1)
+  size_t msg_size = header_size + ((text_length == 0) ? 0 : sizeof(char) * (text_length+1)) + trailer_size(text_length);
+  if (receive_bytes(in, msg_size))
+    return -1;
+  msg = (struct JobMessage *) recv_peek(in); // filling may move the frame
+  if (job_type == (unsigned char) TYPE_Z) {
+    struct JobMessage *job = inflate_job((unsigned char *) msg, text_length);
+    if (!job)
       return -1;
-    free(msg);
-    return 1;
+    int dispatch_status = dispatch_job(in, pipe_out, pipe_err, job, msg_size);
+    recv_consume(in, msg_size);
+    return dispatch_status ? -1 : 1;
+  }
+  msg->text_length = text_length;
+
+  if (debug)
+    printf("\n>>> %d <<< Received message (%li bytes) from server.\n", getpid(), msg_size);
+
+  if (job_type == (unsigned char) TYPE_O || job_type == (unsigned char) TYPE_E) {
+    int dispatch_status = dispatch_job(in, pipe_out, pipe_err, msg, msg_size);
+    recv_consume(in, msg_size);
+    return dispatch_status ? -1 : 1;
 
   } else if (job_type == (unsigned char) TYPE_Q) {
-    free(msg);
+    recv_consume(in, msg_size);
     unsigned char request = (unsigned char) STOP_REQUEST;
     if (debug) {
       printf(">>> %d <<< Received type 'Q' job.\n", getpid());
       printf(">>> %d <<< Sending request (%d) to server and pipes.\n", getpid(), (int) request);
     }
+    if (flush_acks(in->fd) || send_request(in->fd, request) == -1)
+      return -1;
+    if (options.fetch) // batch mode has no printers
+      return 0;
     if (send_to_pipe(pipe_out, request, NULL) == -1)
       return -1;
     if (send_to_pipe(pipe_err, request, NULL) == -1)
       return -1;
-    if (send_request(socket, request) == -1)
-      return -1;
     micro_sleep(100);
     printf("\n>>> %d <<< <Client Notification> All jobs finished.\n", getpid());
     return 0;
 
   } else {
-    free(msg);
     fprintf(stderr, RED ">>> %d <<< [Client Error] Failed to process message: job type unknown.\n" RESET, getpid());
     return -1;
   }
 }
 
+/**
+* Process a batch frame: several jobs decoded in one pass, in place.
+* @in             receive buffer holding the batch header
+* @pipe_out       send information to stdout printer via this pipe
+* @pipe_err       send information to stderr printer via this pipe
+* @batch_length   size of the batch payload
+* Return -1 on error, number of jobs received otherwise.
+*/
+int process_batch(struct RecvBuffer *in, int pipe_out[2], int pipe_err[2], unsigned int batch_length) {
+  size_t header_size = sizeof(char) + sizeof(int);
+  if (receive_bytes(in, header_size + batch_length))
+    return -1;
+  char *batch = recv_peek(in) + header_size;
+  if (debug)
+    printf("\n>>> %d <<< Received batch (%u bytes) from server.\n", getpid(), batch_length);
+
+  int jobs = 0;
+  size_t position = 0;
+  while (position < batch_length) {
+    struct JobMessage *msg = (struct JobMessage *) (batch + position);
+    unsigned int text_length = (batch_length - position < header_size) ? 0 : ntohl(msg->text_length);
+    size_t msg_size = header_size + text_length + 1 + trailer_size(text_length);
+    unsigned char job_type = msg->job_info >> 5;
+    if (!text_length || msg_size > batch_length - position ||
+        (job_type != (unsigned char) TYPE_O && job_type != (unsigned char) TYPE_E &&
+         job_type != (unsigned char) TYPE_Z)) {
+      fprintf(stderr, RED ">>> %d <<< [Client Error] Malformed job in batch.\n" RESET, getpid());
+      return -1;
+    }
+    if (job_type == (unsigned char) TYPE_Z) {
+      msg = inflate_job((unsigned char *) msg, text_length);
+      if (!msg)
+        return -1;
+    } else {
+      msg->text_length = text_length;
+    }
+    if (dispatch_job(in, pipe_out, pipe_err, msg, msg_size))
+      return -1;
+    position += msg_size;
+    jobs++;
+  }
+  recv_consume(in, header_size + batch_length);
+  return jobs;
+}
+
+/**
+* Decompress a 'Z' frame straight into the message that is passed on to
+* the printers, so the text is written once and never copied. The
+* message is reused from job to job.
+* @frame            compressed frame: header, payload, terminator, trailer
+* @payload_length   size of the payload
+* Return the restored 'O' or 'E' job (text length in host byte order),
+* NULL if the frame is malformed.
+*/
+struct JobMessage *inflate_job(const unsigned char *frame, unsigned int payload_length) {
+  size_t header_size = sizeof(char) + sizeof(int);
+  const unsigned char *payload = frame + header_size;
+  uint64_t text_length;
+  int used = (payload_length > 1) ? varint_decode(payload + 1, payload_length - 1, &text_length) : -1;
+  if (used <= 0 || (payload[0] != TYPE_O && payload[0] != TYPE_E) || !text_length ||
+      text_length > MAX_INFLATED_LENGTH) {
+    fprintf(stderr, RED ">>> %d <<< [Client Error] Malformed compressed job.\n" RESET, getpid());
+    return NULL;
+  }
+
+  size_t needed = header_size + text_length + 1 + CRC32C_TRAILER_SIZE;
+  if (needed > session.inflated_capacity) {
+    struct JobMessage *larger = (struct JobMessage *) realloc(session.inflated, needed);
+    if (!larger) {
+      fprintf(stderr, RED ">>> %d <<< [Client Error] Failed to allocate decompression buffer.\n" RESET, getpid());
+      return NULL;
+    }
+    session.inflated = larger;
+    session.inflated_capacity = needed;
+  }
+  struct JobMessage *msg = session.inflated;
+  const struct CodecDict *dict = (session.capabilities & CAP_DICTIONARY) ? &session.dict : NULL;
+  long inflated = codec_decompress(payload + 1 + used, payload_length - 1 - used, msg->job_text, text_length, dict);
+  if (inflated != (long) text_length) {
+    fprintf(stderr, RED ">>> %d <<< [Client Error] Failed to decompress job.\n" RESET, getpid());
+    return NULL;
+  }
+  msg->job_info = (unsigned char) ((payload[0] << 5) | (frame[0] & 31));
+  msg->text_length = (int) text_length;
+  msg->job_text[text_length] = '\0';
+  if (trailer_size(payload_length))
+    memcpy(msg->job_text + text_length + 1, payload + payload_length + 1, CRC32C_TRAILER_SIZE);
+  return msg;
+}
+
 /**
 * Send message to another process via pipe.
 * @pipefd         send via this pipe
@@ -461,10 +1493,9 @@ int send_to_pipe(int pipefd[2], unsigned char pipe_request, struct JobMessage *m
     ssize_t msg_size = sizeof(char) + sizeof(int) + (sizeof(char) * text_length);
     ssize_t sent_bytes = 0;
     ssize_t sent_currently = 0;
-    if (debug)
-      printf(">>> %d <<< Sending message (%li bytes) to pipe.\n", getpid(), msg_size);
+    TRACE(TRACE_PIPE, -1, msg->text_length, 0);
     while (sent_bytes < msg_size) {
-      sent_currently = write(pipefd[1], msg + sent_bytes, msg_size - sent_bytes);
+      sent_currently = write(pipefd[1], (char *) msg + sent_bytes, msg_size - sent_bytes);
       if (sent_currently == -1) {
         perror(RED "[Client Error] Failed to send message to pipe" RESET);
         return -1;
@@ -484,6 +1515,99 @@ int send_to_pipe(int pipefd[2], unsigned char pipe_request, struct JobMessage *m
   }
 }
 
+/**
+* Relay a job's text from the server socket to a printer with splice().
+* The header has already been parsed; the text never enters user space
+* except for bytes that were buffered along with the header. Relayed
+* texts are not checksummed by the client.
+* @in            receive buffer holding the job header
+* @pipefd        printer pipe
+* @text_length   length of the job text
+* Return 0 on success, -1 on error.
+*/
+int relay_to_pipe(struct RecvBuffer *in, int pipefd[2], unsigned int text_length) {
+  size_t header_size = sizeof(char) + sizeof(int);
+  unsigned char pipe_header[sizeof(char) + sizeof(int)];
+  pipe_header[0] = (unsigned char) ONE_JOB_REQUEST;
+  memcpy(pipe_header + 1, &text_length, sizeof(int));
+  if (write_all(pipefd[1], pipe_header, sizeof(pipe_header)))
+    return -1;
+
+  size_t remaining = (size_t) text_length + 1;
+  size_t buffered = recv_available(in) - header_size;
+  if (buffered > remaining)
+    buffered = remaining;
+  if (buffered && write_all(pipefd[1], recv_peek(in) + header_size, buffered))
+    return -1;
+  recv_consume(in, header_size + buffered);
+  remaining -= buffered;
+
+  TRACE(TRACE_PIPE, -1, text_length, 0);
+  while (remaining) {
+    ssize_t moved = splice(in->fd, NULL, pipefd[1], NULL, remaining, SPLICE_F_MOVE | SPLICE_F_MORE);
+    if (moved == 0) {
+      fprintf(stderr, RED ">>> %d <<< [Client Error] Server closed the connection.\n" RESET, getpid());
+      return -1;
+    }
+    if (moved == -1) {
+      if (errno == EINTR)
+        continue;
+      perror(RED "[Client Error] Failed to relay text to pipe" RESET);
+      return -1;
+    }
+    remaining -= moved;
+  }
+  return 0;
+}
+
+/**
+* Print a relayed job: splice its text from the pipe to the printer's
+* output. Outputs that splice() cannot write to (such as terminals) fall
+* back to read() and write().
+* @pipefd        read from this pipe
+* @std_pointer   print job text to this file
+* @text_length   length of the job text
+* Return -1 on error, 0 on success.
+*/
+int print_relayed(int pipefd[2], FILE *std_pointer, unsigned int text_length) {
+  static int splice_output = 1;
+  int out_fd = fileno(std_pointer);
+  const char *color = (std_pointer == stdout) ? BLU : GRN;
+  fflush(std_pointer);
+  if (write_all(out_fd, color, strlen(color)))
+    return -1;
+
+  size_t remaining = text_length;
+  while (remaining) {
+    ssize_t moved = -1;
+    if (splice_output) {
+      moved = splice(pipefd[0], NULL, out_fd, NULL, remaining, SPLICE_F_MOVE | SPLICE_F_MORE);
+      if (moved == -1 && errno == EINVAL)
+        splice_output = 0;
+    }
+    if (!splice_output) {
+      char chunk[16384];
+      moved = read(pipefd[0], chunk, (remaining < sizeof(chunk)) ? remaining : sizeof(chunk));
+      if (moved > 0 && write_all(out_fd, chunk, moved))
+        return -1;
+    }
+    if (moved == -1 && errno == EINTR)
+      continue;
+    if (moved <= 0) {
+      perror(RED "[Client Error] Failed to print relayed text" RESET);
+      return -1;
+    }
+    remaining -= moved;
+  }
+
+  char terminator;
+  if (read(pipefd[0], &terminator, sizeof(char)) != sizeof(char)) {
+    fprintf(stderr, RED ">>> %d <<< [Client Error] Pipe failed to receive data.\n" RESET, getpid());
+    return -1;
+  }
+  return write_all(out_fd, RESET "\n", strlen(RESET "\n"));
+}
+
 /**
 * Process message sent via pipe.
 * @pipefd        read from this pipe
@@ -503,47 +1627,48 @@ int receive_on_pipe(int pipefd[2], FILE *std_pointer) {
       fprintf(stderr, RED ">>> %d <<< [Client Error] Pipe failed to receive data.\n" RESET, getpid());
       return -1;
     }
+    TRACE(TRACE_PIPE, -1, text_length, 1);
+    if (options.relay)
+      return print_relayed(pipefd, std_pointer, (unsigned int) text_length);
 
-    char *job_text = (char *) malloc(sizeof(char) * (text_length+1));
+    if (text_length < 0) {
+      fprintf(stderr, RED ">>> %d <<< [Client Error] Malformed pipe request.\n" RESET, getpid());
+      return -1;
+    }
+    char *job_text = (char *) pool_alloc(&pool, (size_t) text_length + 1);
+    if (!job_text) {
+      fprintf(stderr, RED ">>> %d <<< [Client Error] Failed to allocate job text.\n" RESET, getpid());
+      return -1;
+    }
 
     ssize_t received_bytes = 0;
     ssize_t received_currently = 0;
     while (received_bytes < text_length+1) {
       received_currently = read(pipefd[0], job_text + received_bytes, text_length+1 - received_bytes);
-      if (received_currently == -1) {
+      if (received_currently <= 0) {
         perror(RED "[Client Error] Pipe failed to receive text" RESET);
+        pool_free(&pool, job_text);
         return -1;
       } else {
         received_bytes += received_currently;
       }
     }
 
-    if (debug) {
-      size_t msg_size = sizeof(char) + sizeof(int) + received_bytes;
-      printf(">>> %d <<< Received message (%li bytes) from client via pipe.\n", getpid(), msg_size);
-    }
-
+    int status = 0;
     if (std_pointer == stdout) {
-      if (debug)
-        printf(">>> %d <<< Printing job to stdout.\n\n", getpid());
       fprintf(stdout, BLU "%s" RESET "\n", job_text);
-      micro_sleep(500); // preserve printing order at the cost of context switch overhead
-      free(job_text);
       // add debug printing
 
     } else if (std_pointer == stderr) {
-      if (debug)
-        printf(">>> %d <<< Printing job to stderr.\n\n", getpid());
       fprintf(stderr, GRN "%s" RESET "\n", job_text);
-      micro_sleep(500); // preserve printing order at the cost of context switch overhead
-      free(job_text);
       // add debug printing
 
     } else {
       fprintf(stderr, RED ">>> %d <<< [Client Error] Failed to print text: unknown file pointer on pipe.\n" RESET, getpid());
-      return -1;
+      status = -1;
     }
-    return 0;
+    pool_free(&pool, job_text); // cached, the next text of a similar length reuses it
+    return status;
 
   } else if (pipe_request == (unsigned char) STOP_REQUEST) {
     if (debug) {
@@ -561,28 +1686,81 @@ int receive_on_pipe(int pipefd[2], FILE *std_pointer) {
 /*====================== MISCELLANIOUS UTILITY METHODS =======================*/
 
 /**
-* Validate checksum of received message.
+* Validate checksum (and CRC32C trailer, if requested) of received message.
 * @msg   attempt to validate checksum of this message
 * Return 0 on success, -1 on checksum mismatch.
 */
 int validate_checksum(struct JobMessage *msg) {
-  if (debug)
-    printf(">>> %d <<< Validating checksum.\n", getpid());
   if (msg->text_length == 0)
     return 0;
 
-  unsigned int sum = 0;
-  for (unsigned int i = 0; i < strlen(msg->job_text); i++)
-    sum += msg->job_text[i];
-
-  unsigned int expected = sum % 32;
+  unsigned int expected = checksum_text(msg->job_text, msg->text_length);
   unsigned int received = ((int) msg->job_info) & 31;
-  if (expected == received) {
-    return 0;
-  } else {
+  if (expected != received) {
     fprintf(stderr, RED ">>> %d <<< [Client Error] Checksum mismatch.\n" RESET, getpid());
     return -1;
   }
+
+  if (options.crc32c) {
+    uint32_t crc;
+    memcpy(&crc, msg->job_text + msg->text_length + 1, sizeof(uint32_t));
+    if (ntohl(crc) != checksum_crc32c(msg->job_text, msg->text_length)) {
+      fprintf(stderr, RED ">>> %d <<< [Client Error] CRC32C mismatch.\n" RESET, getpid());
+      return -1;
+    }
+  }
+  return 0;
+}
+
+/**
+* Size of the CRC32C trailer following a job text.
+* @text_length   length of the job text
+* Return number of bytes, 0 if the job has no trailer.
+*/
+size_t trailer_size(unsigned int text_length) {
+  return (options.crc32c && text_length) ? CRC32C_TRAILER_SIZE : 0;
+}
+
+/**
+* Write a whole buffer, retrying short writes.
+* @fd       write to this descriptor
+* @data     bytes to write
+* @length   number of bytes
+* Return 0 on success, -1 on failure.
+*/
+int write_all(int fd, const void *data, size_t length) {
+  size_t written = 0;
+  while (written < length) {
+    ssize_t written_currently = write(fd, (const char *) data + written, length - written);
+    if (written_currently == -1) {
+      if (errno == EINTR)
+        continue;
+      perror(RED "[Client Error] Failed to write" RESET);
+      return -1;
+    }
+    written += written_currently;
+  }
+  return 0;
+}
+
+/**
+* Read exactly `length` bytes, retrying short reads.
+* @fd       read from this descriptor
+* @data     filled in with the bytes read
+* @length   number of bytes
+* Return 0 on success, -1 on failure or end of file.
+*/
+int read_all(int fd, void *data, size_t length) {
+  size_t received = 0;
+  while (received < length) {
+    ssize_t received_currently = read(fd, (char *) data + received, length - received);
+    if (received_currently == -1 && errno == EINTR)
+      continue;
+    if (received_currently <= 0)
+      return -1;
+    received += received_currently;
+  }
+  return 0;
 }
 
 /**
@@ -598,6 +1776,15 @@ int parse_number(char *number_string) {
   return result;
 }
 
+/**
+* Print how the process's pool was used (debug mode).
+*/
+void print_pool_stats(void) {
+  printf(">>> %d <<< Pool: %llu allocations, %llu reused, %llu refused, peak %llu bytes.\n", getpid(),
+         (unsigned long long) pool_stats.allocations, (unsigned long long) pool_stats.reused,
+         (unsigned long long) pool_stats.refused, (unsigned long long) pool_stats.peak);
+}
+
 /**
 * Suspend process for a time.
 * @microseconds   suspend for this many microseconds
@@ -623,5 +1810,9 @@ void handler(int signum) {
   if (signum == SIGINT) {
     printf(">>> %d <<< Received interrupt signal.\n", getpid());
     interrupted = 1;
+  } else if (signum == SIGUSR1) {
+    int saved = errno;
+    trace_dump();
+    errno = saved;
   }
 }
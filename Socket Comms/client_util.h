@@ -4,6 +4,7 @@
 #include <unistd.h>
 #include <stdlib.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <sys/types.h>
 #include <sys/wait.h>
 #include <sys/socket.h>
@@ -11,44 +12,139 @@
 #include <ctype.h>
 #include <time.h>
 #include <signal.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <sys/stat.h>
 
-/* Brief request protocol description:
-   Request type: unsigned char, 1 byte (8 bits).
-   Request value:
-     If 0 - 126, this many jobs are requested.
-     If 127, all jobs are requested.
-     If 128, normal termination.
-     If 129 - 255, termination with error. */
-
-#define ONE_JOB_REQUEST 1
-#define ALL_JOBS_REQUEST 127
-#define STOP_REQUEST 128
-#define ERROR_REQUEST 129 // or any other value between 129 and 255
-
-#define TYPE_O 0 // "000" bit pattern
-#define TYPE_E 1 // "001" bit pattern
-#define TYPE_Q 7 // "111" bit pattern
+#include "protocol.h"
+#include "recv_buffer.h"
+#include "checksum.h"
+#include "codec.h"
+#include "pool.h"
+#include "trace.h"
 
 #define RED "\x1B[31m"
 #define GRN   "\x1B[32m"
 #define BLU   "\x1B[34m"
 #define RESET "\x1B[0m"
 
-struct JobMessage {
-  unsigned char job_info;
-  int text_length;
-  char job_text[];
-} __attribute__((packed));
+#define RELAY_PIPE_SIZE (1024 * 1024) // printer pipe size in relay mode
+#define CLIENT_CAPABILITIES (CAP_CREDIT | CAP_BATCH | CAP_CRC32C | CAP_REQUEST_IDS | CAP_LEASES | \
+                             CAP_COMPRESS | CAP_DICTIONARY | CAP_FILTER | CAP_RESUME)
+#define ACK_BATCH_JOBS 32        // acknowledge dispatched jobs at least this often
+#define PREFETCH_DEPTH 2         // requests kept in flight while fetching several jobs
+#define FETCH_CHUNK_JOBS 512     // jobs per request with protocol version 2
+#define REPLY_DONE -2            // process_reply() read a DONE frame, no job
+#define MAX_INFLATED_LENGTH (16 * 1024 * 1024) // longest text a compressed job may expand to
+#define SINK_BUFFER_SIZE (1024 * 1024) // job texts gathered per write() in batch mode
+#define EXIT_BUSY 2              // batch mode exit status when the server is busy
+
+/* Command line options following the server address and port. */
+struct ClientOptions {
+  int relay;           // splice job texts from the socket to the printers
+  int crc32c;          // ask the server for CRC32C trailers and check them
+  int legacy;          // speak protocol version 1 (no HELLO)
+  int no_compress;     // do not offer COMPRESS
+  int stats;           // print the server's metrics and exit
+  long long fetch;     // jobs to fetch in batch mode, -1 for all, 0 for the menu
+  const char *out_path; // batch mode file for 'O' jobs, NULL for stdout
+  const char *err_path; // batch mode file for 'E' jobs, NULL for stderr
+  size_t memory_cap;   // bytes held for received texts at once, 0 for no limit
+  unsigned char types; // job types to receive, one bit per type, 0 for every type
+  const char *match;   // substring every received job text contains, NULL for any text
+  const char *resume_path; // batch mode checkpoint file, NULL to always start from the first job
+  const char *trace_path; // record events to this file, NULL for no trace
+};
+
+/* Output of batch mode. Job texts are gathered in a large buffer and
+   written with few write() calls. */
+struct Sink {
+  int fd;
+  char *buffer;
+  size_t length;
+  unsigned long long jobs;
+  unsigned long long bytes;
+};
+
+/* What was agreed with the server in the HELLO exchange. */
+struct Session {
+  int version;
+  uint32_t capabilities; // CAP_* bits acknowledged by the server
+  unsigned long unacked; // leased jobs passed on but not acknowledged yet
+  struct CodecDict dict; // sent by the server if DICTIONARY was agreed
+  struct JobMessage *inflated; // compressed jobs are decompressed into this message
+  size_t inflated_capacity;
+  uint64_t token;        // identifies the job file, sent by the server if RESUME was agreed
+  uint64_t checkpoint;   // position in the last CHECKPOINT frame
+  uint64_t processed;    // jobs processed since that frame
+  int resumed;           // this session continues an earlier one
+  long long kept[2];     // bytes of each output at the resumed position, by job type
+};
+
+/* Requests sent while fetching several jobs whose jobs have not all
+   arrived yet, oldest first. */
+struct Prefetch {
+  long long jobs[PREFETCH_DEPTH]; // jobs still expected for each request
+  uint64_t ids[PREFETCH_DEPTH];
+  int head;
+  int count;
+  uint64_t next_id;
+};
+
+/* Credits granted to the server since connecting; a new grant is sent
+   once half of the window has been consumed. */
+struct CreditWindow {
+  unsigned int used_jobs;
+  unsigned int used_bytes;
+};
 
 int usage(int argc, char* argv[]);
+int parse_options(int argc, char *argv[]);
 int parse_number(char *number_string);
 int prepare_address(struct sockaddr_in *serveraddr, char *ip_addr, int port);
 int establish_connection(char *ip_addr, char *port_string);
 int validate_checksum(struct JobMessage *msg);
 int send_request(int socket, unsigned char request);
+int send_credit(int socket, unsigned int jobs, unsigned int bytes);
+int send_batch_limit(int socket, unsigned int batch_jobs);
+int send_crc_request(int socket);
+int send_hello(int socket);
+int send_filter(int socket);
+int receive_hello(int socket);
+int receive_dictionary(int socket);
+int receive_session(int socket);
+int resume_session(int socket);
+int reach_checkpoint(uint64_t checkpoint);
+int save_checkpoint(void);
+struct JobMessage *inflate_job(const unsigned char *frame, unsigned int payload_length);
+int print_stats(int socket);
+int send_fetch(int socket, uint64_t jobs);
+int send_fetch_id(int socket, uint64_t id, uint64_t jobs);
+int prefetch_request(int socket, long long jobs);
+void prefetch_received(long long jobs);
+int fetch_jobs(struct RecvBuffer *in, int pipe_out[2], int pipe_err[2], long long jobs);
+int read_all(int fd, void *data, size_t length);
+size_t trailer_size(unsigned int text_length);
+int consume_credit(int socket, size_t msg_size);
+int acknowledge_job(int socket);
+int flush_acks(int socket);
 int send_to_pipe(int pipefd[2], unsigned char pipe_request, struct JobMessage *msg);
 int receive_on_pipe(int pipefd[2], FILE *std_pointer);
-int process_reply(int socket, int pipe_out[2], int pipe_err[2]);
-int command_menu(int socket, int pipe_out[2], int pipe_err[2]);
+int relay_to_pipe(struct RecvBuffer *in, int pipefd[2], unsigned int text_length);
+int print_relayed(int pipefd[2], FILE *std_pointer, unsigned int text_length);
+int write_all(int fd, const void *data, size_t length);
+int receive_bytes(struct RecvBuffer *in, size_t needed);
+int dispatch_job(struct RecvBuffer *in, int pipe_out[2], int pipe_err[2], struct JobMessage *msg, size_t msg_size);
+int process_reply(struct RecvBuffer *in, int pipe_out[2], int pipe_err[2]);
+int process_batch(struct RecvBuffer *in, int pipe_out[2], int pipe_err[2], unsigned int batch_length);
+int command_menu(struct RecvBuffer *in, int pipe_out[2], int pipe_err[2]);
+int run_batch(int socket);
+int open_sink(struct Sink *sink, const char *path, int std_fd, long long keep);
+int sink_write(struct Sink *sink, const char *text, size_t length);
+int sink_flush(struct Sink *sink);
+void close_sink(struct Sink *sink);
+void print_pool_stats(void);
 int micro_sleep(unsigned long microseconds);
 void handler(int signum);
@@ -0,0 +1,366 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "codec.h"
+#include "checksum.h"
+
+#define LAST_LITERALS 5       // the last bytes of a block are always literals
+#define MATCH_FIND_LIMIT 12   // no match starts this close to the end of a block
+#define SKIP_TRIGGER 6        // search faster through text that does not compress
+#define TRAIN_KMER 8          // training scores segments by their 8-byte substrings
+#define TRAIN_HASH_LOG 20
+
+
+/*============================== UTILITY METHODS =============================*/
+
+static uint32_t read32(const unsigned char *data) {
+  uint32_t value;
+  memcpy(&value, data, sizeof(value));
+  return value;
+}
+
+static uint32_t hash4(uint32_t sequence, int log) {
+  return (sequence * 2654435761u) >> (32 - log);
+}
+
+static uint32_t hash8(const unsigned char *data) {
+  uint64_t value;
+  memcpy(&value, data, sizeof(value));
+  return (uint32_t) ((value * 0x9E3779B185EBCA87ull) >> (64 - TRAIN_HASH_LOG));
+}
+
+/**
+* Largest compressed size of a block.
+* @length   size of the uncompressed block
+*/
+size_t codec_bound(size_t length) {
+  return length + length / 255 + 16;
+}
+
+
+/*================================ COMPRESSION ===============================*/
+
+/**
+* Write a length that did not fit its 4 bits in extra bytes (utility method).
+* @out      write position
+* @length   remaining length
+* Return new write position.
+*/
+static unsigned char *write_length(unsigned char *out, size_t length) {
+  while (length >= 255) {
+    *out++ = 255;
+    length -= 255;
+  }
+  *out++ = (unsigned char) length;
+  return out;
+}
+
+/**
+* Append one sequence to a block (utility method).
+* @out              write position
+* @end              end of the output buffer
+* @literals         bytes to copy as they are
+* @literal_length   number of literals
+* @offset           distance back to the match
+* @match_length     length of the match, 0 for the last sequence
+* Return new write position, NULL if the output buffer is too small.
+*/
+static unsigned char *write_sequence(unsigned char *out, unsigned char *end, const unsigned char *literals,
+                                     size_t literal_length, size_t offset, size_t match_length) {
+  size_t needed = 1 + literal_length / 255 + 1 + literal_length + 2 + match_length / 255 + 1;
+  if ((size_t) (end - out) < needed)
+    return NULL;
+
+  unsigned char *token = out++;
+  if (literal_length >= 15) {
+    *token = 15 << 4;
+    out = write_length(out, literal_length - 15);
+  } else {
+    *token = (unsigned char) (literal_length << 4);
+  }
+  memcpy(out, literals, literal_length);
+  out += literal_length;
+  if (!match_length)
+    return out;
+
+  *out++ = (unsigned char) (offset & 0xFF);
+  *out++ = (unsigned char) (offset >> 8);
+  match_length -= CODEC_MIN_MATCH;
+  if (match_length >= 15) {
+    *token |= 15;
+    out = write_length(out, match_length - 15);
+  } else {
+    *token |= (unsigned char) match_length;
+  }
+  return out;
+}
+
+/**
+* Compress a block. Matches are found greedily through a hash table of
+* 4-byte sequences: first in the block itself, then in the dictionary.
+* Blocks of 64 KiB or more are not compressed.
+* @src        bytes to compress
+* @length     number of bytes
+* @dst        output buffer
+* @capacity   size of the output buffer
+* @dict       dictionary, or NULL
+* Return compressed size, 0 if the block does not fit in capacity bytes.
+*/
+size_t codec_compress(const void *src, size_t length, void *dst, size_t capacity, const struct CodecDict *dict) {
+  const unsigned char *in = (const unsigned char *) src;
+  unsigned char *out = (unsigned char *) dst;
+  unsigned char *end = out + capacity;
+  uint16_t table[1 << CODEC_HASH_LOG]; // position + 1, so 0 means empty
+  size_t anchor = 0;
+  size_t position = 0;
+  if (length > CODEC_MAX_OFFSET)
+    return 0;
+  if (dict && !dict->length)
+    dict = NULL;
+
+  if (length >= MATCH_FIND_LIMIT) {
+    memset(table, 0, sizeof(table));
+    size_t match_limit = length - LAST_LITERALS;
+    size_t search_end = length - MATCH_FIND_LIMIT;
+    unsigned int attempts = 1 << SKIP_TRIGGER;
+
+    while (position <= search_end) {
+      uint32_t sequence = read32(in + position);
+      uint32_t hash = hash4(sequence, CODEC_HASH_LOG);
+      size_t candidate = table[hash];
+      table[hash] = (uint16_t) (position + 1);
+      size_t offset = 0;
+      size_t match_length = 0;
+
+      if (candidate && read32(in + candidate - 1) == sequence) {
+        size_t reference = candidate - 1;
+        match_length = CODEC_MIN_MATCH;
+        while (position + match_length < match_limit && in[reference + match_length] == in[position + match_length])
+          match_length++;
+        while (position > anchor && reference > 0 && in[position - 1] == in[reference - 1]) {
+          position--;
+          reference--;
+          match_length++;
+        }
+        offset = position - reference;
+      } else if (dict) {
+        candidate = dict->table[hash4(sequence, CODEC_DICT_HASH_LOG)];
+        if (candidate && position + dict->length - (candidate - 1) <= CODEC_MAX_OFFSET &&
+            read32(dict->data + candidate - 1) == sequence) {
+          // matches end at the end of the dictionary
+          size_t reference = candidate - 1;
+          match_length = CODEC_MIN_MATCH;
+          while (position + match_length < match_limit && reference + match_length < dict->length &&
+                 dict->data[reference + match_length] == in[position + match_length])
+            match_length++;
+          while (position > anchor && reference > 0 && in[position - 1] == dict->data[reference - 1]) {
+            position--;
+            reference--;
+            match_length++;
+          }
+          offset = position + dict->length - reference;
+        }
+      }
+
+      if (!match_length) {
+        position += attempts++ >> SKIP_TRIGGER;
+        continue;
+      }
+      out = write_sequence(out, end, in + anchor, position - anchor, offset, match_length);
+      if (!out)
+        return 0;
+      position += match_length;
+      anchor = position;
+      attempts = 1 << SKIP_TRIGGER;
+      if (position <= search_end)
+        table[hash4(read32(in + position - 2), CODEC_HASH_LOG)] = (uint16_t) (position - 1);
+    }
+  }
+
+  out = write_sequence(out, end, in + anchor, length - anchor, 0, 0);
+  return out ? (size_t) (out - (unsigned char *) dst) : 0;
+}
+
+
+/*=============================== DECOMPRESSION ==============================*/
+
+/**
+* Read the extra bytes of a length (utility method).
+* @in       read position, advanced past the length
+* @end      end of the block
+* @length   length to add to
+* Return 0 on success, -1 if the block is cut short.
+*/
+static int read_length(const unsigned char **in, const unsigned char *end, size_t *length) {
+  unsigned char byte;
+  do {
+    if (*in == end || *length > (size_t) -1 / 2)
+      return -1;
+    byte = *(*in)++;
+    *length += byte;
+  } while (byte == 255);
+  return 0;
+}
+
+/**
+* Decompress a block. Every length and offset is checked, so a corrupt
+* block cannot write outside the output buffer.
+* @src        compressed block
+* @length     size of the block
+* @dst        output buffer
+* @capacity   size of the output buffer
+* @dict       dictionary the block was compressed with, or NULL
+* Return decompressed size, -1 if the block is malformed or does not fit.
+*/
+long codec_decompress(const void *src, size_t length, void *dst, size_t capacity, const struct CodecDict *dict) {
+  const unsigned char *in = (const unsigned char *) src;
+  const unsigned char *end = in + length;
+  unsigned char *out = (unsigned char *) dst;
+  size_t position = 0;
+
+  while (in < end) {
+    unsigned char token = *in++;
+    size_t literal_length = token >> 4;
+    if (literal_length == 15 && read_length(&in, end, &literal_length))
+      return -1;
+    if ((size_t) (end - in) < literal_length || capacity - position < literal_length)
+      return -1;
+    memcpy(out + position, in, literal_length);
+    in += literal_length;
+    position += literal_length;
+    if (in == end)
+      break; // the last sequence has no match
+
+    if (end - in < 2)
+      return -1;
+    size_t offset = (size_t) in[0] | ((size_t) in[1] << 8);
+    in += 2;
+    size_t match_length = token & 15;
+    if (match_length == 15 && read_length(&in, end, &match_length))
+      return -1;
+    match_length += CODEC_MIN_MATCH;
+    if (!offset || capacity - position < match_length)
+      return -1;
+
+    if (offset > position) {
+      // starts in the dictionary and may run on into the output
+      size_t back = offset - position;
+      if (!dict || back > dict->length)
+        return -1;
+      size_t copied = (back < match_length) ? back : match_length;
+      memcpy(out + position, dict->data + dict->length - back, copied);
+      position += copied;
+      match_length -= copied;
+    }
+    if (offset >= match_length) {
+      memcpy(out + position, out + position - offset, match_length);
+      position += match_length;
+    } else {
+      for (; match_length; match_length--, position++)
+        out[position] = out[position - offset];
+    }
+  }
+  return (long) position;
+}
+
+
+/*================================ DICTIONARIES ==============================*/
+
+/**
+* Take a dictionary, e.g. one received from the server, and index it.
+* @dict     dictionary to fill in
+* @data     dictionary bytes (copied)
+* @length   number of bytes, at most CODEC_MAX_OFFSET
+* Return 0 on success, -1 on error.
+*/
+int codec_dict_load(struct CodecDict *dict, const void *data, size_t length) {
+  memset(dict, 0, sizeof(*dict));
+  if (length > CODEC_MAX_OFFSET)
+    return -1;
+  dict->data = (unsigned char *) malloc(length ? length : 1);
+  dict->table = (uint16_t *) calloc(1 << CODEC_DICT_HASH_LOG, sizeof(uint16_t));
+  if (!dict->data || !dict->table) {
+    codec_dict_free(dict);
+    return -1;
+  }
+  memcpy(dict->data, data, length);
+  dict->length = length;
+  dict->id = checksum_crc32c(data, length);
+  // later positions win, they give shorter offsets
+  for (size_t i = 0; i + CODEC_MIN_MATCH <= length; i++)
+    dict->table[hash4(read32(dict->data + i), CODEC_DICT_HASH_LOG)] = (uint16_t) (i + 1);
+  return 0;
+}
+
+/**
+* Build a dictionary from sample texts. The samples are split into one
+* epoch per dictionary segment; from each epoch the segment whose 8-byte
+* substrings are most frequent across all samples is taken, and its
+* substrings no longer count for later epochs, so the dictionary holds
+* text that recurs across jobs without repeating itself.
+* @dict        dictionary to fill in
+* @samples     job texts, back to back
+* @length      number of sample bytes
+* @dict_size   largest dictionary size
+* Return 0 on success, -1 on error.
+*/
+int codec_dict_train(struct CodecDict *dict, const unsigned char *samples, size_t length, size_t dict_size) {
+  if (dict_size > CODEC_MAX_OFFSET)
+    dict_size = CODEC_MAX_OFFSET;
+  if (length <= dict_size)
+    return codec_dict_load(dict, samples, length);
+
+  uint16_t *frequency = (uint16_t *) calloc(1 << TRAIN_HASH_LOG, sizeof(uint16_t));
+  unsigned char *data = (unsigned char *) malloc(dict_size);
+  if (!frequency || !data) {
+    free(frequency);
+    free(data);
+    return -1;
+  }
+  for (size_t i = 0; i + TRAIN_KMER <= length; i++) {
+    uint32_t hash = hash8(samples + i);
+    if (frequency[hash] < UINT16_MAX)
+      frequency[hash]++;
+  }
+
+  size_t segments = dict_size / CODEC_SEGMENT_SIZE;
+  size_t epoch = length / segments;
+  size_t kmers = CODEC_SEGMENT_SIZE - TRAIN_KMER + 1; // substrings per segment
+  size_t used = 0;
+  for (size_t e = 0; e < segments && epoch >= CODEC_SEGMENT_SIZE; e++) {
+    size_t start = e * epoch;
+    size_t stop = start + epoch;
+    uint64_t score = 0;
+    for (size_t i = 0; i < kmers; i++)
+      score += frequency[hash8(samples + start + i)];
+    uint64_t best = score;
+    size_t best_start = start;
+    for (size_t s = start + 1; s + CODEC_SEGMENT_SIZE <= stop; s++) {
+      score += frequency[hash8(samples + s + kmers - 1)];
+      score -= frequency[hash8(samples + s - 1)];
+      if (score > best) {
+        best = score;
+        best_start = s;
+      }
+    }
+    memcpy(data + used, samples + best_start, CODEC_SEGMENT_SIZE);
+    used += CODEC_SEGMENT_SIZE;
+    for (size_t i = 0; i < kmers; i++)
+      frequency[hash8(samples + best_start + i)] = 0;
+  }
+
+  int status = codec_dict_load(dict, data, used);
+  free(frequency);
+  free(data);
+  return status;
+}
+
+/**
+* Release a dictionary.
+* @dict   dictionary to free
+*/
+void codec_dict_free(struct CodecDict *dict) {
+  free(dict->data);
+  free(dict->table);
+  memset(dict, 0, sizeof(*dict));
+}
@@ -0,0 +1,38 @@
+#ifndef CODEC_H
+#define CODEC_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Fast LZ77 codec for job texts, shared by client and server.
+   Compressed blocks use the LZ4 block format: a sequence is a token (4 bits
+   of literal length, 4 bits of match length - 4), longer lengths continued
+   in extra bytes of up to 255, the literals, and a 2-byte little endian
+   offset back into the output. The last sequence has literals only.
+   With a dictionary, offsets may reach back past the start of the output
+   into the end of the dictionary, which pays off for short texts. */
+
+#define CODEC_MIN_MATCH 4
+#define CODEC_MAX_OFFSET 65535
+#define CODEC_HASH_LOG 12
+#define CODEC_DICT_SIZE (32 * 1024)      // size of trained dictionaries
+#define CODEC_DICT_HASH_LOG 14
+#define CODEC_SAMPLE_BYTES (1024 * 1024) // job text a dictionary is trained on
+#define CODEC_SEGMENT_SIZE 64            // dictionaries are made of segments this long
+
+/* Dictionary with the index the compressor needs to search it. */
+struct CodecDict {
+  unsigned char *data;
+  size_t length;
+  uint32_t id;         // CRC32C of the data, tells dictionaries apart
+  uint16_t *table;     // last position + 1 of every hashed 4-byte sequence
+};
+
+size_t codec_bound(size_t length);
+size_t codec_compress(const void *src, size_t length, void *dst, size_t capacity, const struct CodecDict *dict);
+long codec_decompress(const void *src, size_t length, void *dst, size_t capacity, const struct CodecDict *dict);
+int codec_dict_load(struct CodecDict *dict, const void *data, size_t length);
+int codec_dict_train(struct CodecDict *dict, const unsigned char *samples, size_t length, size_t dict_size);
+void codec_dict_free(struct CodecDict *dict);
+
+#endif
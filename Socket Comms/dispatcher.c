@@ -0,0 +1,254 @@
+#include "server_util.h"
+
+extern int debug;
+
+/*============================== REQUEUED JOBS ===============================*/
+
+/**
+* Double the requeue ring, keeping its order (utility method).
+* Called with dispatcher->lock held.
+* @dispatcher   dispatcher to grow
+* Return 0 on success, -1 on allocation failure.
+*/
+static int grow_requeued(struct Dispatcher *dispatcher) {
+  size_t capacity = dispatcher->requeue_capacity ? dispatcher->requeue_capacity * 2 : REQUEUE_INITIAL_SLOTS;
+  size_t *requeued = (size_t *) malloc(sizeof(size_t) * capacity);
+  if (!requeued)
+    return -1;
+  for (size_t i = 0; i < dispatcher->requeue_count; i++)
+    requeued[i] = dispatcher->requeued[(dispatcher->requeue_head + i) % dispatcher->requeue_capacity];
+  free(dispatcher->requeued);
+  dispatcher->requeued = requeued;
+  dispatcher->requeue_capacity = capacity;
+  dispatcher->requeue_head = 0;
+  return 0;
+}
+
+/**
+* Put a job back in line (utility method).
+* Called with dispatcher->lock held.
+* @dispatcher   dispatcher to requeue with
+* @job          job number
+* @front        1 to hand it out next, 0 to hand it out after other requeued jobs
+* Return 0 on success, -1 on allocation failure (the job is lost).
+*/
+static int requeue(struct Dispatcher *dispatcher, size_t job, int front) {
+  if (dispatcher->requeue_count == dispatcher->requeue_capacity && grow_requeued(dispatcher)) {
+    fprintf(stderr, RED ">>> %d <<< [Server Error] Failed to requeue job %zu.\n" RESET, getpid(), job);
+    return -1;
+  }
+  size_t slot;
+  if (front) {
+    dispatcher->requeue_head = (dispatcher->requeue_head + dispatcher->requeue_capacity - 1) % dispatcher->requeue_capacity;
+    slot = dispatcher->requeue_head;
+  } else {
+    slot = (dispatcher->requeue_head + dispatcher->requeue_count) % dispatcher->requeue_capacity;
+  }
+  dispatcher->requeued[slot] = job;
+  dispatcher->requeue_count++;
+  return 0;
+}
+
+
+/*================================ LEASE RINGS ===============================*/
+
+/**
+* Double a lease ring, keeping its order (utility method).
+* @ring   ring to grow
+* Return 0 on success, -1 on allocation failure.
+*/
+static int grow_leases(struct LeaseRing *ring) {
+  unsigned int capacity = ring->capacity ? ring->capacity * 2 : LEASE_INITIAL_SLOTS;
+  struct Lease *slots = (struct Lease *) malloc(sizeof(struct Lease) * capacity);
+  if (!slots)
+    return -1;
+  for (unsigned int i = 0; i < ring->count; i++)
+    slots[i] = ring->slots[(ring->head + i) % ring->capacity];
+  free(ring->slots);
+  ring->slots = slots;
+  ring->capacity = capacity;
+  ring->head = 0;
+  return 0;
+}
+
+
+/*============================= DISPATCHER METHODS ===========================*/
+
+/**
+* Prepare a dispatcher that hands out the jobs of a store.
+* @dispatcher   dispatcher to prepare
+* @store        store to hand out jobs from
+* @lease_ms     time a client has to acknowledge a job
+* Return 0 on success, -1 on error.
+*/
+int dispatch_init(struct Dispatcher *dispatcher, struct JobStore *store, long lease_ms) {
+  memset(dispatcher, 0, sizeof(*dispatcher));
+  dispatcher->store = store;
+  dispatcher->lease_ms = lease_ms;
+  if (pthread_mutex_init(&dispatcher->lock, NULL)) {
+    fprintf(stderr, RED ">>> %d <<< [Server Error] Failed to prepare job dispatcher.\n" RESET, getpid());
+    return -1;
+  }
+  return 0;
+}
+
+/**
+* Free the requeue ring.
+* @dispatcher   dispatcher to free
+*/
+void dispatch_free(struct Dispatcher *dispatcher) {
+  if (debug)
+    printf(">>> %d <<< Dispatcher handed out %zu job(s), %lu lease(s) expired.\n", getpid(),
+           dispatcher->next_job, dispatcher->expired);
+  free(dispatcher->requeued);
+  dispatcher->requeued = NULL;
+  pthread_mutex_destroy(&dispatcher->lock);
+}
+
+/**
+* Take jobs to send, requeued jobs first. Only indexed jobs are taken.
+* @dispatcher   dispatcher to take from
+* @jobs         filled in with the job numbers taken
+* @count        most jobs to take
+* Return number of jobs taken, 0 if none is available yet, -1 if every job
+* has been handed out and acknowledged.
+*/
+int dispatch_claim(struct Dispatcher *dispatcher, size_t *jobs, int count) {
+  struct JobEntry entry;
+  int claimed = 0;
+  int status = 0;
+  pthread_mutex_lock(&dispatcher->lock);
+  while (claimed < count && dispatcher->requeue_count) {
+    jobs[claimed++] = dispatcher->requeued[dispatcher->requeue_head];
+    dispatcher->requeue_head = (dispatcher->requeue_head + 1) % dispatcher->requeue_capacity;
+    dispatcher->requeue_count--;
+  }
+  while (claimed < count && !(status = job_store_get(dispatcher->store, dispatcher->next_job, &entry)))
+    jobs[claimed++] = dispatcher->next_job++;
+  // past the last job, leases still held elsewhere may come back
+  if (!claimed && status == -1 && !dispatcher->leased)
+    claimed = -1;
+  pthread_mutex_unlock(&dispatcher->lock);
+  return claimed;
+}
+
+/**
+* Give back jobs that were taken but not sent, so they go out next.
+* @dispatcher   dispatcher they were taken from
+* @jobs         job numbers, in the order they were taken
+* @count        number of jobs
+*/
+void dispatch_unclaim(struct Dispatcher *dispatcher, const size_t *jobs, int count) {
+  pthread_mutex_lock(&dispatcher->lock);
+  for (int i = count - 1; i >= 0; i--)
+    requeue(dispatcher, jobs[i], 1);
+  pthread_mutex_unlock(&dispatcher->lock);
+}
+
+/**
+* Lease jobs that were queued for a client.
+* @dispatcher   dispatcher the jobs were taken from
+* @ring         leases of the client
+* @jobs         job numbers, in the order they were queued
+* @count        number of jobs
+* @now          current monotonic time in milliseconds
+* Return 0 on success, -1 on allocation failure.
+*/
+int dispatch_lease(struct Dispatcher *dispatcher, struct LeaseRing *ring, const size_t *jobs, int count, long now) {
+  for (int i = 0; i < count; i++) {
+    if (ring->count == ring->capacity && grow_leases(ring)) {
+      fprintf(stderr, RED ">>> %d <<< [Server Error] Failed to allocate lease.\n" RESET, getpid());
+      dispatch_unclaim(dispatcher, jobs + i, count - i);
+      return -1;
+    }
+    struct Lease *lease = &ring->slots[(ring->head + ring->count) % ring->capacity];
+    lease->job = jobs[i];
+    lease->deadline = now + dispatcher->lease_ms;
+    lease->revoked = 0;
+    ring->count++;
+  }
+  pthread_mutex_lock(&dispatcher->lock);
+  dispatcher->leased += count;
+  pthread_mutex_unlock(&dispatcher->lock);
+  return 0;
+}
+
+/**
+* Release the oldest leases of a client that acknowledged them.
+* @dispatcher   dispatcher the jobs were taken from
+* @ring         leases of the client
+* @count        number of jobs acknowledged
+*/
+void dispatch_ack(struct Dispatcher *dispatcher, struct LeaseRing *ring, unsigned long count) {
+  unsigned long released = 0;
+  while (count-- && ring->count) {
+    if (!ring->slots[ring->head].revoked)
+      released++;
+    ring->head = (ring->head + 1) % ring->capacity;
+    ring->count--;
+  }
+  pthread_mutex_lock(&dispatcher->lock);
+  dispatcher->leased -= released;
+  int finished = released && !dispatcher->leased;
+  pthread_mutex_unlock(&dispatcher->lock);
+  if (finished) // clients waiting for the last leases can quit
+    job_store_notify(dispatcher->store);
+}
+
+/**
+* Hand out again the jobs of leases that ran out. Leases expire in the
+* order they were granted, so only the oldest ones are looked at.
+* @dispatcher   dispatcher the jobs were taken from
+* @ring         leases of one client
+* @now          current monotonic time in milliseconds
+* Return number of leases that expired.
+*/
+int dispatch_expire(struct Dispatcher *dispatcher, struct LeaseRing *ring, long now) {
+  int expired = 0;
+  pthread_mutex_lock(&dispatcher->lock);
+  for (unsigned int i = 0; i < ring->count; i++) {
+    struct Lease *lease = &ring->slots[(ring->head + i) % ring->capacity];
+    if (lease->deadline > now)
+      break;
+    if (lease->revoked)
+      continue;
+    lease->revoked = 1;
+    requeue(dispatcher, lease->job, 0);
+    dispatcher->leased--;
+    dispatcher->expired++;
+    expired++;
+  }
+  pthread_mutex_unlock(&dispatcher->lock);
+  if (expired) {
+    if (debug)
+      printf(">>> %d <<< %d lease(s) expired.\n", getpid(), expired);
+    job_store_notify(dispatcher->store);
+  }
+  return expired;
+}
+
+/**
+* Hand out again every job a disconnecting client still holds.
+* @dispatcher   dispatcher the jobs were taken from
+* @ring         leases of the client, freed
+*/
+void dispatch_release(struct Dispatcher *dispatcher, struct LeaseRing *ring) {
+  int released = 0;
+  pthread_mutex_lock(&dispatcher->lock);
+  for (unsigned int i = 0; i < ring->count; i++) {
+    struct Lease *lease = &ring->slots[(ring->head + i) % ring->capacity];
+    if (lease->revoked)
+      continue;
+    requeue(dispatcher, lease->job, 0);
+    dispatcher->leased--;
+    released++;
+  }
+  pthread_mutex_unlock(&dispatcher->lock);
+  free(ring->slots);
+  memset(ring, 0, sizeof(*ring));
+  if (released) {
+    if (debug)
+      printf(">>> %d <<< Requeued %d job(s) of a disconnected client.\n", getpid(), released);
+    job_store_notify(dispatcher->store);
+  }
+}
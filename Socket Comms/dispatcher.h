@@ -0,0 +1,58 @@
+#ifndef DISPATCHER_H
+#define DISPATCHER_H
+
+#include <stddef.h>
+#include <pthread.h>
+
+/* Hands every job to exactly one client when the server runs with
+   --dispatch, instead of giving each client its own pass over the file.
+   Jobs sent to clients that acknowledge them are leased (see LEASES in
+   protocol.txt): a lease that is not acknowledged in time, or whose
+   client disconnects, puts the job back in line for the next client.
+   Clients that do not acknowledge get their jobs unleased. */
+
+#define DEFAULT_LEASE_MS 30000
+#define LEASE_CHECK_MS 250         // how often expired leases are looked for
+#define REQUEUE_INITIAL_SLOTS 64
+#define LEASE_INITIAL_SLOTS 64
+
+struct JobStore;
+
+struct Lease {
+  size_t job;
+  long deadline;           // monotonic time in milliseconds
+  int revoked;             // expired and handed out again, kept until acknowledged
+};
+
+/* Leases held by one connection, oldest first. Clients acknowledge jobs
+   in the order they were sent, so acknowledgements release the head. */
+struct LeaseRing {
+  struct Lease *slots;
+  unsigned int capacity;
+  unsigned int head;
+  unsigned int count;
+};
+
+struct Dispatcher {
+  struct JobStore *store;
+  pthread_mutex_t lock;
+  size_t next_job;         // first job never handed out
+  size_t *requeued;        // jobs to hand out again before next_job
+  size_t requeue_capacity;
+  size_t requeue_head;
+  size_t requeue_count;
+  unsigned long leased;    // unrevoked leases over all connections
+  long lease_ms;
+  unsigned long expired;   // leases that ran out, for debug output
+};
+
+int dispatch_init(struct Dispatcher *dispatcher, struct JobStore *store, long lease_ms);
+void dispatch_free(struct Dispatcher *dispatcher);
+int dispatch_claim(struct Dispatcher *dispatcher, size_t *jobs, int count);
+void dispatch_unclaim(struct Dispatcher *dispatcher, const size_t *jobs, int count);
+int dispatch_lease(struct Dispatcher *dispatcher, struct LeaseRing *ring, const size_t *jobs, int count, long now);
+void dispatch_ack(struct Dispatcher *dispatcher, struct LeaseRing *ring, unsigned long count);
+int dispatch_expire(struct Dispatcher *dispatcher, struct LeaseRing *ring, long now);
+void dispatch_release(struct Dispatcher *dispatcher, struct LeaseRing *ring);
+
+#endif
@@ -0,0 +1,583 @@
+#include "server_util.h"
+
+extern int debug;
+extern int interrupted;
+
+// epoll data for descriptors that are not client connections
+static char listener_tag;
+static char wake_tag;
+
+/*============================ LOOP SETUP METHODS ============================*/
+
+/**
+* Prepare the event loop around a listening socket.
+* @loop              loop to prepare
+* @listen_sock       nonblocking socket to accept clients on
+* @store             indexed job file to serve
+* @max_connections   clients served at once, later ones are told server is busy
+* @backend           IO_EPOLL or IO_URING, epoll is used if io_uring is unavailable
+* Return 0 on success, -1 on error.
+*/
+int loop_init(struct EventLoop *loop, int listen_sock, struct JobStore *store, int max_connections, int backend) {
+  memset(loop, 0, sizeof(*loop));
+  loop->listen_sock = listen_sock;
+  loop->store = store;
+  loop->max_connections = max_connections;
+  loop->epoll_fd = -1;
+  pool_init(&loop->pool, 0, &loop->metrics.pool);
+  if (metrics_register(&loop->metrics)) {
+    fprintf(stderr, RED ">>> %d <<< [Server Error] Too many event loops keep metrics.\n" RESET, getpid());
+    return -1;
+  }
+
+  loop->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (loop->wake_fd == -1) {
+    perror(RED "[Server Error] Could not watch job index" RESET);
+    return -1;
+  }
+  if (job_store_watch(store, loop->wake_fd)) {
+    fprintf(stderr, RED ">>> %d <<< [Server Error] Too many event loops watch the job index.\n" RESET, getpid());
+    close(loop->wake_fd);
+    return -1;
+  }
+
+  if (backend == IO_URING) {
+    if (!uring_init(loop))
+      return 0;
+    fprintf(stderr, ">>> %d <<< [Server Warning] io_uring unavailable, falling back to epoll.\n", getpid());
+  }
+
+  loop->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+  if (loop->epoll_fd == -1) {
+    perror(RED "[Server Error] Could not create epoll instance" RESET);
+    close(loop->wake_fd);
+    return -1;
+  }
+
+  struct epoll_event event;
+  memset(&event, 0, sizeof(event));
+  event.events = EPOLLIN | EPOLLET;
+  event.data.ptr = &listener_tag;
+  if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, listen_sock, &event)) {
+    perror(RED "[Server Error] Could not watch listening socket" RESET);
+    close(loop->epoll_fd);
+    close(loop->wake_fd);
+    return -1;
+  }
+
+  event.events = EPOLLIN | EPOLLET;
+  event.data.ptr = &wake_tag;
+  if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, loop->wake_fd, &event)) {
+    perror(RED "[Server Error] Could not watch job index" RESET);
+    close(loop->epoll_fd);
+    close(loop->wake_fd);
+    return -1;
+  }
+  return 0;
+}
+
+/**
+* Close a client connection and release its state.
+* @loop   loop the connection belongs to
+* @conn   connection to close
+*/
+static void close_connection(struct EventLoop *loop, struct Connection *conn) {
+  if (debug)
+    printf(">>> %d <<< Closing connection (address: %s).\n", getpid(), conn->address);
+  TRACE(TRACE_CLOSE, conn->sock, conn->out.written_bytes, 0);
+  if (conn->prev)
+    conn->prev->next = conn->next;
+  else
+    loop->all = conn->next;
+  if (conn->next)
+    conn->next->prev = conn->prev;
+  if (loop->dispatcher)
+    dispatch_release(loop->dispatcher, &conn->leases);
+  loop->connections--;
+  __atomic_store_n(&loop->metrics.connections, (uint64_t) loop->connections, __ATOMIC_RELAXED);
+  if (loop->uring && uring_retire(loop, conn))
+    return; // freed once its operations complete
+  close(conn->sock);
+  out_free(&conn->out);
+  pool_free(&loop->pool, conn);
+}
+
+/**
+* Close all connections and the epoll instance or io_uring.
+* @loop   loop to close
+*/
+void loop_close(struct EventLoop *loop) {
+  while (loop->all)
+    close_connection(loop, loop->all);
+  if (loop->uring)
+    uring_close(loop);
+  else
+    close(loop->epoll_fd);
+  close(loop->wake_fd);
+  if (debug)
+    printf(">>> %d <<< Pool: %llu allocations, %llu reused, %llu refused, peak %llu bytes.\n", getpid(),
+           (unsigned long long) loop->metrics.pool.allocations, (unsigned long long) loop->metrics.pool.reused,
+           (unsigned long long) loop->metrics.pool.refused, (unsigned long long) loop->metrics.pool.peak);
+  pool_destroy(&loop->pool);
+}
+
+/**
+* Put a connection on the ready list so it is serviced this turn.
+* @loop   loop to schedule on
+* @conn   connection with work to do
+*/
+void schedule(struct EventLoop *loop, struct Connection *conn) {
+  if (conn->queued)
+    return;
+  conn->queued = 1;
+  conn->next_ready = NULL;
+  if (loop->ready_tail)
+    loop->ready_tail->next_ready = conn;
+  else
+    loop->ready_head = conn;
+  loop->ready_tail = conn;
+}
+
+
+/*========================== CONNECTION I/O METHODS ==========================*/
+
+/**
+* Accept every pending client on the listening socket.
+* @loop   loop to register clients with
+* Return 0 on success, -1 if accepting has to be retried later.
+*/
+static int accept_clients(struct EventLoop *loop) {
+  while (1) {
+    struct sockaddr_in clientaddr;
+    socklen_t clientaddrlen = sizeof(clientaddr);
+    int client_sock = accept4(loop->listen_sock, (struct sockaddr *)&clientaddr, &clientaddrlen,
+                              SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (client_sock == -1) {
+      if (errno == EAGAIN || errno == EWOULDBLOCK)
+        return 0;
+      if (errno == EINTR || errno == ECONNABORTED)
+        continue;
+      perror(RED "[Server Error] Could not accept connection" RESET);
+      return -1;
+    }
+
+    add_connection(loop, client_sock, &clientaddr);
+  }
+}
+
+/**
+* Tell a client that the server is busy without setting up any state for
+* it, when the memory cap leaves no room for it (utility method).
+* @loop          loop the client was accepted on
+* @client_sock   accepted socket, closed
+*/
+static void refuse_connection(struct EventLoop *loop, int client_sock) {
+  if (debug)
+    printf(">>> %d <<< Memory cap reached, notifying client that server is busy.\n", getpid());
+  unsigned char busy = (unsigned char) STOP_REQUEST;
+  if (send(client_sock, &busy, sizeof(busy), MSG_DONTWAIT | MSG_NOSIGNAL) == 1)
+    metric_add(&loop->metrics.busy, 1);
+  close(client_sock);
+}
+
+/**
+* Set up state for an accepted client and register it with the loop.
+* The socket is closed if the client cannot be served.
+* @loop          loop to register the client with
+* @client_sock   accepted socket
+* @clientaddr    address of the client
+* Return 0 on success, -1 on error.
+*/
+int add_connection(struct EventLoop *loop, int client_sock, struct sockaddr_in *clientaddr) {
+  uint64_t refused = loop->metrics.pool.refused;
+  struct Connection *conn = (struct Connection *) pool_calloc(&loop->pool, sizeof(struct Connection));
+  if (!conn || out_init(&conn->out, &loop->pool)) {
+    pool_free(&loop->pool, conn);
+    if (loop->metrics.pool.refused != refused) {
+      refuse_connection(loop, client_sock);
+      return -1;
+    }
+    fprintf(stderr, RED ">>> %d <<< [Server Error] Failed to allocate connection state.\n" RESET, getpid());
+    close(client_sock);
+    return -1;
+  }
+  conn->sock = client_sock;
+  conn->writable = 1;
+  conn->version = 1;
+  conn->greeting = 1;
+  inet_ntop(AF_INET, &clientaddr->sin_addr, conn->address, sizeof(conn->address));
+
+  int enable = 1;
+  if (loop->send_mode == SEND_ZEROCOPY &&
+      setsockopt(client_sock, SOL_SOCKET, SO_ZEROCOPY, &enable, sizeof(int))) {
+    perror("[Server Warning] Zero-copy sends unavailable, falling back to sendfile");
+    loop->send_mode = SEND_SENDFILE;
+  }
+
+  int watched;
+  if (loop->uring) {
+    watched = uring_attach(loop, conn);
+  } else {
+    struct epoll_event event;
+    memset(&event, 0, sizeof(event));
+    event.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+    event.data.ptr = conn;
+    watched = epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, client_sock, &event);
+    if (watched)
+      perror(RED "[Server Error] Could not watch client socket" RESET);
+  }
+  if (watched) {
+    out_free(&conn->out);
+    pool_free(&loop->pool, conn);
+    close(client_sock);
+    return -1;
+  }
+
+  conn->next = loop->all;
+  if (loop->all)
+    loop->all->prev = conn;
+  loop->all = conn;
+  loop->connections++;
+  __atomic_store_n(&loop->metrics.connections, (uint64_t) loop->connections, __ATOMIC_RELAXED);
+  metric_add(&loop->metrics.accepted, 1);
+  TRACE(TRACE_ACCEPT, client_sock, loop->connections, 0);
+
+  approve_connection(loop, conn);
+  schedule(loop, conn);
+  return 0;
+}
+
+/**
+* Read pending requests until the socket is drained or the buffer is full.
+* @conn   connection to read from
+* Return 0 on success, 1 if the client closed the connection, -1 on error.
+*/
+static int read_input(struct Connection *conn) {
+  if (conn->input_start) {
+    memmove(conn->input, conn->input + conn->input_start, conn->input_length);
+    conn->input_start = 0;
+  }
+  while (conn->input_length < INPUT_BUFFER_SIZE) {
+    ssize_t received = recv(conn->sock, conn->input + conn->input_length,
+                            INPUT_BUFFER_SIZE - conn->input_length, 0);
+    if (received == 0)
+      return 1;
+    if (received == -1) {
+      if (errno == EINTR)
+        continue;
+      if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        conn->readable = 0;
+        return 0;
+      }
+      return -1;
+    }
+    conn->input_length += received;
+  }
+  return 0;
+}
+
+/**
+* Check whether the client's credits allow another job (utility method).
+* A job may overdraw the byte credit, so jobs larger than the window
+* still make progress.
+* @conn   connection to check
+* Return 1 if a job may be queued, 0 otherwise.
+*/
+static int has_credit(struct Connection *conn) {
+  if (!conn->flow_control)
+    return 1;
+  return conn->credit_jobs > 0 && (!conn->byte_credit || conn->credit_bytes > 0);
+}
+
+/**
+* Read, process requests and write replies for one connection.
+* Each call writes at most SERVICE_BUDGET bytes so that one greedy
+* client cannot starve the others.
+* @loop   loop the connection belongs to
+* @conn   connection to service
+*/
+static void service_connection(struct EventLoop *loop, struct Connection *conn) {
+  if (conn->stalled_since && conn->writable) {
+    metric_add(&loop->metrics.stall_ns, now_ns() - conn->stalled_since);
+    conn->stalled_since = 0;
+  }
+  if (conn->readable && !conn->closing && conn->input_length < INPUT_BUFFER_SIZE) {
+    int read_status = loop->uring ? uring_read_input(conn) : read_input(conn);
+    if (read_status) {
+      if (read_status == -1 && debug)
+        perror("[Server Warning] Failed to read from client");
+      close_connection(loop, conn);
+      return;
+    }
+  }
+
+  // job requests wait for the current one to finish, credits apply at once
+  int incomplete = 0;
+  while (!conn->closing && conn->input_length &&
+         (!conn->pending_jobs || conn->input[conn->input_start] == EXTENDED_REQUEST)) {
+    int request_status = process_request(loop, conn);
+    if (request_status == -1) {
+      close_connection(loop, conn);
+      return;
+    } else if (request_status == 1) {
+      conn->closing = 1;
+    } else if (request_status == 2) {
+      incomplete = 1;
+      break;
+    }
+  }
+
+  while (conn->pending_jobs && !conn->waiting && has_credit(conn) &&
+         conn->out.pending_bytes < QUEUED_BYTES_LIMIT && out_space(&conn->out) >= 4) {
+    int send_status = send_message(loop, conn);
+    if (send_status == -1) {
+      close_connection(loop, conn);
+      return;
+    }
+    if (send_status == 2)
+      conn->waiting = 1;
+    else if (send_status == 3)
+      break; // filtered out jobs only, other clients get a turn first
+    else if (send_status == 1) {
+      // the jobs ran out, the 'Q' job ends every request
+      for (int i = 0; i < conn->request_count; i++)
+        request_served(loop, conn, conn->requests[(conn->request_head + i) % MAX_PIPELINED_REQUESTS].received);
+      conn->pending_jobs = 0;
+      conn->request_count = 0;
+    }
+  }
+
+  if (conn->out.zerocopy_sends != conn->out.zerocopy_completed)
+    out_reap_zerocopy(&conn->out, conn->sock);
+
+  if (conn->writable && conn->out.count && loop->uring) {
+    if (uring_flush(loop, conn)) {
+      if (debug)
+        perror("[Server Warning] Failed to write to client");
+      close_connection(loop, conn);
+      return;
+    }
+  } else if (conn->writable && conn->out.count) {
+    int blocked;
+    TRACE(TRACE_WRITE_START, conn->sock, conn->out.pending_bytes, 0);
+    ssize_t written = out_flush(&conn->out, conn->sock, SERVICE_BUDGET, &blocked);
+    TRACE(TRACE_WRITE_END, conn->sock, (written == -1) ? 0 : written, blocked);
+    if (written == -1) {
+      if (debug)
+        perror("[Server Warning] Failed to write to client");
+      close_connection(loop, conn);
+      return;
+    }
+    note_written(loop, conn, (size_t) written);
+    if (blocked) {
+      conn->writable = 0;
+      conn->stalled_since = now_ns();
+      metric_add(&loop->metrics.send_stalls, 1);
+    }
+  }
+
+  if (conn->closing && !conn->out.count) {
+    close_connection(loop, conn);
+    return;
+  }
+
+  int more_input = conn->readable && !conn->closing && conn->input_length < INPUT_BUFFER_SIZE;
+  int more_requests = !incomplete && !conn->closing && conn->input_length &&
+                      (!conn->pending_jobs || conn->input[conn->input_start] == EXTENDED_REQUEST);
+  int more_output = conn->writable &&
+                    (conn->out.count || (conn->pending_jobs && !conn->waiting && has_credit(conn)));
+  if (more_input || more_requests || more_output)
+    schedule(loop, conn);
+}
+
+/**
+* Note that every byte of a request is queued, so its latency is recorded
+* once the socket has taken them.
+* @loop       loop the connection belongs to
+* @conn       connection the request arrived on
+* @received   when the request arrived, in nanoseconds
+*/
+void request_served(struct EventLoop *loop, struct Connection *conn, uint64_t received) {
+  if (conn->mark_count == LATENCY_MARKS)
+    return; // the client pipelines faster than its socket drains, skip this one
+  struct LatencyMark *mark = &conn->marks[(conn->mark_head + conn->mark_count) % LATENCY_MARKS];
+  mark->end = conn->out.written_bytes + conn->out.pending_bytes;
+  mark->received = received;
+  conn->mark_count++;
+  if (!conn->out.pending_bytes)
+    note_written(loop, conn, 0);
+}
+
+/**
+* Account for bytes the socket took and record the latency of every
+* request whose last byte is now written.
+* @loop      loop the connection belongs to
+* @conn      connection written to
+* @written   number of bytes written
+*/
+void note_written(struct EventLoop *loop, struct Connection *conn, size_t written) {
+  metric_add(&loop->metrics.bytes_sent, written);
+  if (!conn->mark_count || conn->marks[conn->mark_head].end > conn->out.written_bytes)
+    return;
+  uint64_t now = now_ns();
+  while (conn->mark_count && conn->marks[conn->mark_head].end <= conn->out.written_bytes) {
+    histogram_record(&loop->metrics.request_latency, now - conn->marks[conn->mark_head].received);
+    conn->mark_head = (conn->mark_head + 1) % LATENCY_MARKS;
+    conn->mark_count--;
+  }
+}
+
+/**
+* Reschedule connections that were waiting for the job index.
+* @loop   loop whose job store published more jobs
+*/
+void wake_waiting(struct EventLoop *loop) {
+  uint64_t count;
+  while (read(loop->wake_fd, &count, sizeof(count)) == sizeof(count))
+    ;
+  int woken = 0;
+  for (struct Connection *conn = loop->all; conn; conn = conn->next) {
+    if (conn->waiting) {
+      conn->waiting = 0;
+      schedule(loop, conn);
+      woken++;
+    }
+  }
+  TRACE(TRACE_WAKE, -1, woken, 0);
+}
+
+/**
+* Service every connection on the ready list once.
+* @loop   loop to run
+*/
+static void run_ready(struct EventLoop *loop) {
+  struct Connection *conn = loop->ready_head;
+  loop->ready_head = NULL;
+  loop->ready_tail = NULL;
+  while (conn) {
+    struct Connection *next = conn->next_ready;
+    conn->queued = 0;
+    service_connection(loop, conn);
+    conn = next;
+  }
+}
+
+
+/*============================== LOOP METHODS ================================*/
+
+/**
+* Current monotonic time in milliseconds.
+*/
+long now_ms(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+/**
+* Hand out again the jobs of every lease that ran out.
+* @loop   loop whose connections to check
+*/
+static void expire_leases(struct EventLoop *loop) {
+  long now = now_ms();
+  for (struct Connection *conn = loop->all; conn; conn = conn->next) {
+    if (conn->leases.count)
+      dispatch_expire(loop->dispatcher, &conn->leases, now);
+  }
+}
+
+/**
+* Stop accepting clients and send a type 'Q' job to every connection.
+* Jobs that have not started going out are dropped.
+* @loop   loop to shut down
+*/
+static void begin_shutdown(struct EventLoop *loop) {
+  if (loop->uring)
+    uring_stop_accepting(loop);
+  else
+    epoll_ctl(loop->epoll_fd, EPOLL_CTL_DEL, loop->listen_sock, NULL);
+  for (struct Connection *conn = loop->all; conn; conn = conn->next) {
+    if (!conn->closing) {
+      out_truncate(&conn->out);
+      conn->pending_jobs = 0;
+      conn->request_count = 0;
+      queue_quit(conn);
+      conn->closing = 1;
+    }
+    schedule(loop, conn);
+  }
+}
+
+/**
+* Serve clients until interrupted.
+* @loop   loop to run
+* Return 0 on interrupt, -1 on error.
+*/
+int loop_run(struct EventLoop *loop) {
+  struct epoll_event events[MAX_EVENTS];
+  int accept_retry = 0;
+  long deadline = 0;
+  long next_lease_check = 0;
+  trace_attach();
+
+  while (1) {
+    if (interrupted && !deadline) {
+      begin_shutdown(loop);
+      deadline = now_ms() + SHUTDOWN_GRACE_MS;
+    }
+    if (deadline && (!loop->connections || now_ms() >= deadline))
+      return 0;
+
+    if (loop->dispatcher && now_ms() >= next_lease_check) {
+      expire_leases(loop);
+      next_lease_check = now_ms() + LEASE_CHECK_MS;
+    }
+
+    int timeout = -1;
+    if (loop->ready_head)
+      timeout = 0;
+    else if (deadline || accept_retry)
+      timeout = 100;
+    else if (loop->dispatcher)
+      timeout = LEASE_CHECK_MS;
+
+    if (loop->uring) {
+      // completions schedule the connections they concern
+      if (uring_wait(loop, timeout))
+        return -1;
+      run_ready(loop);
+      continue;
+    }
+
+    int ready = epoll_wait(loop->epoll_fd, events, MAX_EVENTS, timeout);
+    if (ready == -1) {
+      if (errno == EINTR)
+        continue;
+      perror(RED "[Server Error] Failed to wait for events" RESET);
+      return -1;
+    }
+
+    if (accept_retry && !deadline)
+      accept_retry = accept_clients(loop) ? 1 : 0;
+
+    for (int i = 0; i < ready; i++) {
+      if (events[i].data.ptr == &listener_tag) {
+        if (!deadline)
+          accept_retry = accept_clients(loop) ? 1 : 0;
+        continue;
+      }
+      if (events[i].data.ptr == &wake_tag) {
+        wake_waiting(loop);
+        continue;
+      }
+      struct Connection *conn = (struct Connection *) events[i].data.ptr;
+      if (events[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR))
+        conn->readable = 1;
+      if (events[i].events & (EPOLLOUT | EPOLLHUP | EPOLLERR))
+        conn->writable = 1;
+      schedule(loop, conn);
+    }
+
+    run_ready(loop);
+  }
+}
@@ -0,0 +1,130 @@
+#ifndef EVENT_LOOP_H
+#define EVENT_LOOP_H
+
+#include <stdio.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <netinet/in.h>
+
+#include "out_queue.h"
+#include "protocol.h"
+#include "dispatcher.h"
+#include "metrics.h"
+#include "filter.h"
+
+#define INPUT_BUFFER_SIZE 512
+#define MAX_EVENTS 256
+#define SERVICE_BUDGET (256 * 1024) // bytes written per connection per loop turn
+#define QUEUED_BYTES_LIMIT (256 * 1024) // bytes queued ahead of the socket per connection
+#define DEFAULT_MAX_CONNECTIONS 4096
+#define SHUTDOWN_GRACE_MS 2000      // time given to clients to receive 'Q' jobs
+#define LATENCY_MARKS (2 * MAX_PIPELINED_REQUESTS) // served requests whose bytes are still queued
+#define CHECKPOINT_JOBS 1024        // jobs between CHECKPOINT frames to clients that may resume
+#define SERVER_CAPABILITIES (CAP_CREDIT | CAP_BATCH | CAP_CRC32C | CAP_REQUEST_IDS)
+
+// how job texts leave the server
+#define SEND_WRITEV 0        // writev() from the job file mapping
+#define SEND_SENDFILE 1      // sendfile() from the job file for large jobs
+#define SEND_ZEROCOPY 2      // MSG_ZEROCOPY from the job file mapping for large jobs
+// how the loop waits for and performs socket I/O
+#define IO_EPOLL 0           // readiness events, then nonblocking system calls
+#define IO_URING 1           // operations submitted to an io_uring (see uring_loop.h)
+
+#define SENDFILE_THRESHOLD (16 * 1024)
+#define ZEROCOPY_THRESHOLD (32 * 1024) // below this, page pinning costs more than copying
+
+struct UringConnection;
+struct Uring;
+struct FrameCache;
+struct Broadcast;
+
+/* A job request that has not been fully served yet. */
+struct PendingRequest {
+  uint64_t id;         // chosen by the client, see PIPELINED REQUESTS in protocol.txt
+  long jobs;           // jobs left to send, -1 for all jobs
+  int tagged;          // report completion with a DONE control frame
+  uint64_t received;   // when the request arrived, in nanoseconds
+};
+
+/* A served request whose last byte is queued but not written yet. */
+struct LatencyMark {
+  unsigned long long end; // written_bytes of the out queue once it is written
+  uint64_t received;      // when the request arrived, in nanoseconds
+};
+
+/* State of one client. Requests are parsed from the input buffer as they
+   arrive; replies wait in the out queue until the socket accepts them. */
+struct Connection {
+  int sock;
+  char address[INET_ADDRSTRLEN];
+  int readable;        // input edge seen, socket not drained yet
+  int writable;        // socket accepted the last write
+  int closing;         // close once the out queue drains
+  int queued;          // on the ready list
+  struct Connection *next_ready;
+  struct Connection *prev;
+  struct Connection *next;
+  unsigned char input[INPUT_BUFFER_SIZE];
+  size_t input_start;
+  size_t input_length;
+  long pending_jobs;   // jobs left in all requests, -1 for all jobs
+  struct PendingRequest requests[MAX_PIPELINED_REQUESTS];
+  int request_head;
+  int request_count;
+  size_t next_job;     // number of the next job to send
+  size_t scan_job;     // next job for the filter to look at; those from next_job up to it were rejected
+  int waiting;         // next job is not indexed yet
+  int flow_control;    // client grants credits, see FLOW CONTROL in protocol.txt
+  int byte_credit;     // client limits bytes as well as jobs
+  long credit_jobs;    // jobs the client is still willing to receive
+  long credit_bytes;   // bytes the client is still willing to receive
+  long batch_jobs;     // most jobs per batch frame, 0 if the client wants no batches
+  int crc32c;          // append a CRC32C trailer to every job text
+  int version;         // protocol version agreed in HELLO, 1 without one
+  int greeting;        // no request seen yet, so a 0 may still start HELLO
+  int negotiated;      // sent HELLO, so every 0 starts an extended request
+  int acks;            // client acknowledges jobs, so dispatched jobs are leased
+  int compress;        // send compressed copies of job texts where there are any
+  struct JobFilter filter; // jobs the client wants, see FILTERS in protocol.txt
+  int checkpoints;     // client may resume, so its position is reported in CHECKPOINT frames
+  size_t checkpoint;   // next job as of the last CHECKPOINT frame
+  uint64_t resume_jobs; // wanted jobs the client kept from its last session, passed over
+  struct LeaseRing leases;
+  struct LatencyMark marks[LATENCY_MARKS];
+  int mark_head;
+  int mark_count;
+  uint64_t stalled_since; // socket stopped taking queued bytes, 0 if it takes them
+  struct OutQueue out;
+  struct UringConnection *uring; // operations in flight, NULL with the epoll backend
+};
+
+struct EventLoop {
+  int epoll_fd;        // -1 with the io_uring backend
+  struct Uring *uring; // NULL with the epoll backend
+  int listen_sock;
+  int wake_fd;         // eventfd written by the job store
+  struct JobStore *store;
+  int connections;
+  int max_connections;
+  int send_mode;       // SEND_WRITEV, SEND_SENDFILE or SEND_ZEROCOPY
+  struct Dispatcher *dispatcher; // NULL unless jobs are shared between clients
+  struct FrameCache *cache;      // NULL unless large frames are cached
+  struct Broadcast *broadcast;   // NULL unless jobs are sent from a shared ring
+  struct Connection *ready_head;
+  struct Connection *ready_tail;
+  struct Connection *all;
+  struct Pool pool;    // connection state and out queue slots, statistics in metrics.pool
+  struct LoopMetrics metrics;
+};
+
+int loop_init(struct EventLoop *loop, int listen_sock, struct JobStore *store, int max_connections, int backend);
+int loop_run(struct EventLoop *loop);
+void loop_close(struct EventLoop *loop);
+void schedule(struct EventLoop *loop, struct Connection *conn);
+int add_connection(struct EventLoop *loop, int client_sock, struct sockaddr_in *clientaddr);
+void wake_waiting(struct EventLoop *loop);
+void request_served(struct EventLoop *loop, struct Connection *conn, uint64_t received);
+void note_written(struct EventLoop *loop, struct Connection *conn, size_t written);
+long now_ms(void);
+
+#endif
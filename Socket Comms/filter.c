@@ -0,0 +1,178 @@
+#include <string.h>
+#include <stdint.h>
+#include <immintrin.h>
+
+#include "filter.h"
+#include "protocol.h"
+
+#define FILTER_JOB_TYPES ((1u << TYPE_O) | (1u << TYPE_E)) // types a job file holds
+#define FILTER_VECTOR_PATTERN 8 // longest pattern searched with vectors
+
+
+/*============================== SUBSTRING SEARCH ============================*/
+
+/**
+* Find a pattern with the C library (fallback and tail handling).
+* @text             text to search
+* @length           bytes of the text
+* @pattern          pattern to find, at least one byte
+* @pattern_length   bytes of the pattern
+* Return the first occurrence, NULL if there is none.
+*/
+static const char *find_scalar(const char *text, size_t length, const char *pattern, size_t pattern_length) {
+  return (const char *) memmem(text, length, pattern, pattern_length);
+}
+
+/**
+* Find a pattern 16 positions at a time: a position is a candidate if
+* both the first and the last byte of the pattern match there.
+* @text             text to search
+* @length           bytes of the text
+* @pattern          pattern to find, at least one byte
+* @pattern_length   bytes of the pattern
+* Return the first occurrence, NULL if there is none.
+*/
+__attribute__((target("sse2")))
+static const char *find_sse2(const char *text, size_t length, const char *pattern, size_t pattern_length) {
+  __m128i first = _mm_set1_epi8(pattern[0]);
+  __m128i last = _mm_set1_epi8(pattern[pattern_length - 1]);
+  size_t i = 0;
+  for (; i + pattern_length - 1 + 16 <= length; i += 16) {
+    __m128i starts = _mm_loadu_si128((const __m128i *) (text + i));
+    __m128i ends = _mm_loadu_si128((const __m128i *) (text + i + pattern_length - 1));
+    unsigned int candidates = (unsigned int) _mm_movemask_epi8(
+        _mm_and_si128(_mm_cmpeq_epi8(starts, first), _mm_cmpeq_epi8(ends, last)));
+    while (candidates) {
+      const char *found = text + i + __builtin_ctz(candidates);
+      if (!memcmp(found, pattern, pattern_length))
+        return found;
+      candidates &= candidates - 1;
+    }
+  }
+  return find_scalar(text + i, length - i, pattern, pattern_length);
+}
+
+/**
+* Find a pattern 32 positions at a time.
+* @text             text to search
+* @length           bytes of the text
+* @pattern          pattern to find, at least one byte
+* @pattern_length   bytes of the pattern
+* Return the first occurrence, NULL if there is none.
+*/
+__attribute__((target("avx2")))
+static const char *find_avx2(const char *text, size_t length, const char *pattern, size_t pattern_length) {
+  __m256i first = _mm256_set1_epi8(pattern[0]);
+  __m256i last = _mm256_set1_epi8(pattern[pattern_length - 1]);
+  size_t i = 0;
+  for (; i + pattern_length - 1 + 32 <= length; i += 32) {
+    __m256i starts = _mm256_loadu_si256((const __m256i *) (text + i));
+    __m256i ends = _mm256_loadu_si256((const __m256i *) (text + i + pattern_length - 1));
+    uint32_t candidates = (uint32_t) _mm256_movemask_epi8(
+        _mm256_and_si256(_mm256_cmpeq_epi8(starts, first), _mm256_cmpeq_epi8(ends, last)));
+    while (candidates) {
+      const char *found = text + i + __builtin_ctz(candidates);
+      if (!memcmp(found, pattern, pattern_length))
+        return found;
+      candidates &= candidates - 1;
+    }
+  }
+  return find_scalar(text + i, length - i, pattern, pattern_length);
+}
+
+
+/*============================ RUNTIME DISPATCH ==============================*/
+
+struct FilterEngine {
+  const char *(*find)(const char *text, size_t length, const char *pattern, size_t pattern_length);
+  const char *name;
+};
+
+static const struct FilterEngine *engine; // chosen on first use
+
+/**
+* Pick the fastest search this CPU supports (utility method).
+* Racing callers pick the same engine, so no lock is needed.
+* Return the chosen engine.
+*/
+static const struct FilterEngine *select_engine(void) {
+  static const struct FilterEngine engines[] = {
+    { find_avx2, "avx2" },
+    { find_sse2, "sse2" },
+    { find_scalar, "scalar" },
+  };
+  const struct FilterEngine *chosen = __atomic_load_n(&engine, __ATOMIC_ACQUIRE);
+  if (chosen)
+    return chosen;
+
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2"))
+    chosen = &engines[0];
+  else if (__builtin_cpu_supports("sse2"))
+    chosen = &engines[1];
+  else
+    chosen = &engines[2];
+  __atomic_store_n(&engine, chosen, __ATOMIC_RELEASE);
+  return chosen;
+}
+
+/**
+* Find the first occurrence of a pattern in a text, like memmem().
+* Single bytes are left to memchr() and long patterns to memmem(), whose
+* shift table skips ahead further the longer the pattern is.
+* @text             text to search
+* @length           bytes of the text
+* @pattern          pattern to find
+* @pattern_length   bytes of the pattern, 0 matches at the start
+* Return the first occurrence, NULL if there is none.
+*/
+const char *filter_find(const char *text, size_t length, const char *pattern, size_t pattern_length) {
+  if (!pattern_length)
+    return text;
+  if (pattern_length > length)
+    return NULL;
+  if (pattern_length == 1)
+    return (const char *) memchr(text, pattern[0], length);
+  if (pattern_length > FILTER_VECTOR_PATTERN)
+    return find_scalar(text, length, pattern, pattern_length);
+  return select_engine()->find(text, length, pattern, pattern_length);
+}
+
+/**
+* Name the search in use, for debug output.
+*/
+const char *filter_engine(void) {
+  return select_engine()->name;
+}
+
+
+/*================================== FILTER ==================================*/
+
+/**
+* Set a client's filter. A filter that wants every job type and has no
+* pattern is inactive, so the client is served as if it had none.
+* @filter    filter to set
+* @types     bit n set for jobs of type n, 0 for every type
+* @pattern   substring a wanted job text contains
+* @length    bytes of the pattern, at most FILTER_MAX_PATTERN, 0 for any text
+*/
+void filter_set(struct JobFilter *filter, unsigned char types, const char *pattern, size_t length) {
+  filter->types = types ? types : 0xFF;
+  filter->length = length;
+  memcpy(filter->pattern, pattern, length);
+  filter->active = (filter->types & FILTER_JOB_TYPES) != FILTER_JOB_TYPES || length;
+}
+
+/**
+* Check whether a client wants a job.
+* @filter   filter of the client
+* @type     type of the job
+* @text     job text
+* @length   bytes of the text
+* Return 1 if the job is wanted, 0 otherwise.
+*/
+int filter_match(const struct JobFilter *filter, unsigned char type, const char *text, size_t length) {
+  if (!(filter->types & (1u << type)))
+    return 0;
+  return !filter->length || filter_find(text, length, filter->pattern, filter->length);
+}
@@ -0,0 +1,30 @@
+#ifndef FILTER_H
+#define FILTER_H
+
+#include <stddef.h>
+
+#include "protocol.h"
+
+/* Job filter a client sets with a FILTER request (see FILTERS in
+   protocol.txt). The server evaluates it on the indexed job before the
+   job is queued, so jobs the client does not want never cross the
+   network. The substring search compares the first and last byte of a
+   short pattern at 32 (AVX2) or 16 (SSE2) positions of the text at once,
+   and only compares the bytes in between where both match. The
+   implementation is chosen on first use. */
+
+#define FILTER_SCAN_JOBS 4096  // unwanted jobs passed over per send, then other clients get a turn
+
+struct JobFilter {
+  int active;              // 0 while the client wants every job
+  unsigned char types;     // bit n set: jobs of type n are wanted
+  size_t length;           // bytes of the pattern, 0 for any text
+  char pattern[FILTER_MAX_PATTERN];
+};
+
+void filter_set(struct JobFilter *filter, unsigned char types, const char *pattern, size_t length);
+int filter_match(const struct JobFilter *filter, unsigned char type, const char *text, size_t length);
+const char *filter_find(const char *text, size_t length, const char *pattern, size_t pattern_length);
+const char *filter_engine(void);
+
+#endif
@@ -0,0 +1,259 @@
+#include "server_util.h"
+
+extern int debug;
+
+/*================================ FRAME LISTS ===============================*/
+
+/**
+* Take a frame out of its LRU list (utility method).
+* @list    list holding the frame
+* @frame   frame to take out
+*/
+static void list_remove(struct FrameList *list, struct CachedFrame *frame) {
+  if (frame->prev)
+    frame->prev->next = frame->next;
+  else
+    list->head = frame->next;
+  if (frame->next)
+    frame->next->prev = frame->prev;
+  else
+    list->tail = frame->prev;
+  frame->prev = NULL;
+  frame->next = NULL;
+  list->bytes -= frame->length;
+}
+
+/**
+* Put a frame at the head of an LRU list (utility method).
+* @list    list to add to
+* @frame   frame that is in no list
+*/
+static void list_push(struct FrameList *list, struct CachedFrame *frame) {
+  frame->prev = NULL;
+  frame->next = list->head;
+  if (list->head)
+    list->head->prev = frame;
+  else
+    list->tail = frame;
+  list->head = frame;
+  list->bytes += frame->length;
+}
+
+
+/*=================================== CACHE ==================================*/
+
+/**
+* Spread job file offsets over shards and buckets (utility method).
+* @offset   position of a job text
+*/
+static uint64_t hash_offset(uint64_t offset) {
+  return offset * 0x9E3779B97F4A7C15ULL;
+}
+
+/**
+* Prepare an empty cache.
+* @cache    cache to prepare
+* @store    job store the frames are built from
+* @budget   bytes of frames cached at most, split evenly over the shards
+* Return 0 on success, -1 on error.
+*/
+int frame_cache_init(struct FrameCache *cache, struct JobStore *store, size_t budget) {
+  memset(cache, 0, sizeof(*cache));
+  cache->store = store;
+  size_t buckets = 64;
+  while (buckets < budget / FRAME_CACHE_SHARDS / SENDFILE_THRESHOLD)
+    buckets *= 2;
+  for (int i = 0; i < FRAME_CACHE_SHARDS; i++) {
+    struct FrameShard *shard = &cache->shards[i];
+    shard->buckets = (struct CachedFrame **) calloc(buckets, sizeof(struct CachedFrame *));
+    if (!shard->buckets) {
+      fprintf(stderr, RED ">>> %d <<< [Server Error] Failed to allocate frame cache.\n" RESET, getpid());
+      frame_cache_free(cache);
+      return -1;
+    }
+    shard->bucket_mask = buckets - 1;
+    shard->budget = budget / FRAME_CACHE_SHARDS;
+    pthread_mutex_init(&shard->lock, NULL);
+  }
+  if (debug)
+    printf(">>> %d <<< Caching up to %zu MB of job frames.\n", getpid(), budget / (1024 * 1024));
+  return 0;
+}
+
+/**
+* Drop every cached frame. Called once no out queue refers to one.
+* @cache   cache to free, may be partially prepared
+*/
+void frame_cache_free(struct FrameCache *cache) {
+  for (int i = 0; i < FRAME_CACHE_SHARDS; i++) {
+    struct FrameShard *shard = &cache->shards[i];
+    if (!shard->buckets)
+      continue;
+    struct FrameList *lists[2] = { &shard->probation, &shard->protected_list };
+    for (int j = 0; j < 2; j++) {
+      while (lists[j]->head) {
+        struct CachedFrame *frame = lists[j]->head;
+        list_remove(lists[j], frame);
+        frame_release(frame);
+      }
+    }
+    free(shard->buckets);
+    shard->buckets = NULL;
+    pthread_mutex_destroy(&shard->lock);
+  }
+}
+
+/**
+* Drop a reference to a frame, freeing it with the last one. Matches the
+* release callback of out_push_shared().
+* @frame   frame to release
+*/
+void frame_release(void *frame) {
+  struct CachedFrame *cached = (struct CachedFrame *) frame;
+  if (!__atomic_sub_fetch(&cached->refs, 1, __ATOMIC_ACQ_REL))
+    free(cached);
+}
+
+/**
+* Find the link pointing to a cached frame (utility method).
+* Call with the shard locked.
+* @shard    shard to search
+* @offset   key of the frame
+* Return the link, pointing to NULL if the frame is not cached.
+*/
+static struct CachedFrame **find(struct FrameShard *shard, uint64_t offset) {
+  struct CachedFrame **link = &shard->buckets[hash_offset(offset) & shard->bucket_mask];
+  while (*link && (*link)->offset != offset)
+    link = &(*link)->hash_next;
+  return link;
+}
+
+/**
+* Evict frames until the shard is within its budget, probation first
+* (utility method). Call with the shard locked.
+* @shard   shard to trim
+*/
+static void evict(struct FrameShard *shard) {
+  while (shard->probation.bytes + shard->protected_list.bytes > shard->budget) {
+    struct FrameList *list = shard->probation.tail ? &shard->probation : &shard->protected_list;
+    struct CachedFrame *victim = list->tail;
+    list_remove(list, victim);
+    *find(shard, victim->offset) = victim->hash_next;
+    shard->frames--;
+    shard->evictions++;
+    frame_release(victim);
+  }
+}
+
+/**
+* Build the frame of a job: header, text and terminator (utility method).
+* @store   job store holding the job
+* @entry   indexed job with a text
+* Return the frame with one reference, NULL on allocation failure.
+*/
+static struct CachedFrame *build_frame(struct JobStore *store, struct JobEntry *entry) {
+  size_t header_size = sizeof(char) + sizeof(int);
+  size_t length = header_size + entry->length + 1;
+  struct CachedFrame *frame = (struct CachedFrame *) malloc(sizeof(struct CachedFrame) + length);
+  if (!frame)
+    return NULL;
+  const char *text = job_store_text(store, entry);
+  if (store->framed) { // the file holds the whole frame
+    memcpy(frame->data, text - header_size, length);
+  } else {
+    struct JobMessage header;
+    header.job_info = (unsigned char) ((entry->type << 5) + entry->checksum);
+    header.text_length = htonl(entry->length);
+    memcpy(frame->data, &header, header_size);
+    memcpy(frame->data + header_size, text, entry->length);
+    frame->data[length - 1] = '\0';
+  }
+  frame->hash_next = NULL;
+  frame->prev = NULL;
+  frame->next = NULL;
+  frame->offset = entry->offset;
+  frame->length = length;
+  frame->refs = 1;
+  frame->protected_frame = 0;
+  return frame;
+}
+
+/**
+* Get the frame of a job, building and caching it if it is not cached.
+* A frame asked for again is protected; protected frames beyond their
+* share of the budget go back on probation.
+* @cache   cache to look in
+* @entry   indexed job with a text
+* Return the frame with a reference for the caller (see frame_release()),
+* NULL if the frame cannot be cached.
+*/
+struct CachedFrame *frame_cache_get(struct FrameCache *cache, struct JobEntry *entry) {
+  uint64_t hash = hash_offset(entry->offset);
+  struct FrameShard *shard = &cache->shards[(hash >> 60) % FRAME_CACHE_SHARDS];
+  if (sizeof(char) + sizeof(int) + (size_t) entry->length + 1 > shard->budget)
+    return NULL;
+
+  pthread_mutex_lock(&shard->lock);
+  struct CachedFrame *frame = *find(shard, entry->offset);
+  if (frame) {
+    shard->hits++;
+    if (frame->protected_frame) {
+      list_remove(&shard->protected_list, frame);
+    } else {
+      list_remove(&shard->probation, frame);
+      frame->protected_frame = 1;
+    }
+    list_push(&shard->protected_list, frame);
+    while (shard->protected_list.bytes > shard->budget / 100 * FRAME_CACHE_PROTECTED) {
+      struct CachedFrame *demoted = shard->protected_list.tail;
+      list_remove(&shard->protected_list, demoted);
+      demoted->protected_frame = 0;
+      list_push(&shard->probation, demoted);
+    }
+    __atomic_add_fetch(&frame->refs, 1, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&shard->lock);
+    return frame;
+  }
+  shard->misses++;
+  pthread_mutex_unlock(&shard->lock);
+
+  // build without the lock; another worker may build the same frame meanwhile
+  struct CachedFrame *built = build_frame(cache->store, entry);
+  if (!built)
+    return NULL;
+  pthread_mutex_lock(&shard->lock);
+  struct CachedFrame **link = find(shard, entry->offset);
+  if (*link) {
+    frame = *link;
+    __atomic_add_fetch(&frame->refs, 1, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&shard->lock);
+    free(built);
+    return frame;
+  }
+  built->refs = 2; // the cache's and the caller's
+  *link = built;
+  list_push(&shard->probation, built);
+  shard->frames++;
+  evict(shard);
+  pthread_mutex_unlock(&shard->lock);
+  return built;
+}
+
+/**
+* Add up the statistics of every shard.
+* @cache   cache to report on
+* @stats   filled in with the totals
+*/
+void frame_cache_stats(struct FrameCache *cache, struct FrameCacheStats *stats) {
+  memset(stats, 0, sizeof(*stats));
+  for (int i = 0; i < FRAME_CACHE_SHARDS; i++) {
+    struct FrameShard *shard = &cache->shards[i];
+    pthread_mutex_lock(&shard->lock);
+    stats->bytes += shard->probation.bytes + shard->protected_list.bytes;
+    stats->frames += shard->frames;
+    stats->hits += shard->hits;
+    stats->misses += shard->misses;
+    stats->evictions += shard->evictions;
+    pthread_mutex_unlock(&shard->lock);
+  }
+}
@@ -0,0 +1,81 @@
+#ifndef FRAME_CACHE_H
+#define FRAME_CACHE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <pthread.h>
+
+/* Server-wide cache of built job frames (header, text and terminator in
+   one buffer), shared read-only by every connection of every worker.
+   Only jobs that would otherwise be read from the job file for each
+   client are cached, i.e. large texts in sendfile mode: a cached frame
+   goes out with the neighbouring segments in one writev() or send, where
+   the file range costs its own sendfile() (or, with io_uring, a read into
+   one of the few registered buffers) per client.
+   Frames are reference counted: the cache holds one reference and every
+   out queue segment that refers to the frame another, so an evicted
+   frame stays valid until the last connection sent it.
+   Eviction is segmented LRU, which keeps one pass over a large file from
+   flushing frames that clients keep coming back to: a frame enters on
+   probation and is only protected once it is asked for again; frames on
+   probation are evicted first. The cache is split into shards by job so
+   workers rarely wait for each other. */
+
+#define FRAME_CACHE_SHARDS 16
+#define FRAME_CACHE_PROTECTED 80 // percent of the budget protected frames may take
+
+struct JobStore;
+struct JobEntry;
+
+struct CachedFrame {
+  struct CachedFrame *hash_next;
+  struct CachedFrame *prev;    // neighbours in the frame's LRU list
+  struct CachedFrame *next;
+  uint64_t offset;             // position of the job text in the file, the key
+  size_t length;               // bytes of the frame
+  int refs;                    // the cache's reference, if cached, and the segments'
+  int protected_frame;         // in the protected list, otherwise on probation
+  char data[];
+};
+
+/* Most recently used frame at the head. */
+struct FrameList {
+  struct CachedFrame *head;
+  struct CachedFrame *tail;
+  size_t bytes;
+};
+
+struct FrameShard {
+  pthread_mutex_t lock;
+  struct CachedFrame **buckets;
+  size_t bucket_mask;
+  struct FrameList probation;
+  struct FrameList protected_list;
+  size_t budget;               // bytes of frames cached at most
+  uint64_t frames;             // statistics
+  uint64_t hits;
+  uint64_t misses;
+  uint64_t evictions;
+};
+
+struct FrameCache {
+  struct JobStore *store;
+  struct FrameShard shards[FRAME_CACHE_SHARDS];
+};
+
+/* Totals over all shards. */
+struct FrameCacheStats {
+  uint64_t bytes;
+  uint64_t frames;
+  uint64_t hits;
+  uint64_t misses;
+  uint64_t evictions;
+};
+
+int frame_cache_init(struct FrameCache *cache, struct JobStore *store, size_t budget);
+void frame_cache_free(struct FrameCache *cache);
+struct CachedFrame *frame_cache_get(struct FrameCache *cache, struct JobEntry *entry);
+void frame_release(void *frame);
+void frame_cache_stats(struct FrameCache *cache, struct FrameCacheStats *stats);
+
+#endif
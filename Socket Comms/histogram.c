@@ -0,0 +1,86 @@
+#include <string.h>
+
+#include "histogram.h"
+
+/**
+* Bucket a value falls into (utility method).
+* @value   value to look up
+* Return bucket number.
+*/
+static int bucket_of(uint64_t value) {
+  if (value < HISTOGRAM_LINEAR)
+    return (int) value;
+  int exponent = 63 - __builtin_clzll(value); // at least 5
+  int mantissa = (int) (value >> (exponent - HISTOGRAM_SUB_BITS)) & ((1 << HISTOGRAM_SUB_BITS) - 1);
+  return HISTOGRAM_LINEAR + (exponent - 5) * (1 << HISTOGRAM_SUB_BITS) + mantissa;
+}
+
+/**
+* Largest value that falls into a bucket.
+* @bucket   bucket number
+* Return upper limit of the bucket, inclusive.
+*/
+uint64_t histogram_bucket_limit(int bucket) {
+  if (bucket < HISTOGRAM_LINEAR)
+    return (uint64_t) bucket;
+  int exponent = (bucket - HISTOGRAM_LINEAR) / (1 << HISTOGRAM_SUB_BITS) + 5;
+  uint64_t mantissa = (uint64_t) ((bucket - HISTOGRAM_LINEAR) % (1 << HISTOGRAM_SUB_BITS));
+  uint64_t width = (uint64_t) 1 << (exponent - HISTOGRAM_SUB_BITS);
+  return (((uint64_t) 1 << HISTOGRAM_SUB_BITS) + mantissa) * width + (width - 1);
+}
+
+/**
+* Count one value.
+* @histogram   histogram to add to
+* @value       value to count
+*/
+void histogram_record(struct Histogram *histogram, uint64_t value) {
+  uint64_t *count = &histogram->counts[bucket_of(value)];
+  __atomic_store_n(count, *count + 1, __ATOMIC_RELAXED);
+  __atomic_store_n(&histogram->total, histogram->total + 1, __ATOMIC_RELAXED);
+  __atomic_store_n(&histogram->sum, histogram->sum + value, __ATOMIC_RELAXED);
+  if (value > histogram->max)
+    __atomic_store_n(&histogram->max, value, __ATOMIC_RELAXED);
+}
+
+/**
+* Add the counts of one histogram to another. The histogram added may be
+* recorded into meanwhile; its total is then recounted from the buckets.
+* @into   histogram to add to, owned by the caller
+* @from   histogram to add
+*/
+void histogram_merge(struct Histogram *into, const struct Histogram *from) {
+  for (int i = 0; i < HISTOGRAM_BUCKETS; i++) {
+    uint64_t count = __atomic_load_n(&from->counts[i], __ATOMIC_RELAXED);
+    into->counts[i] += count;
+    into->total += count;
+  }
+  into->sum += __atomic_load_n(&from->sum, __ATOMIC_RELAXED);
+  uint64_t max = __atomic_load_n(&from->max, __ATOMIC_RELAXED);
+  if (max > into->max)
+    into->max = max;
+}
+
+/**
+* Value below which a given share of the recorded values fall, rounded up
+* to the end of its bucket and never above the largest value recorded.
+* @histogram    histogram to look into
+* @percentile   share in percent, 0 - 100
+* Return the value, 0 if nothing was recorded.
+*/
+uint64_t histogram_percentile(const struct Histogram *histogram, double percentile) {
+  if (!histogram->total)
+    return 0;
+  uint64_t rank = (uint64_t) (percentile / 100.0 * (double) histogram->total + 0.5);
+  if (rank < 1)
+    rank = 1;
+  uint64_t seen = 0;
+  for (int i = 0; i < HISTOGRAM_BUCKETS; i++) {
+    seen += histogram->counts[i];
+    if (seen >= rank) {
+      uint64_t limit = histogram_bucket_limit(i);
+      return (limit < histogram->max) ? limit : histogram->max;
+    }
+  }
+  return histogram->max;
+}
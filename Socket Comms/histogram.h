@@ -0,0 +1,29 @@
+#ifndef HISTOGRAM_H
+#define HISTOGRAM_H
+
+#include <stdint.h>
+
+/* Latency histogram with logarithmic buckets. Values below 32 get a bucket
+   each; above that, every power of two is split into 16 buckets, so any
+   recorded value is known to within 1/16 (about 6%) across the whole
+   64-bit range in under 8 KB. Recording is a few instructions and never
+   allocates. A histogram has one writer; other threads may read it at
+   any time, so fields are stored and loaded with relaxed atomics. */
+
+#define HISTOGRAM_SUB_BITS 4     // every power of two is split into 2^4 buckets
+#define HISTOGRAM_LINEAR 32      // values below this get a bucket each
+#define HISTOGRAM_BUCKETS (HISTOGRAM_LINEAR + (64 - 5) * (1 << HISTOGRAM_SUB_BITS))
+
+struct Histogram {
+  uint64_t counts[HISTOGRAM_BUCKETS];
+  uint64_t total;      // values recorded
+  uint64_t sum;
+  uint64_t max;
+};
+
+void histogram_record(struct Histogram *histogram, uint64_t value);
+void histogram_merge(struct Histogram *into, const struct Histogram *from);
+uint64_t histogram_percentile(const struct Histogram *histogram, double percentile);
+uint64_t histogram_bucket_limit(int bucket);
+
+#endif
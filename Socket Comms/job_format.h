@@ -0,0 +1,124 @@
+#ifndef JOB_FORMAT_H
+#define JOB_FORMAT_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "checksum.h"
+
+/* Compiled job files, written by jobc from a ".job" file and served as
+   they are. Integers are little endian, like the lengths in ".job" files.
+     header   JOBC_HEADER_SIZE bytes, see the offsets below
+     table    one JOBC_ENTRY_SIZE entry per job, in job order
+     frames   every job exactly as it goes on the wire: the 5-byte header
+              (type and checksum, big endian text length), the text and,
+              unless the text is empty, the terminating 0
+   The table and header carry CRC32Cs, the table carries each text's
+   CRC32C, so the server checks nothing but the table when it starts and
+   can send every frame as one byte range of the file. */
+
+#define MAX_TEXT_LENGTH 54378 // longest text in ".job" files (see "genjob.c"), not for compiled files
+
+#define JOBC_MAGIC "JOBC"
+#define JOBC_VERSION 1
+#define JOBC_HEADER_SIZE 64
+#define JOBC_ENTRY_SIZE 24
+
+// header fields
+#define JOBC_VERSION_AT 4        // u32
+#define JOBC_JOB_COUNT_AT 8      // u64
+#define JOBC_TABLE_AT 16         // u64 offset of the table
+#define JOBC_FRAMES_AT 24        // u64 offset of the frames
+#define JOBC_FRAMES_SIZE_AT 32   // u64
+#define JOBC_TABLE_CRC_AT 40     // u32 CRC32C of the table
+#define JOBC_HEADER_CRC_AT 60    // u32 CRC32C of the header up to here
+
+// table entry fields
+#define JOBC_FRAME_OFFSET_AT 0   // u64 offset of the frame from the start of the frames
+#define JOBC_TEXT_LENGTH_AT 8    // u32
+#define JOBC_TEXT_CRC_AT 12      // u32 CRC32C of the text
+#define JOBC_JOB_INFO_AT 16      // u8 first byte of the frame, type << 5 | checksum
+
+/* Layout of a compiled job file, as read from its header. */
+struct JobcHeader {
+  uint32_t version;
+  uint64_t job_count;
+  uint64_t table_offset;
+  uint64_t frames_offset;
+  uint64_t frames_size;
+  uint32_t table_crc;
+};
+
+static inline uint32_t jobc_get32(const unsigned char *data) {
+  return (uint32_t) data[0] | ((uint32_t) data[1] << 8) | ((uint32_t) data[2] << 16) | ((uint32_t) data[3] << 24);
+}
+
+static inline uint64_t jobc_get64(const unsigned char *data) {
+  return (uint64_t) jobc_get32(data) | ((uint64_t) jobc_get32(data + 4) << 32);
+}
+
+static inline void jobc_put32(unsigned char *data, uint32_t value) {
+  for (int i = 0; i < 4; i++)
+    data[i] = (unsigned char) (value >> 8*i);
+}
+
+static inline void jobc_put64(unsigned char *data, uint64_t value) {
+  jobc_put32(data, (uint32_t) value);
+  jobc_put32(data + 4, (uint32_t) (value >> 32));
+}
+
+/**
+* Fill in the header of a compiled job file.
+* @data     JOBC_HEADER_SIZE bytes
+* @header   layout to write
+*/
+static inline void jobc_write_header(unsigned char *data, const struct JobcHeader *header) {
+  memset(data, 0, JOBC_HEADER_SIZE);
+  memcpy(data, JOBC_MAGIC, 4);
+  jobc_put32(data + JOBC_VERSION_AT, header->version);
+  jobc_put64(data + JOBC_JOB_COUNT_AT, header->job_count);
+  jobc_put64(data + JOBC_TABLE_AT, header->table_offset);
+  jobc_put64(data + JOBC_FRAMES_AT, header->frames_offset);
+  jobc_put64(data + JOBC_FRAMES_SIZE_AT, header->frames_size);
+  jobc_put32(data + JOBC_TABLE_CRC_AT, header->table_crc);
+  jobc_put32(data + JOBC_HEADER_CRC_AT, checksum_crc32c(data, JOBC_HEADER_CRC_AT));
+}
+
+/**
+* Check whether a file starts like a compiled job file.
+* @data   start of the file
+* @size   size of the file
+* Return 1 if it does, 0 otherwise.
+*/
+static inline int jobc_detect(const void *data, size_t size) {
+  return size >= JOBC_HEADER_SIZE && !memcmp(data, JOBC_MAGIC, 4);
+}
+
+/**
+* Read and check the header and table of a compiled job file.
+* @data     start of the file
+* @size     size of the file
+* @header   filled in with the file's layout
+* Return 0 on success, -1 if the file is damaged or of another version.
+*/
+static inline int jobc_read_header(const unsigned char *data, size_t size, struct JobcHeader *header) {
+  if (!jobc_detect(data, size) ||
+      jobc_get32(data + JOBC_HEADER_CRC_AT) != checksum_crc32c(data, JOBC_HEADER_CRC_AT))
+    return -1;
+  header->version = jobc_get32(data + JOBC_VERSION_AT);
+  header->job_count = jobc_get64(data + JOBC_JOB_COUNT_AT);
+  header->table_offset = jobc_get64(data + JOBC_TABLE_AT);
+  header->frames_offset = jobc_get64(data + JOBC_FRAMES_AT);
+  header->frames_size = jobc_get64(data + JOBC_FRAMES_SIZE_AT);
+  header->table_crc = jobc_get32(data + JOBC_TABLE_CRC_AT);
+  if (header->version != JOBC_VERSION || header->job_count > size / JOBC_ENTRY_SIZE ||
+      header->table_offset > size || header->job_count * JOBC_ENTRY_SIZE > size - header->table_offset ||
+      header->frames_offset > size || header->frames_size > size - header->frames_offset)
+    return -1;
+  if (checksum_crc32c(data + header->table_offset, header->job_count * JOBC_ENTRY_SIZE) != header->table_crc)
+    return -1;
+  return 0;
+}
+
+#endif
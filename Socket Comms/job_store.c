@@ -0,0 +1,761 @@
+#include "server_util.h"
+
+extern int debug;
+
+/*============================== INDEX BUILDING ==============================*/
+
+/**
+* Compress every job of a run of jobs in one chunk that shrinks by at
+* least an eighth (utility method). The 'Z' payloads are packed into one
+* arena, linked to the chunk's other arenas; a job that does not shrink,
+* or does not fit, keeps packed NULL.
+* @store   store the chunk belongs to
+* @chunk   chunk number
+* @first   first job of the run within the chunk
+* @count   number of jobs in the run
+*/
+static void pack_jobs(struct JobStore *store, size_t chunk, unsigned int first, unsigned int count) {
+  struct JobEntry *entries = store->chunks[chunk] + first;
+  const struct CodecDict *dict = (store->compression == COMPRESS_DICT) ? &store->dict : NULL;
+  uint32_t offsets[INDEX_CHUNK_JOBS];
+  unsigned char *packed = NULL;
+  size_t used = sizeof(struct PackedArena);
+  size_t capacity = 0;
+  unsigned char *scratch = (unsigned char *) malloc(1 + VARINT_MAX_SIZE + codec_bound(MAX_TEXT_LENGTH));
+  if (!scratch)
+    return;
+
+  memset(offsets, 0xFF, sizeof(offsets)); // UINT32_MAX: not compressed
+  for (unsigned int i = 0; i < count; i++) {
+    uint32_t length = entries[i].length;
+    if (length < PACK_MIN_LENGTH || length > MAX_TEXT_LENGTH)
+      continue;
+    scratch[0] = entries[i].type;
+    size_t header = 1 + varint_encode(length, scratch + 1);
+    size_t limit = length - length / 8;
+    const char *text = store->map + entries[i].offset;
+    size_t compressed = codec_compress(text, length, scratch + header, limit - header, dict);
+    if (!compressed)
+      continue;
+
+    size_t size = header + compressed;
+    if (used + size > capacity) {
+      size_t grown = (capacity * 2 > used + size) ? capacity * 2 : used + size + 16 * 1024;
+      unsigned char *larger = (unsigned char *) realloc(packed, grown);
+      if (!larger)
+        break;
+      packed = larger;
+      capacity = grown;
+    }
+    memcpy(packed + used, scratch, size);
+    offsets[i] = (uint32_t) used;
+    entries[i].packed_length = (uint32_t) size;
+    used += size;
+  }
+  free(scratch);
+
+  if (!packed)
+    return;
+  if (used < capacity) {
+    unsigned char *shrunk = (unsigned char *) realloc(packed, used);
+    if (shrunk)
+      packed = shrunk;
+  }
+  for (unsigned int i = 0; i < count; i++) {
+    if (offsets[i] == UINT32_MAX)
+      entries[i].packed_length = 0;
+    else
+      entries[i].packed = packed + offsets[i];
+  }
+  struct PackedArena *arena = (struct PackedArena *) packed;
+  arena->next = store->chunk_packed[chunk];
+  store->chunk_packed[chunk] = arena;
+}
+
+/**
+* Checksum a run of jobs in one chunk, unless the file is compiled and
+* came with checksums, and compress them if compression is on (utility
+* method).
+* @store   store the chunk belongs to
+* @chunk   chunk number
+* @first   first job of the run within the chunk
+* @count   number of jobs in the run
+*/
+static void hash_jobs(struct JobStore *store, size_t chunk, unsigned int first, unsigned int count) {
+  struct JobEntry *entries = store->chunks[chunk] + first;
+  for (unsigned int i = 0; i < count && !store->framed; i++) {
+    const unsigned char *text = (const unsigned char *) store->map + entries[i].offset;
+    entries[i].checksum = checksum_text(text, entries[i].length);
+    entries[i].crc32c = checksum_crc32c(text, entries[i].length);
+  }
+  if (store->compression != COMPRESS_NONE)
+    pack_jobs(store, chunk, first, count);
+}
+
+/**
+* Checksum and compress every job of one chunk (utility method).
+* @store   store the chunk belongs to
+* @chunk   chunk number
+*/
+static void hash_chunk(struct JobStore *store, size_t chunk) {
+  hash_jobs(store, chunk, 0, store->chunk_jobs[chunk]);
+}
+
+/**
+* Wake every event loop waiting for jobs (utility method).
+* @store   store that published jobs
+*/
+static void notify_watchers(struct JobStore *store) {
+  uint64_t one = 1;
+  TRACE(TRACE_PUBLISH, -1, __atomic_load_n(&store->ready_jobs, __ATOMIC_ACQUIRE), 0);
+  for (int i = 0; i < store->watcher_count; i++) {
+    if (write(store->watchers[i], &one, sizeof(one)) != sizeof(one) && errno != EAGAIN)
+      perror("[Server Warning] Failed to notify event loop");
+  }
+}
+
+/**
+* Mark a chunk as hashed and publish every leading chunk that is done.
+* Called with store->lock held.
+* @store   store the chunk belongs to
+* @chunk   chunk number, or -1 to only publish
+* Return 1 if more jobs became servable, 0 otherwise.
+*/
+static int publish_chunks(struct JobStore *store, long chunk) {
+  if (chunk >= 0)
+    store->chunk_done[chunk] = 1;
+  size_t ready = store->ready_jobs;
+  int published = 0;
+  while (store->next_publish < store->chunks_walked && store->chunk_done[store->next_publish]) {
+    ready += store->chunk_jobs[store->next_publish];
+    store->next_publish++;
+    published = 1;
+  }
+  __atomic_store_n(&store->ready_jobs, ready, __ATOMIC_RELEASE);
+  if (store->walk_done && store->next_publish == store->chunks_walked && !store->complete) {
+    __atomic_store_n(&store->complete, 1, __ATOMIC_RELEASE);
+    published = 1;
+  }
+  return published;
+}
+
+/**
+* Checksum walked chunks until the walk is over and no chunk is left.
+* @store   store to index
+*/
+static void hash_chunks(struct JobStore *store) {
+  while (1) {
+    pthread_mutex_lock(&store->lock);
+    while (store->next_hash >= store->chunks_walked && !store->walk_done)
+      pthread_cond_wait(&store->walked, &store->lock);
+    if (store->next_hash >= store->chunks_walked) {
+      pthread_mutex_unlock(&store->lock);
+      return;
+    }
+    size_t chunk = store->next_hash++;
+    pthread_mutex_unlock(&store->lock);
+
+    hash_chunk(store, chunk);
+
+    pthread_mutex_lock(&store->lock);
+    int published = publish_chunks(store, chunk);
+    pthread_mutex_unlock(&store->lock);
+    if (published)
+      notify_watchers(store);
+  }
+}
+
+/**
+* Hand a chunk whose boundaries are known to the checksum threads.
+* With a single index thread the walker checksums it right away.
+* @store   store to index
+* @chunk   chunk number
+* @jobs    jobs in the chunk
+*/
+static void finish_walked_chunk(struct JobStore *store, size_t chunk, unsigned int jobs) {
+  store->chunk_jobs[chunk] = jobs;
+  if (store->thread_count == 1) {
+    hash_chunk(store, chunk);
+    pthread_mutex_lock(&store->lock);
+    store->chunks_walked++;
+    store->next_hash++;
+    int published = publish_chunks(store, chunk);
+    pthread_mutex_unlock(&store->lock);
+    if (published)
+      notify_watchers(store);
+    return;
+  }
+  pthread_mutex_lock(&store->lock);
+  store->chunks_walked++;
+  pthread_cond_broadcast(&store->walked);
+  pthread_mutex_unlock(&store->lock);
+}
+
+/**
+* Read the next job of the file (utility method). In a ".job" file the
+* cursor is the position of the job's header; in a compiled job file it
+* is the job's number, and the checksums come from the table.
+* @store    store holding the file
+* @cursor   where the job starts, advanced past it
+* @entry    filled in with the job
+* Return 0 on success, 1 at the end of the file or at a job that is cut
+* short (more may be appended), -1 at an invalid job.
+*/
+static int next_job(struct JobStore *store, size_t *cursor, struct JobEntry *entry) {
+  const unsigned char *map = (const unsigned char *) store->map;
+  memset(entry, 0, sizeof(*entry));
+  if (store->framed) {
+    if (*cursor >= store->job_count)
+      return 1;
+    const unsigned char *row = map + store->table_offset + *cursor * JOBC_ENTRY_SIZE;
+    uint64_t frame = jobc_get64(row + JOBC_FRAME_OFFSET_AT);
+    entry->length = jobc_get32(row + JOBC_TEXT_LENGTH_AT);
+    entry->crc32c = jobc_get32(row + JOBC_TEXT_CRC_AT);
+    entry->type = row[JOBC_JOB_INFO_AT] >> 5;
+    entry->checksum = row[JOBC_JOB_INFO_AT] & 31;
+    if (frame > store->frames_size || 5 + (uint64_t) entry->length + (entry->length ? 1 : 0) > store->frames_size - frame ||
+        (entry->type != TYPE_O && entry->type != TYPE_E))
+      return -1;
+    entry->offset = store->frames_offset + frame + 5;
+    (*cursor)++;
+    return 0;
+  }
+
+  size_t position = *cursor;
+  if (position + 5 > store->size)
+    return 1;
+  if (map[position] == 'O')
+    entry->type = (unsigned char) TYPE_O;
+  else if (map[position] == 'E')
+    entry->type = (unsigned char) TYPE_E;
+  else
+    return -1;
+
+  for (int i = 0; i < 4; i++) {
+    // unaffected by endianness due to bit shifting
+    entry->length += ((uint32_t) map[position + 1 + i] << 8*i);
+  }
+  if (entry->length > MAX_TEXT_LENGTH)
+    return -1;
+  if (position + 5 + entry->length > store->size)
+    return 1;
+  entry->offset = position + 5;
+  *cursor = position + 5 + entry->length;
+  return 0;
+}
+
+/**
+* Walk the job boundaries of the file, then help with checksums.
+* The walk stops at the end of file, at an invalid job or at a job
+* whose text is cut short. Compiled job files are walked through their
+* table instead.
+* @arg   store to index
+*/
+static void *walk_jobs(void *arg) {
+  struct JobStore *store = (struct JobStore *) arg;
+  size_t position = 0;
+  size_t chunk = 0;
+  unsigned int jobs = 0;
+  trace_attach();
+
+  while (1) {
+    if (!jobs && __atomic_load_n(&store->stopping, __ATOMIC_RELAXED))
+      break;
+    struct JobEntry entry;
+    size_t next = position;
+    if (next_job(store, &next, &entry))
+      break;
+
+    if (!jobs) {
+      store->chunks[chunk] = (struct JobEntry *) malloc(sizeof(struct JobEntry) * INDEX_CHUNK_JOBS);
+      if (!store->chunks[chunk])
+        break;
+    }
+    store->chunks[chunk][jobs] = entry;
+    position = next;
+
+    if (++jobs == INDEX_CHUNK_JOBS) {
+      finish_walked_chunk(store, chunk, jobs);
+      chunk++;
+      jobs = 0;
+    }
+  }
+  if (jobs)
+    finish_walked_chunk(store, chunk, jobs);
+
+  if (store->stopping) {
+    // cut short on purpose
+  } else if (store->framed && position < store->job_count) {
+    fprintf(stderr, ">>> %d <<< Invalid table entry encountered in file (job %zu).\n", getpid(), position);
+  } else if (!store->framed && position < store->size) {
+    fprintf(stderr, ">>> %d <<< Invalid job encountered in file (offset %zu).\n", getpid(), position);
+  }
+  if (debug)
+    printf(">>> %d <<< Job boundaries indexed (%zu %s).\n", getpid(), position, store->framed ? "jobs" : "bytes");
+
+  pthread_mutex_lock(&store->lock);
+  store->walk_done = 1;
+  pthread_cond_broadcast(&store->walked);
+  int published = publish_chunks(store, -1);
+  pthread_mutex_unlock(&store->lock);
+  if (published)
+    notify_watchers(store);
+
+  if (store->thread_count > 1)
+    hash_chunks(store);
+  return NULL;
+}
+
+/**
+* Block until the followed file changes or the store is closed, then
+* take in its new size (utility method). Changes are reported by
+* inotify, so nothing is polled.
+* @store   store following its file
+* Return 0 if the file may have grown, -1 to stop following.
+*/
+static int wait_for_growth(struct JobStore *store) {
+  struct pollfd fds[2];
+  fds[0].fd = store->inotify_fd;
+  fds[0].events = POLLIN;
+  fds[1].fd = store->stop_fd;
+  fds[1].events = POLLIN;
+  while (poll(fds, 2, -1) == -1) {
+    if (errno != EINTR) {
+      perror(RED "[Server Error] Failed to wait for job file changes" RESET);
+      return -1;
+    }
+  }
+  if (fds[1].revents || __atomic_load_n(&store->stopping, __ATOMIC_RELAXED))
+    return -1;
+
+  char events[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+  while (read(store->inotify_fd, events, sizeof(events)) > 0)
+    ; // every event means the same: look at the size again
+  struct stat file_stat;
+  if (fstat(store->fd, &file_stat)) {
+    perror(RED "[Server Error] Failed to inspect job file" RESET);
+    return -1;
+  }
+  size_t size = (size_t) file_stat.st_size;
+  if (size < store->size) {
+    fprintf(stderr, RED ">>> %d <<< [Server Error] Job file was truncated, no longer following it.\n" RESET,
+            getpid());
+    return -1;
+  }
+  if (size > store->map_size) {
+    fprintf(stderr, RED ">>> %d <<< [Server Error] Job file outgrew follow mode (%llu bytes).\n" RESET, getpid(),
+            (unsigned long long) store->map_size);
+    return -1;
+  }
+  store->size = size;
+  return 0;
+}
+
+/**
+* Checksum the jobs walked since the last call and make them servable
+* (utility method). Jobs may end in the middle of a chunk; the rest of
+* the chunk is filled in and published later.
+* @store     store following its file
+* @indexed   number of jobs walked
+*/
+static void publish_followed(struct JobStore *store, size_t indexed) {
+  size_t ready = store->ready_jobs;
+  if (ready == indexed)
+    return;
+  while (ready < indexed) {
+    size_t chunk = ready / INDEX_CHUNK_JOBS;
+    unsigned int first = (unsigned int) (ready % INDEX_CHUNK_JOBS);
+    unsigned int count = INDEX_CHUNK_JOBS - first;
+    if (count > indexed - ready)
+      count = (unsigned int) (indexed - ready);
+    hash_jobs(store, chunk, first, count);
+    ready += count;
+  }
+  pthread_mutex_lock(&store->lock);
+  __atomic_store_n(&store->ready_jobs, ready, __ATOMIC_RELEASE);
+  pthread_mutex_unlock(&store->lock);
+  notify_watchers(store);
+}
+
+/**
+* Double the chunk table of a followed file (utility method). Readers
+* may still be looking at the old table, so it is kept until the store
+* is closed.
+* @store   store following its file
+* Return 0 on success, -1 if the table cannot grow.
+*/
+static int grow_followed_index(struct JobStore *store) {
+  size_t limit = (store->map_size / 5) / INDEX_CHUNK_JOBS + 1;
+  size_t count = (store->max_chunks * 2 < limit) ? store->max_chunks * 2 : limit;
+  if (count == store->max_chunks || store->retired_count == MAX_RETIRED_INDEXES)
+    return -1;
+  struct JobEntry **chunks = (struct JobEntry **) calloc(count, sizeof(struct JobEntry *));
+  if (!chunks)
+    return -1;
+  if (store->chunk_packed) { // only the index thread touches it
+    struct PackedArena **packed = (struct PackedArena **) realloc(store->chunk_packed,
+                                                                   count * sizeof(struct PackedArena *));
+    if (!packed) {
+      free(chunks);
+      return -1;
+    }
+    memset(packed + store->max_chunks, 0, (count - store->max_chunks) * sizeof(struct PackedArena *));
+    store->chunk_packed = packed;
+  }
+  memcpy(chunks, store->chunks, store->max_chunks * sizeof(struct JobEntry *));
+
+  pthread_mutex_lock(&store->lock);
+  store->retired[store->retired_count++] = store->chunks;
+  __atomic_store_n(&store->chunks, chunks, __ATOMIC_RELEASE);
+  store->max_chunks = count;
+  pthread_mutex_unlock(&store->lock);
+  return 0;
+}
+
+/**
+* Walk a file that is still being written, publishing jobs as soon as
+* they are complete. A job whose header or text is cut short is left
+* for later; the walk carries on from its start once the file grows.
+* Runs until the store is closed or the file turns invalid.
+* @arg   store to index
+*/
+static void *follow_jobs(void *arg) {
+  struct JobStore *store = (struct JobStore *) arg;
+  size_t position = 0;
+  size_t indexed = 0;
+  trace_attach();
+
+  while (!__atomic_load_n(&store->stopping, __ATOMIC_RELAXED)) {
+    struct JobEntry entry;
+    size_t next = position;
+    int status = next_job(store, &next, &entry);
+    if (status == -1) {
+      fprintf(stderr, ">>> %d <<< Invalid job encountered in file (offset %zu).\n", getpid(), position);
+      break;
+    }
+    if (status == 1) {
+      publish_followed(store, indexed);
+      if (wait_for_growth(store))
+        break;
+      continue;
+    }
+
+    size_t chunk = indexed / INDEX_CHUNK_JOBS;
+    if (chunk == store->max_chunks && grow_followed_index(store))
+      break;
+    if (!store->chunks[chunk]) {
+      store->chunks[chunk] = (struct JobEntry *) malloc(sizeof(struct JobEntry) * INDEX_CHUNK_JOBS);
+      if (!store->chunks[chunk])
+        break;
+    }
+    store->chunks[chunk][indexed % INDEX_CHUNK_JOBS] = entry;
+    position = next;
+    if (++indexed % INDEX_CHUNK_JOBS == 0)
+      publish_followed(store, indexed);
+  }
+
+  if (debug)
+    printf(">>> %d <<< Stopped following job file (%zu bytes).\n", getpid(), position);
+  if (__atomic_load_n(&store->stopping, __ATOMIC_RELAXED))
+    return NULL; // the event loops are gone, nobody is waiting
+  publish_followed(store, indexed);
+  pthread_mutex_lock(&store->lock);
+  store->walk_done = 1;
+  __atomic_store_n(&store->complete, 1, __ATOMIC_RELEASE);
+  pthread_mutex_unlock(&store->lock);
+  notify_watchers(store);
+  return NULL;
+}
+
+/**
+* Checksum thread entry point.
+* @arg   store to index
+*/
+static void *hash_worker(void *arg) {
+  trace_attach();
+  hash_chunks((struct JobStore *) arg);
+  return NULL;
+}
+
+
+/*=============================== STORE METHODS ==============================*/
+
+/**
+* Map a job file into memory. To follow a file that is still being
+* written, FOLLOW_MAP_SIZE bytes of address space are mapped up front:
+* appended pages become readable in place, so job texts never move.
+* @store    store to prepare
+* @path     job file to map
+* @follow   1 to keep indexing jobs appended to the file
+* Return 0 on success, -1 on error.
+*/
+int job_store_open(struct JobStore *store, const char *path, int follow) {
+  memset(store, 0, sizeof(*store));
+  store->inotify_fd = -1;
+  store->stop_fd = -1;
+  store->fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (store->fd == -1) {
+    perror(RED "[Server Error] Failed to open job file" RESET);
+    return -1;
+  }
+
+  struct stat file_stat;
+  if (fstat(store->fd, &file_stat)) {
+    perror(RED "[Server Error] Failed to inspect job file" RESET);
+    close(store->fd);
+    return -1;
+  }
+  store->size = (size_t) file_stat.st_size;
+  store->map_size = follow ? FOLLOW_MAP_SIZE : store->size;
+  if (follow && store->size > store->map_size) {
+    fprintf(stderr, RED ">>> %d <<< [Server Error] Job file is too large to follow.\n" RESET, getpid());
+    close(store->fd);
+    return -1;
+  }
+
+  if (store->map_size) {
+    void *map = mmap(NULL, store->map_size, PROT_READ, MAP_SHARED, store->fd, 0);
+    if (map == MAP_FAILED) {
+      perror(RED "[Server Error] Failed to map job file" RESET);
+      close(store->fd);
+      return -1;
+    }
+    store->map = (const char *) map;
+  }
+
+  // the file's identity and first bytes, so a rewritten file gets a new token
+  uint64_t identity[2] = { (uint64_t) file_stat.st_dev, (uint64_t) file_stat.st_ino };
+  size_t sampled = (store->size < TOKEN_SAMPLE_BYTES) ? store->size : TOKEN_SAMPLE_BYTES;
+  store->token = ((uint64_t) checksum_crc32c(identity, sizeof(identity)) << 32) |
+                 checksum_crc32c(store->map, sampled);
+
+  if (jobc_detect(store->map, store->size)) {
+    struct JobcHeader header;
+    if (jobc_read_header((const unsigned char *) store->map, store->size, &header)) {
+      fprintf(stderr, RED ">>> %d <<< [Server Error] Compiled job file is damaged or of another version.\n" RESET,
+              getpid());
+      job_store_close(store);
+      return -1;
+    }
+    store->framed = 1;
+    store->job_count = header.job_count;
+    store->table_offset = header.table_offset;
+    store->frames_offset = header.frames_offset;
+    store->frames_size = header.frames_size;
+    if (debug)
+      printf(">>> %d <<< Compiled job file with %llu job(s).\n", getpid(), (unsigned long long) header.job_count);
+  }
+
+  if (follow && store->framed) {
+    fprintf(stderr, RED ">>> %d <<< [Server Error] Compiled job files cannot be followed.\n" RESET, getpid());
+    job_store_close(store);
+    return -1;
+  }
+  if (follow) {
+    store->follow = 1;
+    store->inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    store->stop_fd = eventfd(0, EFD_CLOEXEC);
+    if (store->inotify_fd == -1 || store->stop_fd == -1 ||
+        inotify_add_watch(store->inotify_fd, path, IN_MODIFY) == -1) {
+      perror(RED "[Server Error] Failed to watch job file" RESET);
+      job_store_close(store);
+      return -1;
+    }
+  }
+
+  if (store->framed)
+    store->max_chunks = store->job_count / INDEX_CHUNK_JOBS + 1;
+  else
+    store->max_chunks = (store->size / 5) / INDEX_CHUNK_JOBS + 1;
+  if (follow && store->max_chunks < FOLLOW_INDEX_CHUNKS)
+    store->max_chunks = FOLLOW_INDEX_CHUNKS; // grows with the file, see grow_followed_index()
+  store->chunks = (struct JobEntry **) calloc(store->max_chunks, sizeof(struct JobEntry *));
+  if (!follow) {
+    store->chunk_jobs = (unsigned int *) calloc(store->max_chunks, sizeof(unsigned int));
+    store->chunk_done = (unsigned char *) calloc(store->max_chunks, sizeof(unsigned char));
+  }
+  if (!store->chunks || (!follow && (!store->chunk_jobs || !store->chunk_done))) {
+    fprintf(stderr, RED ">>> %d <<< [Server Error] Failed to allocate job index.\n" RESET, getpid());
+    job_store_close(store);
+    return -1;
+  }
+  pthread_mutex_init(&store->lock, NULL);
+  pthread_cond_init(&store->walked, NULL);
+  return 0;
+}
+
+/**
+* Turn on compression of stored jobs. Must be called before
+* job_store_start(). In COMPRESS_DICT mode the dictionary is trained
+* here, on job texts taken evenly from the whole file, so this walks the
+* job boundaries once before indexing starts.
+* @store   store to compress
+* @mode    COMPRESS_NONE, COMPRESS_FAST or COMPRESS_DICT
+* Return 0 on success, -1 on error.
+*/
+int job_store_compress(struct JobStore *store, int mode) {
+  store->compression = mode;
+  if (mode == COMPRESS_NONE)
+    return 0;
+  store->chunk_packed = (struct PackedArena **) calloc(store->max_chunks, sizeof(struct PackedArena *));
+  if (!store->chunk_packed) {
+    fprintf(stderr, RED ">>> %d <<< [Server Error] Failed to allocate job index.\n" RESET, getpid());
+    return -1;
+  }
+  if (mode != COMPRESS_DICT)
+    return 0;
+
+  unsigned char *samples = (unsigned char *) malloc(CODEC_SAMPLE_BYTES);
+  if (!samples) {
+    fprintf(stderr, RED ">>> %d <<< [Server Error] Failed to allocate dictionary samples.\n" RESET, getpid());
+    return -1;
+  }
+  // take a job whenever fewer bytes were sampled than its position calls for
+  size_t sampled = 0;
+  size_t cursor = 0;
+  struct JobEntry entry;
+  while (sampled < CODEC_SAMPLE_BYTES && !next_job(store, &cursor, &entry)) {
+    if ((uint64_t) sampled * store->size <= (uint64_t) entry.offset * CODEC_SAMPLE_BYTES) {
+      size_t taken = (entry.length < CODEC_SAMPLE_BYTES - sampled) ? entry.length : CODEC_SAMPLE_BYTES - sampled;
+      memcpy(samples + sampled, store->map + entry.offset, taken);
+      sampled += taken;
+    }
+  }
+
+  int status = codec_dict_train(&store->dict, samples, sampled, CODEC_DICT_SIZE);
+  free(samples);
+  if (status) {
+    fprintf(stderr, RED ">>> %d <<< [Server Error] Failed to train compression dictionary.\n" RESET, getpid());
+    return -1;
+  }
+  if (debug)
+    printf(">>> %d <<< Trained %zu byte dictionary on %zu bytes of job text.\n", getpid(), store->dict.length,
+           sampled);
+  return 0;
+}
+
+/**
+* Register an eventfd to be written whenever more jobs become servable.
+* Must be called before job_store_start().
+* @store      store to watch
+* @event_fd   eventfd to write to
+* Return 0 on success, -1 if there are too many watchers.
+*/
+int job_store_watch(struct JobStore *store, int event_fd) {
+  if (store->watcher_count == MAX_STORE_WATCHERS)
+    return -1;
+  store->watchers[store->watcher_count++] = event_fd;
+  return 0;
+}
+
+/**
+* Start indexing in the background.
+* @store     store to index
+* @threads   number of index threads (small files always use one)
+* Return 0 on success, -1 on error.
+*/
+int job_store_start(struct JobStore *store, int threads) {
+  if (threads < 1 || store->size < PARALLEL_INDEX_BYTES)
+    threads = 1;
+  if ((store->framed && store->compression == COMPRESS_NONE) || store->follow)
+    threads = 1; // nothing to checksum, or jobs trickle in
+  if (threads > MAX_INDEX_THREADS)
+    threads = MAX_INDEX_THREADS;
+  store->thread_count = threads;
+  if (debug)
+    printf(">>> %d <<< Indexing job file with %d thread(s), %s checksums.\n", getpid(), threads, checksum_engine());
+
+  for (int i = 0; i < threads; i++) {
+    if (pthread_create(&store->threads[i], NULL, i ? hash_worker : (store->follow ? follow_jobs : walk_jobs), store)) {
+      fprintf(stderr, RED ">>> %d <<< [Server Error] Failed to start index thread.\n" RESET, getpid());
+      store->thread_count = i;
+      return -1;
+    }
+  }
+  return 0;
+}
+
+/**
+* Look up one job.
+* @store   store to look in
+* @index   job number, starting at 0
+* @entry   filled in with the job's position, length, type and checksum
+* Return 0 if found, 1 if not indexed yet, -1 if past the last job.
+*/
+int job_store_get(struct JobStore *store, size_t index, struct JobEntry *entry) {
+  int complete = __atomic_load_n(&store->complete, __ATOMIC_ACQUIRE);
+  size_t ready = __atomic_load_n(&store->ready_jobs, __ATOMIC_ACQUIRE);
+  if (index >= ready)
+    return complete ? -1 : 1;
+  struct JobEntry **chunks = __atomic_load_n(&store->chunks, __ATOMIC_ACQUIRE); // after ready_jobs
+  *entry = chunks[index / INDEX_CHUNK_JOBS][index % INDEX_CHUNK_JOBS];
+  return 0;
+}
+
+/**
+* Locate the text of an indexed job in the mapped file.
+* @store   store the job belongs to
+* @entry   indexed job
+* Return pointer to the first byte of the text (not NUL-terminated).
+*/
+const char *job_store_text(struct JobStore *store, struct JobEntry *entry) {
+  return store->map + entry->offset;
+}
+
+/**
+* Wake every event loop waiting for jobs, e.g. when jobs are handed out
+* again by the dispatcher.
+* @store   store whose watchers to wake
+*/
+void job_store_notify(struct JobStore *store) {
+  notify_watchers(store);
+}
+
+/**
+* Stop indexing, unmap the file and free the index.
+* @store   store to close
+*/
+void job_store_close(struct JobStore *store) {
+  __atomic_store_n(&store->stopping, 1, __ATOMIC_RELAXED);
+  if (store->stop_fd != -1) {
+    uint64_t one = 1;
+    if (write(store->stop_fd, &one, sizeof(one)) != sizeof(one))
+      perror("[Server Warning] Failed to stop following job file");
+  }
+  for (int i = 0; i < store->thread_count; i++)
+    pthread_join(store->threads[i], NULL);
+  store->thread_count = 0;
+  if (store->chunks) {
+    for (size_t i = 0; i < store->max_chunks; i++)
+      free(store->chunks[i]);
+  }
+  if (store->chunk_packed) {
+    for (size_t i = 0; i < store->max_chunks; i++) {
+      while (store->chunk_packed[i]) {
+        struct PackedArena *next = store->chunk_packed[i]->next;
+        free(store->chunk_packed[i]);
+        store->chunk_packed[i] = next;
+      }
+    }
+  }
+  free(store->chunk_packed);
+  store->chunk_packed = NULL;
+  codec_dict_free(&store->dict);
+  free(store->chunks);
+  for (int i = 0; i < store->retired_count; i++)
+    free(store->retired[i]); // their chunks are in the current table
+  store->retired_count = 0;
+  free(store->chunk_jobs);
+  free(store->chunk_done);
+  store->chunks = NULL;
+  if (store->map)
+    munmap((void *) store->map, store->map_size);
+  store->map = NULL;
+  if (store->inotify_fd != -1)
+    close(store->inotify_fd);
+  if (store->stop_fd != -1)
+    close(store->stop_fd);
+  store->inotify_fd = -1;
+  store->stop_fd = -1;
+  close(store->fd);
+}
@@ -0,0 +1,106 @@
+#ifndef JOB_STORE_H
+#define JOB_STORE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <pthread.h>
+
+#include "codec.h"
+#include "job_format.h"
+
+/* Memory-mapped job file with an index of every job in it.
+   One thread walks the job boundaries (a jump per job); the job texts are
+   checksummed by a pool of threads one chunk at a time (see checksum.h). A job can be
+   served as soon as every chunk up to and including its own is done, so
+   the server starts sending before large files are fully indexed.
+   Compiled job files (see job_format.h) are walked through their table
+   and come with checksums, so only compression is left for the threads.
+   A followed file is indexed by one thread that waits for appended jobs
+   and publishes them as they complete.
+   With compression on, the threads also keep a compressed copy of every
+   job that shrinks, so sending it costs no more than sending the text. */
+
+#define INDEX_CHUNK_JOBS 256
+#define MAX_INDEX_THREADS 8
+#define PARALLEL_INDEX_BYTES (4 * 1024 * 1024) // smaller files use one thread
+#define MAX_STORE_WATCHERS 64
+// compression of stored jobs (see COMPRESSION in protocol.txt)
+#define COMPRESS_NONE 0
+#define COMPRESS_FAST 1      // each job on its own
+#define COMPRESS_DICT 2      // with a dictionary trained on the job file
+#define PACK_MIN_LENGTH 32   // shorter texts are not worth compressing
+#define FOLLOW_MAP_SIZE (16ULL * 1024 * 1024 * 1024) // largest file follow mode can take
+#define FOLLOW_INDEX_CHUNKS 64   // initial chunk table of a followed file, doubled as it grows
+#define MAX_RETIRED_INDEXES 32   // outgrown chunk tables, enough to double up to FOLLOW_MAP_SIZE
+#define TOKEN_SAMPLE_BYTES 4096 // bytes at the start of the file the session token covers
+
+struct JobEntry {
+  uint64_t offset;         // position of the job text in the file
+  uint32_t length;         // text length in bytes
+  unsigned char type;      // TYPE_O or TYPE_E
+  unsigned char checksum;  // sum of text bytes % 32
+  uint32_t crc32c;         // CRC32C of the text, sent to clients that ask for it
+  const unsigned char *packed; // payload of a 'Z' frame for the job, NULL if not compressed
+  uint32_t packed_length;
+};
+
+/* Compressed payloads of a run of jobs in one chunk. */
+struct PackedArena {
+  struct PackedArena *next;     // other runs of the same chunk
+};
+
+struct JobStore {
+  int fd;
+  const char *map;
+  size_t size;                  // grows while a file is followed
+  size_t map_size;              // mapped bytes, more than the file while following
+  int framed;                   // compiled job file: every text sits inside its frame
+  uint64_t token;               // identifies the file to clients resuming a session
+  uint64_t job_count;           // the rest is only set for compiled job files
+  uint64_t table_offset;
+  uint64_t frames_offset;
+  uint64_t frames_size;
+
+  struct JobEntry **chunks;     // read with __atomic_load_n; only replaced, never changed in place
+  unsigned int *chunk_jobs;     // jobs in each chunk, not used while following
+  unsigned char *chunk_done;    // checksums computed, not used while following
+  size_t max_chunks;
+  struct JobEntry **retired[MAX_RETIRED_INDEXES]; // chunk tables a followed file outgrew,
+  int retired_count;                               // kept for readers until the store is closed
+
+  size_t ready_jobs;            // jobs servable, read with __atomic_load_n
+  int complete;                 // set once ready_jobs is final
+
+  pthread_mutex_t lock;
+  pthread_cond_t walked;
+  size_t chunks_walked;
+  size_t next_hash;
+  size_t next_publish;
+  int walk_done;
+  int stopping;                 // set by job_store_close() to cut a walk short
+
+  pthread_t threads[MAX_INDEX_THREADS];
+  int thread_count;
+
+  int watchers[MAX_STORE_WATCHERS]; // eventfds written when jobs are published
+  int watcher_count;
+
+  int compression;              // COMPRESS_NONE, COMPRESS_FAST or COMPRESS_DICT
+  struct CodecDict dict;        // trained in COMPRESS_DICT mode
+  struct PackedArena **chunk_packed; // compressed jobs of each chunk, back to back
+
+  int follow;                   // index jobs appended to the file (see follow_jobs())
+  int inotify_fd;               // reports changes to the followed file
+  int stop_fd;                  // eventfd written by job_store_close()
+};
+
+int job_store_open(struct JobStore *store, const char *path, int follow);
+int job_store_compress(struct JobStore *store, int mode);
+int job_store_watch(struct JobStore *store, int event_fd);
+int job_store_start(struct JobStore *store, int threads);
+int job_store_get(struct JobStore *store, size_t index, struct JobEntry *entry);
+const char *job_store_text(struct JobStore *store, struct JobEntry *entry);
+void job_store_notify(struct JobStore *store);
+void job_store_close(struct JobStore *store);
+
+#endif
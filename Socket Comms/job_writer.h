@@ -0,0 +1,60 @@
+#ifndef JOB_WRITER_H
+#define JOB_WRITER_H
+
+#include <stddef.h>
+#include <string.h>
+#include <unistd.h>
+
+/* Buffered output of the tools that write job files (jobc and jobgen).
+   Bytes are collected in one buffer and written when it is full, so a
+   file of many small jobs takes few write() calls. */
+
+#define WRITE_BUFFER_SIZE (1024 * 1024)
+
+/* Output file written through one buffer. */
+struct Output {
+  int fd;
+  unsigned char *buffer; // WRITE_BUFFER_SIZE bytes
+  size_t length;         // bytes buffered
+};
+
+/**
+* Write everything buffered to the output file.
+* @out   output file
+* Return 0 on success, -1 on failure.
+*/
+static inline int output_flush(struct Output *out) {
+  size_t written = 0;
+  while (written < out->length) {
+    ssize_t written_currently = write(out->fd, out->buffer + written, out->length - written);
+    if (written_currently == -1)
+      return -1;
+    written += written_currently;
+  }
+  out->length = 0;
+  return 0;
+}
+
+/**
+* Append bytes to the output file.
+* @out      output file
+* @data     bytes to write
+* @length   number of bytes
+* Return 0 on success, -1 on failure.
+*/
+static inline int output_write(struct Output *out, const void *data, size_t length) {
+  const unsigned char *bytes = (const unsigned char *) data;
+  while (length) {
+    if (out->length == WRITE_BUFFER_SIZE && output_flush(out))
+      return -1;
+    size_t room = WRITE_BUFFER_SIZE - out->length;
+    size_t taken = (length < room) ? length : room;
+    memcpy(out->buffer + out->length, bytes, taken);
+    out->length += taken;
+    bytes += taken;
+    length -= taken;
+  }
+  return 0;
+}
+
+#endif
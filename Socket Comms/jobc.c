@@ -0,0 +1,235 @@
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <arpa/inet.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "protocol.h"
+#include "checksum.h"
+#include "job_format.h"
+#include "job_writer.h"
+
+#define RED   "\x1B[31m"
+#define RESET "\x1B[0m"
+
+int debug = 0; // 0 for regular use, 1 for debug mode
+
+int usage(int argc, char *argv[]);
+int parse_job(const unsigned char *map, size_t size, size_t position, unsigned char *job_type, uint32_t *text_length);
+int count_jobs(const unsigned char *map, size_t size, uint64_t *jobs, uint64_t *frames_size);
+int compile(const unsigned char *map, size_t size, const char *path);
+
+/**
+* Print instructions.
+* @argc  number of arguments to main
+* @argv  array of arguments to main
+* Return 1 on insufficient number of arguments, 0 otherwise.
+*/
+int usage(int argc, char *argv[]) {
+  if (argc < 3) {
+    printf("Usage: %s [filename.job] [filename.jobc]\n", argv[0]);
+    printf("Debug: %s [filename.job] [filename.jobc] -debug\n", argv[0]);
+    printf("Compiles a job file into the indexed format the server maps and sends as it is.\n");
+    return 1;
+  }
+  return 0;
+}
+
+int main(int argc, char *argv[]) {
+  if (usage(argc, argv))
+    return EXIT_SUCCESS;
+  for (int i = 3; i < argc; i++) {
+    if (!strcmp(argv[i], "-debug") || !strcmp(argv[i], "--debug")) {
+      debug = 1;
+    } else {
+      fprintf(stderr, RED ">>> %d <<< [Compiler Error] Unknown option \"%s\".\n" RESET, getpid(), argv[i]);
+      return EXIT_FAILURE;
+    }
+  }
+
+  int fd = open(argv[1], O_RDONLY | O_CLOEXEC);
+  if (fd == -1) {
+    perror(RED "[Compiler Error] Failed to open job file" RESET);
+    return EXIT_FAILURE;
+  }
+  struct stat file_stat;
+  if (fstat(fd, &file_stat)) {
+    perror(RED "[Compiler Error] Failed to inspect job file" RESET);
+    close(fd);
+    return EXIT_FAILURE;
+  }
+  size_t size = (size_t) file_stat.st_size;
+  const unsigned char *map = NULL;
+  if (size) {
+    void *mapped = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (mapped == MAP_FAILED) {
+      perror(RED "[Compiler Error] Failed to map job file" RESET);
+      close(fd);
+      return EXIT_FAILURE;
+    }
+    madvise(mapped, size, MADV_SEQUENTIAL);
+    map = (const unsigned char *) mapped;
+  }
+  if (jobc_detect(map, size)) {
+    fprintf(stderr, RED ">>> %d <<< [Compiler Error] \"%s\" is already compiled.\n" RESET, getpid(), argv[1]);
+    munmap((void *) map, size);
+    close(fd);
+    return EXIT_FAILURE;
+  }
+
+  int status = compile(map, size, argv[2]);
+  if (map)
+    munmap((void *) map, size);
+  close(fd);
+  if (status) {
+    unlink(argv[2]);
+    return EXIT_FAILURE;
+  }
+  return EXIT_SUCCESS;
+}
+
+/**
+* Parse the header of the job at a file position. Unlike the server,
+* the compiler takes texts of any length that fits in the file.
+* @map           job file
+* @size          size of the job file
+* @position      offset of the header
+* @job_type      filled in with TYPE_O or TYPE_E
+* @text_length   filled in with the text length
+* Return 0 on success, -1 if there is no valid job at the position.
+*/
+int parse_job(const unsigned char *map, size_t size, size_t position, unsigned char *job_type, uint32_t *text_length) {
+  if (size - position < 5)
+    return -1;
+  if (map[position] == 'O')
+    *job_type = (unsigned char) TYPE_O;
+  else if (map[position] == 'E')
+    *job_type = (unsigned char) TYPE_E;
+  else
+    return -1;
+  *text_length = 0;
+  for (int i = 0; i < 4; i++) {
+    // unaffected by endianness due to bit shifting
+    *text_length += ((uint32_t) map[position + 1 + i] << 8*i);
+  }
+  if (*text_length > size - position - 5)
+    return -1;
+  return 0;
+}
+
+/**
+* Count the jobs of a job file and the space their frames take.
+* @map           job file
+* @size          size of the job file
+* @jobs          filled in with the number of jobs
+* @frames_size   filled in with the size of all frames
+* Return 0 on success, -1 if the file holds an invalid job.
+*/
+int count_jobs(const unsigned char *map, size_t size, uint64_t *jobs, uint64_t *frames_size) {
+  size_t position = 0;
+  *jobs = 0;
+  *frames_size = 0;
+  while (position < size) {
+    unsigned char job_type;
+    uint32_t text_length;
+    if (parse_job(map, size, position, &job_type, &text_length)) {
+      fprintf(stderr, RED ">>> %d <<< [Compiler Error] Invalid job encountered in file (offset %zu).\n" RESET,
+              getpid(), position);
+      return -1;
+    }
+    (*jobs)++;
+    *frames_size += 5 + text_length + (text_length ? 1 : 0);
+    position += 5 + text_length;
+  }
+  return 0;
+}
+
+/**
+* Write a compiled job file: header, table, then every job as a frame.
+* @map    job file
+* @size   size of the job file
+* @path   file to write
+* Return 0 on success, -1 on error.
+*/
+int compile(const unsigned char *map, size_t size, const char *path) {
+  struct JobcHeader header;
+  memset(&header, 0, sizeof(header));
+  header.version = JOBC_VERSION;
+  if (count_jobs(map, size, &header.job_count, &header.frames_size))
+    return -1;
+  header.table_offset = JOBC_HEADER_SIZE;
+  header.frames_offset = JOBC_HEADER_SIZE + header.job_count * JOBC_ENTRY_SIZE;
+  if (debug)
+    printf(">>> %d <<< Compiling %llu job(s), %s checksums.\n", getpid(), (unsigned long long) header.job_count,
+           checksum_engine());
+
+  unsigned char *table = (unsigned char *) calloc(header.job_count ? header.job_count : 1, JOBC_ENTRY_SIZE);
+  if (!table) {
+    fprintf(stderr, RED ">>> %d <<< [Compiler Error] Failed to allocate job table.\n" RESET, getpid());
+    return -1;
+  }
+  size_t position = 0;
+  uint64_t frame = 0;
+  for (uint64_t i = 0; i < header.job_count; i++) {
+    unsigned char job_type;
+    uint32_t text_length;
+    parse_job(map, size, position, &job_type, &text_length);
+    const unsigned char *text = map + position + 5;
+    unsigned char *entry = table + i * JOBC_ENTRY_SIZE;
+    jobc_put64(entry + JOBC_FRAME_OFFSET_AT, frame);
+    jobc_put32(entry + JOBC_TEXT_LENGTH_AT, text_length);
+    jobc_put32(entry + JOBC_TEXT_CRC_AT, checksum_crc32c(text, text_length));
+    entry[JOBC_JOB_INFO_AT] = (unsigned char) ((job_type << 5) + checksum_text(text, text_length));
+    frame += 5 + text_length + (text_length ? 1 : 0);
+    position += 5 + text_length;
+  }
+  header.table_crc = checksum_crc32c(table, header.job_count * JOBC_ENTRY_SIZE);
+
+  struct Output out;
+  out.length = 0;
+  out.buffer = (unsigned char *) malloc(WRITE_BUFFER_SIZE);
+  out.fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (!out.buffer || out.fd == -1) {
+    perror(RED "[Compiler Error] Failed to create compiled file" RESET);
+    if (out.fd != -1)
+      close(out.fd);
+    free(out.buffer);
+    free(table);
+    return -1;
+  }
+
+  unsigned char header_bytes[JOBC_HEADER_SIZE];
+  jobc_write_header(header_bytes, &header);
+  int status = output_write(&out, header_bytes, sizeof(header_bytes)) ||
+               output_write(&out, table, header.job_count * JOBC_ENTRY_SIZE);
+  position = 0;
+  for (uint64_t i = 0; i < header.job_count && !status; i++) {
+    const unsigned char *entry = table + i * JOBC_ENTRY_SIZE;
+    uint32_t text_length = jobc_get32(entry + JOBC_TEXT_LENGTH_AT);
+    struct JobMessage frame_header;
+    frame_header.job_info = entry[JOBC_JOB_INFO_AT];
+    frame_header.text_length = htonl(text_length);
+    status = output_write(&out, &frame_header, sizeof(char) + sizeof(int)) ||
+             output_write(&out, map + position + 5, text_length) ||
+             (text_length && output_write(&out, "", sizeof(char)));
+    position += 5 + text_length;
+  }
+  status = status || output_flush(&out) || fsync(out.fd);
+  if (close(out.fd))
+    status = -1;
+  free(out.buffer);
+  free(table);
+  if (status) {
+    perror(RED "[Compiler Error] Failed to write compiled file" RESET);
+    return -1;
+  }
+
+  printf(">>> %d <<< <Compiler Notification> Compiled %llu job(s) into \"%s\" (%llu bytes).\n", getpid(),
+         (unsigned long long) header.job_count, path,
+         (unsigned long long) (header.frames_offset + header.frames_size));
+  return 0;
+}
@@ -0,0 +1,332 @@
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <math.h>
+#include <time.h>
+
+#include "job_format.h"
+#include "job_writer.h"
+
+#define RED   "\x1B[31m"
+#define RESET "\x1B[0m"
+
+#define SIZE_FIXED 0
+#define SIZE_UNIFORM 1
+#define SIZE_LOGNORMAL 2
+
+#define TEXT_WORDS 0
+#define TEXT_RANDOM 1
+
+int debug = 0; // 0 for regular use, 1 for debug mode
+
+/* Command line options following the file name and job count. */
+struct GeneratorOptions {
+  int size_distribution; // SIZE_FIXED, SIZE_UNIFORM or SIZE_LOGNORMAL
+  long min_size;         // fixed size, or the smallest uniform size
+  long max_size;         // largest uniform size
+  long median_size;      // median of the lognormal distribution
+  double sigma;          // spread of the lognormal distribution
+  double error_percent;  // share of 'E' jobs
+  double empty_percent;  // share of jobs without text
+  int text;              // TEXT_WORDS or TEXT_RANDOM
+  uint64_t seed;
+};
+
+static const char *words[] = {
+  "the", "job", "server", "client", "queue", "file", "socket", "frame", "of", "and", "to", "in", "is", "for",
+  "that", "with", "on", "as", "data", "text", "sent", "read", "write", "request", "reply", "error", "output",
+  "process", "thread", "event", "loop", "buffer", "batch", "index", "chunk", "lease", "credit", "time", "byte",
+  "connection", "network", "message", "every", "one", "each", "from", "by", "at", "it", "be", "this", "not",
+  "more", "when", "will", "until", "after", "before", "again", "some", "all", "new", "old", "next"
+};
+#define WORD_COUNT (sizeof(words) / sizeof(words[0]))
+
+int usage(int argc, char *argv[]);
+int parse_options(int argc, char *argv[], struct GeneratorOptions *options);
+int parse_size(const char *spec, struct GeneratorOptions *options);
+uint64_t next_random(uint64_t *state);
+double random_unit(uint64_t *state);
+uint32_t pick_size(struct GeneratorOptions *options, uint64_t *state);
+void fill_text(unsigned char *text, uint32_t length, int kind, uint64_t *state);
+int generate(const char *path, long long jobs, struct GeneratorOptions *options);
+
+/**
+* Print instructions.
+* @argc  number of arguments to main
+* @argv  array of arguments to main
+* Return 1 on insufficient number of arguments, 0 otherwise.
+*/
+int usage(int argc, char *argv[]) {
+  if (argc < 3) {
+    printf("Usage: %s [filename.job] [jobs] [options]\n", argv[0]);
+    printf("Debug: %s [filename.job] [jobs] -debug\n", argv[0]);
+    printf("Writes a job file of synthetic jobs for benchmarks.\n");
+    printf("Options:\n");
+    printf("  --size DIST       text lengths: fixed:N, uniform:MIN-MAX or lognormal:MEDIAN[:SIGMA]\n");
+    printf("                    (default uniform:16-1024, at most %d)\n", MAX_TEXT_LENGTH);
+    printf("  --errors P        percentage of 'E' jobs (default 10)\n");
+    printf("  --empty P         percentage of jobs without text (default 0)\n");
+    printf("  --text KIND       words (compressible, default) or random\n");
+    printf("  --seed N          seed of the generator (default: time), same seed, same file\n");
+    return 1;
+  }
+  return 0;
+}
+
+int main(int argc, char *argv[]) {
+  if (usage(argc, argv))
+    return EXIT_SUCCESS;
+
+  char *endptr;
+  long long jobs = strtoll(argv[2], &endptr, 10);
+  if (endptr == argv[2] || *endptr || jobs < 0) {
+    fprintf(stderr, RED ">>> %d <<< [Generator Error] Invalid number of jobs \"%s\".\n" RESET, getpid(), argv[2]);
+    return EXIT_FAILURE;
+  }
+  struct GeneratorOptions options;
+  memset(&options, 0, sizeof(options));
+  options.size_distribution = SIZE_UNIFORM;
+  options.min_size = 16;
+  options.max_size = 1024;
+  options.sigma = 1.0;
+  options.error_percent = 10;
+  options.text = TEXT_WORDS;
+  options.seed = (uint64_t) time(NULL) ^ ((uint64_t) getpid() << 32);
+  if (parse_options(argc, argv, &options))
+    return EXIT_FAILURE;
+
+  if (generate(argv[1], jobs, &options)) {
+    unlink(argv[1]);
+    return EXIT_FAILURE;
+  }
+  return EXIT_SUCCESS;
+}
+
+/**
+* Parse options following the file name and job count.
+* @argc      number of arguments to main
+* @argv      array of arguments to main
+* @options   filled in with the requested options
+* Return 0 on success, -1 on an unknown or malformed option.
+*/
+int parse_options(int argc, char *argv[], struct GeneratorOptions *options) {
+  for (int i = 3; i < argc; i++) {
+    char *endptr = NULL;
+    if (!strcmp(argv[i], "-debug") || !strcmp(argv[i], "--debug")) {
+      debug = 1;
+    } else if (!strcmp(argv[i], "--size") && i + 1 < argc) {
+      if (parse_size(argv[++i], options)) {
+        fprintf(stderr, RED ">>> %d <<< [Generator Error] Invalid size distribution \"%s\".\n" RESET, getpid(),
+                argv[i]);
+        return -1;
+      }
+    } else if (!strcmp(argv[i], "--errors") && i + 1 < argc) {
+      options->error_percent = strtod(argv[++i], &endptr);
+      if (endptr == argv[i] || options->error_percent < 0 || options->error_percent > 100) {
+        fprintf(stderr, RED ">>> %d <<< [Generator Error] Invalid percentage of 'E' jobs.\n" RESET, getpid());
+        return -1;
+      }
+    } else if (!strcmp(argv[i], "--empty") && i + 1 < argc) {
+      options->empty_percent = strtod(argv[++i], &endptr);
+      if (endptr == argv[i] || options->empty_percent < 0 || options->empty_percent > 100) {
+        fprintf(stderr, RED ">>> %d <<< [Generator Error] Invalid percentage of empty jobs.\n" RESET, getpid());
+        return -1;
+      }
+    } else if (!strcmp(argv[i], "--text") && i + 1 < argc) {
+      i++;
+      if (!strcmp(argv[i], "words")) {
+        options->text = TEXT_WORDS;
+      } else if (!strcmp(argv[i], "random")) {
+        options->text = TEXT_RANDOM;
+      } else {
+        fprintf(stderr, RED ">>> %d <<< [Generator Error] Unknown kind of text \"%s\".\n" RESET, getpid(), argv[i]);
+        return -1;
+      }
+    } else if (!strcmp(argv[i], "--seed") && i + 1 < argc) {
+      options->seed = strtoull(argv[++i], &endptr, 10);
+      if (endptr == argv[i]) {
+        fprintf(stderr, RED ">>> %d <<< [Generator Error] Invalid seed.\n" RESET, getpid());
+        return -1;
+      }
+    } else {
+      fprintf(stderr, RED ">>> %d <<< [Generator Error] Unknown option \"%s\".\n" RESET, getpid(), argv[i]);
+      return -1;
+    }
+  }
+  return 0;
+}
+
+/**
+* Parse a size distribution: fixed:N, uniform:MIN-MAX or
+* lognormal:MEDIAN[:SIGMA].
+* @spec      distribution in string form
+* @options   filled in with the distribution
+* Return 0 on success, -1 if malformed or out of range.
+*/
+int parse_size(const char *spec, struct GeneratorOptions *options) {
+  char *endptr;
+  if (!strncmp(spec, "fixed:", 6)) {
+    options->size_distribution = SIZE_FIXED;
+    options->min_size = strtol(spec + 6, &endptr, 10);
+    return (endptr == spec + 6 || *endptr || options->min_size < 0 || options->min_size > MAX_TEXT_LENGTH) ? -1 : 0;
+  }
+  if (!strncmp(spec, "uniform:", 8)) {
+    options->size_distribution = SIZE_UNIFORM;
+    options->min_size = strtol(spec + 8, &endptr, 10);
+    if (endptr == spec + 8 || *endptr != '-')
+      return -1;
+    const char *max = endptr + 1;
+    options->max_size = strtol(max, &endptr, 10);
+    return (endptr == max || *endptr || options->min_size < 0 || options->max_size < options->min_size ||
+            options->max_size > MAX_TEXT_LENGTH) ? -1 : 0;
+  }
+  if (!strncmp(spec, "lognormal:", 10)) {
+    options->size_distribution = SIZE_LOGNORMAL;
+    options->median_size = strtol(spec + 10, &endptr, 10);
+    if (endptr == spec + 10 || options->median_size <= 0 || options->median_size > MAX_TEXT_LENGTH)
+      return -1;
+    if (*endptr == ':') {
+      const char *sigma = endptr + 1;
+      options->sigma = strtod(sigma, &endptr);
+      if (endptr == sigma || options->sigma < 0)
+        return -1;
+    }
+    return *endptr ? -1 : 0;
+  }
+  return -1;
+}
+
+/**
+* Next number of a xorshift64* generator.
+* @state   generator state, never 0
+* Return 64 random bits.
+*/
+uint64_t next_random(uint64_t *state) {
+  *state ^= *state >> 12;
+  *state ^= *state << 25;
+  *state ^= *state >> 27;
+  return *state * 0x2545F4914F6CDD1DULL;
+}
+
+/**
+* Random number in [0, 1).
+* @state   generator state
+*/
+double random_unit(uint64_t *state) {
+  return (double) (next_random(state) >> 11) / 9007199254740992.0; // 2^53
+}
+
+/**
+* Draw the length of the next job text.
+* @options   size distribution
+* @state     generator state
+* Return text length, at most MAX_TEXT_LENGTH.
+*/
+uint32_t pick_size(struct GeneratorOptions *options, uint64_t *state) {
+  if (options->size_distribution == SIZE_FIXED)
+    return (uint32_t) options->min_size;
+  if (options->size_distribution == SIZE_UNIFORM)
+    return (uint32_t) (options->min_size + next_random(state) % (uint64_t) (options->max_size - options->min_size + 1));
+
+  // Box-Muller transform of two uniform numbers into a normal one
+  double u = 1.0 - random_unit(state);
+  double v = random_unit(state);
+  double normal = sqrt(-2.0 * log(u)) * cos(2.0 * M_PI * v);
+  double size = (double) options->median_size * exp(options->sigma * normal);
+  if (size < 1)
+    return 1;
+  return (size > MAX_TEXT_LENGTH) ? MAX_TEXT_LENGTH : (uint32_t) size;
+}
+
+/**
+* Fill a job text with printable characters.
+* @text     text to fill
+* @length   text length
+* @kind     TEXT_WORDS for words and sentences, TEXT_RANDOM for random characters
+* @state    generator state
+*/
+void fill_text(unsigned char *text, uint32_t length, int kind, uint64_t *state) {
+  uint32_t filled = 0;
+  if (kind == TEXT_RANDOM) {
+    while (filled < length)
+      text[filled++] = (unsigned char) (' ' + next_random(state) % 95);
+    return;
+  }
+  int capital = 1;
+  while (filled < length) {
+    uint64_t bits = next_random(state);
+    const char *word = words[bits % WORD_COUNT];
+    for (size_t i = 0; word[i] && filled < length; i++)
+      text[filled++] = (unsigned char) ((capital && !i) ? word[i] - 'a' + 'A' : word[i]);
+    capital = 0;
+    if (filled < length && (bits >> 32) % 12 == 0) {
+      text[filled++] = '.';
+      capital = 1;
+    }
+    if (filled < length)
+      text[filled++] = ' ';
+  }
+}
+
+/**
+* Write a job file of synthetic jobs.
+* @path      file to write
+* @jobs      number of jobs
+* @options   what the jobs look like
+* Return 0 on success, -1 on error.
+*/
+int generate(const char *path, long long jobs, struct GeneratorOptions *options) {
+  uint64_t state = options->seed ? options->seed : 1;
+  if (debug)
+    printf(">>> %d <<< Generating %lld job(s) with seed %llu.\n", getpid(), jobs, (unsigned long long) state);
+
+  struct Output out;
+  out.length = 0;
+  out.buffer = (unsigned char *) malloc(WRITE_BUFFER_SIZE);
+  unsigned char *text = (unsigned char *) malloc(MAX_TEXT_LENGTH);
+  out.fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (!out.buffer || !text || out.fd == -1) {
+    perror(RED "[Generator Error] Failed to create job file" RESET);
+    if (out.fd != -1)
+      close(out.fd);
+    free(out.buffer);
+    free(text);
+    return -1;
+  }
+
+  int status = 0;
+  unsigned long long text_bytes = 0;
+  long long error_jobs = 0;
+  for (long long i = 0; i < jobs && !status; i++) {
+    unsigned char header[5];
+    uint32_t length = pick_size(options, &state);
+    if (random_unit(&state) * 100 < options->empty_percent)
+      length = 0;
+    header[0] = 'O';
+    if (random_unit(&state) * 100 < options->error_percent) {
+      header[0] = 'E';
+      error_jobs++;
+    }
+    for (int j = 0; j < 4; j++)
+      header[1 + j] = (unsigned char) (length >> 8*j); // little endian, as in every ".job" file
+    fill_text(text, length, options->text, &state);
+    status = output_write(&out, header, sizeof(header)) || output_write(&out, text, length);
+    text_bytes += length;
+  }
+  status = status || output_flush(&out);
+  if (close(out.fd))
+    status = -1;
+  free(out.buffer);
+  free(text);
+  if (status) {
+    perror(RED "[Generator Error] Failed to write job file" RESET);
+    return -1;
+  }
+
+  printf(">>> %d <<< <Generator Notification> Wrote %lld job(s), %lld of them 'E', with %llu bytes of text"
+         " into \"%s\".\n", getpid(), jobs, error_jobs, text_bytes, path);
+  return 0;
+}
@@ -0,0 +1,611 @@
+#include <netdb.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <stdint.h>
+#include <pthread.h>
+
+#include "protocol.h"
+#include "recv_buffer.h"
+#include "histogram.h"
+
+#define RED   "\x1B[31m"
+#define RESET "\x1B[0m"
+
+#define MAX_LOAD_CONNECTIONS 4096
+#define LOAD_RECV_BUFFER_SIZE (256 * 1024)
+#define LOAD_POLL_MS 200         // how often a waiting connection checks whether to stop
+#define LOAD_ACK_JOBS 32         // acknowledge dispatched jobs at least this often
+#define LOAD_CAPABILITIES (CAP_BATCH | CAP_REQUEST_IDS | CAP_LEASES)
+
+int debug = 0; // 0 for regular use, 1 for debug mode
+int interrupted = 0; // switches to 1 if interrupt is caught
+
+/* Command line options following the server address and port. */
+struct LoadOptions {
+  int connections;
+  long duration_ms;    // run this long, 0 for a fixed number of rounds
+  long rounds;         // passes over the job file per connection
+  long request_jobs;   // jobs asked for by each FETCH_ID
+  int depth;           // requests kept in flight
+  int batch;           // batch limit, 0 for no batches
+  int crc32c;          // ask for CRC32C trailers
+  int compress;        // accept compressed jobs
+};
+
+/* A request whose jobs have not all arrived yet. */
+struct Pending {
+  uint64_t sent;       // when it was sent, in nanoseconds
+  uint64_t jobs;       // jobs still expected
+};
+
+/* One simulated client, run by its own thread. */
+struct LoadClient {
+  pthread_t thread;
+  int number;
+  int sock;
+  struct RecvBuffer in;
+  uint32_t capabilities;   // agreed in the HELLO exchange
+  struct Pending pending[MAX_PIPELINED_REQUESTS];
+  int head;
+  int count;
+  uint64_t next_id;
+  unsigned long unacked;   // leased jobs not acknowledged yet
+  struct Histogram latency; // request sent to job received, in nanoseconds
+  unsigned long long jobs;
+  unsigned long long bytes;
+  unsigned long connects;
+  unsigned long busy;      // connections the server turned down
+  unsigned long rounds;    // passes that ended with a type 'Q' job
+  int status;
+};
+
+struct LoadOptions options;
+struct sockaddr_in server_address;
+uint64_t deadline;   // when to stop in duration mode, in nanoseconds
+
+int usage(int argc, char *argv[]);
+int parse_options(int argc, char *argv[]);
+int parse_number(char *number_string);
+int prepare_address(struct sockaddr_in *serveraddr, char *host_addr, int port);
+uint64_t now_ns(void);
+int should_stop(void);
+void *run_client(void *arg);
+int open_session(struct LoadClient *client);
+int run_session(struct LoadClient *client);
+int send_all(int sock, const void *data, size_t length);
+int send_fetch_id(struct LoadClient *client);
+int send_ack(struct LoadClient *client);
+int count_job(struct LoadClient *client, uint64_t received);
+int receive_frame(struct LoadClient *client, size_t size);
+void report(struct LoadClient *clients, uint64_t elapsed);
+void handler(int signal_number);
+
+/**
+* Print instructions.
+* @argc  number of arguments to main
+* @argv  array of arguments to main
+* Return 1 on insufficient number of arguments, 0 otherwise.
+*/
+int usage(int argc, char *argv[]) {
+  if (argc < 3) {
+    printf("Usage: %s [server address] [port] [options]\n", argv[0]);
+    printf("Debug: %s [server address] [port] -debug\n", argv[0]);
+    printf("Drives a server with many clients and reports throughput and per-job latency.\n");
+    printf("Options:\n");
+    printf("  --connections N   clients connected at once (default 1, at most %d)\n", MAX_LOAD_CONNECTIONS);
+    printf("  --duration S      run for S seconds, reconnecting whenever the jobs run out\n");
+    printf("  --rounds N        otherwise, passes over the job file per client (default 1)\n");
+    printf("  --request N       jobs asked for by each request (default 64)\n");
+    printf("  --depth N         requests kept in flight (default 2, at most %d)\n", MAX_PIPELINED_REQUESTS);
+    printf("  --batch N         accept batches of up to N jobs (default: no batches)\n");
+    printf("  --crc32c          ask for CRC32C trailers (not checked)\n");
+    printf("  --compress        accept compressed jobs (not decompressed)\n");
+    printf("Latency is the time from sending a request to receiving each of its jobs.\n");
+    return 1;
+  }
+  return 0;
+}
+
+int main(int argc, char *argv[]) {
+  if (usage(argc, argv))
+    return EXIT_SUCCESS;
+
+  options.connections = 1;
+  options.rounds = 1;
+  options.request_jobs = 64;
+  options.depth = 2;
+  if (parse_options(argc, argv))
+    return EXIT_FAILURE;
+  int port = parse_number(argv[2]);
+  if (port <= 0 || port > 65535 || prepare_address(&server_address, argv[1], port) != 1) {
+    fprintf(stderr, RED ">>> %d <<< [Load Error] Failed to resolve server address.\n" RESET, getpid());
+    return EXIT_FAILURE;
+  }
+
+  struct sigaction sa;
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = handler;
+  sigaction(SIGINT, &sa, NULL);
+  sa.sa_handler = SIG_IGN;
+  sigaction(SIGPIPE, &sa, NULL);
+
+  struct LoadClient *clients = (struct LoadClient *) calloc(options.connections, sizeof(struct LoadClient));
+  if (!clients) {
+    fprintf(stderr, RED ">>> %d <<< [Load Error] Failed to allocate clients.\n" RESET, getpid());
+    return EXIT_FAILURE;
+  }
+  uint64_t start = now_ns();
+  if (options.duration_ms)
+    deadline = start + (uint64_t) options.duration_ms * 1000000;
+  int started = 0;
+  for (; started < options.connections; started++) {
+    clients[started].number = started;
+    if (pthread_create(&clients[started].thread, NULL, run_client, &clients[started])) {
+      perror(RED "[Load Error] Failed to start client thread" RESET);
+      interrupted = 1;
+      break;
+    }
+  }
+  int status = (started < options.connections) ? -1 : 0;
+  for (int i = 0; i < started; i++) {
+    pthread_join(clients[i].thread, NULL);
+    if (clients[i].status)
+      status = -1;
+  }
+  report(clients, now_ns() - start);
+  free(clients);
+  return status ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+/**
+* Parse options following the server address and port.
+* @argc   number of arguments to main
+* @argv   array of arguments to main
+* Return 0 on success, -1 on an unknown or malformed option.
+*/
+int parse_options(int argc, char *argv[]) {
+  for (int i = 3; i < argc; i++) {
+    if (!strcmp(argv[i], "-debug") || !strcmp(argv[i], "--debug")) {
+      debug = 1;
+    } else if (!strcmp(argv[i], "--connections") && i + 1 < argc) {
+      options.connections = parse_number(argv[++i]);
+      if (options.connections <= 0 || options.connections > MAX_LOAD_CONNECTIONS) {
+        fprintf(stderr, RED ">>> %d <<< [Load Error] Number of connections must be 1 - %d.\n" RESET, getpid(),
+                MAX_LOAD_CONNECTIONS);
+        return -1;
+      }
+    } else if (!strcmp(argv[i], "--duration") && i + 1 < argc) {
+      char *endptr;
+      double seconds = strtod(argv[++i], &endptr);
+      if (endptr == argv[i] || seconds <= 0) {
+        fprintf(stderr, RED ">>> %d <<< [Load Error] Invalid duration.\n" RESET, getpid());
+        return -1;
+      }
+      options.duration_ms = (long) (seconds * 1000);
+    } else if (!strcmp(argv[i], "--rounds") && i + 1 < argc) {
+      options.rounds = parse_number(argv[++i]);
+      if (options.rounds <= 0) {
+        fprintf(stderr, RED ">>> %d <<< [Load Error] Invalid number of rounds.\n" RESET, getpid());
+        return -1;
+      }
+    } else if (!strcmp(argv[i], "--request") && i + 1 < argc) {
+      options.request_jobs = parse_number(argv[++i]);
+      if (options.request_jobs <= 0) {
+        fprintf(stderr, RED ">>> %d <<< [Load Error] Invalid number of jobs per request.\n" RESET, getpid());
+        return -1;
+      }
+    } else if (!strcmp(argv[i], "--depth") && i + 1 < argc) {
+      options.depth = parse_number(argv[++i]);
+      if (options.depth <= 0 || options.depth > MAX_PIPELINED_REQUESTS) {
+        fprintf(stderr, RED ">>> %d <<< [Load Error] Depth must be 1 - %d.\n" RESET, getpid(),
+                MAX_PIPELINED_REQUESTS);
+        return -1;
+      }
+    } else if (!strcmp(argv[i], "--batch") && i + 1 < argc) {
+      options.batch = parse_number(argv[++i]);
+      if (options.batch < 0 || options.batch > BATCH_MAX_JOBS) {
+        fprintf(stderr, RED ">>> %d <<< [Load Error] Batch limit must be 0 - %d.\n" RESET, getpid(), BATCH_MAX_JOBS);
+        return -1;
+      }
+    } else if (!strcmp(argv[i], "--crc32c")) {
+      options.crc32c = 1;
+    } else if (!strcmp(argv[i], "--compress")) {
+      options.compress = 1;
+    } else {
+      fprintf(stderr, RED ">>> %d <<< [Load Error] Unknown option \"%s\".\n" RESET, getpid(), argv[i]);
+      return -1;
+    }
+  }
+  return 0;
+}
+
+/**
+* Serve as one client: connect, fetch jobs until they run out, and
+* start over until the rounds are done or the time is up.
+* @arg   client to run
+*/
+void *run_client(void *arg) {
+  struct LoadClient *client = (struct LoadClient *) arg;
+  if (recv_init(&client->in, -1, LOAD_RECV_BUFFER_SIZE)) {
+    fprintf(stderr, RED ">>> %d <<< [Load Error] Failed to allocate receive buffer.\n" RESET, getpid());
+    client->status = -1;
+    return NULL;
+  }
+  while (!should_stop() && (options.duration_ms || client->rounds < (unsigned long) options.rounds)) {
+    int status = open_session(client);
+    if (status == 1) {
+      struct timespec pause = { 0, 10 * 1000000 }; // server is full, try again shortly
+      nanosleep(&pause, NULL);
+      continue;
+    }
+    unsigned long long jobs = client->jobs;
+    if (!status)
+      status = run_session(client);
+    if (client->sock != -1) {
+      unsigned char stop = (unsigned char) STOP_REQUEST;
+      send_all(client->sock, &stop, sizeof(stop));
+      close(client->sock);
+      client->sock = -1;
+    }
+    if (status == -1) {
+      if (!should_stop())
+        client->status = -1;
+      break;
+    }
+    if (status == 0 && client->jobs == jobs)
+      break; // nothing left for this client, as with a dispatching server
+  }
+  recv_free(&client->in);
+  return NULL;
+}
+
+/**
+* Connect to the server and agree on protocol version 2.
+* @client   client to connect
+* Return 0 on success, 1 if the server is busy, -1 on error.
+*/
+int open_session(struct LoadClient *client) {
+  client->sock = socket(PF_INET, SOCK_STREAM, IPPROTO_TCP);
+  if (client->sock == -1) {
+    perror(RED "[Load Error] Failed to create socket" RESET);
+    return -1;
+  }
+  struct timeval timeout = { 0, LOAD_POLL_MS * 1000 };
+  setsockopt(client->sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+  int nodelay = 1; // requests are small and latency is what is measured
+  setsockopt(client->sock, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+  if (connect(client->sock, (struct sockaddr *) &server_address, sizeof(server_address)) == -1) {
+    perror(RED "[Load Error] Failed to connect to server" RESET);
+    return -1;
+  }
+  client->connects++;
+  client->in.fd = client->sock;
+  client->in.start = 0;
+  client->in.end = 0;
+  client->head = 0;
+  client->count = 0;
+  client->unacked = 0;
+
+  if (receive_frame(client, 1))
+    return -1;
+  unsigned char available = (unsigned char) *recv_peek(&client->in);
+  recv_consume(&client->in, 1);
+  if (available) {
+    client->busy++;
+    close(client->sock);
+    client->sock = -1;
+    return 1;
+  }
+
+  unsigned char request[3 + VARINT_MAX_SIZE];
+  uint32_t capabilities = LOAD_CAPABILITIES | (options.crc32c ? CAP_CRC32C : 0) |
+                          (options.compress ? (CAP_COMPRESS | CAP_DICTIONARY) : 0);
+  request[0] = (unsigned char) EXTENDED_REQUEST;
+  request[1] = (unsigned char) EXT_HELLO;
+  request[2] = (unsigned char) PROTOCOL_VERSION;
+  size_t size = 3 + varint_encode(capabilities, request + 3);
+  if (send_all(client->sock, request, size) || receive_frame(client, sizeof(char) + sizeof(int)))
+    return -1;
+  unsigned char *frame = (unsigned char *) recv_peek(&client->in);
+  uint32_t length;
+  memcpy(&length, frame + 1, sizeof(uint32_t));
+  length = ntohl(length);
+  if ((frame[0] >> 5) != TYPE_C || length < 3 || length > 2 + VARINT_MAX_SIZE ||
+      receive_frame(client, sizeof(char) + sizeof(int) + length)) {
+    fprintf(stderr, RED ">>> %d <<< [Load Error] Malformed HELLO reply.\n" RESET, getpid());
+    return -1;
+  }
+  frame = (unsigned char *) recv_peek(&client->in);
+  uint64_t agreed;
+  if (frame[5] != CTRL_HELLO || varint_decode(frame + 7, length - 2, &agreed) <= 0) {
+    fprintf(stderr, RED ">>> %d <<< [Load Error] Malformed HELLO reply.\n" RESET, getpid());
+    return -1;
+  }
+  recv_consume(&client->in, sizeof(char) + sizeof(int) + length);
+  client->capabilities = (uint32_t) agreed;
+  if (debug && client->connects == 1)
+    printf(">>> %d <<< Client %d agreed on capabilities 0x%x.\n", getpid(), client->number,
+           (unsigned int) client->capabilities);
+
+  if ((client->capabilities & CAP_BATCH) && options.batch > 1) {
+    unsigned char batch[2 + sizeof(uint32_t)];
+    uint32_t limit = htonl((uint32_t) options.batch);
+    batch[0] = (unsigned char) EXTENDED_REQUEST;
+    batch[1] = (unsigned char) EXT_BATCH;
+    memcpy(batch + 2, &limit, sizeof(limit));
+    if (send_all(client->sock, batch, sizeof(batch)))
+      return -1;
+  }
+  if ((client->capabilities & CAP_CRC32C) && options.crc32c) {
+    unsigned char crc[2] = { EXTENDED_REQUEST, EXT_CRC32C };
+    if (send_all(client->sock, crc, sizeof(crc)))
+      return -1;
+  }
+  while (client->count < options.depth) {
+    if (send_fetch_id(client))
+      return -1;
+  }
+  return 0;
+}
+
+/**
+* Receive jobs until they run out or it is time to stop, keeping the
+* requested number of requests in flight.
+* @client   connected client
+* Return 0 once a type 'Q' job arrives, 1 if stopped early, -1 on error.
+*/
+int run_session(struct LoadClient *client) {
+  size_t header_size = sizeof(char) + sizeof(int);
+  size_t trailer = ((client->capabilities & CAP_CRC32C) && options.crc32c) ? CRC32C_TRAILER_SIZE : 0;
+  while (!should_stop()) {
+    int status = receive_frame(client, header_size);
+    if (status)
+      return status;
+    unsigned char *frame = (unsigned char *) recv_peek(&client->in);
+    int type = frame[0] >> 5;
+    uint32_t length;
+    memcpy(&length, frame + 1, sizeof(uint32_t));
+    length = ntohl(length);
+
+    if (type == TYPE_Q) {
+      recv_consume(&client->in, header_size);
+      client->bytes += header_size;
+      client->rounds++;
+      return (client->unacked && send_ack(client)) ? -1 : 0;
+    }
+    size_t size = header_size + length;
+    if ((type == TYPE_O || type == TYPE_E || type == TYPE_Z) && length)
+      size += 1 + trailer;
+    status = receive_frame(client, size);
+    if (status)
+      return status;
+    frame = (unsigned char *) recv_peek(&client->in);
+    uint64_t received = now_ns();
+
+    if (type == TYPE_C) {
+      if (frame[header_size] == CTRL_DONE && client->count) {
+        client->head = (client->head + 1) % MAX_PIPELINED_REQUESTS;
+        client->count--;
+        if ((client->unacked && send_ack(client)) || send_fetch_id(client))
+          return -1;
+      }
+    } else if (type == TYPE_B) {
+      size_t position = header_size;
+      while (position + header_size <= size) {
+        uint32_t job_length;
+        memcpy(&job_length, frame + position + 1, sizeof(uint32_t));
+        job_length = ntohl(job_length);
+        position += header_size + (job_length ? job_length + 1 + trailer : 0);
+        if (count_job(client, received))
+          return -1;
+      }
+    } else if (count_job(client, received)) {
+      return -1;
+    }
+    recv_consume(&client->in, size);
+    client->bytes += size;
+  }
+  return 1;
+}
+
+/**
+* Count one received job against the oldest request in flight.
+* @client     client that received the job
+* @received   when it was received, in nanoseconds
+* Return 0 on success, -1 if an acknowledgement could not be sent.
+*/
+int count_job(struct LoadClient *client, uint64_t received) {
+  client->jobs++;
+  if (client->count) {
+    struct Pending *pending = &client->pending[client->head];
+    histogram_record(&client->latency, received - pending->sent);
+    if (pending->jobs)
+      pending->jobs--;
+  }
+  if ((client->capabilities & CAP_LEASES) && ++client->unacked >= LOAD_ACK_JOBS)
+    return send_ack(client);
+  return 0;
+}
+
+/**
+* Wait until a whole frame (or the given number of bytes) is buffered.
+* @client   client to receive on
+* @size     bytes needed
+* Return 0 on success, 1 if it is time to stop, -1 on error.
+*/
+int receive_frame(struct LoadClient *client, size_t size) {
+  while (1) {
+    int status = recv_fill(&client->in, size);
+    if (!status)
+      return 0;
+    if (status == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+      if (should_stop())
+        return 1;
+      continue;
+    }
+    if (status == 1)
+      fprintf(stderr, RED ">>> %d <<< [Load Error] Server closed the connection.\n" RESET, getpid());
+    else
+      perror(RED "[Load Error] Failed to receive from server" RESET);
+    return -1;
+  }
+}
+
+/**
+* Ask for the next jobs with a FETCH_ID request and note when.
+* @client   client sending the request
+* Return 0 on success, -1 on failure.
+*/
+int send_fetch_id(struct LoadClient *client) {
+  unsigned char request[2 + 2 * VARINT_MAX_SIZE];
+  request[0] = (unsigned char) EXTENDED_REQUEST;
+  request[1] = (unsigned char) EXT_FETCH_ID;
+  size_t size = 2 + varint_encode(client->next_id++, request + 2);
+  size += varint_encode((uint64_t) options.request_jobs, request + size);
+  struct Pending *pending = &client->pending[(client->head + client->count) % MAX_PIPELINED_REQUESTS];
+  pending->sent = now_ns();
+  pending->jobs = (uint64_t) options.request_jobs;
+  client->count++;
+  return send_all(client->sock, request, size);
+}
+
+/**
+* Acknowledge every leased job received so far.
+* @client   client sending the acknowledgement
+* Return 0 on success, -1 on failure.
+*/
+int send_ack(struct LoadClient *client) {
+  unsigned char request[2 + VARINT_MAX_SIZE];
+  request[0] = (unsigned char) EXTENDED_REQUEST;
+  request[1] = (unsigned char) EXT_ACK;
+  size_t size = 2 + varint_encode(client->unacked, request + 2);
+  client->unacked = 0;
+  return send_all(client->sock, request, size);
+}
+
+/**
+* Send a whole request.
+* @sock     send to this socket
+* @data     request bytes
+* @length   number of bytes
+* Return 0 on success, -1 on failure.
+*/
+int send_all(int sock, const void *data, size_t length) {
+  const char *bytes = (const char *) data;
+  while (length) {
+    ssize_t sent = write(sock, bytes, length);
+    if (sent == -1 && errno == EINTR)
+      continue;
+    if (sent <= 0) {
+      if (!should_stop())
+        perror(RED "[Load Error] Failed to send request" RESET);
+      return -1;
+    }
+    bytes += sent;
+    length -= sent;
+  }
+  return 0;
+}
+
+/**
+* Print the totals of all clients.
+* @clients   clients that ran
+* @elapsed   time they ran, in nanoseconds
+*/
+void report(struct LoadClient *clients, uint64_t elapsed) {
+  struct Histogram *latency = (struct Histogram *) calloc(1, sizeof(struct Histogram));
+  if (!latency)
+    return;
+  unsigned long long jobs = 0, bytes = 0;
+  unsigned long connects = 0, busy = 0;
+  for (int i = 0; i < options.connections; i++) {
+    histogram_merge(latency, &clients[i].latency);
+    jobs += clients[i].jobs;
+    bytes += clients[i].bytes;
+    connects += clients[i].connects;
+    busy += clients[i].busy;
+  }
+  double seconds = (double) elapsed / 1e9;
+  printf(">>> %d <<< <Load Notification> %d client(s) received %llu job(s), %.1f MB in %.3f s.\n", getpid(),
+         options.connections, jobs, (double) bytes / 1e6, seconds);
+  printf("  throughput   %.0f jobs/s, %.1f MB/s\n", (double) jobs / seconds, (double) bytes / 1e6 / seconds);
+  printf("  latency      p50 %.1f us, p99 %.1f us, p999 %.1f us, max %.1f us, mean %.1f us\n",
+         histogram_percentile(latency, 50) / 1e3, histogram_percentile(latency, 99) / 1e3,
+         histogram_percentile(latency, 99.9) / 1e3, latency->max / 1e3,
+         latency->total ? (double) latency->sum / (double) latency->total / 1e3 : 0.0);
+  printf("  connections  %lu made, %lu turned down as busy\n", connects, busy);
+  free(latency);
+}
+
+/**
+* Whether the clients should stop: on interrupt, or once the time is up.
+* Return 1 if so, 0 otherwise.
+*/
+int should_stop(void) {
+  if (__atomic_load_n(&interrupted, __ATOMIC_RELAXED))
+    return 1;
+  return deadline && now_ns() >= deadline;
+}
+
+/**
+* Monotonic time.
+* Return nanoseconds since an arbitrary point.
+*/
+uint64_t now_ns(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t) now.tv_sec * 1000000000ULL + (uint64_t) now.tv_nsec;
+}
+
+/**
+* Parse a positive integer in string form.
+* @number_string  number to parse in string form
+* Return parsed number on sucess, -1 on failure.
+*/
+int parse_number(char *number_string) {
+  char *endptr;
+  int result = strtol(number_string, &endptr, 10);
+  if (endptr == number_string && result == 0)
+    result = -1;
+  return result;
+}
+
+/**
+* Prepare address struct (utility method).
+* @serveraddr  address struct to prepare
+* @host_addr   server's IP address or host name
+* @port        server's port
+* Return 1 if IP address is resolved, 0 if failed to resolve.
+*/
+int prepare_address(struct sockaddr_in *serveraddr, char *host_addr, int port) {
+  memset(serveraddr, 0, sizeof(*serveraddr));
+  serveraddr->sin_family = AF_INET;
+  int ip_status = inet_aton(host_addr, &(serveraddr->sin_addr));
+  if (!ip_status) { // DNS lookup
+    struct hostent *hostinfo;
+    if ((hostinfo = gethostbyname(host_addr)) == NULL)
+      return 0;
+    ip_status = 1;
+    serveraddr->sin_addr = *((struct in_addr *)hostinfo->h_addr_list[0]);
+  }
+  serveraddr->sin_port = htons(port);
+  return ip_status;
+}
+
+/**
+* Handle interrupt signal: every client stops at its next frame.
+* @signal_number   signal caught
+*/
+void handler(int signal_number) {
+  (void) signal_number;
+  __atomic_store_n(&interrupted, 1, __ATOMIC_RELAXED);
+}
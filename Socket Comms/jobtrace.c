@@ -0,0 +1,323 @@
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdint.h>
+
+#include "trace.h"
+
+#define RED   "\x1B[31m"
+#define RESET "\x1B[0m"
+
+int debug = 0; // 0 for regular use, 1 for debug mode
+
+/* Command line options following the trace file. */
+struct DecoderOptions {
+  int sock;            // only show events of this socket, -1 for all
+  int summary;         // print event counts instead of the timeline
+};
+
+/* One event of the timeline with the thread that recorded it. */
+struct TimedEvent {
+  struct TraceEvent event;
+  uint32_t thread;
+  uint64_t order;      // position in the file, keeps the order of equal times
+};
+
+static const char *type_names[TRACE_TYPES] = {
+  "?", "ACCEPT", "CLOSE", "REQUEST", "FRAME", "BATCH", "DONE", "WRITE_START", "WRITE_END", "PUBLISH", "WAKE", "CLAIM",
+  "SPAN", "PIPE"
+};
+
+int usage(int argc, char *argv[]);
+int parse_options(int argc, char *argv[], struct DecoderOptions *options);
+struct TimedEvent *load_trace(const char *path, struct TraceFileHeader *header, size_t *count);
+int compare_events(const void *first, const void *second);
+double event_ns(const struct TraceFileHeader *header, uint64_t time);
+void describe(const struct TraceEvent *event, char *text, size_t size);
+void print_timeline(const struct TraceFileHeader *header, struct TimedEvent *events, size_t count,
+                    struct DecoderOptions *options);
+void print_summary(const struct TraceFileHeader *header, struct TimedEvent *events, size_t count,
+                   struct DecoderOptions *options);
+
+/**
+* Print instructions.
+* @argc  number of arguments to main
+* @argv  array of arguments to main
+* Return 1 on insufficient number of arguments, 0 otherwise.
+*/
+int usage(int argc, char *argv[]) {
+  if (argc < 2) {
+    printf("Usage: %s [trace file] [options]\n", argv[0]);
+    printf("Prints the events a server or client started with --trace recorded, as one timeline.\n");
+    printf("Options:\n");
+    printf("  --sock N     only events of client socket N\n");
+    printf("  --summary    count events by type instead\n");
+    return 1;
+  }
+  return 0;
+}
+
+/**
+* Parse options following the trace file.
+* @argc      number of arguments to main
+* @argv      array of arguments to main
+* @options   filled in with the options
+* Return 0 on success, -1 on an unknown or malformed option.
+*/
+int parse_options(int argc, char *argv[], struct DecoderOptions *options) {
+  for (int i = 2; i < argc; i++) {
+    if (!strcmp(argv[i], "-debug") || !strcmp(argv[i], "--debug")) {
+      debug = 1;
+    } else if (!strcmp(argv[i], "--sock") && i + 1 < argc) {
+      char *end;
+      options->sock = (int) strtol(argv[++i], &end, 10);
+      if (*end || options->sock < 0) {
+        fprintf(stderr, RED "[Trace Error] Invalid socket \"%s\".\n" RESET, argv[i]);
+        return -1;
+      }
+    } else if (!strcmp(argv[i], "--summary")) {
+      options->summary = 1;
+    } else {
+      fprintf(stderr, RED "[Trace Error] Unknown option \"%s\".\n" RESET, argv[i]);
+      return -1;
+    }
+  }
+  return 0;
+}
+
+int main(int argc, char *argv[]) {
+  if (usage(argc, argv))
+    return EXIT_SUCCESS;
+
+  struct DecoderOptions options;
+  options.sock = -1;
+  options.summary = 0;
+  if (parse_options(argc, argv, &options))
+    return EXIT_FAILURE;
+
+  struct TraceFileHeader header;
+  size_t count;
+  struct TimedEvent *events = load_trace(argv[1], &header, &count);
+  if (!events)
+    return EXIT_FAILURE;
+  qsort(events, count, sizeof(struct TimedEvent), compare_events);
+  if (options.summary)
+    print_summary(&header, events, count, &options);
+  else
+    print_timeline(&header, events, count, &options);
+  free(events);
+  return EXIT_SUCCESS;
+}
+
+/**
+* Read every event of a trace file.
+* @path     trace file written by the server
+* @header   filled in with the file header
+* @count    filled in with the number of events
+* Return the events (free() them), NULL on error.
+*/
+struct TimedEvent *load_trace(const char *path, struct TraceFileHeader *header, size_t *count) {
+  FILE *file = fopen(path, "rb");
+  if (!file) {
+    perror(RED "[Trace Error] Failed to open trace file" RESET);
+    return NULL;
+  }
+  if (fread(header, sizeof(*header), 1, file) != 1 || memcmp(header->magic, TRACE_MAGIC, sizeof(header->magic)) ||
+      header->format != TRACE_FORMAT) {
+    fprintf(stderr, RED "[Trace Error] \"%s\" is not a trace file of this version.\n" RESET, path);
+    fclose(file);
+    return NULL;
+  }
+
+  struct TimedEvent *events = NULL;
+  size_t used = 0;
+  for (uint32_t ring = 0; ring < header->rings; ring++) {
+    struct TraceRingHeader ring_header;
+    if (fread(&ring_header, sizeof(ring_header), 1, file) != 1 || ring_header.events > TRACE_RING_EVENTS) {
+      fprintf(stderr, RED "[Trace Error] Trace file is cut short.\n" RESET);
+      break;
+    }
+    if (!ring_header.events)
+      continue;
+    struct TimedEvent *grown = (struct TimedEvent *) realloc(events, (used + ring_header.events) * sizeof(*events));
+    if (!grown) {
+      fprintf(stderr, RED "[Trace Error] Failed to allocate events.\n" RESET);
+      break;
+    }
+    events = grown;
+    if (debug)
+      printf("Thread %u: %u of %llu events kept.\n", ring_header.thread, ring_header.events,
+             (unsigned long long) ring_header.recorded);
+    uint32_t read_events = 0;
+    for (; read_events < ring_header.events; read_events++) {
+      struct TimedEvent *timed = &events[used];
+      if (fread(&timed->event, sizeof(timed->event), 1, file) != 1)
+        break;
+      timed->thread = ring_header.thread;
+      timed->order = used++;
+    }
+    if (read_events < ring_header.events) {
+      fprintf(stderr, RED "[Trace Error] Trace file is cut short.\n" RESET);
+      break;
+    }
+  }
+  fclose(file);
+  if (!events)
+    events = (struct TimedEvent *) malloc(sizeof(struct TimedEvent));
+  *count = used;
+  return events;
+}
+
+/**
+* Order events by time, then by their position in the file (qsort()).
+*/
+int compare_events(const void *first, const void *second) {
+  const struct TimedEvent *a = (const struct TimedEvent *) first;
+  const struct TimedEvent *b = (const struct TimedEvent *) second;
+  if (a->event.time != b->event.time)
+    return (a->event.time < b->event.time) ? -1 : 1;
+  return (a->order < b->order) ? -1 : (a->order > b->order);
+}
+
+/**
+* Convert an event time to nanoseconds since tracing started, using the
+* clock pairs taken when tracing started and when the trace was written.
+* @header   trace file header
+* @time     event time in ticks
+* Return nanoseconds, negative for events from before the start.
+*/
+double event_ns(const struct TraceFileHeader *header, uint64_t time) {
+  double ticks = (double) (header->dump_ticks - header->start_ticks);
+  double ns_per_tick = (ticks > 0) ? (double) (header->dump_ns - header->start_ns) / ticks : 1.0;
+  return ((double) time - (double) header->start_ticks) * ns_per_tick;
+}
+
+/**
+* Describe the arguments of an event.
+* @event   event to describe
+* @text    filled in with the description
+* @size    size of text
+*/
+void describe(const struct TraceEvent *event, char *text, size_t size) {
+  long long a = (long long) event->a, b = (long long) event->b;
+  switch (event->type) {
+  case TRACE_ACCEPT:
+    snprintf(text, size, "connections=%lld", a);
+    break;
+  case TRACE_CLOSE:
+    snprintf(text, size, "written=%lld", a);
+    break;
+  case TRACE_REQUEST:
+    snprintf(text, size, "opcode=%lld jobs=%lld", a, b);
+    break;
+  case TRACE_FRAME:
+    snprintf(text, size, "job=%lld bytes=%lld", a, b);
+    break;
+  case TRACE_BATCH:
+    snprintf(text, size, "jobs=%lld bytes=%lld", a, b);
+    break;
+  case TRACE_DONE:
+    snprintf(text, size, "id=%llu", (unsigned long long) event->a);
+    break;
+  case TRACE_WRITE_START:
+    snprintf(text, size, "queued=%lld", a);
+    break;
+  case TRACE_WRITE_END:
+    snprintf(text, size, "written=%lld%s", a, b ? " blocked" : "");
+    break;
+  case TRACE_PUBLISH:
+    snprintf(text, size, "ready=%lld", a);
+    break;
+  case TRACE_WAKE:
+    snprintf(text, size, "rescheduled=%lld", a);
+    break;
+  case TRACE_CLAIM:
+    snprintf(text, size, "first=%lld jobs=%lld", a, b);
+    break;
+  case TRACE_SPAN:
+    snprintf(text, size, "jobs=%lld bytes=%lld", a, b);
+    break;
+  case TRACE_PIPE:
+    snprintf(text, size, "bytes=%lld %s", a, b ? "read" : "written");
+    break;
+  default:
+    snprintf(text, size, "a=%lld b=%lld", a, b);
+  }
+}
+
+/**
+* Print events in time order, each with the time since the previous event
+* of the same socket (or thread, for events without a socket).
+* @header    trace file header
+* @events    events sorted by time
+* @count     number of events
+* @options   decoder options
+*/
+void print_timeline(const struct TraceFileHeader *header, struct TimedEvent *events, size_t count,
+                    struct DecoderOptions *options) {
+  double *last = NULL;  // time of the previous event, by socket
+  size_t last_size = 0;
+  printf("%14s %10s %8s %5s  %-12s %s\n", "time (us)", "+us", "thread", "sock", "event", "details");
+  for (size_t i = 0; i < count; i++) {
+    struct TraceEvent *event = &events[i].event;
+    if (options->sock != -1 && event->sock != options->sock)
+      continue;
+    double ns = event_ns(header, event->time);
+    char delta[32] = "";
+    if (event->sock >= 0) {
+      if ((size_t) event->sock >= last_size) {
+        size_t size = (size_t) event->sock * 2 + 64;
+        double *grown = (double *) realloc(last, size * sizeof(double));
+        if (!grown)
+          break;
+        for (size_t j = last_size; j < size; j++)
+          grown[j] = -1;
+        last = grown;
+        last_size = size;
+      }
+      if (last[event->sock] >= 0)
+        snprintf(delta, sizeof(delta), "%.3f", (ns - last[event->sock]) / 1000);
+      last[event->sock] = (event->type == TRACE_CLOSE) ? -1 : ns;
+    }
+
+    char details[96];
+    describe(event, details, sizeof(details));
+    const char *name = (event->type < TRACE_TYPES) ? type_names[event->type] : "?";
+    if (event->sock >= 0)
+      printf("%14.3f %10s %8u %5d  %-12s %s\n", ns / 1000, delta, events[i].thread, event->sock, name, details);
+    else
+      printf("%14.3f %10s %8u %5s  %-12s %s\n", ns / 1000, delta, events[i].thread, "-", name, details);
+  }
+  free(last);
+}
+
+/**
+* Print how many events of each type the trace holds and the time they span.
+* @header    trace file header
+* @events    events sorted by time
+* @count     number of events
+* @options   decoder options
+*/
+void print_summary(const struct TraceFileHeader *header, struct TimedEvent *events, size_t count,
+                   struct DecoderOptions *options) {
+  unsigned long long counts[TRACE_TYPES];
+  memset(counts, 0, sizeof(counts));
+  double first = 0, last = 0;
+  unsigned long long shown = 0;
+  for (size_t i = 0; i < count; i++) {
+    struct TraceEvent *event = &events[i].event;
+    if (options->sock != -1 && event->sock != options->sock)
+      continue;
+    double ns = event_ns(header, event->time);
+    if (!shown++)
+      first = ns;
+    last = ns;
+    counts[(event->type < TRACE_TYPES) ? event->type : 0]++;
+  }
+  printf("%llu events over %.3f ms\n", shown, (last - first) / 1e6);
+  for (int type = 0; type < TRACE_TYPES; type++) {
+    if (counts[type])
+      printf("  %-12s %llu\n", type_names[type], counts[type]);
+  }
+}
@@ -0,0 +1,347 @@
+#include "server_util.h"
+
+extern int debug;
+extern int interrupted;
+
+static struct LoopMetrics *loops[MAX_WORKERS];
+static int loop_count = 0;
+static struct FrameCache *frame_cache = NULL;
+static struct Broadcast *broadcast = NULL;
+
+/*=============================== COLLECTING =================================*/
+
+/**
+* Current monotonic time in nanoseconds.
+*/
+uint64_t now_ns(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t) now.tv_sec * 1000000000ULL + (uint64_t) now.tv_nsec;
+}
+
+/**
+* Make a loop's metrics part of every report. Loops register before the
+* server starts serving and stay registered until it exits.
+* @metrics   metrics of the loop
+* Return 0 on success, -1 if too many loops are registered.
+*/
+int metrics_register(struct LoopMetrics *metrics) {
+  int count = __atomic_load_n(&loop_count, __ATOMIC_ACQUIRE);
+  if (count == MAX_WORKERS)
+    return -1;
+  loops[count] = metrics;
+  __atomic_store_n(&loop_count, count + 1, __ATOMIC_RELEASE);
+  return 0;
+}
+
+/**
+* Make the frame cache part of every report, before the server starts
+* serving.
+* @cache   cache shared by the loops
+*/
+void metrics_register_cache(struct FrameCache *cache) {
+  frame_cache = cache;
+}
+
+/**
+* Make the broadcast ring part of every report, before the server starts
+* serving.
+* @ring   ring shared by the loops
+*/
+void metrics_register_broadcast(struct Broadcast *ring) {
+  broadcast = ring;
+}
+
+/**
+* Append to the report (utility method). Output that does not fit is cut.
+* @text     report
+* @used     bytes of the report written so far
+* @format   printf() format
+*/
+__attribute__((format(printf, 3, 4)))
+static void append(char *text, size_t *used, const char *format, ...) {
+  if (*used >= METRICS_TEXT_SIZE)
+    return;
+  va_list args;
+  va_start(args, format);
+  int written = vsnprintf(text + *used, METRICS_TEXT_SIZE - *used, format, args);
+  va_end(args);
+  if (written > 0)
+    *used += (size_t) written;
+  if (*used > METRICS_TEXT_SIZE)
+    *used = METRICS_TEXT_SIZE;
+}
+
+/**
+* Append one counter or gauge with its help and type lines (utility method).
+* @text    report
+* @used    bytes of the report written so far
+* @name    metric name
+* @type    "counter" or "gauge"
+* @help    description
+* @value   value
+*/
+static void append_metric(char *text, size_t *used, const char *name, const char *type, const char *help,
+                          uint64_t value) {
+  append(text, used, "# HELP %s %s\n# TYPE %s %s\n%s %llu\n", name, help, name, type, name,
+         (unsigned long long) value);
+}
+
+/**
+* Append a histogram as a summary with its median and tail quantiles
+* (utility method).
+* @text        report
+* @used        bytes of the report written so far
+* @name        metric name
+* @help        description
+* @histogram   recorded values
+* @scale       divisor turning recorded values into reported units
+*/
+static void append_summary(char *text, size_t *used, const char *name, const char *help,
+                           const struct Histogram *histogram, double scale) {
+  static const double quantiles[] = { 50, 90, 99, 99.9 };
+  append(text, used, "# HELP %s %s\n# TYPE %s summary\n", name, help, name);
+  for (size_t i = 0; i < sizeof(quantiles) / sizeof(quantiles[0]); i++)
+    append(text, used, "%s{quantile=\"%g\"} %g\n", name, quantiles[i] / 100,
+           (double) histogram_percentile(histogram, quantiles[i]) / scale);
+  append(text, used, "%s_sum %g\n%s_count %llu\n", name, (double) histogram->sum / scale, name,
+         (unsigned long long) histogram->total);
+}
+
+/**
+* Add up the metrics of every loop and render them in the Prometheus text
+* format.
+* @store    job store served, for the indexing progress
+* @length   filled in with the length of the report
+* Return the report (free() it), NULL on allocation failure.
+*/
+char *metrics_render(struct JobStore *store, size_t *length) {
+  char *text = (char *) malloc(METRICS_TEXT_SIZE);
+  struct LoopMetrics *total = (struct LoopMetrics *) calloc(1, sizeof(struct LoopMetrics));
+  if (!text || !total) {
+    free(text);
+    free(total);
+    return NULL;
+  }
+
+  int count = __atomic_load_n(&loop_count, __ATOMIC_ACQUIRE);
+  for (int i = 0; i < count; i++) {
+    struct LoopMetrics *loop = loops[i];
+    total->connections += __atomic_load_n(&loop->connections, __ATOMIC_RELAXED);
+    total->accepted += __atomic_load_n(&loop->accepted, __ATOMIC_RELAXED);
+    total->busy += __atomic_load_n(&loop->busy, __ATOMIC_RELAXED);
+    total->requests += __atomic_load_n(&loop->requests, __ATOMIC_RELAXED);
+    total->all_requests += __atomic_load_n(&loop->all_requests, __ATOMIC_RELAXED);
+    total->jobs_sent += __atomic_load_n(&loop->jobs_sent, __ATOMIC_RELAXED);
+    total->bytes_sent += __atomic_load_n(&loop->bytes_sent, __ATOMIC_RELAXED);
+    total->send_stalls += __atomic_load_n(&loop->send_stalls, __ATOMIC_RELAXED);
+    total->stall_ns += __atomic_load_n(&loop->stall_ns, __ATOMIC_RELAXED);
+    total->ring_jobs += __atomic_load_n(&loop->ring_jobs, __ATOMIC_RELAXED);
+    total->filtered += __atomic_load_n(&loop->filtered, __ATOMIC_RELAXED);
+    total->pool.in_use += __atomic_load_n(&loop->pool.in_use, __ATOMIC_RELAXED);
+    total->pool.cached += __atomic_load_n(&loop->pool.cached, __ATOMIC_RELAXED);
+    total->pool.allocations += __atomic_load_n(&loop->pool.allocations, __ATOMIC_RELAXED);
+    total->pool.reused += __atomic_load_n(&loop->pool.reused, __ATOMIC_RELAXED);
+    total->pool.refused += __atomic_load_n(&loop->pool.refused, __ATOMIC_RELAXED);
+    histogram_merge(&total->request_jobs, &loop->request_jobs);
+    histogram_merge(&total->request_latency, &loop->request_latency);
+  }
+
+  size_t used = 0;
+  append_metric(text, &used, "jobserver_connections", "gauge", "Clients connected now.", total->connections);
+  append_metric(text, &used, "jobserver_connections_accepted_total", "counter", "Clients accepted.",
+                total->accepted);
+  append_metric(text, &used, "jobserver_busy_rejections_total", "counter",
+                "Clients told that the server is busy.", total->busy);
+  append_metric(text, &used, "jobserver_requests_total", "counter", "Job requests received.", total->requests);
+  append_metric(text, &used, "jobserver_all_jobs_requests_total", "counter",
+                "Job requests for all jobs received.", total->all_requests);
+  append_metric(text, &used, "jobserver_jobs_sent_total", "counter", "Jobs queued for clients.", total->jobs_sent);
+  append_metric(text, &used, "jobserver_bytes_sent_total", "counter", "Bytes written to client sockets.",
+                total->bytes_sent);
+  append_metric(text, &used, "jobserver_jobs_filtered_total", "counter",
+                "Jobs not sent because a client's filter rejected them.", total->filtered);
+  append_metric(text, &used, "jobserver_send_stalls_total", "counter",
+                "Times a client socket would not take queued bytes.", total->send_stalls);
+  append(text, &used, "# HELP jobserver_send_stall_seconds_total Time spent waiting for such sockets.\n"
+         "# TYPE jobserver_send_stall_seconds_total counter\njobserver_send_stall_seconds_total %g\n",
+         (double) total->stall_ns / 1e9);
+  append_metric(text, &used, "jobserver_pool_bytes_in_use", "gauge",
+                "Bytes of connection state and out queues in use.", total->pool.in_use);
+  append_metric(text, &used, "jobserver_pool_bytes_cached", "gauge",
+                "Bytes kept on the pools' free lists for reuse.", total->pool.cached);
+  append_metric(text, &used, "jobserver_pool_allocations_total", "counter", "Blocks handed out by the pools.",
+                total->pool.allocations);
+  append_metric(text, &used, "jobserver_pool_reused_total", "counter",
+                "Blocks handed out from a free list instead of malloc().", total->pool.reused);
+  append_metric(text, &used, "jobserver_pool_refused_total", "counter",
+                "Allocations refused because of the memory cap.", total->pool.refused);
+  if (frame_cache) {
+    struct FrameCacheStats cache;
+    frame_cache_stats(frame_cache, &cache);
+    append_metric(text, &used, "jobserver_frame_cache_bytes", "gauge", "Bytes of job frames cached.", cache.bytes);
+    append_metric(text, &used, "jobserver_frame_cache_frames", "gauge", "Job frames cached.", cache.frames);
+    append_metric(text, &used, "jobserver_frame_cache_hits_total", "counter",
+                  "Large jobs sent from a cached frame.", cache.hits);
+    append_metric(text, &used, "jobserver_frame_cache_misses_total", "counter",
+                  "Large jobs whose frame had to be built.", cache.misses);
+    append_metric(text, &used, "jobserver_frame_cache_evictions_total", "counter",
+                  "Frames evicted to stay within the budget.", cache.evictions);
+  }
+  if (broadcast) {
+    struct BroadcastStats ring;
+    broadcast_stats(broadcast, &ring);
+    append_metric(text, &used, "jobserver_broadcast_jobs_sent_total", "counter",
+                  "Jobs sent from the broadcast ring, the rest came from the job file.", total->ring_jobs);
+    append_metric(text, &used, "jobserver_broadcast_frames_built_total", "counter",
+                  "Job frames built into the broadcast ring.", ring.built_jobs);
+    append_metric(text, &used, "jobserver_broadcast_ring_bytes", "gauge", "Bytes of frames the ring keeps.",
+                  ring.bytes);
+    append_metric(text, &used, "jobserver_broadcast_chunks_dropped_total", "counter",
+                  "Ring chunks dropped to make room for newer jobs.", ring.dropped_chunks);
+  }
+  append_metric(text, &used, "jobserver_jobs_indexed", "gauge", "Jobs indexed and ready to send.",
+                __atomic_load_n(&store->ready_jobs, __ATOMIC_ACQUIRE));
+  append_metric(text, &used, "jobserver_index_complete", "gauge", "1 once the whole job file is indexed.",
+                (uint64_t) __atomic_load_n(&store->complete, __ATOMIC_ACQUIRE));
+  append_summary(text, &used, "jobserver_request_jobs", "Jobs asked for per request, all-jobs requests aside.",
+                 &total->request_jobs, 1);
+  append_summary(text, &used, "jobserver_request_latency_seconds",
+                 "Time from receiving a request to writing its last byte.", &total->request_latency, 1e9);
+  free(total);
+  *length = used;
+  return text;
+}
+
+
+/*================================= ENDPOINT =================================*/
+
+/**
+* Answer one HTTP request on the metrics endpoint (utility method).
+* @endpoint   endpoint the client connected to
+* @client     accepted socket, closed by the caller
+*/
+static void serve_client(struct MetricsEndpoint *endpoint, int client) {
+  char request[1024];
+  size_t received = 0;
+  request[0] = '\0';
+  while (received < sizeof(request) - 1 && !strstr(request, "\r\n")) {
+    ssize_t count = recv(client, request + received, sizeof(request) - 1 - received, 0);
+    if (count <= 0)
+      return;
+    received += (size_t) count;
+    request[received] = '\0';
+  }
+  request[received] = '\0';
+
+  char header[128];
+  size_t length = 0;
+  char *text = NULL;
+  if (!strncmp(request, "GET /metrics ", 13) || !strncmp(request, "GET / ", 6))
+    text = metrics_render(endpoint->store, &length);
+  if (text)
+    snprintf(header, sizeof(header), "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\n"
+             "Content-Length: %zu\r\n\r\n", length);
+  else
+    snprintf(header, sizeof(header), "HTTP/1.0 404 Not Found\r\nContent-Length: 0\r\n\r\n");
+
+  struct iovec iov[2];
+  iov[0].iov_base = header;
+  iov[0].iov_len = strlen(header);
+  iov[1].iov_base = text;
+  iov[1].iov_len = length;
+  int iov_count = text ? 2 : 1;
+  struct iovec *next = iov;
+  while (iov_count) {
+    ssize_t written = writev(client, next, iov_count);
+    if (written <= 0)
+      break;
+    while (iov_count && (size_t) written >= next->iov_len) {
+      written -= next->iov_len;
+      next++;
+      iov_count--;
+    }
+    if (iov_count) {
+      next->iov_base = (char *) next->iov_base + written;
+      next->iov_len -= written;
+    }
+  }
+  free(text);
+}
+
+/**
+* Endpoint thread: answer scrapes one at a time until the server is
+* interrupted or the endpoint stopped.
+* @arg   endpoint to serve
+*/
+static void *serve_endpoint(void *arg) {
+  struct MetricsEndpoint *endpoint = (struct MetricsEndpoint *) arg;
+  while (__atomic_load_n(&endpoint->running, __ATOMIC_RELAXED) && !interrupted) {
+    struct pollfd listener;
+    listener.fd = endpoint->sock;
+    listener.events = POLLIN;
+    if (poll(&listener, 1, METRICS_POLL_MS) <= 0)
+      continue;
+    int client = accept4(endpoint->sock, NULL, NULL, SOCK_CLOEXEC);
+    if (client == -1)
+      continue;
+    struct timeval timeout = { 1, 0 }; // a stuck scraper must not hold up the next one
+    setsockopt(client, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    setsockopt(client, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+    serve_client(endpoint, client);
+    close(client);
+  }
+  return NULL;
+}
+
+/**
+* Listen for metrics scrapes on a localhost port.
+* @endpoint   endpoint to start
+* @port       port on 127.0.0.1
+* @store      job store served
+* Return 0 on success, -1 on error.
+*/
+int metrics_start(struct MetricsEndpoint *endpoint, int port, struct JobStore *store) {
+  memset(endpoint, 0, sizeof(*endpoint));
+  endpoint->store = store;
+  endpoint->sock = socket(PF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, IPPROTO_TCP);
+  if (endpoint->sock == -1) {
+    perror(RED "[Server Error] Could not create metrics socket" RESET);
+    return -1;
+  }
+  int enable = 1;
+  setsockopt(endpoint->sock, SOL_SOCKET, SO_REUSEADDR, &enable, sizeof(int));
+  struct sockaddr_in address;
+  memset(&address, 0, sizeof(address));
+  address.sin_family = AF_INET;
+  address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  address.sin_port = htons((unsigned short) port);
+  if (bind(endpoint->sock, (struct sockaddr *) &address, sizeof(address)) || listen(endpoint->sock, 16)) {
+    perror(RED "[Server Error] Failed to listen for metrics scrapes" RESET);
+    close(endpoint->sock);
+    return -1;
+  }
+
+  endpoint->running = 1;
+  if (pthread_create(&endpoint->thread, NULL, serve_endpoint, endpoint)) {
+    fprintf(stderr, RED ">>> %d <<< [Server Error] Failed to start metrics thread.\n" RESET, getpid());
+    close(endpoint->sock);
+    endpoint->running = 0;
+    return -1;
+  }
+  if (debug)
+    printf(">>> %d <<< Serving metrics on 127.0.0.1:%d.\n", getpid(), port);
+  return 0;
+}
+
+/**
+* Stop the metrics endpoint and close its socket.
+* @endpoint   endpoint to stop, may never have been started
+*/
+void metrics_stop(struct MetricsEndpoint *endpoint) {
+  if (!endpoint->running)
+    return;
+  __atomic_store_n(&endpoint->running, 0, __ATOMIC_RELAXED);
+  pthread_join(endpoint->thread, NULL);
+  close(endpoint->sock);
+}
@@ -0,0 +1,66 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <pthread.h>
+
+#include "histogram.h"
+#include "pool.h"
+
+/* Counters and histograms kept by every event loop. Each loop only writes
+   its own, with plain arithmetic and relaxed atomic stores, so keeping
+   them costs next to nothing; the STATS request and the metrics endpoint
+   add up all loops when they are read. They are reported in the
+   Prometheus text format (see METRICS in protocol.txt). */
+
+#define METRICS_TEXT_SIZE (8 * 1024)
+#define METRICS_POLL_MS 200        // how often the endpoint checks for interrupts
+
+struct JobStore;
+struct FrameCache;
+struct Broadcast;
+
+struct LoopMetrics {
+  uint64_t connections;         // clients connected now
+  uint64_t accepted;            // clients accepted
+  uint64_t busy;                // clients told that the server is busy
+  uint64_t requests;            // job requests received
+  uint64_t all_requests;        // of which for all jobs
+  uint64_t jobs_sent;           // jobs queued, including jobs in batches
+  uint64_t bytes_sent;          // bytes the sockets accepted
+  uint64_t send_stalls;         // times a socket would not take queued bytes
+  uint64_t stall_ns;            // time spent waiting for such sockets
+  uint64_t ring_jobs;           // of the jobs sent, jobs sent from the broadcast ring
+  uint64_t filtered;            // jobs passed over because the client's filter rejected them
+  struct Histogram request_jobs;    // jobs asked for per request, all-jobs requests aside
+  struct Histogram request_latency; // request received to its last byte written, in nanoseconds
+  struct PoolStats pool;        // connection state and out queue slots, kept by the loop's pool
+};
+
+/* Localhost HTTP endpoint serving the metrics on its own thread. */
+struct MetricsEndpoint {
+  int sock;
+  struct JobStore *store;
+  pthread_t thread;
+  int running;
+};
+
+/**
+* Add to a counter only the owning loop writes.
+* @counter   counter to add to
+* @value     amount to add
+*/
+static inline void metric_add(uint64_t *counter, uint64_t value) {
+  __atomic_store_n(counter, *counter + value, __ATOMIC_RELAXED);
+}
+
+int metrics_register(struct LoopMetrics *metrics);
+void metrics_register_cache(struct FrameCache *cache);
+void metrics_register_broadcast(struct Broadcast *ring);
+char *metrics_render(struct JobStore *store, size_t *length);
+int metrics_start(struct MetricsEndpoint *endpoint, int port, struct JobStore *store);
+void metrics_stop(struct MetricsEndpoint *endpoint);
+uint64_t now_ns(void);
+
+#endif
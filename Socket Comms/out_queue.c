@@ -0,0 +1,390 @@
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <sys/uio.h>
+#include <sys/socket.h>
+#include <sys/sendfile.h>
+#include <linux/errqueue.h>
+
+#include "out_queue.h"
+
+/**
+* Prepare an empty queue.
+* @queue   queue to prepare
+* @pool    pool the slot array is allocated from
+* Return 0 on success, -1 on allocation failure.
+*/
+int out_init(struct OutQueue *queue, struct Pool *pool) {
+  memset(queue, 0, sizeof(*queue));
+  queue->pool = pool;
+  queue->slots = (struct OutSegment *) pool_alloc(pool, sizeof(struct OutSegment) * OUT_INITIAL_SLOTS);
+  if (!queue->slots)
+    return -1;
+  queue->capacity = OUT_INITIAL_SLOTS;
+  return 0;
+}
+
+/**
+* Let go of what a segment's bytes belong to (utility method).
+* @segment   segment that was sent or dropped
+*/
+static void drop_owner(struct OutSegment *segment) {
+  if (segment->release)
+    segment->release(segment->owner);
+  else
+    free(segment->owner);
+  segment->owner = NULL;
+}
+
+/**
+* Release the head segment (utility method).
+* @queue   queue to advance
+*/
+static void release_head(struct OutQueue *queue) {
+  struct OutSegment *segment = &queue->slots[queue->head];
+  drop_owner(segment);
+  queue->pending_bytes -= segment->length - queue->head_sent;
+  queue->head = (queue->head + 1) % queue->capacity;
+  queue->count--;
+  queue->head_sent = 0;
+}
+
+/**
+* Drop every queued segment and the slot array.
+* @queue   queue to free
+*/
+void out_free(struct OutQueue *queue) {
+  while (queue->count)
+    release_head(queue);
+  pool_free(queue->pool, queue->slots);
+  queue->slots = NULL;
+  queue->capacity = 0;
+}
+
+/**
+* Double the number of slots, keeping queued segments in order.
+* @queue   queue to grow
+* Return 0 on success, -1 if the queue is at its maximum size or the
+* pool's memory cap is reached.
+*/
+static int grow(struct OutQueue *queue) {
+  if (queue->capacity >= OUT_MAX_SLOTS)
+    return -1;
+  unsigned int capacity = queue->capacity * 2;
+  struct OutSegment *slots = (struct OutSegment *) pool_alloc(queue->pool, sizeof(struct OutSegment) * capacity);
+  if (!slots)
+    return -1;
+  for (unsigned int i = 0; i < queue->count; i++)
+    slots[i] = queue->slots[(queue->head + i) % queue->capacity];
+  pool_free(queue->pool, queue->slots);
+  queue->slots = slots;
+  queue->capacity = capacity;
+  queue->head = 0;
+  return 0;
+}
+
+/**
+* Append a segment that refers to memory owned elsewhere.
+* @queue    append to this queue
+* @data     bytes to send (must stay valid until sent)
+* @length   number of bytes
+* @owner    pointer to free() once sent, or NULL
+* Return 0 on success, -1 if the queue is full.
+*/
+int out_push(struct OutQueue *queue, const void *data, size_t length, void *owner) {
+  if (queue->count == queue->capacity && grow(queue))
+    return -1;
+  struct OutSegment *segment = &queue->slots[(queue->head + queue->count) % queue->capacity];
+  segment->data = (const char *) data;
+  segment->length = length;
+  segment->owner = owner;
+  segment->release = NULL;
+  segment->kind = OUT_MEMORY;
+  queue->count++;
+  queue->pending_bytes += length;
+  return 0;
+}
+
+/**
+* Append a segment that refers to memory shared with other queues.
+* @queue     append to this queue
+* @data      bytes to send (must stay valid until sent)
+* @length    number of bytes
+* @owner     reference held by the segment
+* @release   called with owner once sent or dropped
+* Return 0 on success, -1 if the queue is full (owner is not released).
+*/
+int out_push_shared(struct OutQueue *queue, const void *data, size_t length, void *owner,
+                    void (*release)(void *owner)) {
+  if (out_push(queue, data, length, owner))
+    return -1;
+  queue->slots[(queue->head + queue->count - 1) % queue->capacity].release = release;
+  return 0;
+}
+
+/**
+* Append a small segment, copying its bytes into the queue.
+* @queue    append to this queue
+* @data     bytes to copy (at most OUT_INLINE_SIZE)
+* @length   number of bytes
+* Return 0 on success, -1 if the queue is full or the data too long.
+*/
+int out_push_copy(struct OutQueue *queue, const void *data, size_t length) {
+  if (length > OUT_INLINE_SIZE)
+    return -1;
+  if (out_push(queue, NULL, length, NULL))
+    return -1;
+  struct OutSegment *segment = &queue->slots[(queue->head + queue->count - 1) % queue->capacity];
+  memcpy(segment->inline_data, data, length);
+  return 0;
+}
+
+/**
+* Append a range of a file, to be sent with sendfile().
+* @queue    append to this queue
+* @fd       file to send from (must stay open until sent)
+* @offset   position of the first byte in the file
+* @length   number of bytes
+* Return 0 on success, -1 if the queue is full.
+*/
+int out_push_file(struct OutQueue *queue, int fd, off_t offset, size_t length) {
+  if (out_push(queue, NULL, length, NULL))
+    return -1;
+  struct OutSegment *segment = &queue->slots[(queue->head + queue->count - 1) % queue->capacity];
+  segment->kind = OUT_FILE;
+  segment->file_fd = fd;
+  segment->file_offset = offset;
+  return 0;
+}
+
+/**
+* Append memory to be sent with MSG_ZEROCOPY.
+* The memory must stay unchanged until the kernel reports completion,
+* which holds for the read-only job file mapping.
+* @queue    append to this queue
+* @data     bytes to send
+* @length   number of bytes
+* Return 0 on success, -1 if the queue is full.
+*/
+int out_push_zerocopy(struct OutQueue *queue, const void *data, size_t length) {
+  if (out_push(queue, data, length, NULL))
+    return -1;
+  queue->slots[(queue->head + queue->count - 1) % queue->capacity].kind = OUT_ZEROCOPY;
+  return 0;
+}
+
+/**
+* Number of segments that can still be appended. A queue the pool's
+* memory cap keeps from growing only offers the slots it has.
+* @queue   queue to check
+*/
+unsigned int out_space(struct OutQueue *queue) {
+  if (queue->capacity < OUT_MAX_SLOTS &&
+      !pool_fits(queue->pool, sizeof(struct OutSegment) * queue->capacity * 2))
+    return queue->capacity - queue->count;
+  return OUT_MAX_SLOTS - queue->count;
+}
+
+/**
+* Drop queued segments that have not started going out.
+* A partially written head is kept so the byte stream stays framed, and
+* so are segments an asynchronous send still refers to.
+* @queue   queue to truncate
+*/
+void out_truncate(struct OutQueue *queue) {
+  unsigned int keep = (queue->count && queue->head_sent) ? 1 : 0;
+  if (keep < queue->in_flight)
+    keep = queue->in_flight;
+  while (queue->count > keep) {
+    unsigned int last = (queue->head + queue->count - 1) % queue->capacity;
+    struct OutSegment *segment = &queue->slots[last];
+    drop_owner(segment);
+    queue->pending_bytes -= segment->length;
+    queue->count--;
+  }
+}
+
+/**
+* Account for bytes the socket accepted, releasing segments fully sent.
+* @queue     queue that was written from
+* @written   number of bytes accepted
+*/
+void out_consume(struct OutQueue *queue, size_t written) {
+  queue->written_bytes += written;
+  while (written > 0) {
+    struct OutSegment *segment = &queue->slots[queue->head];
+    size_t remaining = segment->length - queue->head_sent;
+    if (written >= remaining) {
+      written -= remaining;
+      release_head(queue);
+    } else {
+      queue->head_sent += written;
+      queue->pending_bytes -= written;
+      written = 0;
+    }
+  }
+  // zero-length segments (empty job texts) never reach the loop above
+  while (queue->count && queue->slots[queue->head].length == queue->head_sent)
+    release_head(queue);
+}
+
+/**
+* Write the file segment at the head of the queue (utility method).
+* @queue    queue to write from
+* @sock     socket to write to
+* @budget   maximum number of bytes to send
+* Return number of bytes written, -1 on error (errno set). A file cut
+* short under the segment is an error, as sendfile() would keep
+* returning 0.
+*/
+static ssize_t flush_file(struct OutQueue *queue, int sock, size_t budget) {
+  struct OutSegment *segment = &queue->slots[queue->head];
+  off_t offset = segment->file_offset + queue->head_sent;
+  size_t length = segment->length - queue->head_sent;
+  if (length > budget)
+    length = budget;
+  ssize_t written = sendfile(sock, segment->file_fd, &offset, length);
+  if (written == 0) {
+    errno = EIO;
+    return -1;
+  }
+  return written;
+}
+
+/**
+* Describe memory segments from the head of the queue as an iovec array.
+* Gathering stops at a file segment, after a zero-copy segment (which is
+* sent on its own) and once roughly budget bytes were gathered.
+* @queue         queue to gather from
+* @iov           filled in with at most max_iov entries
+* @max_iov       size of iov
+* @budget        stop gathering after roughly this many bytes
+* @inline_copy   if not NULL, inline bytes are copied here (OUT_INLINE_SIZE
+*                per entry) so the iovecs survive the slot array growing
+* @more          set to 1 if segments are left behind the gathered ones
+* Return number of iovec entries filled in.
+*/
+int out_gather(struct OutQueue *queue, struct iovec *iov, int max_iov, size_t budget,
+               unsigned char *inline_copy, int *more) {
+  int iov_count = 0;
+  size_t batch = 0;
+  unsigned int i;
+
+  for (i = 0; i < queue->count && iov_count < max_iov; i++) {
+    struct OutSegment *segment = &queue->slots[(queue->head + i) % queue->capacity];
+    if (segment->kind == OUT_FILE || (segment->kind == OUT_ZEROCOPY && i))
+      break;
+    const char *data = segment->data;
+    size_t skip = i ? 0 : queue->head_sent;
+    if (!data && inline_copy) {
+      data = (const char *) memcpy(inline_copy + iov_count * OUT_INLINE_SIZE, segment->inline_data, segment->length);
+    } else if (!data) {
+      data = (const char *) segment->inline_data;
+    }
+    iov[iov_count].iov_base = (void *) (data + skip);
+    iov[iov_count].iov_len = segment->length - skip;
+    batch += segment->length - skip;
+    iov_count++;
+    if (segment->kind == OUT_ZEROCOPY || batch >= budget) {
+      i++;
+      break;
+    }
+  }
+  *more = i < queue->count;
+  return iov_count;
+}
+
+/**
+* Write memory segments from the head of the queue (utility method).
+* Consecutive memory segments share one sendmsg(); a zero-copy segment
+* is sent on its own. MSG_MORE is set while more segments are queued so
+* that headers leave in the same packet as the text that follows them.
+* @queue    queue to write from
+* @sock     socket to write to
+* @budget   stop gathering after roughly this many bytes
+* Return number of bytes written, -1 on error (errno set).
+*/
+static ssize_t flush_memory(struct OutQueue *queue, int sock, size_t budget) {
+  struct iovec iov[IOV_MAX];
+  int more;
+  int flags = MSG_NOSIGNAL;
+  if (queue->slots[queue->head].kind == OUT_ZEROCOPY)
+    flags |= MSG_ZEROCOPY;
+
+  struct msghdr msg;
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = iov;
+  msg.msg_iovlen = out_gather(queue, iov, IOV_MAX, budget, NULL, &more);
+  if (more)
+    flags |= MSG_MORE;
+  ssize_t written = sendmsg(sock, &msg, flags);
+  if (written > 0 && (flags & MSG_ZEROCOPY))
+    queue->zerocopy_sends++;
+  return written;
+}
+
+/**
+* Write queued segments to a nonblocking socket.
+* @queue     queue to write from
+* @sock      socket to write to
+* @budget    stop after roughly this many bytes
+* @blocked   set to 1 if the socket stopped accepting data
+* Return number of bytes written, -1 on socket error.
+*/
+ssize_t out_flush(struct OutQueue *queue, int sock, size_t budget, int *blocked) {
+  ssize_t total = 0;
+  *blocked = 0;
+
+  while (queue->count && (size_t) total < budget) {
+    ssize_t written;
+    if (queue->slots[queue->head].kind == OUT_FILE)
+      written = flush_file(queue, sock, budget - total);
+    else
+      written = flush_memory(queue, sock, budget - total);
+
+    if (written == -1) {
+      if (errno == EINTR)
+        continue;
+      if (errno == EAGAIN || errno == EWOULDBLOCK || errno == ENOBUFS) {
+        // ENOBUFS: too many zero-copy sends in flight, wait for completions
+        *blocked = 1;
+        break;
+      }
+      return -1;
+    }
+    total += written;
+    out_consume(queue, written);
+  }
+  return total;
+}
+
+/**
+* Read zero-copy completion notifications from the socket's error queue.
+* @queue   queue whose sends completed
+* @sock    socket the sends were issued on
+* Return number of sends still in flight.
+*/
+int out_reap_zerocopy(struct OutQueue *queue, int sock) {
+  while (queue->zerocopy_completed < queue->zerocopy_sends) {
+    char control[128];
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    if (recvmsg(sock, &msg, MSG_ERRQUEUE) == -1)
+      break;
+
+    for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+      struct sock_extended_err *error = (struct sock_extended_err *) CMSG_DATA(cmsg);
+      if (error->ee_origin != SO_EE_ORIGIN_ZEROCOPY || error->ee_errno)
+        continue;
+      // ee_info to ee_data is the range of completed send numbers
+      unsigned long completed = error->ee_data - error->ee_info + 1;
+      queue->zerocopy_completed += completed;
+      if (error->ee_code & SO_EE_CODE_ZEROCOPY_COPIED)
+        queue->zerocopy_copied += completed;
+    }
+  }
+  return (int) (queue->zerocopy_sends - queue->zerocopy_completed);
+}
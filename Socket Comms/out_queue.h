@@ -0,0 +1,66 @@
+#ifndef OUT_QUEUE_H
+#define OUT_QUEUE_H
+
+#include <stddef.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#include "pool.h"
+
+/* Per-connection queue of bytes waiting to be written to a socket.
+   Segments are written in order with writev(); a segment that was only
+   partially written stays at the head until the socket accepts the rest.
+   File segments go out with sendfile() and zero-copy segments with
+   MSG_ZEROCOPY, so their bytes are never copied in user space. */
+
+#define OUT_INLINE_SIZE 16     // small headers are copied into the segment
+#define OUT_INITIAL_SLOTS 32
+#define OUT_MAX_SLOTS 4096
+
+#define OUT_MEMORY 0
+#define OUT_FILE 1       // range of a file, sent with sendfile()
+#define OUT_ZEROCOPY 2   // memory pinned by the kernel until completion
+
+struct OutSegment {
+  const char *data;            // NULL means the bytes live in inline_data
+  size_t length;
+  void *owner;                 // passed to free() (or release) once the segment is sent
+  void (*release)(void *owner); // NULL for free()
+  int kind;                    // OUT_MEMORY, OUT_FILE or OUT_ZEROCOPY
+  int file_fd;
+  off_t file_offset;
+  unsigned char inline_data[OUT_INLINE_SIZE];
+};
+
+struct OutQueue {
+  struct OutSegment *slots;    // from the pool, grown by doubling
+  struct Pool *pool;
+  unsigned int capacity;
+  unsigned int head;
+  unsigned int count;
+  size_t head_sent;            // bytes of the head segment already written
+  size_t pending_bytes;        // bytes queued but not yet written
+  unsigned long long written_bytes; // bytes written since the queue was created
+  unsigned int in_flight;      // head segments an unfinished asynchronous send refers to
+  unsigned long zerocopy_sends;     // MSG_ZEROCOPY sends issued
+  unsigned long zerocopy_completed; // completions reaped from the error queue
+  unsigned long zerocopy_copied;    // completions where the kernel copied anyway
+};
+
+int out_init(struct OutQueue *queue, struct Pool *pool);
+void out_free(struct OutQueue *queue);
+int out_push(struct OutQueue *queue, const void *data, size_t length, void *owner);
+int out_push_shared(struct OutQueue *queue, const void *data, size_t length, void *owner,
+                    void (*release)(void *owner));
+int out_push_copy(struct OutQueue *queue, const void *data, size_t length);
+int out_push_file(struct OutQueue *queue, int fd, off_t offset, size_t length);
+int out_push_zerocopy(struct OutQueue *queue, const void *data, size_t length);
+unsigned int out_space(struct OutQueue *queue);
+void out_truncate(struct OutQueue *queue);
+int out_gather(struct OutQueue *queue, struct iovec *iov, int max_iov, size_t budget,
+               unsigned char *inline_copy, int *more);
+void out_consume(struct OutQueue *queue, size_t written);
+ssize_t out_flush(struct OutQueue *queue, int sock, size_t budget, int *blocked);
+int out_reap_zerocopy(struct OutQueue *queue, int sock);
+
+#endif
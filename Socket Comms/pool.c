@@ -0,0 +1,162 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+
+#include "pool.h"
+
+/* Every block starts with the size it was allocated with, kept apart from
+   the caller's bytes so they stay aligned. */
+union PoolHeader {
+  size_t size;
+  long double align;
+};
+
+/**
+* Update a statistic only the owner writes (utility method).
+* @field   statistic to update
+* @value   new value
+*/
+static void set_stat(uint64_t *field, uint64_t value) {
+  __atomic_store_n(field, value, __ATOMIC_RELAXED);
+}
+
+/**
+* Find the size class of a request (utility method).
+* @size   bytes requested
+* Return the class index, POOL_CLASSES if the request is too large.
+*/
+static int size_class(size_t size) {
+  if (size > ((size_t) 1 << POOL_MAX_SHIFT))
+    return POOL_CLASSES;
+  int shift = POOL_MIN_SHIFT;
+  while (((size_t) 1 << shift) < size)
+    shift++;
+  return shift - POOL_MIN_SHIFT;
+}
+
+/**
+* Prepare an empty pool.
+* @pool    pool to prepare
+* @cap     most bytes the pool may hold, 0 for no limit
+* @stats   statistics kept for the pool
+*/
+void pool_init(struct Pool *pool, size_t cap, struct PoolStats *stats) {
+  memset(pool, 0, sizeof(*pool));
+  memset(stats, 0, sizeof(*stats));
+  pool->cap = cap;
+  pool->stats = stats;
+}
+
+/**
+* Give every cached block back to the system (utility method).
+* @pool   pool to trim
+*/
+static void trim(struct Pool *pool) {
+  for (int class = 0; class < POOL_CLASSES; class++) {
+    while (pool->free[class]) {
+      struct PoolBlock *block = pool->free[class];
+      pool->free[class] = block->next;
+      free((union PoolHeader *) block - 1);
+    }
+  }
+  set_stat(&pool->stats->cached, 0);
+}
+
+/**
+* Release the cached blocks. Blocks still handed out must have been
+* given back with pool_free() first.
+* @pool   pool to destroy
+*/
+void pool_destroy(struct Pool *pool) {
+  trim(pool);
+}
+
+/**
+* Check whether the memory cap allows an allocation. Cached blocks do not
+* count, as they are given back to the system when room is needed.
+* @pool   pool to check
+* @size   bytes that would be requested
+* Return 1 if it would succeed (memory permitting), 0 otherwise.
+*/
+int pool_fits(struct Pool *pool, size_t size) {
+  int class = size_class(size);
+  size_t rounded = (class < POOL_CLASSES) ? (size_t) 1 << (class + POOL_MIN_SHIFT) : size;
+  return !pool->cap || pool->stats->in_use + rounded <= pool->cap;
+}
+
+/**
+* Hand out a block, reusing a cached one of the same size class if any.
+* @pool   pool to allocate from
+* @size   bytes needed
+* Return the block (give it back with pool_free()), NULL on allocation
+* failure or if the memory cap does not allow it.
+*/
+void *pool_alloc(struct Pool *pool, size_t size) {
+  struct PoolStats *stats = pool->stats;
+  int class = size_class(size);
+  if (class < POOL_CLASSES && pool->free[class]) {
+    struct PoolBlock *block = pool->free[class];
+    pool->free[class] = block->next;
+    size_t rounded = (size_t) 1 << (class + POOL_MIN_SHIFT);
+    set_stat(&stats->cached, stats->cached - rounded);
+    set_stat(&stats->in_use, stats->in_use + rounded);
+    set_stat(&stats->allocations, stats->allocations + 1);
+    set_stat(&stats->reused, stats->reused + 1);
+    return block;
+  }
+
+  size_t rounded = (class < POOL_CLASSES) ? (size_t) 1 << (class + POOL_MIN_SHIFT) : size;
+  if (pool->cap && stats->in_use + stats->cached + rounded > pool->cap) {
+    trim(pool);
+    if (stats->in_use + rounded > pool->cap) {
+      set_stat(&stats->refused, stats->refused + 1);
+      return NULL;
+    }
+  }
+  union PoolHeader *header = (union PoolHeader *) malloc(sizeof(union PoolHeader) + rounded);
+  if (!header)
+    return NULL;
+  header->size = rounded;
+  set_stat(&stats->in_use, stats->in_use + rounded);
+  set_stat(&stats->allocations, stats->allocations + 1);
+  if (stats->in_use + stats->cached > stats->peak)
+    set_stat(&stats->peak, stats->in_use + stats->cached);
+  return header + 1;
+}
+
+/**
+* Hand out a block filled with zeros.
+* @pool   pool to allocate from
+* @size   bytes needed
+* Return the block (give it back with pool_free()), NULL on failure.
+*/
+void *pool_calloc(struct Pool *pool, size_t size) {
+  void *block = pool_alloc(pool, size);
+  if (block)
+    memset(block, 0, size);
+  return block;
+}
+
+/**
+* Give a block back. Blocks of a size class are cached for reuse, larger
+* ones are freed.
+* @pool    pool the block came from
+* @block   block to give back, may be NULL
+*/
+void pool_free(struct Pool *pool, void *block) {
+  if (!block)
+    return;
+  struct PoolStats *stats = pool->stats;
+  union PoolHeader *header = (union PoolHeader *) block - 1;
+  size_t size = header->size;
+  set_stat(&stats->in_use, stats->in_use - size);
+  int class = size_class(size);
+  if (class == POOL_CLASSES) {
+    free(header);
+    return;
+  }
+  struct PoolBlock *cached = (struct PoolBlock *) block;
+  cached->next = pool->free[class];
+  pool->free[class] = cached;
+  set_stat(&stats->cached, stats->cached + size);
+}
@@ -0,0 +1,46 @@
+#ifndef POOL_H
+#define POOL_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Size-classed buffer pool. Blocks are rounded up to a power of two and
+   kept on a free list per size when released, so buffers of the same
+   sizes are reused instead of going back to malloc() over and over.
+   Larger blocks come straight from malloc(). A pool has one owner (an
+   event loop, or a client process) and takes no locks; its statistics
+   may be read from other threads. The memory cap bounds the bytes a pool
+   holds, handed out or cached: cached blocks are given back to the
+   system first, then allocations are refused. */
+
+#define POOL_MIN_SHIFT 6       // smallest class, 64 bytes
+#define POOL_MAX_SHIFT 18      // largest class, 256 KB
+#define POOL_CLASSES (POOL_MAX_SHIFT - POOL_MIN_SHIFT + 1)
+
+struct PoolStats {
+  uint64_t in_use;       // bytes handed out
+  uint64_t cached;       // bytes on the free lists
+  uint64_t peak;         // most bytes held at once
+  uint64_t allocations;  // blocks handed out
+  uint64_t reused;       // of which taken from a free list
+  uint64_t refused;      // allocations refused by the memory cap
+};
+
+struct PoolBlock {
+  struct PoolBlock *next;
+};
+
+struct Pool {
+  size_t cap;            // most bytes held, 0 for no limit
+  struct PoolBlock *free[POOL_CLASSES];
+  struct PoolStats *stats;
+};
+
+void pool_init(struct Pool *pool, size_t cap, struct PoolStats *stats);
+void pool_destroy(struct Pool *pool);
+void *pool_alloc(struct Pool *pool, size_t size);
+void *pool_calloc(struct Pool *pool, size_t size);
+void pool_free(struct Pool *pool, void *block);
+int pool_fits(struct Pool *pool, size_t size);
+
+#endif
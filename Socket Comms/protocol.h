@@ -0,0 +1,118 @@
+#ifndef PROTOCOL_H
+#define PROTOCOL_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Wire definitions shared by client and server (see protocol.txt).
+   Request type: unsigned char, 1 byte (8 bits).
+   Request value:
+     If 0, an extended request follows (opcode byte + payload).
+     If 1 - 126, this many jobs are requested.
+     If 127, all jobs are requested.
+     If 128, normal termination.
+     If 129 - 255, termination with error. */
+
+#define EXTENDED_REQUEST 0
+#define ONE_JOB_REQUEST 1
+#define ALL_JOBS_REQUEST 127
+#define STOP_REQUEST 128
+#define ERROR_REQUEST 129 // or any other value between 129 and 255
+
+// extended request opcodes, sent after EXTENDED_REQUEST
+#define EXT_CREDIT 1      // payload: 4-byte job credit, 4-byte byte credit
+#define EXT_BATCH 2       // payload: 4-byte maximum number of jobs per batch
+#define EXT_CRC32C 3      // no payload; jobs with text carry a CRC32C trailer
+#define EXT_HELLO 4       // payload: 1-byte version, varint capabilities
+#define EXT_FETCH 5       // payload: varint job count, 0 for all jobs (version 2)
+#define EXT_FETCH_ID 6    // payload: varint request ID, varint job count (version 2)
+#define EXT_ACK 7         // payload: varint number of jobs done, oldest first (version 2)
+#define EXT_STATS 8       // no payload; answered with a STATS control frame (version 2)
+#define EXT_FILTER 9      // payload: 1-byte type mask, varint pattern length, pattern (version 2)
+#define EXT_RESUME 10     // payload: varint checkpoint, varint jobs received after it (version 2)
+
+// protocol version 2 (see VERSION 2 in protocol.txt)
+#define PROTOCOL_VERSION 2
+#define CAP_CREDIT (1u << 0)
+#define CAP_BATCH (1u << 1)
+#define CAP_CRC32C (1u << 2)
+#define CAP_REQUEST_IDS (1u << 3)
+#define CAP_LEASES (1u << 4)  // only offered by servers that dispatch jobs
+#define CAP_COMPRESS (1u << 5) // only offered by servers started with --compress
+#define CAP_DICTIONARY (1u << 6) // only offered by servers started with --compress dict
+#define CAP_FILTER (1u << 7)  // not offered by servers that dispatch jobs
+#define CAP_RESUME (1u << 8)  // not offered by servers that dispatch jobs
+#define VARINT_MAX_SIZE 10    // bytes needed for a 64-bit value
+#define MAX_PIPELINED_REQUESTS 16 // FETCH requests a server keeps track of
+
+#define CRC32C_TRAILER_SIZE 4 // follows the terminating 0 (see INTEGRITY in protocol.txt)
+#define FILTER_MAX_PATTERN 255 // longest substring of a FILTER request (see FILTERS in protocol.txt)
+
+#define TYPE_O 0 // "000" bit pattern
+#define TYPE_E 1 // "001" bit pattern
+#define TYPE_C 2 // "010" bit pattern, control frame (version 2)
+#define TYPE_B 3 // "011" bit pattern, batch of jobs (see BATCHES in protocol.txt)
+#define TYPE_Z 4 // "100" bit pattern, compressed job (see COMPRESSION in protocol.txt)
+#define TYPE_Q 7 // "111" bit pattern
+
+// control frame opcodes, first byte of a 'C' frame's payload
+#define CTRL_HELLO 1      // payload: 1-byte version, varint capabilities
+#define CTRL_DONE 2       // payload: varint request ID
+#define CTRL_DICTIONARY 3 // payload: varint dictionary ID, dictionary bytes
+#define CTRL_STATS 4      // payload: server metrics in the Prometheus text format
+#define CTRL_SESSION 5    // payload: varint session token (identifies the job file)
+#define CTRL_CHECKPOINT 6 // payload: varint number of the next job to check
+
+// credit window granted by the client (see FLOW CONTROL in protocol.txt)
+#define CREDIT_WINDOW_JOBS 64
+#define CREDIT_WINDOW_BYTES (4 * 1024 * 1024)
+
+// batch frames, only sent to clients that asked for them
+#define BATCH_MAX_JOBS 255             // keeps a batch within one writev()
+#define BATCH_MAX_BYTES (256 * 1024)
+
+struct JobMessage {
+  unsigned char job_info;
+  int text_length;
+  char job_text[];
+} __attribute__((packed));
+
+/**
+* Encode an unsigned integer as a varint (7 bits per byte, least
+* significant group first, high bit set on every byte but the last).
+* @value   value to encode
+* @out     at least VARINT_MAX_SIZE bytes
+* Return number of bytes written.
+*/
+static inline size_t varint_encode(uint64_t value, unsigned char *out) {
+  size_t size = 0;
+  while (value >= 0x80) {
+    out[size++] = (unsigned char) (value | 0x80);
+    value >>= 7;
+  }
+  out[size++] = (unsigned char) value;
+  return size;
+}
+
+/**
+* Decode a varint.
+* @data     encoded bytes
+* @length   number of bytes available
+* @value    filled in with the decoded value
+* Return number of bytes used, 0 if more bytes are needed, -1 if malformed.
+*/
+static inline int varint_decode(const unsigned char *data, size_t length, uint64_t *value) {
+  uint64_t result = 0;
+  for (size_t i = 0; i < length; i++) {
+    if (i == VARINT_MAX_SIZE)
+      return -1;
+    result |= (uint64_t) (data[i] & 0x7F) << (7 * i);
+    if (!(data[i] & 0x80)) {
+      *value = result;
+      return (int) i + 1;
+    }
+  }
+  return (length >= VARINT_MAX_SIZE) ? -1 : 0;
+}
+
+#endif
@@ -0,0 +1,114 @@
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+
+#include "recv_buffer.h"
+
+/**
+* Prepare an empty receive buffer.
+* @buffer     buffer to prepare
+* @fd         descriptor to read from
+* @capacity   initial size in bytes
+* Return 0 on success, -1 on allocation failure.
+*/
+int recv_init(struct RecvBuffer *buffer, int fd, size_t capacity) {
+  memset(buffer, 0, sizeof(*buffer));
+  buffer->data = (char *) malloc(capacity);
+  if (!buffer->data)
+    return -1;
+  buffer->fd = fd;
+  buffer->capacity = capacity;
+  return 0;
+}
+
+/**
+* Free the buffer memory (the descriptor is left open).
+* @buffer   buffer to free
+*/
+void recv_free(struct RecvBuffer *buffer) {
+  free(buffer->data);
+  buffer->data = NULL;
+}
+
+/**
+* Make at least `needed` unparsed bytes available contiguously.
+* Reads as much as the buffer holds on each read(), so small frames
+* usually need no read() at all. In exact mode only the missing bytes
+* are read, so the caller can splice() what follows from the socket.
+* @buffer   buffer to fill
+* @needed   number of bytes the caller is about to parse
+* Return 0 on success, 1 if the peer closed the connection first,
+* -1 on error (errno set, EINTR if the stop flag was raised).
+*/
+int recv_fill(struct RecvBuffer *buffer, size_t needed) {
+  if (buffer->end - buffer->start >= needed)
+    return 0;
+
+  if (needed > buffer->capacity) {
+    size_t capacity = buffer->capacity;
+    while (capacity < needed)
+      capacity *= 2;
+    char *data = (char *) realloc(buffer->data, capacity);
+    if (!data)
+      return -1;
+    buffer->data = data;
+    buffer->capacity = capacity;
+  }
+  if (buffer->capacity - buffer->start < needed) {
+    // frame straddles the end of the buffer, move its received part to the front
+    memmove(buffer->data, buffer->data + buffer->start, buffer->end - buffer->start);
+    buffer->end -= buffer->start;
+    buffer->start = 0;
+  }
+
+  while (buffer->end - buffer->start < needed) {
+    size_t wanted = buffer->capacity - buffer->end;
+    if (buffer->exact)
+      wanted = needed - (buffer->end - buffer->start);
+    if (buffer->stop && *buffer->stop) {
+      errno = EINTR;
+      return -1;
+    }
+    ssize_t received = read(buffer->fd, buffer->data + buffer->end, wanted);
+    buffer->reads++;
+    if (received == 0)
+      return 1;
+    if (received == -1) {
+      if (errno == EINTR && !(buffer->stop && *buffer->stop))
+        continue;
+      return -1;
+    }
+    buffer->end += received;
+  }
+  return 0;
+}
+
+/**
+* Pointer to the first unparsed byte.
+* @buffer   buffer to look into
+*/
+char *recv_peek(struct RecvBuffer *buffer) {
+  return buffer->data + buffer->start;
+}
+
+/**
+* Mark bytes as parsed. An emptied buffer starts over at the front.
+* @buffer   buffer to advance
+* @length   number of bytes parsed
+*/
+void recv_consume(struct RecvBuffer *buffer, size_t length) {
+  buffer->start += length;
+  if (buffer->start == buffer->end) {
+    buffer->start = 0;
+    buffer->end = 0;
+  }
+}
+
+/**
+* Number of received bytes not parsed yet.
+* @buffer   buffer to check
+*/
+size_t recv_available(struct RecvBuffer *buffer) {
+  return buffer->end - buffer->start;
+}
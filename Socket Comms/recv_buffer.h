@@ -0,0 +1,32 @@
+#ifndef RECV_BUFFER_H
+#define RECV_BUFFER_H
+
+#include <stddef.h>
+#include <signal.h>
+
+/* Receive buffer for the client's socket. Data is read in large chunks and
+   frames are parsed in place. When a frame straddles the end of the
+   buffer, its received part is moved to the front before reading on, so a
+   frame is always contiguous; frames larger than the buffer grow it. */
+
+#define RECV_BUFFER_SIZE (512 * 1024)
+
+struct RecvBuffer {
+  int fd;
+  char *data;
+  size_t capacity;
+  size_t start;        // first byte not parsed yet
+  size_t end;          // one past the last byte received
+  unsigned long reads; // read() calls made, for debugging
+  int exact;           // read only the bytes asked for, leaving the rest in the socket
+  volatile sig_atomic_t *stop; // if set by a signal handler, an interrupted read() gives up
+};
+
+int recv_init(struct RecvBuffer *buffer, int fd, size_t capacity);
+void recv_free(struct RecvBuffer *buffer);
+int recv_fill(struct RecvBuffer *buffer, size_t needed);
+char *recv_peek(struct RecvBuffer *buffer);
+void recv_consume(struct RecvBuffer *buffer, size_t length);
+size_t recv_available(struct RecvBuffer *buffer);
+
+#endif
@@ -2,7 +2,8 @@
 
 int debug = 0; // 0 for regular use, 1 for debug mode
 int interrupted = 0; // switches to 1 if interrupt is caught
-int connections = 0;
+int interrupt_fds[MAX_WORKERS]; // eventfds of the worker loops, written on interrupt
+int interrupt_fd_count = 0;
 
 /**
 * Print instructions.
@@ -12,67 +13,264 @@ int connections = 0;
 */
 int usage(int argc, char* argv[]) {
     if(argc < 3) {
-        printf("Usage: %s [filename.job] [port]\n", argv[0]);
+        printf("Usage: %s [filename.job] [port] [options]\n", argv[0]);
         printf("Debug: %s [filename.job] [port] -debug\n", argv[0]);
+        printf("The job file may also be one compiled by jobc, which is served without indexing.\n");
+        printf("Options:\n");
+        printf("  --max-connections N   serve at most N clients at once (default %d)\n", DEFAULT_MAX_CONNECTIONS);
+        printf("  --index-threads N     threads used to index large job files (default: one per core)\n");
+        printf("  --send-mode MODE      writev, sendfile (default) or zerocopy\n");
+        printf("  --dispatch            hand every job to only one of the connected clients\n");
+        printf("  --lease-timeout MS    time a client has to acknowledge a dispatched job (default %d)\n",
+               DEFAULT_LEASE_MS);
+        printf("  --workers N           event loop threads, each with its own listening socket\n");
+        printf("                        (default 1, 0 for one per core)\n");
+        printf("  --io-backend NAME     epoll (default) or uring; with uring, large texts are read\n");
+        printf("                        into registered buffers instead of using sendfile\n");
+        printf("  --compress MODE       none (default), fast or dict: offer clients compressed jobs,\n");
+        printf("                        with dict also a dictionary trained on the job file\n");
+        printf("  --follow              keep serving jobs appended to the job file while it is written\n");
+        printf("  --metrics-port N      serve metrics in the Prometheus text format on 127.0.0.1:N\n");
+        printf("  --trace FILE          record events and write them to FILE on SIGUSR1 and on exit,\n");
+        printf("                        for jobtrace\n");
+        printf("  --memory-cap MB       bound the memory held for connections and their queues;\n");
+        printf("                        clients beyond it are told the server is busy\n");
+        printf("  --frame-cache MB      share built frames of large jobs between clients, up to MB\n");
+        printf("                        (sendfile mode, not with --dispatch)\n");
+        printf("  --broadcast           build every job frame once into a ring all clients send from\n");
         return 1;
     }
     return 0;
 }
 
+/**
+* Parse options following the file name and port.
+* @argc      number of arguments to main
+* @argv      array of arguments to main
+* @options   filled in with the requested settings
+* Return 0 on success, -1 on an unknown or malformed option.
+*/
+int parse_options(int argc, char *argv[], struct ServerOptions *options) {
+  for (int i = 3; i < argc; i++) {
+    if (!strcmp(argv[i], "-debug") || !strcmp(argv[i], "--debug")) {
+      debug = 1;
+    } else if (!strcmp(argv[i], "--max-connections") && i + 1 < argc) {
+      options->max_connections = parse_number(argv[++i]);
+      if (options->max_connections <= 0) {
+        fprintf(stderr, RED ">>> %d <<< [Server Error] Invalid connection limit.\n" RESET, getpid());
+        return -1;
+      }
+    } else if (!strcmp(argv[i], "--index-threads") && i + 1 < argc) {
+      options->index_threads = parse_number(argv[++i]);
+      if (options->index_threads <= 0) {
+        fprintf(stderr, RED ">>> %d <<< [Server Error] Invalid number of index threads.\n" RESET, getpid());
+        return -1;
+      }
+    } else if (!strcmp(argv[i], "--send-mode") && i + 1 < argc) {
+      i++;
+      if (!strcmp(argv[i], "writev")) {
+        options->send_mode = SEND_WRITEV;
+      } else if (!strcmp(argv[i], "sendfile")) {
+        options->send_mode = SEND_SENDFILE;
+      } else if (!strcmp(argv[i], "zerocopy")) {
+        options->send_mode = SEND_ZEROCOPY;
+      } else {
+        fprintf(stderr, RED ">>> %d <<< [Server Error] Unknown send mode \"%s\".\n" RESET, getpid(), argv[i]);
+        return -1;
+      }
+    } else if (!strcmp(argv[i], "--workers") && i + 1 < argc) {
+      options->workers = parse_number(argv[++i]);
+      if (options->workers == 0)
+        options->workers = (int) sysconf(_SC_NPROCESSORS_ONLN);
+      if (options->workers <= 0 || options->workers > MAX_WORKERS) {
+        fprintf(stderr, RED ">>> %d <<< [Server Error] Number of workers must be 1 - %d.\n" RESET, getpid(), MAX_WORKERS);
+        return -1;
+      }
+    } else if (!strcmp(argv[i], "--io-backend") && i + 1 < argc) {
+      i++;
+      if (!strcmp(argv[i], "epoll")) {
+        options->io_backend = IO_EPOLL;
+      } else if (!strcmp(argv[i], "uring")) {
+        options->io_backend = IO_URING;
+      } else {
+        fprintf(stderr, RED ">>> %d <<< [Server Error] Unknown I/O backend \"%s\".\n" RESET, getpid(), argv[i]);
+        return -1;
+      }
+    } else if (!strcmp(argv[i], "--compress") && i + 1 < argc) {
+      i++;
+      if (!strcmp(argv[i], "none")) {
+        options->compression = COMPRESS_NONE;
+      } else if (!strcmp(argv[i], "fast")) {
+        options->compression = COMPRESS_FAST;
+      } else if (!strcmp(argv[i], "dict")) {
+        options->compression = COMPRESS_DICT;
+      } else {
+        fprintf(stderr, RED ">>> %d <<< [Server Error] Unknown compression mode \"%s\".\n" RESET, getpid(), argv[i]);
+        return -1;
+      }
+    } else if (!strcmp(argv[i], "--dispatch")) {
+      options->dispatch = 1;
+    } else if (!strcmp(argv[i], "--follow")) {
+      options->follow = 1;
+    } else if (!strcmp(argv[i], "--broadcast")) {
+      options->broadcast = 1;
+    } else if (!strcmp(argv[i], "--metrics-port") && i + 1 < argc) {
+      options->metrics_port = parse_number(argv[++i]);
+      if (options->metrics_port <= 0 || options->metrics_port > 65535) {
+        fprintf(stderr, RED ">>> %d <<< [Server Error] Invalid metrics port.\n" RESET, getpid());
+        return -1;
+      }
+    } else if (!strcmp(argv[i], "--trace") && i + 1 < argc) {
+      options->trace_path = argv[++i];
+    } else if (!strcmp(argv[i], "--memory-cap") && i + 1 < argc) {
+      int megabytes = parse_number(argv[++i]);
+      if (megabytes <= 0) {
+        fprintf(stderr, RED ">>> %d <<< [Server Error] Invalid memory cap.\n" RESET, getpid());
+        return -1;
+      }
+      options->memory_cap = (size_t) megabytes * 1024 * 1024;
+    } else if (!strcmp(argv[i], "--frame-cache") && i + 1 < argc) {
+      int megabytes = parse_number(argv[++i]);
+      if (megabytes <= 0) {
+        fprintf(stderr, RED ">>> %d <<< [Server Error] Invalid frame cache size.\n" RESET, getpid());
+        return -1;
+      }
+      options->frame_cache = (size_t) megabytes * 1024 * 1024;
+    } else if (!strcmp(argv[i], "--lease-timeout") && i + 1 < argc) {
+      options->lease_ms = parse_number(argv[++i]);
+      if (options->lease_ms <= 0) {
+        fprintf(stderr, RED ">>> %d <<< [Server Error] Invalid lease timeout.\n" RESET, getpid());
+        return -1;
+      }
+    } else {
+      fprintf(stderr, RED ">>> %d <<< [Server Error] Unknown option \"%s\".\n" RESET, getpid(), argv[i]);
+      return -1;
+    }
+  }
+  if (options->io_backend == IO_URING && options->send_mode == SEND_ZEROCOPY) {
+    fprintf(stderr, ">>> %d <<< [Server Warning] Zero-copy sends need the epoll backend, using sendfile.\n", getpid());
+    options->send_mode = SEND_SENDFILE;
+  }
+  if (options->broadcast && options->dispatch) {
+    fprintf(stderr, RED ">>> %d <<< [Server Error] --broadcast sends every job to every client, "
+            "it cannot be combined with --dispatch.\n" RESET, getpid());
+    return -1;
+  }
+  if (options->frame_cache && (options->send_mode != SEND_SENDFILE || options->dispatch)) {
+    fprintf(stderr, ">>> %d <<< [Server Warning] Frame cache only serves sendfile mode without --dispatch, "
+            "ignoring --frame-cache.\n", getpid());
+    options->frame_cache = 0;
+  }
+  return 0;
+}
+
 int main(int argc, char *argv[]) {
   if(usage(argc, argv)) {
       return EXIT_SUCCESS;
   }
 
-  if (argc == 4) {
-    if (!strcmp(argv[3], "-debug"))
-      debug = 1;
-  }
+  struct ServerOptions options;
+  memset(&options, 0, sizeof(options));
+  options.max_connections = DEFAULT_MAX_CONNECTIONS;
+  options.index_threads = (int) sysconf(_SC_NPROCESSORS_ONLN);
+  options.send_mode = SEND_SENDFILE;
+  options.lease_ms = DEFAULT_LEASE_MS;
+  options.workers = 1;
+  options.io_backend = IO_EPOLL;
+  options.compression = COMPRESS_NONE;
+  if (parse_options(argc, argv, &options))
+    return EXIT_FAILURE;
+  if (options.trace_path && trace_init(options.trace_path))
+    return EXIT_FAILURE;
 
-  // set up signal handler
+  // set up signal handler (no SA_RESTART, so epoll_wait returns on interrupt)
   struct sigaction sa;
   memset(&sa, 0, sizeof(sa));
   sa.sa_handler = handler;
 
   if (sigaction(SIGINT, &sa, NULL)) {
-    perror(RED "[Client Error] Failed to catch interrupt signal" RESET);
+    perror(RED "[Server Error] Failed to catch interrupt signal" RESET);
+    exit(EXIT_FAILURE);
+  }
+  if (options.trace_path && sigaction(SIGUSR1, &sa, NULL)) {
+    perror(RED "[Server Error] Failed to catch trace signal" RESET);
     exit(EXIT_FAILURE);
   }
+  sa.sa_handler = SIG_IGN; // failed writes are reported by write() instead
+  sigaction(SIGPIPE, &sa, NULL);
 
   if (debug) {
     printf(">>> %d <<< Server process start.\n", getpid());
-    printf(">>> %d <<< Checking source file \"%s\".\n", getpid(), argv[1]);
+    printf(">>> %d <<< Mapping source file \"%s\".\n", getpid(), argv[1]);
   }
-  FILE *job_file = fopen(argv[1], "r");
-  if (job_file == NULL) {
+  struct JobStore store;
+  if (job_store_open(&store, argv[1], options.follow)) {
     fprintf(stderr, ">>> %d <<< Failed to open file.\n", getpid());
     return EXIT_FAILURE;
   }
-  fclose(job_file);
+  if (job_store_compress(&store, options.compression)) {
+    job_store_close(&store);
+    return EXIT_FAILURE;
+  }
 
   if (debug) {
     printf(">>> %d <<< Creating socket for incoming connections.\n", getpid());
   }
 
-  int sock = define_connection(argv[2]);
-  if (sock == -1) {
-    close(sock);
+  raise_file_limit();
+  struct Dispatcher dispatcher;
+  if (options.dispatch && dispatch_init(&dispatcher, &store, options.lease_ms)) {
+    job_store_close(&store);
     return EXIT_FAILURE;
   }
 
-  if (debug)
-    printf(">>> %d <<< Opening source file \"%s\".\n", getpid(), argv[1]);
-  job_file = fopen(argv[1], "r");
-  int connection_status = accept_connections(sock, job_file);
-  if (connection_status) {
+  struct FrameCache cache;
+  if (options.frame_cache) {
+    if (frame_cache_init(&cache, &store, options.frame_cache)) {
+      if (options.dispatch)
+        dispatch_free(&dispatcher);
+      job_store_close(&store);
+      return EXIT_FAILURE;
+    }
+    metrics_register_cache(&cache);
+  }
+  struct Broadcast ring;
+  if (options.broadcast) {
+    if (broadcast_init(&ring, &store)) {
+      if (options.frame_cache)
+        frame_cache_free(&cache);
+      job_store_close(&store);
+      return EXIT_FAILURE;
+    }
+    metrics_register_broadcast(&ring);
+  }
+
+  struct Worker workers[MAX_WORKERS];
+  struct MetricsEndpoint endpoint;
+  endpoint.running = 0;
+  int worker_count = 0;
+  int loop_status = start_workers(workers, &worker_count, &options, argv[2], &store,
+                                  options.dispatch ? &dispatcher : NULL, options.frame_cache ? &cache : NULL,
+                                  options.broadcast ? &ring : NULL);
+  if (!loop_status && options.metrics_port)
+    loop_status = metrics_start(&endpoint, options.metrics_port, &store);
+  if (!loop_status)
+    loop_status = run_workers(workers, worker_count);
+  metrics_stop(&endpoint);
+  close_workers(workers, worker_count);
+  if (options.dispatch)
+    dispatch_free(&dispatcher);
+  if (options.frame_cache)
+    frame_cache_free(&cache);
+  if (options.broadcast)
+    broadcast_free(&ring);
+  job_store_close(&store);
+  trace_close();
+  if (loop_status) {
     fprintf(stderr, ">>> %d <<< [Server Warning] Terminating due to an error.\n", getpid());
-    fclose(job_file);
-    close(sock);
     return EXIT_FAILURE;
   }
   printf(">>> %d <<< <Server Notification> Exiting program.\n", getpid());
-  fclose(job_file);
-  close(sock);
 
   return EXIT_SUCCESS;
 }
@@ -83,9 +281,10 @@ int main(int argc, char *argv[]) {
 /**
 * Create and prepare socket for connections.
 * @port_string   port to connect to
+* @reuse_port    1 if several workers listen on the port (SO_REUSEPORT)
 * Return socket file descriptor on success, -1 otherwise.
 */
-int define_connection(char *port_string) {
+int define_connection(char *port_string, int reuse_port) {
   struct sockaddr_in serveraddr;
 
   int port_int = parse_number(port_string);
@@ -102,8 +301,10 @@ int define_connection(char *port_string) {
   }
 
   int enable = 1;
-  if (setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &enable, sizeof(int))) {
+  if (setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &enable, sizeof(int)) ||
+      (reuse_port && setsockopt(sock, SOL_SOCKET, SO_REUSEPORT, &enable, sizeof(int)))) {
     perror(RED "[Server Error] Failed to change socket properties" RESET);
+    close(sock);
     return -1;
   }
 
@@ -111,12 +312,14 @@ int define_connection(char *port_string) {
   int bind_status = bind(sock, (struct sockaddr *)&serveraddr, sizeof(serveraddr));
   if (bind_status == -1) {
     perror(RED "[Server Error] Failed to assign address to socket" RESET);
+    close(sock);
     return -1;
   }
 
   int listen_status = listen(sock, SOMAXCONN);
   if (listen_status == -1) {
     perror(RED "[Server Error] Failed to prepare socket for connections" RESET);
+    close(sock);
     return -1;
   }
   return sock;
@@ -134,36 +337,6 @@ void prepare_address(struct sockaddr_in *serveraddr, int port) {
   memset(&(serveraddr->sin_zero), '\0', 8);
 }
 
-/**
-* Accept connections from client and start processing queries.
-* @sock     connection socket
-* @fileptr  file to read jobs from
-* Return -1 on error, 0 on success.
-*/
-int accept_connections(int sock, FILE *fileptr) {
-  int client_sock = approve_connection(sock, 0);
-  if (client_sock == -1)
-    return -1;
-  else if (client_sock == -2)
-    return 0;
-
-  if (set_nonblock(sock)) // make socket nonblocking for all new connections
-    return -1;
-
-  while(1) {
-    int request_status = process_request(client_sock, fileptr);
-    if (request_status == -1) {
-      close(client_sock);
-      return -1;
-    } else if (request_status == 1) {
-      break;
-    }
-
-    approve_connection(sock, 1);
-  }
-  return 0;
-}
-
 /**
 * Set socket as nonblocking.
 * @socket   make this socket nonblocking
@@ -179,266 +352,991 @@ int set_nonblock(int socket) {
 }
 
 /**
-* Approve one connection and notify client of whether server is available.
-* @sock       socket used to approve connection
-* @nonblock   specify if socket is nonblocking
-* Return ready socket on success, -1 on error, -2 on interrupt.
+* Raise the soft limit on open files so thousands of clients fit.
 */
-int approve_connection(int sock, int nonblock) {
-  struct sockaddr_in clientaddr;
-  memset(&clientaddr, 0, sizeof(clientaddr));
-  socklen_t clientaddrlen = sizeof(clientaddr);
-
-  int client_sock;
-  client_sock = accept(sock, (struct sockaddr *)&clientaddr, &clientaddrlen);
-  if (!nonblock && client_sock == -1) {
-    if (interrupted)
-      return -2;
-    perror(RED "[Server Error] Could not accept connection" RESET);
-    return -1;
+void raise_file_limit(void) {
+  struct rlimit limit;
+  if (getrlimit(RLIMIT_NOFILE, &limit))
+    return;
+  if (limit.rlim_cur < limit.rlim_max) {
+    limit.rlim_cur = limit.rlim_max;
+    if (setrlimit(RLIMIT_NOFILE, &limit) && debug)
+      perror("[Server Warning] Failed to raise open file limit");
   }
-  connections++;
-
-  if (clientaddr.sin_addr.s_addr) {
-    char *client_ip = inet_ntoa(clientaddr.sin_addr);
-    printf(">>> %d <<< Client connected (address: %s).\n", getpid(), client_ip);
-
-    ssize_t sent;
-    unsigned char available;
-    if (connections == 1) {
-      if (debug)
-        printf(">>> %d <<< Notifying client of server's availability.\n", getpid());
-      available = 0;
-      sent = write(client_sock, &available, sizeof(char));
-    } else if (connections > 1) {
-      if (debug)
-        printf(">>> %d <<< Notifying client that server is busy.\n", getpid());
-      available = (unsigned char) STOP_REQUEST;
-      sent = write(client_sock, &available, sizeof(char));
-      close(client_sock);
-      connections--;
-    }
-    if (sent != sizeof(char)) {
-      fprintf(stderr, RED ">>> %d <<< [Server Error] Failed to send notification to client.\n" RESET, getpid());
-      return -1;
-    }
-    return client_sock;
-  }
-  return -1;
 }
 
-
-/*========================== COMMUNICATION METHODS ===========================*/
-
 /**
-* Process one query from client.
-* Note: requests are processed in nonblocking mode so as to be able
-*       to immediately notify other clients that server is busy.
-* @client_sock   send reply via this socket
-* @fileptr       file to read jobs from
-* Return -1 on error, 0 on success, 1 on success and exit.
-*/
-int process_request(int client_sock, FILE *fileptr) {
-  unsigned char request_char;
-  ssize_t received = recv(client_sock, &request_char, sizeof(char), MSG_DONTWAIT);
-  unsigned int request = (unsigned int) request_char;
-  if (!request || received == -1) {
-    if (interrupted) {
-      send_message(client_sock, NULL);
-      return 1;
-    }
+* Notify a new client of whether server is available.
+* @loop   loop the client was accepted on
+* @conn   newly accepted connection
+* Return 0 if the client is served, 1 if it is told that server is busy.
+*/
+int approve_connection(struct EventLoop *loop, struct Connection *conn) {
+  printf(">>> %d <<< Client connected (address: %s).\n", getpid(), conn->address);
+
+  unsigned char available;
+  if (loop->connections <= loop->max_connections) {
+    if (debug)
+      printf(">>> %d <<< Notifying client of server's availability.\n", getpid());
+    available = 0;
+    out_push_copy(&conn->out, &available, sizeof(char));
     return 0;
   }
 
   if (debug)
-    printf("\n>>> %d <<< Received request (%d) from client.\n", getpid(), request);
+    printf(">>> %d <<< Notifying client that server is busy.\n", getpid());
+  metric_add(&loop->metrics.busy, 1);
+  available = (unsigned char) STOP_REQUEST;
+  out_push_copy(&conn->out, &available, sizeof(char));
+  conn->closing = 1;
+  return 1;
+}
 
-  if (request == ONE_JOB_REQUEST) {
-    return send_message(client_sock, fileptr);
 
-  } else if (request < ALL_JOBS_REQUEST) {
-    int num_jobs = request & 127;
-    for (int i = 0; i < num_jobs; i++) {
-      int send_status = send_message(client_sock, fileptr);
-      if (send_status)
-        return send_status;
-    }
+/*========================== COMMUNICATION METHODS ===========================*/
+
+/**
+* Process one request from the connection's input buffer.
+* Job requests only set how many jobs are owed; the event loop queues them
+* as the client's socket accepts more data. Until a client sends HELLO as
+* its first request, a 0 asks for no jobs, as it did in version 1.
+* @loop   loop the client is served on
+* @conn   connection the request arrived on
+* Return -1 on error, 0 on success, 1 on success and disconnect,
+* 2 if the request is not complete yet.
+*/
+int process_request(struct EventLoop *loop, struct Connection *conn) {
+  unsigned char request = conn->input[conn->input_start];
+  if (request == EXTENDED_REQUEST && conn->negotiated)
+    return process_extended_request(loop, conn);
+  if (request == EXTENDED_REQUEST && conn->greeting) {
+    if (conn->input_length < 2)
+      return 2;
+    if (conn->input[conn->input_start + 1] == EXT_HELLO)
+      return process_extended_request(loop, conn);
+  }
+  conn->greeting = 0;
+  conn->input_start++;
+  conn->input_length--;
+  if (request == EXTENDED_REQUEST) // version 1 client asking for 0 jobs
     return 0;
 
+  TRACE(TRACE_REQUEST, conn->sock, 0, (request < ALL_JOBS_REQUEST) ? (long) (request & 127) : -1);
+
+  if (request < ALL_JOBS_REQUEST) {
+    return add_request(loop, conn, 0, request & 127, 0);
+
   } else if (request == ALL_JOBS_REQUEST) {
-    while(1) {
-      int send_status = send_message(client_sock, fileptr);
-      if (send_status)
-        return 0;
-    }
-    return 0;
+    return add_request(loop, conn, 0, -1, 0);
 
   } else if (request == STOP_REQUEST) {
     printf(">>> %d <<< <Server Notification> Client disconnected.\n", getpid());
     return 1;
 
-  } else if (request > STOP_REQUEST) {
+  } else {
     fprintf(stderr, ">>> %d <<< <Server Notification> Client disconnected with an error.\n", getpid());
     return 1;
+  }
+}
 
-  } else {
-    fprintf(stderr, RED ">>> %d <<< [Server Error] Failed to process request: request type unknown.\n" RESET, getpid());
+/**
+* Report an extended request whose payload cannot be parsed (utility method).
+* @opcode   opcode of the request
+* Return -1.
+*/
+int malformed_request(unsigned char opcode) {
+  fprintf(stderr, RED ">>> %d <<< [Server Error] Failed to process request: malformed extended request (%d).\n" RESET,
+          getpid(), (int) opcode);
+  return -1;
+}
+
+/**
+* Queue a control frame (protocol version 2).
+* @conn      queue on this connection
+* @payload   control opcode followed by its fields
+* @length    payload length, at most OUT_INLINE_SIZE - 5
+* Return 0 on success, -1 if the queue is full.
+*/
+int queue_control(struct Connection *conn, const unsigned char *payload, size_t length) {
+  unsigned char frame[OUT_INLINE_SIZE];
+  size_t header_size = sizeof(char) + sizeof(int);
+  uint32_t length_n = htonl((uint32_t) length);
+  frame[0] = (unsigned char) (TYPE_C << 5);
+  memcpy(frame + 1, &length_n, sizeof(uint32_t));
+  memcpy(frame + header_size, payload, length);
+  return out_push_copy(&conn->out, frame, header_size + length);
+}
+
+/**
+* Queue the control frame that answers a HELLO request.
+* @conn           connection that sent HELLO
+* @capabilities   capabilities supported by both sides
+* Return 0 on success, -1 if the queue is full.
+*/
+int queue_hello(struct Connection *conn, uint32_t capabilities) {
+  unsigned char payload[2 + 5];
+  payload[0] = (unsigned char) CTRL_HELLO;
+  payload[1] = (unsigned char) conn->version;
+  size_t length = 2 + varint_encode(capabilities, payload + 2);
+  return queue_control(conn, payload, length);
+}
+
+/**
+* Settle the capabilities of a connection that sent HELLO.
+* In dictionary mode, only clients that take the dictionary get
+* compressed jobs, since every compressed job may refer to it.
+* @loop           loop the client is served on
+* @conn           connection that sent HELLO
+* @capabilities   capabilities offered by the client
+* Return capabilities supported by both sides.
+*/
+uint32_t negotiate(struct EventLoop *loop, struct Connection *conn, uint32_t capabilities) {
+  uint32_t offered = SERVER_CAPABILITIES | (loop->dispatcher ? CAP_LEASES : (CAP_FILTER | CAP_RESUME));
+  if (loop->store->compression != COMPRESS_NONE)
+    offered |= CAP_COMPRESS;
+  if (loop->store->compression == COMPRESS_DICT)
+    offered |= CAP_DICTIONARY;
+  uint32_t agreed = capabilities & offered;
+  if (loop->store->compression == COMPRESS_DICT && !(agreed & CAP_DICTIONARY))
+    agreed &= ~CAP_COMPRESS;
+  if (!(agreed & CAP_COMPRESS))
+    agreed &= ~CAP_DICTIONARY;
+  conn->acks = (agreed & CAP_LEASES) ? 1 : 0;
+  conn->compress = (agreed & CAP_COMPRESS) ? 1 : 0;
+  conn->checkpoints = (agreed & CAP_RESUME) ? 1 : 0;
+  return agreed;
+}
+
+/**
+* Queue the control frame that carries the compression dictionary.
+* Only the header is copied; the dictionary is sent from the job store.
+* @conn   connection that agreed to DICTIONARY
+* @dict   dictionary of the job store
+* Return 0 on success, -1 if the queue is full.
+*/
+int queue_dictionary(struct Connection *conn, const struct CodecDict *dict) {
+  unsigned char frame[sizeof(char) + sizeof(int) + 1 + 5];
+  size_t header_size = sizeof(char) + sizeof(int);
+  size_t prefix = 1 + varint_encode(dict->id, frame + header_size + 1);
+  uint32_t length_n = htonl((uint32_t) (prefix + dict->length));
+  frame[0] = (unsigned char) (TYPE_C << 5);
+  memcpy(frame + 1, &length_n, sizeof(uint32_t));
+  frame[header_size] = (unsigned char) CTRL_DICTIONARY;
+  if (debug)
+    printf(">>> %d <<< Sending %zu byte dictionary to client.\n", getpid(), dict->length);
+  if (out_push_copy(&conn->out, frame, header_size + prefix))
+    return -1;
+  return out_push(&conn->out, dict->data, dict->length, NULL);
+}
+
+/**
+* Queue the control frame that tells a client that may resume which job
+* file it is being served from.
+* @conn    connection that agreed to RESUME
+* @token   session token of the job store
+* Return 0 on success, -1 if the queue is full.
+*/
+int queue_session(struct Connection *conn, uint64_t token) {
+  unsigned char payload[1 + VARINT_MAX_SIZE];
+  payload[0] = (unsigned char) CTRL_SESSION;
+  size_t length = 1 + varint_encode(token, payload + 1);
+  return queue_control(conn, payload, length);
+}
+
+/**
+* Queue a control frame with the client's position: every job before it
+* was queued or passed over ahead of the frame.
+* @conn   connection that agreed to RESUME
+* Return 0 on success, -1 if the queue is full.
+*/
+int queue_checkpoint(struct Connection *conn) {
+  unsigned char payload[1 + VARINT_MAX_SIZE];
+  payload[0] = (unsigned char) CTRL_CHECKPOINT;
+  size_t length = 1 + varint_encode(conn->next_job, payload + 1);
+  conn->checkpoint = conn->next_job;
+  return queue_control(conn, payload, length);
+}
+
+/**
+* Queue the control frame that answers a STATS request: the metrics of
+* the whole server, as served by the metrics endpoint.
+* @loop   loop the client is served on
+* @conn   connection that sent STATS
+* Return 0 on success, -1 on failure.
+*/
+int queue_stats(struct EventLoop *loop, struct Connection *conn) {
+  size_t length;
+  char *text = metrics_render(loop->store, &length);
+  if (!text) {
+    fprintf(stderr, RED ">>> %d <<< [Server Error] Failed to allocate metrics.\n" RESET, getpid());
     return -1;
   }
+  unsigned char header[sizeof(char) + sizeof(int) + 1];
+  uint32_t length_n = htonl((uint32_t) (1 + length));
+  header[0] = (unsigned char) (TYPE_C << 5);
+  memcpy(header + 1, &length_n, sizeof(uint32_t));
+  header[sizeof(header) - 1] = (unsigned char) CTRL_STATS;
+  if (out_push_copy(&conn->out, header, sizeof(header)) || out_push(&conn->out, text, length, text)) {
+    free(text);
+    return -1;
+  }
+  return 0;
 }
 
+/**
+* Queue a new job request behind those still being served.
+* @loop     loop the client is served on
+* @conn     connection the request arrived on
+* @id       request ID chosen by the client (FETCH_ID only)
+* @jobs     number of jobs, -1 for all jobs
+* @tagged   1 to send a DONE control frame once the request is served
+* Return 0 on success, -1 if too many requests are outstanding.
+*/
+int add_request(struct EventLoop *loop, struct Connection *conn, uint64_t id, long jobs, int tagged) {
+  if (conn->request_count == MAX_PIPELINED_REQUESTS) {
+    fprintf(stderr, RED ">>> %d <<< [Server Error] Failed to process request: too many requests in flight.\n" RESET,
+            getpid());
+    return -1;
+  }
+  struct PendingRequest *request = &conn->requests[(conn->request_head + conn->request_count) % MAX_PIPELINED_REQUESTS];
+  request->id = id;
+  request->jobs = jobs;
+  request->tagged = tagged;
+  request->received = now_ns();
+  conn->request_count++;
+  metric_add(&loop->metrics.requests, 1);
+  if (jobs == -1)
+    metric_add(&loop->metrics.all_requests, 1);
+  else
+    histogram_record(&loop->metrics.request_jobs, (uint64_t) jobs);
 
-/*====================== FILE READING AND JOB CREATION =======================*/
+  if (jobs == -1 || conn->pending_jobs == -1)
+    conn->pending_jobs = -1;
+  else if (conn->pending_jobs > LONG_MAX - jobs)
+    conn->pending_jobs = LONG_MAX;
+  else
+    conn->pending_jobs += jobs;
+  return 0;
+}
 
 /**
-* Send one message to client.
-* @client_sock    send message via this socket
-* @fileptr file   to read jobs from
-* Return 1 if message text is empty, 0 otherwise.
+* Count jobs against the oldest requests, reporting finished FETCH_ID
+* requests to the client.
+* @loop   loop the client is served on
+* @conn   connection the jobs were queued on
+* @jobs   number of jobs just queued
+* Return 0 on success, -1 if the queue is full.
 */
-int send_message(int client_sock, FILE *fileptr) {
-  struct JobMessage *msg = fetch_job(fileptr);
-  int text_length = (msg->text_length == 0) ? 0 : ntohl(msg->text_length) + 1;
-  ssize_t msg_size = sizeof(char) + sizeof(int) + sizeof(char) * text_length;
-  if (debug)
-    printf(">>> %d <<< Sending message (%li bytes) to client.\n", getpid(), msg_size);
-  ssize_t sent_bytes = 0;
-  while (sent_bytes < msg_size) {
-    sent_bytes += write(client_sock, msg + sent_bytes, msg_size - sent_bytes);
-  }
-  micro_sleep(500);
-  free(msg);
-  if (!text_length)
-    return 1;
+int finish_requests(struct EventLoop *loop, struct Connection *conn, long jobs) {
+  while (jobs > 0 && conn->request_count) {
+    struct PendingRequest *request = &conn->requests[conn->request_head];
+    if (request->jobs == -1)
+      return 0;
+    long served = (jobs < request->jobs) ? jobs : request->jobs;
+    request->jobs -= served;
+    jobs -= served;
+    if (request->jobs)
+      return 0;
+
+    if (request->tagged) {
+      unsigned char payload[1 + VARINT_MAX_SIZE];
+      payload[0] = (unsigned char) CTRL_DONE;
+      size_t length = 1 + varint_encode(request->id, payload + 1);
+      if (queue_control(conn, payload, length))
+        return -1;
+    }
+    TRACE(TRACE_DONE, conn->sock, request->id, 0);
+    request_served(loop, conn, request->received);
+    conn->request_head = (conn->request_head + 1) % MAX_PIPELINED_REQUESTS;
+    conn->request_count--;
+  }
   return 0;
 }
 
 /**
-* Read file and put together a job for client.
-* @fileptr  file to read jobs from
-* Return job structure (type Q job on error/EOF).
+* Process an extended request (opcode byte and payload follow the 0 byte).
+* @loop   loop the client is served on
+* @conn   connection the request arrived on
+* Return -1 on error, 0 on success, 2 if the request is not complete yet.
 */
-struct JobMessage *fetch_job(FILE *file_ptr) {
-  if (!file_ptr) {
-    struct JobMessage *quit_msg = create_msg((unsigned char) TYPE_Q, 0, NULL);
-    return quit_msg;
+int process_extended_request(struct EventLoop *loop, struct Connection *conn) {
+  unsigned char *input = conn->input + conn->input_start;
+  if (conn->input_length < 2)
+    return 2;
+  unsigned char opcode = input[1];
+
+  if (opcode == EXT_CREDIT) {
+    uint32_t jobs, bytes;
+    if (conn->input_length < 2 + 2 * sizeof(uint32_t))
+      return 2;
+    memcpy(&jobs, input + 2, sizeof(uint32_t));
+    memcpy(&bytes, input + 2 + sizeof(uint32_t), sizeof(uint32_t));
+    jobs = ntohl(jobs);
+    bytes = ntohl(bytes);
+    conn->flow_control = 1;
+    conn->credit_jobs += jobs;
+    if (bytes) {
+      conn->byte_credit = 1;
+      conn->credit_bytes += bytes;
+    }
+    conn->input_start += 2 + 2 * sizeof(uint32_t);
+    conn->input_length -= 2 + 2 * sizeof(uint32_t);
+    TRACE(TRACE_REQUEST, conn->sock, opcode, jobs);
+    return 0;
+
+  } else if (opcode == EXT_BATCH) {
+    uint32_t batch_jobs;
+    if (conn->input_length < 2 + sizeof(uint32_t))
+      return 2;
+    memcpy(&batch_jobs, input + 2, sizeof(uint32_t));
+    batch_jobs = ntohl(batch_jobs);
+    conn->batch_jobs = (batch_jobs > BATCH_MAX_JOBS) ? BATCH_MAX_JOBS : batch_jobs;
+    conn->input_start += 2 + sizeof(uint32_t);
+    conn->input_length -= 2 + sizeof(uint32_t);
+    if (debug)
+      printf(">>> %d <<< Client accepts batches of up to %ld job(s).\n", getpid(), conn->batch_jobs);
+    return 0;
+
+  } else if (opcode == EXT_CRC32C) {
+    conn->crc32c = 1;
+    conn->input_start += 2;
+    conn->input_length -= 2;
+    if (debug)
+      printf(">>> %d <<< Client asked for CRC32C trailers.\n", getpid());
+    return 0;
+
+  } else if (opcode == EXT_HELLO) {
+    uint64_t capabilities;
+    if (conn->input_length < 3)
+      return 2;
+    int used = varint_decode(input + 3, conn->input_length - 3, &capabilities);
+    if (used == 0)
+      return 2;
+    if (used == -1)
+      return malformed_request(opcode);
+    conn->version = (input[2] < PROTOCOL_VERSION) ? input[2] : PROTOCOL_VERSION;
+    conn->greeting = 0;
+    conn->negotiated = 1;
+    conn->input_start += 3 + used;
+    conn->input_length -= 3 + used;
+    if (debug)
+      printf(">>> %d <<< Client speaks version %d (capabilities 0x%llx).\n", getpid(), (int) input[2],
+             (unsigned long long) capabilities);
+    uint32_t agreed = negotiate(loop, conn, (uint32_t) capabilities);
+    if (queue_hello(conn, agreed))
+      return -1;
+    if ((agreed & CAP_DICTIONARY) && queue_dictionary(conn, &loop->store->dict))
+      return -1;
+    return (agreed & CAP_RESUME) ? queue_session(conn, loop->store->token) : 0;
+
+  } else if ((opcode == EXT_FETCH || opcode == EXT_FETCH_ID) && conn->version >= 2) {
+    uint64_t id = 0, jobs;
+    int id_used = 0;
+    if (opcode == EXT_FETCH_ID) {
+      id_used = varint_decode(input + 2, conn->input_length - 2, &id);
+      if (id_used == 0)
+        return 2;
+      if (id_used == -1)
+        return malformed_request(opcode);
+    }
+    int used = varint_decode(input + 2 + id_used, conn->input_length - 2 - id_used, &jobs);
+    if (used == 0)
+      return 2;
+    if (used == -1)
+      return malformed_request(opcode);
+    conn->input_start += 2 + id_used + used;
+    conn->input_length -= 2 + id_used + used;
+    long count = (!jobs || jobs > LONG_MAX) ? -1 : (long) jobs;
+    TRACE(TRACE_REQUEST, conn->sock, opcode, count);
+    return add_request(loop, conn, id, count, opcode == EXT_FETCH_ID);
+
+  } else if (opcode == EXT_ACK && conn->acks) {
+    uint64_t jobs;
+    int used = varint_decode(input + 2, conn->input_length - 2, &jobs);
+    if (used == 0)
+      return 2;
+    if (used == -1)
+      return malformed_request(opcode);
+    conn->input_start += 2 + used;
+    conn->input_length -= 2 + used;
+    TRACE(TRACE_REQUEST, conn->sock, opcode, jobs);
+    dispatch_ack(loop->dispatcher, &conn->leases, (unsigned long) jobs);
+    return 0;
+
+  } else if (opcode == EXT_STATS && conn->version >= 2) {
+    conn->input_start += 2;
+    conn->input_length -= 2;
+    TRACE(TRACE_REQUEST, conn->sock, opcode, 0);
+    return queue_stats(loop, conn);
+
+  } else if (opcode == EXT_FILTER && conn->version >= 2 && !loop->dispatcher) {
+    uint64_t length;
+    if (conn->input_length < 3)
+      return 2;
+    int used = varint_decode(input + 3, conn->input_length - 3, &length);
+    if (used == 0)
+      return 2;
+    if (used == -1 || length > FILTER_MAX_PATTERN)
+      return malformed_request(opcode);
+    if (conn->input_length < 3 + used + length)
+      return 2;
+    filter_set(&conn->filter, input[2], (const char *) input + 3 + used, (size_t) length);
+    conn->input_start += 3 + used + length;
+    conn->input_length -= 3 + used + length;
+    TRACE(TRACE_REQUEST, conn->sock, opcode, length);
+    if (debug)
+      printf(">>> %d <<< Client filters jobs (types 0x%02x, %d byte pattern, %s search).\n", getpid(),
+             (unsigned int) conn->filter.types, (int) length, filter_engine());
+    return 0;
+
+  } else if (opcode == EXT_RESUME && conn->checkpoints) {
+    uint64_t checkpoint, jobs;
+    int checkpoint_used = varint_decode(input + 2, conn->input_length - 2, &checkpoint);
+    if (checkpoint_used == 0)
+      return 2;
+    if (checkpoint_used == -1)
+      return malformed_request(opcode);
+    int used = varint_decode(input + 2 + checkpoint_used, conn->input_length - 2 - checkpoint_used, &jobs);
+    if (used == 0)
+      return 2;
+    if (used == -1)
+      return malformed_request(opcode);
+    conn->input_start += 2 + checkpoint_used + used;
+    conn->input_length -= 2 + checkpoint_used + used;
+    TRACE(TRACE_REQUEST, conn->sock, opcode, checkpoint);
+    // without a filter every job counts, so the index takes the client straight there
+    conn->next_job = conn->filter.active ? checkpoint : checkpoint + jobs;
+    conn->resume_jobs = conn->filter.active ? jobs : 0;
+    conn->checkpoint = conn->next_job;
+    conn->scan_job = conn->next_job;
+    conn->waiting = 0;
+    if (debug)
+      printf(">>> %d <<< Client resumes at job %llu, passing over %llu more.\n", getpid(),
+             (unsigned long long) conn->next_job, (unsigned long long) conn->resume_jobs);
+    return 0;
   }
 
+  fprintf(stderr, RED ">>> %d <<< [Server Error] Failed to process request: unknown extended request (%d).\n" RESET,
+          getpid(), (int) opcode);
+  return -1;
+}
+
+
+/*================================= WORKERS ==================================*/
+
+/**
+* Create one listening socket and event loop per worker. With several
+* workers, each socket is bound with SO_REUSEPORT so the kernel spreads
+* new connections over them; the job store and dispatcher are shared.
+* @workers        filled in with the prepared workers
+* @worker_count   filled in with the number of workers prepared
+* @options        server options
+* @port_string    port to listen on
+* @store          job store shared by all workers
+* @dispatcher     dispatcher shared by all workers, or NULL
+* @cache          frame cache shared by all workers, or NULL
+* @ring           broadcast ring shared by all workers, or NULL
+* Return 0 on success, -1 on error.
+*/
+int start_workers(struct Worker *workers, int *worker_count, struct ServerOptions *options, char *port_string,
+                  struct JobStore *store, struct Dispatcher *dispatcher, struct FrameCache *cache,
+                  struct Broadcast *ring) {
+  int count = options->workers;
+  int max_connections = (options->max_connections + count - 1) / count;
   if (debug)
-    printf("\n>>> %d <<< Reading from file.\n", getpid());
-  unsigned char job_type = fgetc(file_ptr);
-  if (job_type == 'O')
-    job_type = (unsigned char) TYPE_O;
-  else if (job_type == 'E')
-    job_type = (unsigned char) TYPE_E;
-  else
-    job_type = 'U'; // Unknown type
+    printf(">>> %d <<< Starting %d worker(s).\n", getpid(), count);
 
-  unsigned int text_length = 0;
-  for (int i = 0; i < 4; i++) {
-    // unaffected by endianness due to bit shifting
-    text_length += ((unsigned int) fgetc(file_ptr) << 8*i);
+  for (int i = 0; i < count; i++) {
+    struct Worker *worker = &workers[i];
+    worker->sock = define_connection(port_string, count > 1);
+    if (worker->sock == -1)
+      return -1;
+    if (set_nonblock(worker->sock) || loop_init(&worker->loop, worker->sock, store, max_connections,
+                                               options->io_backend)) {
+      close(worker->sock);
+      return -1;
+    }
+    worker->loop.send_mode = options->send_mode;
+    worker->loop.dispatcher = dispatcher;
+    worker->loop.cache = cache;
+    worker->loop.broadcast = ring;
+    worker->loop.pool.cap = options->memory_cap / count;
+    worker->status = 0;
+    interrupt_fds[i] = worker->loop.wake_fd;
+    interrupt_fd_count = i + 1;
+    *worker_count = i + 1;
+  }
+  return job_store_start(store, options->index_threads);
+}
+
+/**
+* Thread entry point of every worker but the first.
+* @arg   worker to run
+*/
+static void *worker_thread(void *arg) {
+  struct Worker *worker = (struct Worker *) arg;
+  worker->status = loop_run(&worker->loop);
+  if (worker->status)
+    stop_workers(); // one failed worker shuts the whole server down
+  return NULL;
+}
+
+/**
+* Run every worker's event loop until the server is interrupted.
+* The first worker runs on the calling thread.
+* @workers        workers to run
+* @worker_count   number of workers
+* Return 0 on success, -1 if any worker failed.
+*/
+int run_workers(struct Worker *workers, int worker_count) {
+  int started = 1;
+  for (; started < worker_count; started++) {
+    if (pthread_create(&workers[started].thread, NULL, worker_thread, &workers[started])) {
+      fprintf(stderr, RED ">>> %d <<< [Server Error] Failed to start worker thread.\n" RESET, getpid());
+      stop_workers();
+      break;
+    }
   }
 
-  // maximum text length specified in "genjob.c" is 54,378 symbols
-  if (!feof(file_ptr) && (text_length > 54378 || job_type == 'U')) {
-    printf("Len: %d\n", text_length);
-    printf("Type: %c\n", job_type);
-    fprintf(stderr, ">>> %d <<< Invalid job encountered in file.\n", getpid());
-    struct JobMessage *quit_msg = create_msg((unsigned char) TYPE_Q, 0, NULL);
-    return quit_msg;
+  int status = loop_run(&workers[0].loop);
+  if (status)
+    stop_workers();
+  for (int i = 1; i < started; i++) {
+    pthread_join(workers[i].thread, NULL);
+    if (workers[i].status)
+      status = -1;
   }
+  return (status || started < worker_count) ? -1 : 0;
+}
 
-  if (!feof(file_ptr)) {
-    char *job_text = (char *) malloc(text_length+1);
-    fread(job_text, sizeof(char), text_length, file_ptr);
-    job_text[text_length] = '\0';
-    struct JobMessage *msg = create_msg(job_type, text_length, job_text);
-    return msg;
+/**
+* Close every worker's connections, event loop and listening socket.
+* @workers        workers to close
+* @worker_count   number of workers
+*/
+void close_workers(struct Worker *workers, int worker_count) {
+  interrupt_fd_count = 0;
+  for (int i = 0; i < worker_count; i++) {
+    loop_close(&workers[i].loop);
+    close(workers[i].sock);
+  }
+}
 
-  } else {
+
+/*====================== FILE READING AND JOB CREATION =======================*/
+
+/**
+* Queue one message for client.
+* The job text is sent straight from the job file; only the five-byte
+* header is built here. Depending on the send mode, large texts go out
+* with sendfile() or MSG_ZEROCOPY and never pass through user space.
+* Clients that accept batches get several small jobs in one batch frame.
+* In broadcast mode, runs of jobs are queued from the shared ring instead.
+* Jobs the client's filter rejects are passed over.
+* @loop   loop holding the job store
+* @conn   queue message on this connection
+* Return 1 if message text is empty, 2 if the job is not indexed yet,
+* 3 if only unwanted jobs were found so far, 0 otherwise, -1 on error.
+*/
+int send_message(struct EventLoop *loop, struct Connection *conn) {
+  if (loop->broadcast && !conn->crc32c && !conn->compress && !conn->filter.active) {
+    int spanned = send_span(loop, conn);
+    if (spanned)
+      return (spanned == -1) ? -1 : 0;
+  }
+  if (conn->batch_jobs > 1) {
+    int batched = send_batch(loop, conn);
+    if (batched == -2)
+      return 3;
+    if (batched)
+      return (batched == -1) ? -1 : 0;
+  }
+
+  size_t job;
+  struct JobEntry entry;
+  int taken = take_jobs(loop, conn, &job, &entry, 1, 0);
+  if (taken == 0)
+    return 2;
+  if (taken == -2)
+    return 3;
+  if (taken == -1) {
     if (debug)
-      printf(">>> %d <<< EOF encountered when reading file.\n", getpid());
-    struct JobMessage *quit_msg = create_msg((unsigned char) TYPE_Q, 0, NULL);
-    return quit_msg;
+      printf(">>> %d <<< No jobs left for client.\n", getpid());
+    if (conn->checkpoints && conn->next_job != conn->checkpoint && queue_checkpoint(conn))
+      return -1;
+    return queue_quit(conn) ? -1 : 1;
+  }
+  return send_job(loop, conn, job, &entry);
+}
+
+/**
+* Queue one job in its own frame.
+* @loop    loop holding the job store
+* @conn    queue the job on this connection
+* @job     job number
+* @entry   indexed job
+* Return 0 on success, -1 if the queue is full.
+*/
+int send_job(struct EventLoop *loop, struct Connection *conn, size_t job, struct JobEntry *entry) {
+  size_t size = frame_size(conn, entry);
+  TRACE(TRACE_FRAME, conn->sock, job, size);
+  if (queue_job(loop, conn, entry))
+    return -1;
+  return charge_jobs(loop, conn, &job, 1, size);
+}
+
+/**
+* Queue a run of the client's next jobs from the broadcast ring, as one
+* segment referring to the ring. The run stays within the current
+* request, the client's credits and the queued bytes limit.
+* @loop   loop holding the ring
+* @conn   queue the jobs on this connection
+* Return number of jobs queued, 0 if the ring does not hold the next job
+* (it is sent from the job file), -1 if the queue is full.
+*/
+int send_span(struct EventLoop *loop, struct Connection *conn) {
+  long limit = LONG_MAX;
+  long request_jobs = conn->request_count ? conn->requests[conn->request_head].jobs : conn->pending_jobs;
+  if (request_jobs > 0)
+    limit = request_jobs;
+  if (conn->flow_control && conn->credit_jobs < limit)
+    limit = conn->credit_jobs;
+  long max_bytes = (long) (QUEUED_BYTES_LIMIT - conn->out.pending_bytes);
+  if (conn->byte_credit && conn->credit_bytes < max_bytes)
+    max_bytes = conn->credit_bytes;
+
+  struct BroadcastSpan span;
+  long jobs = broadcast_span(loop->broadcast, conn->next_job, limit, max_bytes, &span);
+  if (!jobs)
+    return 0;
+  TRACE(TRACE_SPAN, conn->sock, jobs, span.length);
+  if (out_push_shared(&conn->out, span.data, span.length, span.chunk, broadcast_release)) {
+    broadcast_release(span.chunk);
+    return -1;
   }
+  metric_add(&loop->metrics.ring_jobs, (uint64_t) jobs);
+  if (charge_jobs(loop, conn, NULL, jobs, span.length))
+    return -1;
+  return (int) jobs;
 }
 
 /**
-* Create job structure
-* @job_type     type of job to create (can be 'O', 'E' or 'Q')
-* @text_length  length of job text
-* @job_text     text of job to create
-* Return job structure.
+* Queue one job: its header, its text and the terminator. Clients that
+* agreed to COMPRESS get the stored compressed copy instead of the text,
+* if the job has one.
+* @loop    loop holding the job store
+* @conn    queue the job on this connection
+* @entry   indexed job
+* Return 0 on success, -1 if the queue is full.
 */
-struct JobMessage *create_msg(unsigned char job_type, unsigned int text_length, char* job_text) {
-  size_t msg_size;
-  if (text_length)
-    msg_size = sizeof(char) + sizeof(int) + sizeof(char) * (text_length + 1);
+int queue_job(struct EventLoop *loop, struct Connection *conn, struct JobEntry *entry) {
+  struct JobMessage header;
+  header.job_info = (unsigned char) ((entry->type << 5) + entry->checksum);
+  header.text_length = htonl(entry->length);
+  if (conn->compress && entry->packed_length) {
+    header.job_info = (unsigned char) ((TYPE_Z << 5) + entry->checksum);
+    header.text_length = htonl(entry->packed_length);
+    if (out_push_copy(&conn->out, &header, sizeof(char) + sizeof(int)) ||
+        out_push(&conn->out, entry->packed, entry->packed_length, NULL) || queue_terminator(conn, entry))
+      return -1;
+    return 0;
+  }
+
+  if (loop->cache && loop->send_mode == SEND_SENDFILE && entry->length >= SENDFILE_THRESHOLD) {
+    int cached = queue_cached(loop, conn, entry);
+    if (cached != 1)
+      return cached;
+  }
+  if (loop->store->framed && entry->length)
+    return queue_frame(loop, conn, entry);
+  if (out_push_copy(&conn->out, &header, sizeof(char) + sizeof(int)))
+    return -1;
+  if (!entry->length)
+    return 0;
+  const char *text = job_store_text(loop->store, entry);
+  int push_status;
+  if (loop->send_mode == SEND_SENDFILE && entry->length >= SENDFILE_THRESHOLD)
+    push_status = out_push_file(&conn->out, loop->store->fd, (off_t) entry->offset, entry->length);
+  else if (loop->send_mode == SEND_ZEROCOPY && entry->length >= ZEROCOPY_THRESHOLD)
+    push_status = out_push_zerocopy(&conn->out, text, entry->length);
   else
-    msg_size = sizeof(char) + sizeof(int);
-  if (debug)
-    printf(">>> %d <<< Allocating memory (%li bytes) for job structure.\n", getpid(), msg_size);
-  struct JobMessage *msg = (struct JobMessage *) malloc(msg_size);
-  msg->text_length = htonl(text_length);
-  if (text_length)
-    strncpy(msg->job_text, job_text, text_length+1);
-  unsigned char job_info = (job_type << 5);
-  if (job_type == (char) TYPE_O || job_type == (char) TYPE_E)
-    job_info += checksum(job_text);
-  msg->job_info = job_info;
-  free(job_text);
-  return msg;
+    push_status = out_push(&conn->out, text, entry->length, NULL);
+  return (push_status || queue_terminator(conn, entry)) ? -1 : 0;
 }
 
+/**
+* Queue a job of a compiled job file, whose header, text and terminator
+* lie back to back in the file: the whole frame goes out as one byte
+* range, followed by the CRC32C trailer if the client asked for it.
+* @loop    loop holding the job store
+* @conn    queue the job on this connection
+* @entry   indexed job with a text
+* Return 0 on success, -1 if the queue is full.
+*/
+int queue_frame(struct EventLoop *loop, struct Connection *conn, struct JobEntry *entry) {
+  size_t header_size = sizeof(char) + sizeof(int);
+  size_t length = header_size + entry->length + 1;
+  const char *frame = job_store_text(loop->store, entry) - header_size;
+  int push_status;
+  if (loop->send_mode == SEND_SENDFILE && entry->length >= SENDFILE_THRESHOLD)
+    push_status = out_push_file(&conn->out, loop->store->fd, (off_t) (entry->offset - header_size), length);
+  else if (loop->send_mode == SEND_ZEROCOPY && entry->length >= ZEROCOPY_THRESHOLD)
+    push_status = out_push_zerocopy(&conn->out, frame, length);
+  else
+    push_status = out_push(&conn->out, frame, length, NULL);
+  if (push_status || !conn->crc32c)
+    return push_status ? -1 : 0;
+  uint32_t crc = htonl(entry->crc32c);
+  return out_push_copy(&conn->out, &crc, CRC32C_TRAILER_SIZE);
+}
 
-/*====================== MISCELLANIOUS UTILITY METHODS =======================*/
+/**
+* Queue a large job as a frame from the frame cache, in one segment that
+* goes out along with its neighbours instead of its own sendfile().
+* @loop    loop holding the frame cache
+* @conn    queue the job on this connection
+* @entry   indexed job with a text
+* Return 0 on success, -1 if the queue is full, 1 if the frame cannot be
+* cached (the job is then sent from the file).
+*/
+int queue_cached(struct EventLoop *loop, struct Connection *conn, struct JobEntry *entry) {
+  struct CachedFrame *frame = frame_cache_get(loop->cache, entry);
+  if (!frame)
+    return 1;
+  if (out_push_shared(&conn->out, frame->data, frame->length, frame, frame_release)) {
+    frame_release(frame);
+    return -1;
+  }
+  if (!conn->crc32c)
+    return 0;
+  uint32_t crc = htonl(entry->crc32c);
+  return out_push_copy(&conn->out, &crc, CRC32C_TRAILER_SIZE);
+}
 
 /**
-* Parse a positive integer in string form.
-* @number_string  number to parse in string form
-* Return parsed number on sucess, -1 on failure.
+* Take the next jobs to send to a client: the client's own next jobs,
+* or in dispatch mode jobs that no other client holds. Jobs the client's
+* filter rejects, and wanted jobs it kept from the session it resumes,
+* are passed over, at most FILTER_SCAN_JOBS per call; the client moves
+* past those ahead of the first job taken right away. The filter looks at
+* every job once: the scan goes on from conn->scan_job in the next call.
+* A batch stops before the first job that does not fit in it, so every job
+* taken is sent.
+* @loop      loop holding the job store
+* @conn      connection the jobs are for
+* @jobs      filled in with the job numbers
+* @entries   filled in with the indexed jobs
+* @count     most jobs to take
+* @batch     1 if the jobs go out in one batch frame
+* Return number of jobs taken, 0 if none is available yet, -1 if no jobs
+* are left, -2 if only unwanted jobs were found so far.
 */
-int parse_number(char *number_string) {
-  char *endptr;
-  int result = strtol(number_string, &endptr, 10);
-  if (endptr == number_string && result == 0)
-    result = -1;
-  return result;
+int take_jobs(struct EventLoop *loop, struct Connection *conn, size_t *jobs, struct JobEntry *entries, int count,
+              int batch) {
+  int taken = 0;
+  if (loop->dispatcher) {
+    taken = dispatch_claim(loop->dispatcher, jobs, count);
+    if (taken > 0)
+      TRACE(TRACE_CLAIM, conn->sock, jobs[0], taken);
+    for (int i = 0; i < taken; i++)
+      job_store_get(loop->store, jobs[i], &entries[i]);
+    return taken;
+  }
+
+  int status = 0;
+  int passed = 0;
+  size_t payload = 0;
+  if (conn->next_job < conn->scan_job) // rejected after the jobs taken last time
+    conn->next_job = conn->scan_job;
+  size_t job = conn->next_job;
+  while (taken < count && !(status = job_store_get(loop->store, job, &entries[taken]))) {
+    struct JobEntry *entry = &entries[taken];
+    if (batch && !batch_fits(conn, entry, payload))
+      break;
+    int wanted = !conn->filter.active ||
+                 filter_match(&conn->filter, entry->type, job_store_text(loop->store, entry), entry->length);
+    if (wanted && !conn->resume_jobs) {
+      payload += frame_size(conn, entry);
+      jobs[taken++] = job++;
+      continue;
+    }
+    job++;
+    if (wanted)
+      conn->resume_jobs--; // nothing is taken before these run out
+    else
+      metric_add(&loop->metrics.filtered, 1);
+    if (!taken)
+      conn->next_job = job;
+    if (++passed == FILTER_SCAN_JOBS)
+      break;
+  }
+  conn->scan_job = job;
+  if (passed == FILTER_SCAN_JOBS && !taken)
+    return -2;
+  return (!taken && status == -1) ? -1 : taken;
 }
 
 /**
-* Compute  checksum (Rule: sum of all characters in text % 32)
-* @text    compute checksum of this text
-* Return checksum as unsigned char.
+* Check whether a job can join a batch frame: it is not empty, too small
+* for sendfile() and keeps the batch within BATCH_MAX_BYTES, and the client
+* still has byte credit for it.
+* @conn      connection the batch is for
+* @entry     indexed job
+* @payload   bytes already in the batch
+* Return 1 if the job fits, 0 otherwise.
 */
-unsigned char checksum(char *text) {
-  if (strlen(text)) {
-    unsigned int sum = 0;
-    for (unsigned int i = 0; i < strlen(text); i++)
-      sum += text[i];
-    unsigned char checksum = (unsigned char) (sum % 32);
-    return checksum;
-  } else {
+int batch_fits(struct Connection *conn, struct JobEntry *entry, size_t payload) {
+  if (!entry->length || entry->length >= SENDFILE_THRESHOLD)
+    return 0;
+  if (payload + frame_size(conn, entry) > BATCH_MAX_BYTES)
+    return 0;
+  return !conn->byte_credit || conn->credit_bytes - (long) payload > 0;
+}
+
+/**
+* Size of a job on the wire, including the CRC32C trailer if the client
+* asked for one. Compressed jobs count with their compressed size.
+* @conn    connection the job is sent on
+* @entry   indexed job
+* Return number of bytes.
+*/
+size_t frame_size(struct Connection *conn, struct JobEntry *entry) {
+  if (!entry->length)
+    return sizeof(char) + sizeof(int);
+  size_t payload = (conn->compress && entry->packed_length) ? entry->packed_length : entry->length;
+  return sizeof(char) + sizeof(int) + payload + 1 + (conn->crc32c ? CRC32C_TRAILER_SIZE : 0);
+}
+
+/**
+* Queue the terminating 0 after a job text, followed by the job's CRC32C
+* if the client asked for it.
+* @conn    queue on this connection
+* @entry   indexed job
+* Return 0 on success, -1 if the queue is full.
+*/
+int queue_terminator(struct Connection *conn, struct JobEntry *entry) {
+  static const char terminator = '\0';
+  if (!conn->crc32c)
+    return out_push(&conn->out, &terminator, sizeof(char), NULL);
+  unsigned char trailer[1 + CRC32C_TRAILER_SIZE];
+  uint32_t crc = htonl(entry->crc32c);
+  trailer[0] = 0;
+  memcpy(trailer + 1, &crc, CRC32C_TRAILER_SIZE);
+  return out_push_copy(&conn->out, trailer, sizeof(trailer));
+}
+
+/**
+* Queue up to conn->batch_jobs small jobs as one batch frame.
+* The batch is gathered from the index first, so its length is known
+* before the header is queued; the whole frame then leaves in a single
+* writev(). Jobs large enough for sendfile() end the batch.
+* @loop   loop holding the job store
+* @conn   queue the batch on this connection
+* Return number of jobs queued (0 if fewer than two could be batched),
+* -2 if only unwanted jobs were found so far, -1 on error.
+*/
+int send_batch(struct EventLoop *loop, struct Connection *conn) {
+  size_t jobs[BATCH_MAX_JOBS];
+  struct JobEntry entries[BATCH_MAX_JOBS];
+  long limit = conn->batch_jobs;
+  long request_jobs = conn->request_count ? conn->requests[conn->request_head].jobs : conn->pending_jobs;
+  if (request_jobs > 0 && request_jobs < limit) // a batch never spans two requests
+    limit = request_jobs;
+  if (conn->flow_control && conn->credit_jobs < limit)
+    limit = conn->credit_jobs;
+  if ((long) (out_space(&conn->out) - 2) / 3 < limit)
+    limit = (out_space(&conn->out) - 2) / 3;
+
+  if (limit < 2)
     return 0;
+  int taken = take_jobs(loop, conn, jobs, entries, (int) limit, 1);
+  if (taken == -2)
+    return -2;
+  int count = 0;
+  size_t payload = 0;
+  while (count < taken && batch_fits(conn, &entries[count], payload)) { // only dispatched jobs may not fit
+    payload += frame_size(conn, &entries[count]);
+    count++;
   }
+  if (count == 1 && !loop->dispatcher) // past the filter already, so it is not taken twice
+    return send_job(loop, conn, jobs[0], &entries[0]) ? -1 : 1;
+  if (count < 2)
+    count = 0;
+  if (loop->dispatcher && taken > count) // the rest goes out next
+    dispatch_unclaim(loop->dispatcher, jobs + count, taken - count);
+  if (!count)
+    return 0;
+
+  TRACE(TRACE_BATCH, conn->sock, count, payload);
+  struct JobMessage header;
+  header.job_info = (unsigned char) (TYPE_B << 5);
+  header.text_length = htonl((uint32_t) payload);
+  if (out_push_copy(&conn->out, &header, sizeof(char) + sizeof(int)))
+    return -1;
+  for (int i = 0; i < count; i++) {
+    if (queue_job(loop, conn, &entries[i]))
+      return -1;
+  }
+  if (charge_jobs(loop, conn, jobs, count, payload))
+    return -1;
+  return count;
 }
 
 /**
-* Suspend process for a time.
-* @microseconds  suspend for this many microseconds
-* Return 0 on success, -1 on failure.
+* Advance a connection past jobs that were queued (utility method), and
+* past the jobs its filter rejected in between. A client that may resume
+* is told its position every CHECKPOINT_JOBS jobs.
+* In dispatch mode the jobs are leased to clients that acknowledge them.
+* @loop    loop holding the dispatcher
+* @conn    connection the jobs were queued on
+* @jobs    job numbers, NULL if they follow the connection's next job
+* @count   number of jobs
+* @bytes   their size on the wire
+* Return 0 on success, -1 if the queue is full.
+*/
+int charge_jobs(struct EventLoop *loop, struct Connection *conn, const size_t *jobs, long count, size_t bytes) {
+  if (loop->dispatcher && conn->acks && dispatch_lease(loop->dispatcher, &conn->leases, jobs, (int) count, now_ms()))
+    return -1;
+  size_t next_job = conn->next_job + count;
+  if (jobs && !loop->dispatcher && jobs[count - 1] + 1 > next_job)
+    next_job = jobs[count - 1] + 1; // rejected jobs in between, counted by take_jobs()
+  conn->next_job = next_job;
+  if (conn->pending_jobs > 0)
+    conn->pending_jobs -= count;
+  conn->credit_jobs -= count;
+  conn->credit_bytes -= (long) bytes;
+  metric_add(&loop->metrics.jobs_sent, (uint64_t) count);
+  if (conn->checkpoints && conn->next_job - conn->checkpoint >= CHECKPOINT_JOBS && queue_checkpoint(conn))
+    return -1;
+  return finish_requests(loop, conn, count);
+}
+
+/**
+* Queue a type 'Q' job, telling client that no jobs are left.
+* @conn   queue message on this connection
+* Return 0 on success, -1 on error.
+*/
+int queue_quit(struct Connection *conn) {
+  struct JobMessage quit_msg;
+  quit_msg.job_info = (unsigned char) (TYPE_Q << 5);
+  quit_msg.text_length = 0;
+  return out_push_copy(&conn->out, &quit_msg, sizeof(char) + sizeof(int));
+}
+
+
+/*====================== MISCELLANIOUS UTILITY METHODS =======================*/
+
+/**
+* Parse a positive integer in string form.
+* @number_string  number to parse in string form
+* Return parsed number on sucess, -1 on failure.
 */
-int micro_sleep(unsigned long microseconds) {
-  struct timespec req, rem;
-  time_t seconds = (int) (microseconds/1000000);
-  time_t nanoseconds = microseconds * 1000;
-  req.tv_sec = seconds;
-  req.tv_nsec = nanoseconds;
-  int sleep_status = nanosleep(&req, &rem);
-  if (sleep_status && !interrupted)
-    fprintf(stderr, ">>> %d <<< [Server Warning] Failed to sleep for %li ms.\n", getpid(), microseconds);
-  return sleep_status;
+int parse_number(char *number_string) {
+  char *endptr;
+  int result = strtol(number_string, &endptr, 10);
+  if (endptr == number_string && result == 0)
+    result = -1;
+  return result;
 }
 
 /**
@@ -448,6 +1346,23 @@ int micro_sleep(unsigned long microseconds) {
 void handler(int signum) {
   if (signum == SIGINT) {
     printf(">>> %d <<< Received interrupt signal.\n", getpid());
-    interrupted = 1;
+    stop_workers();
+  } else if (signum == SIGUSR1) {
+    int saved = errno;
+    trace_dump();
+    errno = saved;
+  }
+}
+
+/**
+* Make every worker shut down, even those waiting in epoll_wait().
+* Async-signal-safe.
+*/
+void stop_workers(void) {
+  uint64_t one = 1;
+  interrupted = 1;
+  for (int i = 0; i < interrupt_fd_count; i++) {
+    if (write(interrupt_fds[i], &one, sizeof(one)) != sizeof(one))
+      continue;
   }
 }
@@ -10,44 +10,101 @@
 #include <signal.h>
 #include <time.h>
 #include <fcntl.h>
+#include <stdint.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <poll.h>
+#include <sys/inotify.h>
+#include <sys/uio.h>
+#include <stdarg.h>
 
-/* Brief request protocol description:
-   Request type: unsigned char, 1 byte (8 bits).
-   Request value:
-     If 0 - 126, this many jobs are requested.
-     If 127, all jobs are requested.
-     If 128, normal termination.
-     If 129 - 255, termination with error. */
-
-#define ONE_JOB_REQUEST 1
-#define ALL_JOBS_REQUEST 127
-#define STOP_REQUEST 128
-#define ERROR_REQUEST 129 // or any other value between 129 and 255
-
-#define TYPE_O 0 // "000" bit pattern
-#define TYPE_E 1 // "001" bit pattern
-#define TYPE_Q 7 // "111" bit pattern
+#include "protocol.h"
+#include "job_store.h"
+#include "checksum.h"
+#include "event_loop.h"
+#include "uring_loop.h"
+#include "dispatcher.h"
+#include "metrics.h"
+#include "trace.h"
+#include "frame_cache.h"
+#include "broadcast.h"
+#include "filter.h"
 
 #define RED   "\x1B[31m"
 #define RESET "\x1B[0m"
 
-struct JobMessage {
-  unsigned char job_info;
-  int text_length;
-  char job_text[];
-} __attribute__((packed));
+/* Command line options following the job file and port. */
+struct ServerOptions {
+  int max_connections;
+  int index_threads;
+  int send_mode;       // SEND_WRITEV, SEND_SENDFILE or SEND_ZEROCOPY
+  int dispatch;        // hand every job to one client only
+  long lease_ms;       // time a client has to acknowledge a job
+  int workers;         // event loop threads
+  int io_backend;      // IO_EPOLL or IO_URING
+  int compression;     // COMPRESS_NONE, COMPRESS_FAST or COMPRESS_DICT
+  int follow;          // keep indexing jobs appended to the job file
+  int metrics_port;    // localhost port of the metrics endpoint, 0 for none
+  char *trace_path;    // file the event trace is written to, NULL for none
+  size_t memory_cap;   // bytes of connection state and out queues, 0 for no limit
+  size_t frame_cache;  // bytes of job frames cached, 0 for no cache
+  int broadcast;       // send jobs from a shared ring of built frames
+};
+
+#define MAX_WORKERS MAX_STORE_WATCHERS
+
+/* One event loop thread with its own listening socket. */
+struct Worker {
+  struct EventLoop loop;
+  int sock;
+  pthread_t thread;
+  int status;          // result of loop_run()
+};
 
 int usage(int argc, char* argv[]);
+int parse_options(int argc, char *argv[], struct ServerOptions *options);
 int parse_number(char *number_string);
-unsigned char checksum(char *text);
-struct JobMessage *create_msg(unsigned char job_type, unsigned int text_length, char* job_text);
-struct JobMessage *fetch_job(FILE *file_ptr);
+int queue_quit(struct Connection *conn);
 void prepare_address(struct sockaddr_in *serveraddr, int port);
-int define_connection(char *port_string);
-int send_message(int client_sock, FILE *fileptr);
-int process_request(int client_sock, FILE *fileptr);
-int accept_connections(int sock, FILE *fileptr);
-int approve_connection(int socket, int nonblock);
+int define_connection(char *port_string, int reuse_port);
+int start_workers(struct Worker *workers, int *worker_count, struct ServerOptions *options, char *port_string,
+                  struct JobStore *store, struct Dispatcher *dispatcher, struct FrameCache *cache,
+                  struct Broadcast *ring);
+int run_workers(struct Worker *workers, int worker_count);
+void close_workers(struct Worker *workers, int worker_count);
+int send_message(struct EventLoop *loop, struct Connection *conn);
+int send_job(struct EventLoop *loop, struct Connection *conn, size_t job, struct JobEntry *entry);
+int send_batch(struct EventLoop *loop, struct Connection *conn);
+int send_span(struct EventLoop *loop, struct Connection *conn);
+size_t frame_size(struct Connection *conn, struct JobEntry *entry);
+int batch_fits(struct Connection *conn, struct JobEntry *entry, size_t payload);
+int queue_terminator(struct Connection *conn, struct JobEntry *entry);
+int queue_cached(struct EventLoop *loop, struct Connection *conn, struct JobEntry *entry);
+int take_jobs(struct EventLoop *loop, struct Connection *conn, size_t *jobs, struct JobEntry *entries, int count,
+              int batch);
+int charge_jobs(struct EventLoop *loop, struct Connection *conn, const size_t *jobs, long count, size_t bytes);
+int process_request(struct EventLoop *loop, struct Connection *conn);
+int process_extended_request(struct EventLoop *loop, struct Connection *conn);
+int malformed_request(unsigned char opcode);
+int queue_control(struct Connection *conn, const unsigned char *payload, size_t length);
+int queue_hello(struct Connection *conn, uint32_t capabilities);
+int queue_dictionary(struct Connection *conn, const struct CodecDict *dict);
+int queue_session(struct Connection *conn, uint64_t token);
+int queue_checkpoint(struct Connection *conn);
+uint32_t negotiate(struct EventLoop *loop, struct Connection *conn, uint32_t capabilities);
+int queue_job(struct EventLoop *loop, struct Connection *conn, struct JobEntry *entry);
+int queue_frame(struct EventLoop *loop, struct Connection *conn, struct JobEntry *entry);
+int add_request(struct EventLoop *loop, struct Connection *conn, uint64_t id, long jobs, int tagged);
+int finish_requests(struct EventLoop *loop, struct Connection *conn, long jobs);
+int queue_stats(struct EventLoop *loop, struct Connection *conn);
+int approve_connection(struct EventLoop *loop, struct Connection *conn);
 int set_nonblock(int socket);
-int micro_sleep(unsigned long milliseconds);
+void raise_file_limit(void);
 void handler(int signum);
+void stop_workers(void);
@@ -0,0 +1,220 @@
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <sys/syscall.h>
+
+#include "trace.h"
+
+#define RED   "\x1B[31m"
+#define RESET "\x1B[0m"
+
+extern int debug;
+
+__thread struct TraceRing *trace_ring = NULL;
+
+static struct TraceRing *rings[TRACE_MAX_RINGS];
+static int ring_slots = 0;       // slots taken, a slot may not be filled in yet
+static int enabled = 0;
+static char trace_path[PATH_MAX];
+static pid_t trace_pid;          // process the rings belong to
+static uint64_t start_ticks;
+static uint64_t start_ns;
+
+/**
+* Read the monotonic clock (utility method).
+* Return nanoseconds.
+*/
+static uint64_t monotonic_ns(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t) now.tv_sec * 1000000000ULL + (uint64_t) now.tv_nsec;
+}
+
+/*================================ RECORDING =================================*/
+
+/**
+* Enable tracing. Threads only record once they attach.
+* @path   file the trace is written to
+* Return 0 on success, -1 if tracing is not possible.
+*/
+int trace_init(const char *path) {
+#ifdef NO_TRACE
+  (void) path;
+  fprintf(stderr, RED ">>> %d <<< [Trace Error] Built without tracing (TRACE=0).\n" RESET, getpid());
+  return -1;
+#else
+  if (strlen(path) >= sizeof(trace_path)) {
+    fprintf(stderr, RED ">>> %d <<< [Trace Error] Trace file name is too long.\n" RESET, getpid());
+    return -1;
+  }
+  strcpy(trace_path, path);
+  trace_pid = getpid();
+  start_ticks = trace_clock();
+  start_ns = monotonic_ns();
+  __atomic_store_n(&enabled, 1, __ATOMIC_RELEASE);
+  if (debug)
+    printf(">>> %d <<< Tracing to \"%s\", send SIGUSR1 to write the trace.\n", getpid(), trace_path);
+  return 0;
+#endif
+}
+
+/**
+* Drop the rings a forked process inherited, which its parent writes, and
+* trace to a file of its own (utility method). The child of fork() runs
+* one thread, so nothing records meanwhile.
+*/
+static void trace_forked(void) {
+  int slots = (ring_slots > TRACE_MAX_RINGS) ? TRACE_MAX_RINGS : ring_slots;
+  for (int i = 0; i < slots; i++) {
+    free(rings[i]);
+    rings[i] = NULL;
+  }
+  ring_slots = 0;
+  trace_ring = NULL;
+  size_t length = strlen(trace_path);
+  snprintf(trace_path + length, sizeof(trace_path) - length, ".%d", getpid());
+  trace_pid = getpid();
+}
+
+/**
+* Give the calling thread a ring of its own, if tracing is enabled.
+* Threads that cannot get one go untraced. The first call in a forked
+* process also sets it up to write its own trace.
+*/
+void trace_attach(void) {
+  if (!__atomic_load_n(&enabled, __ATOMIC_ACQUIRE))
+    return;
+  if (trace_pid != getpid())
+    trace_forked();
+  if (trace_ring)
+    return;
+  struct TraceRing *ring = (struct TraceRing *) calloc(1, sizeof(struct TraceRing));
+  if (!ring) {
+    fprintf(stderr, ">>> %d <<< [Trace Warning] Failed to allocate trace ring.\n", getpid());
+    return;
+  }
+  int slot = __atomic_fetch_add(&ring_slots, 1, __ATOMIC_ACQ_REL);
+  if (slot >= TRACE_MAX_RINGS) {
+    fprintf(stderr, ">>> %d <<< [Trace Warning] Too many threads trace, leaving one out.\n", getpid());
+    free(ring);
+    return;
+  }
+  ring->thread = (uint32_t) syscall(SYS_gettid);
+  __atomic_store_n(&rings[slot], ring, __ATOMIC_RELEASE);
+  trace_ring = ring;
+}
+
+
+/*================================= DUMPING ==================================*/
+
+/**
+* Write a whole buffer (utility method). Async-signal-safe.
+* @fd       file to write to
+* @data     bytes to write
+* @length   number of bytes
+* Return 0 on success, -1 on error.
+*/
+static int write_all(int fd, const void *data, size_t length) {
+  const char *next = (const char *) data;
+  while (length) {
+    ssize_t written = write(fd, next, length);
+    if (written == -1 && errno == EINTR)
+      continue;
+    if (written <= 0)
+      return -1;
+    next += written;
+    length -= (size_t) written;
+  }
+  return 0;
+}
+
+/**
+* Write the events of one ring, oldest first (utility method).
+* Async-signal-safe.
+* @fd     trace file
+* @ring   ring to write
+* Return 0 on success, -1 on error.
+*/
+static int dump_ring(int fd, struct TraceRing *ring) {
+  uint64_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+  struct TraceRingHeader header;
+  memset(&header, 0, sizeof(header));
+  header.thread = ring->thread;
+  header.events = (uint32_t) ((head < TRACE_RING_EVENTS) ? head : TRACE_RING_EVENTS);
+  header.recorded = head;
+  if (write_all(fd, &header, sizeof(header)))
+    return -1;
+  size_t first = (size_t) ((head - header.events) & (TRACE_RING_EVENTS - 1));
+  size_t tail = TRACE_RING_EVENTS - first;
+  if (tail > header.events)
+    tail = header.events;
+  if (write_all(fd, ring->events + first, tail * sizeof(struct TraceEvent)))
+    return -1;
+  return write_all(fd, ring->events, (header.events - tail) * sizeof(struct TraceEvent));
+}
+
+/**
+* Write every ring to the trace file, replacing an earlier trace.
+* Async-signal-safe, so it may run in a signal handler. Threads keep
+* recording meanwhile; the newest event of a ring may then be torn.
+* Return 0 on success or if tracing is off, -1 on error (errno set).
+*/
+int trace_dump(void) {
+  if (!__atomic_load_n(&enabled, __ATOMIC_ACQUIRE) || trace_pid != getpid())
+    return 0; // a forked process that never attached has no rings of its own
+  int fd = open(trace_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (fd == -1)
+    return -1;
+
+  int slots = __atomic_load_n(&ring_slots, __ATOMIC_ACQUIRE);
+  if (slots > TRACE_MAX_RINGS)
+    slots = TRACE_MAX_RINGS;
+  struct TraceRing *filled[TRACE_MAX_RINGS];
+  int count = 0;
+  for (int i = 0; i < slots; i++) {
+    filled[count] = __atomic_load_n(&rings[i], __ATOMIC_ACQUIRE);
+    if (filled[count])
+      count++;
+  }
+
+  struct TraceFileHeader header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, TRACE_MAGIC, sizeof(header.magic));
+  header.format = TRACE_FORMAT;
+  header.rings = (uint32_t) count;
+  header.start_ticks = start_ticks;
+  header.start_ns = start_ns;
+  header.dump_ticks = trace_clock();
+  header.dump_ns = monotonic_ns();
+  int status = write_all(fd, &header, sizeof(header));
+  for (int i = 0; i < count && !status; i++)
+    status = dump_ring(fd, filled[i]);
+  int saved = errno;
+  close(fd);
+  errno = saved;
+  return status;
+}
+
+/**
+* Write the final trace and stop tracing. Called once every other thread
+* is done.
+*/
+void trace_close(void) {
+  if (!__atomic_load_n(&enabled, __ATOMIC_ACQUIRE) || trace_pid != getpid())
+    return;
+  if (trace_dump())
+    perror(RED "[Trace Error] Failed to write trace" RESET);
+  else
+    printf(">>> %d <<< Trace written to \"%s\".\n", getpid(), trace_path);
+  __atomic_store_n(&enabled, 0, __ATOMIC_RELEASE);
+  int slots = (ring_slots > TRACE_MAX_RINGS) ? TRACE_MAX_RINGS : ring_slots;
+  for (int i = 0; i < slots; i++) {
+    free(rings[i]);
+    rings[i] = NULL;
+  }
+  trace_ring = NULL;
+}
@@ -0,0 +1,119 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdint.h>
+#include <time.h>
+
+/* Binary event trace. Every thread that traces owns a ring of fixed-size
+   events, so recording one is a timestamp read and a 32-byte store, with
+   no locks, read-modify-write atomics or system calls. With --trace the
+   rings are written to a file on SIGUSR1 and when the server or client
+   exits; jobtrace turns that file into a timeline. A process forked after
+   tracing started writes its own rings, to the file name followed by
+   ".<pid>". Without --trace an event costs a thread-local load and a
+   branch; built with "make TRACE=0" it costs nothing at all. */
+
+#define TRACE_RING_EVENTS (1 << 16)  // events kept per thread, a power of two
+#define TRACE_MAX_RINGS 96           // threads that may trace
+#define TRACE_MAGIC "JOBTRACE"
+#define TRACE_FORMAT 1
+
+// event types, with the meaning of their two arguments
+#define TRACE_ACCEPT 1         // client accepted; a: connections on the loop
+#define TRACE_CLOSE 2          // connection closed; a: bytes written to it
+#define TRACE_REQUEST 3        // request decoded; a: opcode (0 for one-byte requests), b: jobs (-1 for all)
+#define TRACE_FRAME 4          // job frame queued; a: job number, b: bytes on the wire
+#define TRACE_BATCH 5          // batch frame queued; a: jobs in it, b: payload bytes
+#define TRACE_DONE 6           // request fully queued; a: request ID
+#define TRACE_WRITE_START 7    // write or send submitted; a: bytes queued
+#define TRACE_WRITE_END 8      // write or send done; a: bytes written, b: 1 if the socket blocked
+#define TRACE_PUBLISH 9        // index thread handed jobs to the loops; a: jobs ready
+#define TRACE_WAKE 10          // loop picked up the hand-off; a: connections rescheduled
+#define TRACE_CLAIM 11         // jobs claimed from the dispatcher; a: first job, b: number of jobs
+#define TRACE_SPAN 12          // run of frames queued from the broadcast ring; a: jobs, b: bytes
+#define TRACE_PIPE 13          // client job text crossed a printer pipe; a: text bytes, b: 0 written, 1 read
+#define TRACE_TYPES 14
+
+struct TraceEvent {
+  uint64_t time;       // TSC ticks, or nanoseconds where there is no TSC
+  uint32_t type;
+  int32_t sock;        // client socket on the server, -1 for none
+  uint64_t a;
+  uint64_t b;
+};
+
+struct TraceRing {
+  uint64_t head;       // events recorded so far
+  uint32_t thread;     // kernel thread ID
+  uint32_t unused;
+  struct TraceEvent events[TRACE_RING_EVENTS];
+};
+
+/* Trace file: a TraceFileHeader, then for every ring a TraceRingHeader
+   followed by its events, oldest first. Two (ticks, nanoseconds) pairs
+   taken when tracing started and when the file was written convert event
+   times to nanoseconds. All fields are in host byte order. */
+struct TraceFileHeader {
+  char magic[8];
+  uint32_t format;
+  uint32_t rings;
+  uint64_t start_ticks;
+  uint64_t start_ns;   // CLOCK_MONOTONIC
+  uint64_t dump_ticks;
+  uint64_t dump_ns;
+};
+
+struct TraceRingHeader {
+  uint32_t thread;
+  uint32_t events;     // events following
+  uint64_t recorded;   // events recorded, older ones were overwritten
+};
+
+extern __thread struct TraceRing *trace_ring;
+
+/**
+* Read the trace clock (utility method).
+* Return TSC ticks on x86-64, monotonic nanoseconds elsewhere.
+*/
+static inline uint64_t trace_clock(void) {
+#if defined(__x86_64__)
+  return __builtin_ia32_rdtsc();
+#else
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t) now.tv_sec * 1000000000ULL + (uint64_t) now.tv_nsec;
+#endif
+}
+
+/**
+* Record one event in the calling thread's ring, if it has one.
+* @type   TRACE_ event type
+* @sock   client socket, -1 for none
+* @a      first argument
+* @b      second argument
+*/
+static inline void trace_event(uint32_t type, int sock, uint64_t a, uint64_t b) {
+  struct TraceRing *ring = trace_ring;
+  if (!ring)
+    return;
+  struct TraceEvent *event = &ring->events[ring->head & (TRACE_RING_EVENTS - 1)];
+  event->time = trace_clock();
+  event->type = type;
+  event->sock = sock;
+  event->a = a;
+  event->b = b;
+  __atomic_store_n(&ring->head, ring->head + 1, __ATOMIC_RELEASE);
+}
+
+#ifdef NO_TRACE
+#define TRACE(type, sock, a, b) ((void) 0)
+#else
+#define TRACE(type, sock, a, b) trace_event((type), (sock), (uint64_t) (a), (uint64_t) (b))
+#endif
+
+int trace_init(const char *path);
+void trace_attach(void);
+int trace_dump(void);
+void trace_close(void);
+
+#endif
@@ -0,0 +1,772 @@
+#include "server_util.h"
+
+extern int debug;
+
+/*================================ RING SETUP ================================*/
+
+static int sys_io_uring_setup(unsigned int entries, struct io_uring_params *params) {
+  return (int) syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int sys_io_uring_enter(int fd, unsigned int to_submit, unsigned int min_complete, unsigned int flags,
+                              void *arg, size_t arg_size) {
+  return (int) syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, arg, arg_size);
+}
+
+static int sys_io_uring_register(int fd, unsigned int opcode, void *arg, unsigned int count) {
+  return (int) syscall(__NR_io_uring_register, fd, opcode, arg, count);
+}
+
+/**
+* Unmap the rings and buffers and close the ring, but keep the
+* structure itself (utility method). Works on a partially set up ring.
+* @ring   ring to release
+*/
+static void release_ring(struct Uring *ring) {
+  if (ring->fd != -1)
+    close(ring->fd); // also drops the registered and provided buffers
+  if (ring->sqes)
+    munmap(ring->sqes, ring->sqes_size);
+  if (ring->cq_ring && ring->cq_ring != ring->sq_ring)
+    munmap(ring->cq_ring, ring->cq_ring_size);
+  if (ring->sq_ring)
+    munmap(ring->sq_ring, ring->sq_ring_size);
+  if (ring->buf_ring)
+    munmap(ring->buf_ring, sizeof(struct io_uring_buf) * URING_RECV_BUFFERS);
+  if (ring->fixed_buffers)
+    munmap(ring->fixed_buffers, (size_t) URING_FIXED_BUFFERS * URING_FIXED_BUFFER_SIZE);
+  free(ring->recv_buffers);
+}
+
+/**
+* Map a region of the ring (utility method).
+* @fd       ring descriptor
+* @size     bytes to map
+* @offset   IORING_OFF_SQ_RING, IORING_OFF_CQ_RING or IORING_OFF_SQES
+* Return the mapping, NULL on error.
+*/
+static void *map_ring(int fd, size_t size, off_t offset) {
+  void *map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, offset);
+  return (map == MAP_FAILED) ? NULL : map;
+}
+
+/**
+* Map anonymous, page-aligned memory (utility method).
+* @size   bytes to map
+* Return the mapping, NULL on error.
+*/
+static void *map_anonymous(size_t size) {
+  void *map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  return (map == MAP_FAILED) ? NULL : map;
+}
+
+/**
+* Give a receive buffer back to the kernel (utility method).
+* The buffer becomes visible once the tail is published.
+* @ring   ring the buffer belongs to
+* @id     buffer number
+*/
+static void provide_buffer(struct Uring *ring, unsigned short id) {
+  struct io_uring_buf *buf = &ring->buf_ring->bufs[ring->buf_tail & (URING_RECV_BUFFERS - 1)];
+  buf->addr = (uint64_t) (uintptr_t) (ring->recv_buffers + (size_t) id * URING_RECV_BUFFER_SIZE);
+  buf->len = URING_RECV_BUFFER_SIZE;
+  buf->bid = id;
+  ring->buf_tail++;
+}
+
+/**
+* Publish buffers given back with provide_buffer() (utility method).
+* @ring   ring the buffers belong to
+*/
+static void publish_buffers(struct Uring *ring) {
+  __atomic_store_n(&ring->buf_ring->tail, ring->buf_tail, __ATOMIC_RELEASE);
+}
+
+/**
+* Map the submission and completion rings (utility method).
+* @ring     ring to set up
+* @params   parameters filled in by io_uring_setup()
+* Return 0 on success, -1 on error.
+*/
+static int map_rings(struct Uring *ring, struct io_uring_params *params) {
+  ring->sq_ring_size = params->sq_off.array + params->sq_entries * sizeof(unsigned int);
+  ring->cq_ring_size = params->cq_off.cqes + params->cq_entries * sizeof(struct io_uring_cqe);
+  if (params->features & IORING_FEAT_SINGLE_MMAP) {
+    if (ring->cq_ring_size > ring->sq_ring_size)
+      ring->sq_ring_size = ring->cq_ring_size;
+    ring->cq_ring_size = ring->sq_ring_size;
+  }
+
+  ring->sq_ring = map_ring(ring->fd, ring->sq_ring_size, IORING_OFF_SQ_RING);
+  if (!ring->sq_ring)
+    return -1;
+  if (params->features & IORING_FEAT_SINGLE_MMAP)
+    ring->cq_ring = ring->sq_ring;
+  else if (!(ring->cq_ring = map_ring(ring->fd, ring->cq_ring_size, IORING_OFF_CQ_RING)))
+    return -1;
+  ring->sqes_size = params->sq_entries * sizeof(struct io_uring_sqe);
+  ring->sqes = (struct io_uring_sqe *) map_ring(ring->fd, ring->sqes_size, IORING_OFF_SQES);
+  if (!ring->sqes)
+    return -1;
+
+  char *sq = (char *) ring->sq_ring;
+  char *cq = (char *) ring->cq_ring;
+  ring->sq_head = (unsigned int *) (sq + params->sq_off.head);
+  ring->sq_tail = (unsigned int *) (sq + params->sq_off.tail);
+  ring->sq_mask = (unsigned int *) (sq + params->sq_off.ring_mask);
+  ring->sq_array = (unsigned int *) (sq + params->sq_off.array);
+  ring->sq_entries = params->sq_entries;
+  ring->sq_local_tail = *ring->sq_tail;
+  ring->cq_head = (unsigned int *) (cq + params->cq_off.head);
+  ring->cq_tail = (unsigned int *) (cq + params->cq_off.tail);
+  ring->cq_mask = (unsigned int *) (cq + params->cq_off.ring_mask);
+  ring->cqes = (struct io_uring_cqe *) (cq + params->cq_off.cqes);
+  return 0;
+}
+
+/**
+* Register the provided receive buffers and the fixed read buffers
+* (utility method).
+* @ring   ring to register the buffers with
+* Return 0 on success, -1 on error.
+*/
+static int register_buffers(struct Uring *ring) {
+  ring->buf_ring = (struct io_uring_buf_ring *) map_anonymous(sizeof(struct io_uring_buf) * URING_RECV_BUFFERS);
+  ring->recv_buffers = (char *) malloc((size_t) URING_RECV_BUFFERS * URING_RECV_BUFFER_SIZE);
+  if (!ring->buf_ring || !ring->recv_buffers)
+    return -1;
+  struct io_uring_buf_reg reg;
+  memset(&reg, 0, sizeof(reg));
+  reg.ring_addr = (uint64_t) (uintptr_t) ring->buf_ring;
+  reg.ring_entries = URING_RECV_BUFFERS;
+  reg.bgid = URING_BUFFER_GROUP;
+  if (sys_io_uring_register(ring->fd, IORING_REGISTER_PBUF_RING, &reg, 1))
+    return -1;
+  for (unsigned short i = 0; i < URING_RECV_BUFFERS; i++)
+    provide_buffer(ring, i);
+  publish_buffers(ring);
+
+  ring->fixed_buffers = (char *) map_anonymous((size_t) URING_FIXED_BUFFERS * URING_FIXED_BUFFER_SIZE);
+  if (!ring->fixed_buffers)
+    return -1;
+  struct iovec iov[URING_FIXED_BUFFERS];
+  for (int i = 0; i < URING_FIXED_BUFFERS; i++) {
+    iov[i].iov_base = ring->fixed_buffers + (size_t) i * URING_FIXED_BUFFER_SIZE;
+    iov[i].iov_len = URING_FIXED_BUFFER_SIZE;
+    ring->free_fixed[i] = i;
+  }
+  ring->free_fixed_count = URING_FIXED_BUFFERS;
+  return sys_io_uring_register(ring->fd, IORING_REGISTER_BUFFERS, iov, URING_FIXED_BUFFERS) ? -1 : 0;
+}
+
+
+/*============================ SUBMISSION METHODS ============================*/
+
+/**
+* Hand queued submissions to the kernel and optionally wait for completions
+* (utility method).
+* @ring      ring to enter
+* @wait      wait for at least one completion
+* @timeout   longest wait in milliseconds, -1 for no limit
+* Return 0 on success (including interrupts and timeouts), -1 on error.
+*/
+static int enter(struct Uring *ring, int wait, int timeout) {
+  __atomic_store_n(ring->sq_tail, ring->sq_local_tail, __ATOMIC_RELEASE);
+  unsigned int to_submit = ring->sq_local_tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+  if (!to_submit && !wait)
+    return 0;
+
+  unsigned int flags = 0;
+  struct io_uring_getevents_arg arg;
+  struct __kernel_timespec ts;
+  void *arg_pointer = NULL;
+  size_t arg_size = 0;
+  if (wait) {
+    flags |= IORING_ENTER_GETEVENTS;
+    if (timeout >= 0) {
+      memset(&arg, 0, sizeof(arg));
+      ts.tv_sec = timeout / 1000;
+      ts.tv_nsec = (long long) (timeout % 1000) * 1000000;
+      arg.ts = (uint64_t) (uintptr_t) &ts;
+      flags |= IORING_ENTER_EXT_ARG;
+      arg_pointer = &arg;
+      arg_size = sizeof(arg);
+    }
+  }
+
+  if (sys_io_uring_enter(ring->fd, to_submit, wait ? 1 : 0, flags, arg_pointer, arg_size) == -1) {
+    // EBUSY/EAGAIN: completions have to be reaped before more can be submitted
+    if (errno == EINTR || errno == ETIME || errno == EBUSY || errno == EAGAIN)
+      return 0;
+    perror(RED "[Server Error] Failed to enter io_uring" RESET);
+    return -1;
+  }
+  return 0;
+}
+
+/**
+* Make sure the submission queue has room (utility method).
+* @ring    ring to submit to
+* @count   number of entries needed
+* Return 0 on success, -1 if the kernel does not take queued entries.
+*/
+static int reserve(struct Uring *ring, unsigned int count) {
+  for (int attempt = 0; attempt < 2; attempt++) {
+    unsigned int head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+    if (ring->sq_entries - (ring->sq_local_tail - head) >= count)
+      return 0;
+    if (enter(ring, 0, 0))
+      return -1;
+  }
+  errno = EBUSY;
+  return -1;
+}
+
+/**
+* Take the next submission queue entry, cleared (utility method).
+* Call reserve() first.
+* @ring        ring to submit to
+* @opcode      IORING_OP_...
+* @fd          descriptor the operation works on
+* @user_data   returned with the completion
+*/
+static struct io_uring_sqe *next_sqe(struct Uring *ring, unsigned char opcode, int fd, uint64_t user_data) {
+  unsigned int index = ring->sq_local_tail & *ring->sq_mask;
+  struct io_uring_sqe *sqe = &ring->sqes[index];
+  memset(sqe, 0, sizeof(*sqe));
+  sqe->opcode = opcode;
+  sqe->fd = fd;
+  sqe->user_data = user_data;
+  ring->sq_array[index] = index;
+  ring->sq_local_tail++;
+  return sqe;
+}
+
+/**
+* User data of an operation on a connection (utility method).
+* @conn   connection, NULL for the listening socket and the wake eventfd
+* @op     URING_OP_...
+*/
+static uint64_t tag(struct Connection *conn, int op) {
+  return (uint64_t) (uintptr_t) conn | (uint64_t) op;
+}
+
+/**
+* Accept clients until cancelled (utility method).
+* @loop   loop whose listening socket to accept on
+* Return 0 on success, -1 on error.
+*/
+static int arm_accept(struct EventLoop *loop) {
+  struct Uring *ring = loop->uring;
+  if (reserve(ring, 1))
+    return -1;
+  struct io_uring_sqe *sqe = next_sqe(ring, IORING_OP_ACCEPT, loop->listen_sock, tag(NULL, URING_OP_ACCEPT));
+  sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+  sqe->accept_flags = SOCK_CLOEXEC;
+  ring->accepting = 1;
+  return 0;
+}
+
+/**
+* Watch the eventfd written by the job store (utility method).
+* @loop   loop to wake
+* Return 0 on success, -1 on error.
+*/
+static int arm_wake(struct EventLoop *loop) {
+  struct Uring *ring = loop->uring;
+  if (reserve(ring, 1))
+    return -1;
+  struct io_uring_sqe *sqe = next_sqe(ring, IORING_OP_POLL_ADD, loop->wake_fd, tag(NULL, URING_OP_WAKE));
+  sqe->poll32_events = POLLIN;
+  sqe->len = IORING_POLL_ADD_MULTI;
+  return 0;
+}
+
+/**
+* Receive from a client into provided buffers until cancelled (utility method).
+* @ring   ring to submit to
+* @conn   connection to receive on
+* Return 0 on success, -1 on error.
+*/
+static int arm_recv(struct Uring *ring, struct Connection *conn) {
+  if (reserve(ring, 1))
+    return -1;
+  struct io_uring_sqe *sqe = next_sqe(ring, IORING_OP_RECV, conn->sock, tag(conn, URING_OP_RECV));
+  sqe->ioprio = IORING_RECV_MULTISHOT;
+  sqe->flags = IOSQE_BUFFER_SELECT;
+  sqe->buf_group = URING_BUFFER_GROUP;
+  conn->uring->receiving = 1;
+  conn->uring->inflight++;
+  return 0;
+}
+
+/**
+* Cancel one kind of operation on a connection (utility method).
+* @ring   ring the operation was submitted to
+* @conn   connection the operation works on
+* @op     URING_OP_...
+*/
+static void cancel(struct Uring *ring, struct Connection *conn, int op) {
+  if (reserve(ring, 1))
+    return;
+  struct io_uring_sqe *sqe = next_sqe(ring, IORING_OP_ASYNC_CANCEL, -1, tag(NULL, URING_OP_CANCEL));
+  sqe->addr = tag(conn, op);
+}
+
+
+/*=============================== LOOP METHODS ===============================*/
+
+/**
+* Set up an io_uring for the loop, with a multishot accept on the
+* listening socket and a watch on the job store's eventfd.
+* @loop   loop with its listening socket and wake eventfd set
+* Return 0 on success, -1 if io_uring is unavailable.
+*/
+int uring_init(struct EventLoop *loop) {
+  struct Uring *ring = (struct Uring *) calloc(1, sizeof(struct Uring));
+  if (!ring)
+    return -1;
+
+  struct io_uring_params params;
+  memset(&params, 0, sizeof(params));
+  params.flags = IORING_SETUP_CQSIZE | IORING_SETUP_COOP_TASKRUN;
+  params.cq_entries = URING_CQ_ENTRIES;
+  ring->fd = sys_io_uring_setup(URING_ENTRIES, &params);
+  if (ring->fd == -1 && errno == EINVAL) {
+    params.flags = IORING_SETUP_CQSIZE; // kernels before 5.19
+    ring->fd = sys_io_uring_setup(URING_ENTRIES, &params);
+  }
+  if (ring->fd == -1) {
+    perror("[Server Warning] Could not create io_uring");
+    free(ring);
+    return -1;
+  }
+  if (!(params.features & IORING_FEAT_EXT_ARG) || !(params.features & IORING_FEAT_NODROP) ||
+      map_rings(ring, &params) || register_buffers(ring)) {
+    perror("[Server Warning] Could not set up io_uring");
+    release_ring(ring);
+    free(ring);
+    return -1;
+  }
+
+  loop->uring = ring;
+  if (arm_accept(loop) || arm_wake(loop) || enter(ring, 0, 0)) {
+    release_ring(ring);
+    free(ring);
+    loop->uring = NULL;
+    return -1;
+  }
+  if (debug)
+    printf(">>> %d <<< Using io_uring (features %#x).\n", getpid(), params.features);
+  return 0;
+}
+
+/**
+* Free a closed connection whose operations all completed (utility method).
+* @loop   loop the connection was retired on
+* @conn   connection to free
+*/
+static void free_retired(struct EventLoop *loop, struct Connection *conn) {
+  struct Uring *ring = loop->uring;
+  if (conn->prev)
+    conn->prev->next = conn->next;
+  else
+    ring->retired = conn->next;
+  if (conn->next)
+    conn->next->prev = conn->prev;
+  out_free(&conn->out);
+  free(conn->uring->backlog);
+  pool_free(&loop->pool, conn->uring);
+  pool_free(&loop->pool, conn);
+}
+
+/**
+* Give cancelled operations time to complete, then close the ring.
+* Connections must have been closed already.
+* @loop   loop to close
+*/
+void uring_close(struct EventLoop *loop) {
+  struct Uring *ring = loop->uring;
+  long deadline = now_ms() + URING_CLOSE_MS;
+  while (ring->retired && now_ms() < deadline) {
+    if (uring_wait(loop, URING_ACCEPT_RETRY_MS))
+      break;
+  }
+  release_ring(ring);
+  // the ring is gone, so nothing refers to the remaining connections any more
+  while (ring->retired)
+    free_retired(loop, ring->retired);
+  free(ring);
+  loop->uring = NULL;
+}
+
+/**
+* Start receiving from a newly accepted client.
+* @loop   loop the client was accepted on
+* @conn   new connection
+* Return 0 on success, -1 on error.
+*/
+int uring_attach(struct EventLoop *loop, struct Connection *conn) {
+  conn->uring = (struct UringConnection *) pool_calloc(&loop->pool, sizeof(struct UringConnection));
+  if (!conn->uring) {
+    fprintf(stderr, RED ">>> %d <<< [Server Error] Failed to allocate connection state.\n" RESET, getpid());
+    return -1;
+  }
+  conn->uring->fixed_buffer = -1;
+  if (arm_recv(loop->uring, conn)) {
+    perror(RED "[Server Error] Could not receive from client" RESET);
+    pool_free(&loop->pool, conn->uring);
+    conn->uring = NULL;
+    return -1;
+  }
+  return 0;
+}
+
+/**
+* Close a connection's socket and cancel its operations. The connection
+* may only be freed once the last of them completed.
+* @loop   loop the connection belongs to
+* @conn   connection to close, already removed from the loop's list
+* Return 1 if the connection is freed later, 0 if it can be freed now.
+*/
+int uring_retire(struct EventLoop *loop, struct Connection *conn) {
+  struct Uring *ring = loop->uring;
+  struct UringConnection *state = conn->uring;
+  if (!state)
+    return 0;
+  if (!state->inflight) {
+    free(state->backlog);
+    pool_free(&loop->pool, state);
+    conn->uring = NULL;
+    return 0;
+  }
+
+  if (state->receiving)
+    cancel(ring, conn, URING_OP_RECV);
+  if (!conn->writable)
+    cancel(ring, conn, URING_OP_SEND); // may wait for a client that stopped reading
+  state->retired = 1;
+  close(conn->sock); // operations hold their own reference to the socket
+  conn->prev = NULL;
+  conn->next = ring->retired;
+  if (ring->retired)
+    ring->retired->prev = conn;
+  ring->retired = conn;
+  return 1;
+}
+
+/**
+* Stop accepting clients, e.g. when shutting down.
+* @loop   loop to stop accepting on
+*/
+void uring_stop_accepting(struct EventLoop *loop) {
+  struct Uring *ring = loop->uring;
+  ring->stop_accepting = 1;
+  if (ring->accepting)
+    cancel(ring, NULL, URING_OP_ACCEPT);
+}
+
+
+/*========================== CONNECTION I/O METHODS ==========================*/
+
+/**
+* Append received bytes to a connection's backlog (utility method).
+* @state    connection state
+* @data     bytes received
+* @length   number of bytes
+* Return 0 on success, -1 if the client has too much unread data waiting.
+*/
+static int append_backlog(struct UringConnection *state, const char *data, size_t length) {
+  if (state->backlog_start) {
+    memmove(state->backlog, state->backlog + state->backlog_start, state->backlog_length);
+    state->backlog_start = 0;
+  }
+  size_t needed = state->backlog_length + length;
+  if (needed > URING_BACKLOG_LIMIT)
+    return -1;
+  if (needed > state->backlog_capacity) {
+    size_t capacity = state->backlog_capacity ? state->backlog_capacity : INPUT_BUFFER_SIZE;
+    while (capacity < needed)
+      capacity *= 2;
+    unsigned char *backlog = (unsigned char *) realloc(state->backlog, capacity);
+    if (!backlog)
+      return -1;
+    state->backlog = backlog;
+    state->backlog_capacity = capacity;
+  }
+  memcpy(state->backlog + state->backlog_length, data, length);
+  state->backlog_length += length;
+  return 0;
+}
+
+/**
+* Move received bytes into the input buffer, the io_uring counterpart of
+* reading the socket.
+* @conn   connection to read from
+* Return 0 on success, 1 if the client closed the connection, -1 on error.
+*/
+int uring_read_input(struct Connection *conn) {
+  struct UringConnection *state = conn->uring;
+  if (conn->input_start) {
+    memmove(conn->input, conn->input + conn->input_start, conn->input_length);
+    conn->input_start = 0;
+  }
+  size_t length = INPUT_BUFFER_SIZE - conn->input_length;
+  if (length > state->backlog_length)
+    length = state->backlog_length;
+  memcpy(conn->input + conn->input_length, state->backlog + state->backlog_start, length);
+  conn->input_length += length;
+  state->backlog_start += length;
+  state->backlog_length -= length;
+
+  if (!state->backlog_length) {
+    state->backlog_start = 0;
+    if (state->error) {
+      errno = state->error;
+      return -1;
+    }
+    if (state->eof)
+      return 1;
+    conn->readable = 0;
+  }
+  return 0;
+}
+
+/**
+* Submit a send of the head of a connection's out queue. Memory segments
+* are gathered into one sendmsg; a file segment is read into a registered
+* buffer by a read linked to the send (straight from the job file mapping
+* if every registered buffer is taken). The connection is not writable
+* until the send completes.
+* @loop   loop the connection belongs to
+* @conn   connection with queued output
+* Return 0 on success, -1 on error (errno set).
+*/
+int uring_flush(struct EventLoop *loop, struct Connection *conn) {
+  struct Uring *ring = loop->uring;
+  struct UringConnection *state = conn->uring;
+  struct OutQueue *queue = &conn->out;
+  if (state->error) {
+    errno = state->error;
+    return -1;
+  }
+  if (reserve(ring, 2))
+    return -1;
+
+  struct OutSegment *head = &queue->slots[queue->head];
+  unsigned int flags = MSG_NOSIGNAL | MSG_WAITALL; // no short sends to resubmit
+  if (head->kind == OUT_FILE) {
+    size_t length = head->length - queue->head_sent;
+    if (length > URING_FIXED_BUFFER_SIZE)
+      length = URING_FIXED_BUFFER_SIZE;
+    off_t offset = head->file_offset + (off_t) queue->head_sent;
+    if (queue->count > 1 || queue->head_sent + length < head->length)
+      flags |= MSG_MORE;
+
+    const char *data = loop->store->map + offset;
+    if (ring->free_fixed_count) {
+      int buffer = ring->free_fixed[--ring->free_fixed_count];
+      char *fixed = ring->fixed_buffers + (size_t) buffer * URING_FIXED_BUFFER_SIZE;
+      // a short or failed read cancels the linked send
+      struct io_uring_sqe *sqe = next_sqe(ring, IORING_OP_READ_FIXED, head->file_fd, tag(conn, URING_OP_READ));
+      sqe->addr = (uint64_t) (uintptr_t) fixed;
+      sqe->len = (unsigned int) length;
+      sqe->off = (uint64_t) offset;
+      sqe->buf_index = (unsigned short) buffer;
+      sqe->flags = IOSQE_IO_LINK;
+      state->inflight++;
+      state->fixed_buffer = buffer;
+      data = fixed;
+    }
+    struct io_uring_sqe *sqe = next_sqe(ring, IORING_OP_SEND, conn->sock, tag(conn, URING_OP_SEND));
+    sqe->addr = (uint64_t) (uintptr_t) data;
+    sqe->len = (unsigned int) length;
+    sqe->msg_flags = flags;
+    queue->in_flight = 1;
+  } else {
+    int more;
+    memset(&state->msg, 0, sizeof(state->msg));
+    state->msg.msg_iov = state->iov;
+    state->msg.msg_iovlen = out_gather(queue, state->iov, URING_MAX_IOV, SERVICE_BUDGET, state->inline_copy, &more);
+    if (more)
+      flags |= MSG_MORE;
+    struct io_uring_sqe *sqe = next_sqe(ring, IORING_OP_SENDMSG, conn->sock, tag(conn, URING_OP_SEND));
+    sqe->addr = (uint64_t) (uintptr_t) &state->msg;
+    sqe->len = 1;
+    sqe->msg_flags = flags;
+    queue->in_flight = (unsigned int) state->msg.msg_iovlen;
+  }
+  state->inflight++;
+  conn->writable = 0;
+  TRACE(TRACE_WRITE_START, conn->sock, queue->pending_bytes, 0);
+  return 0;
+}
+
+
+/*============================ COMPLETION METHODS ============================*/
+
+/**
+* Handle a client accepted by the multishot accept (utility method).
+* @loop   loop that accepted the client
+* @cqe    completion of the accept
+*/
+static void accepted(struct EventLoop *loop, struct io_uring_cqe *cqe) {
+  struct Uring *ring = loop->uring;
+  if (!(cqe->flags & IORING_CQE_F_MORE))
+    ring->accepting = 0;
+  if (cqe->res < 0) {
+    if (cqe->res != -ECANCELED) {
+      errno = -cqe->res;
+      perror(RED "[Server Error] Could not accept connection" RESET);
+      ring->accept_retry = now_ms() + URING_ACCEPT_RETRY_MS;
+    }
+    return;
+  }
+  if (ring->stop_accepting) {
+    close(cqe->res);
+    return;
+  }
+
+  struct sockaddr_in clientaddr;
+  socklen_t clientaddrlen = sizeof(clientaddr);
+  if (getpeername(cqe->res, (struct sockaddr *) &clientaddr, &clientaddrlen))
+    memset(&clientaddr, 0, sizeof(clientaddr));
+  add_connection(loop, cqe->res, &clientaddr);
+}
+
+/**
+* Handle bytes received by a connection's multishot recv (utility method).
+* @loop    loop the connection belongs to
+* @conn    connection that received
+* @state   its io_uring state
+* @cqe     completion of the recv
+*/
+static void received(struct EventLoop *loop, struct Connection *conn, struct UringConnection *state,
+                     struct io_uring_cqe *cqe) {
+  struct Uring *ring = loop->uring;
+  if (cqe->flags & IORING_CQE_F_BUFFER) {
+    unsigned short id = (unsigned short) (cqe->flags >> IORING_CQE_BUFFER_SHIFT);
+    if (cqe->res > 0 && !state->retired &&
+        append_backlog(state, ring->recv_buffers + (size_t) id * URING_RECV_BUFFER_SIZE, (size_t) cqe->res) &&
+        !state->error)
+      state->error = EMSGSIZE;
+    provide_buffer(ring, id);
+    publish_buffers(ring);
+  }
+  if (!(cqe->flags & IORING_CQE_F_MORE))
+    state->receiving = 0;
+  if (state->retired)
+    return;
+
+  if (cqe->res == 0)
+    state->eof = 1;
+  else if (cqe->res < 0 && cqe->res != -ENOBUFS && !state->error)
+    state->error = -cqe->res;
+  // ENOBUFS: every provided buffer was in use, they are back by now
+  if (!state->receiving && !state->eof && !state->error && arm_recv(ring, conn))
+    state->error = errno;
+  conn->readable = 1;
+  schedule(loop, conn);
+}
+
+/**
+* Account for a completed send (utility method).
+* @loop    loop the connection belongs to
+* @conn    connection that sent
+* @state   its io_uring state
+* @cqe     completion of the send
+*/
+static void sent(struct EventLoop *loop, struct Connection *conn, struct UringConnection *state,
+                 struct io_uring_cqe *cqe) {
+  struct Uring *ring = loop->uring;
+  if (state->fixed_buffer != -1) {
+    ring->free_fixed[ring->free_fixed_count++] = state->fixed_buffer;
+    state->fixed_buffer = -1;
+  }
+  conn->out.in_flight = 0;
+  if (state->retired)
+    return;
+  TRACE(TRACE_WRITE_END, conn->sock, (cqe->res < 0) ? 0 : cqe->res, 0);
+
+  if (cqe->res >= 0) {
+    out_consume(&conn->out, (size_t) cqe->res);
+    note_written(loop, conn, (size_t) cqe->res);
+  } else if (!state->error)
+    state->error = -cqe->res;
+  conn->writable = 1;
+  schedule(loop, conn);
+}
+
+/**
+* Dispatch one completion (utility method).
+* @loop   loop the operation was submitted on
+* @cqe    completion to handle
+*/
+static void complete(struct EventLoop *loop, struct io_uring_cqe *cqe) {
+  int op = (int) (cqe->user_data & URING_OP_MASK);
+  struct Connection *conn = (struct Connection *) (uintptr_t) (cqe->user_data & ~(uint64_t) URING_OP_MASK);
+  if (op == URING_OP_ACCEPT) {
+    accepted(loop, cqe);
+    return;
+  }
+  if (op == URING_OP_WAKE) {
+    if (!(cqe->flags & IORING_CQE_F_MORE) && arm_wake(loop))
+      perror(RED "[Server Error] Could not watch job index" RESET);
+    wake_waiting(loop);
+    return;
+  }
+  if (op == URING_OP_CANCEL || !conn)
+    return;
+
+  struct UringConnection *state = conn->uring;
+  if (op == URING_OP_RECV)
+    received(loop, conn, state, cqe);
+  else if (op == URING_OP_SEND)
+    sent(loop, conn, state, cqe);
+  else if (op == URING_OP_READ && cqe->res < 0 && !state->error && !state->retired)
+    state->error = -cqe->res; // the linked send reports the failure
+
+  if (!(cqe->flags & IORING_CQE_F_MORE))
+    state->inflight--;
+  if (state->retired && !state->inflight)
+    free_retired(loop, conn);
+}
+
+/**
+* Submit queued operations, wait for completions and handle them.
+* Connections with work to do are put on the ready list.
+* @loop      loop to run
+* @timeout   longest wait in milliseconds, 0 to only poll, -1 for no limit
+* Return 0 on success, -1 on error.
+*/
+int uring_wait(struct EventLoop *loop, int timeout) {
+  struct Uring *ring = loop->uring;
+  if (!ring->accepting && !ring->stop_accepting) {
+    if (ring->accept_retry && now_ms() < ring->accept_retry) {
+      if (timeout < 0 || timeout > URING_ACCEPT_RETRY_MS)
+        timeout = URING_ACCEPT_RETRY_MS;
+    } else {
+      ring->accept_retry = 0;
+      if (arm_accept(loop))
+        return -1;
+    }
+  }
+
+  unsigned int head = *ring->cq_head;
+  int wait = timeout != 0 && head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+  if (enter(ring, wait, timeout))
+    return -1;
+
+  unsigned int tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+  while (head != tail) {
+    complete(loop, &ring->cqes[head & *ring->cq_mask]);
+    head++;
+    if (head == tail) {
+      // handlers may free space that lets overflowed completions in
+      __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+      tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+    }
+  }
+  __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+  return 0;
+}
@@ -0,0 +1,102 @@
+#ifndef URING_LOOP_H
+#define URING_LOOP_H
+
+#include <stddef.h>
+#include <sys/uio.h>
+#include <sys/socket.h>
+#include <linux/io_uring.h>
+
+#include "out_queue.h"
+
+/* io_uring backend of the event loop. Instead of waiting for readiness
+   and then calling accept4(), recv() and sendmsg(), the loop submits the
+   operations themselves and reaps their completions:
+     - one multishot accept on the listening socket,
+     - one multishot recv per client, into buffers the kernel picks from
+       a ring of provided buffers,
+     - at most one send per client, gathered from its out queue,
+     - large job texts are read from the job file into registered buffers
+       by a read linked to the send that writes them out.
+   Request parsing and job production are shared with the epoll backend. */
+
+#define URING_ENTRIES 256                // submission queue size
+#define URING_CQ_ENTRIES 4096            // completion queue size
+#define URING_RECV_BUFFERS 256           // provided receive buffers, a power of two
+#define URING_RECV_BUFFER_SIZE 2048
+#define URING_BUFFER_GROUP 0
+#define URING_FIXED_BUFFERS 32           // registered buffers for job file reads
+#define URING_FIXED_BUFFER_SIZE (64 * 1024)
+#define URING_MAX_IOV 512                // iovecs gathered per send
+#define URING_BACKLOG_LIMIT (64 * 1024)  // received bytes a client may have waiting
+#define URING_ACCEPT_RETRY_MS 100
+#define URING_CLOSE_MS 1000              // time given to cancelled operations on close
+
+// operation in the low bits of a completion's user data, the rest is the connection
+#define URING_OP_MASK 7
+#define URING_OP_ACCEPT 1  // no connection
+#define URING_OP_WAKE 2    // no connection
+#define URING_OP_CANCEL 3  // no connection
+#define URING_OP_RECV 4
+#define URING_OP_SEND 5
+#define URING_OP_READ 6
+
+struct Uring {
+  int fd;
+  unsigned int *sq_head;
+  unsigned int *sq_tail;
+  unsigned int *sq_mask;
+  unsigned int *sq_array;
+  unsigned int sq_entries;
+  unsigned int sq_local_tail;      // includes entries not handed to the kernel yet
+  struct io_uring_sqe *sqes;
+  unsigned int *cq_head;
+  unsigned int *cq_tail;
+  unsigned int *cq_mask;
+  struct io_uring_cqe *cqes;
+  void *sq_ring;
+  size_t sq_ring_size;
+  void *cq_ring;                   // same as sq_ring with IORING_FEAT_SINGLE_MMAP
+  size_t cq_ring_size;
+  size_t sqes_size;
+  struct io_uring_buf_ring *buf_ring;
+  char *recv_buffers;
+  unsigned short buf_tail;
+  char *fixed_buffers;
+  int free_fixed[URING_FIXED_BUFFERS];
+  int free_fixed_count;
+  int accepting;                   // multishot accept armed
+  int stop_accepting;
+  long accept_retry;               // time to arm accept again after an error, 0 if none
+  struct Connection *retired;      // closed connections with operations in flight
+};
+
+/* Operations in flight for one client. */
+struct UringConnection {
+  int inflight;        // submitted operations whose last completion is outstanding
+  int receiving;       // multishot recv armed
+  int eof;             // client closed its end
+  int error;           // errno of a failed recv or send, 0 if none
+  int retired;         // connection closed, free once inflight drops to 0
+  int fixed_buffer;    // registered buffer of the send in flight, -1 if none
+  struct msghdr msg;
+  struct iovec iov[URING_MAX_IOV];
+  unsigned char inline_copy[URING_MAX_IOV * OUT_INLINE_SIZE];
+  unsigned char *backlog; // received bytes that did not fit the input buffer yet
+  size_t backlog_start;
+  size_t backlog_length;
+  size_t backlog_capacity;
+};
+
+struct EventLoop;
+struct Connection;
+
+int uring_init(struct EventLoop *loop);
+void uring_close(struct EventLoop *loop);
+int uring_attach(struct EventLoop *loop, struct Connection *conn);
+int uring_retire(struct EventLoop *loop, struct Connection *conn);
+int uring_read_input(struct Connection *conn);
+int uring_flush(struct EventLoop *loop, struct Connection *conn);
+void uring_stop_accepting(struct EventLoop *loop);
+int uring_wait(struct EventLoop *loop, int timeout);
+
+#endif